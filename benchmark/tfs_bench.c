@@ -0,0 +1,1126 @@
+/*
+ *	Tiny File System
+ *	File:	benchmark/tfs_bench.c
+ *
+ *	Metadata and data path benchmarks for tfs, run against the -o ram block device.
+ *	tfs.c is compiled straight into this program, so nothing is mounted and the FUSE
+ *	operations are called directly through tfs_ope.
+ *
+ *	Build (from the top level directory):
+ *		gcc -std=gnu99 -O2 -Wall -D_FILE_OFFSET_BITS=64 -DTFS_NO_MAIN -I. \
+ *			benchmark/tfs_bench.c block.c -o tfs_bench `pkg-config fuse --cflags --libs` -llz4
+ *
+ *	Usage: tfs_bench [-n ops] [-s seed] [-w workload] [-c blocks] [-j] [-S] [-t trace] [-D] [-Z] [-K]
+ *		-n	number of files/directories/lookups for the metadata workloads (default 1000)
+ *		-s	seed for the random workloads
+ *		-w	only run workloads whose name starts with this prefix
+ *		-c	block cache size as with -o cache_blocks, 0 for every block access to reach the device
+ *		-j	print the results as JSON instead of a table
+ *		-S	run with -o stats and print what /.tfs_stats would show to stderr, to see what the
+ *			instrumentation costs and where the block I/O goes
+ *		-t	record the block I/O of the run with -o trace, for benchmark/tfs_replay.c. Every
+ *			workload starts from a fresh filesystem and a fresh trace, so pick one with -w
+ *		-D	run with -o dedup, -S shows how much it saved
+ *		-Z	run with -o compress, the log_* workloads write and read data that compresses well
+ *		-K	run with -o checksum. Reads are only checked when they reach the device, so compare
+ *			with -c 0 for the full cost; the crc32c_* workloads time the CRC by itself
+ */
+
+#include "../tfs.c"
+
+#include <time.h>
+#include <getopt.h>
+
+#define BENCH_FILE_SIZE (8*1024*1024) // file used by the data workloads
+#define BENCH_MIN_OPS 256 // data workloads repeat the file until they have at least this many samples
+
+// Entries a directory can hold, not counting "." and ".."
+#define DIR_FILES ((int)(sizeof(((struct inode *)0)->direct_ptr) / sizeof(int)) * (int)(BLOCK_SIZE / sizeof(struct dirent)) - 2)
+
+
+/*
+ * The -o ram device, counting the blocks that reach it
+ */
+static unsigned long bio_reads ;
+static unsigned long bio_writes ;
+
+static int bench_read(const int block_num, void *buf) {
+
+	bio_reads++ ;
+	return ram_read(block_num, buf) ;
+}
+
+static int bench_write(const int block_num, const void *buf) {
+
+	bio_writes++ ;
+	return ram_write(block_num, buf) ;
+}
+
+static struct tfs_dev bench_device ; // ram_device with the two above, see main()
+
+
+/*
+ * Measurements
+ */
+struct bench {
+
+	const char * name ;
+	size_t ops ; // timed operations so far
+	size_t max_ops ;
+	uint64_t * lat ; // latency of each operation in ns
+	uint64_t bytes ; // payload moved by the data workloads
+	unsigned long reads ; // block reads and writes issued by the timed operations
+	unsigned long writes ;
+
+	// In flight
+	uint64_t start ;
+	unsigned long start_reads ;
+	unsigned long start_writes ;
+
+} ;
+
+static int json = 0 ;
+static int results = 0 ; // printed so far, for the JSON separators
+
+static void bench_begin(struct bench *b, const char *name, size_t max_ops) {
+
+	memset(b, 0, sizeof(*b)) ;
+	b->name = name ;
+	b->max_ops = max_ops ;
+	b->lat = (uint64_t *)malloc(max_ops * sizeof(uint64_t)) ;
+
+}
+
+static void sample_begin(struct bench *b) {
+
+	b->start_reads = bio_reads ;
+	b->start_writes = bio_writes ;
+	b->start = now_ns() ;
+
+}
+
+static void sample_end(struct bench *b) {
+
+	uint64_t t = now_ns() - b->start ;
+	b->reads += bio_reads - b->start_reads ;
+	b->writes += bio_writes - b->start_writes ;
+	if (b->ops < b->max_ops) {
+
+		b->lat[b->ops++] = t ;
+
+	}
+
+}
+
+static int cmp_u64(const void *a, const void *b) {
+
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b ;
+	return x < y ? -1 : x > y ;
+}
+
+static uint64_t percentile(struct bench *b, double p) {
+
+	return b->lat[(size_t)(p * (b->ops - 1))] ;
+}
+
+static void bench_end(struct bench *b) {
+
+	if (b->ops == 0) {
+
+		fprintf(stderr, "%s: no operations completed\n", b->name) ;
+		free(b->lat) ;
+		return ;
+
+	}
+
+	uint64_t total = 0 ;
+	size_t i ;
+	for (i = 0 ; i < b->ops ; i++) {
+
+		total += b->lat[i] ;
+
+	}
+	qsort(b->lat, b->ops, sizeof(uint64_t), cmp_u64) ;
+
+	double secs = total / 1e9 ;
+	double ops_sec = secs > 0 ? b->ops / secs : 0 ;
+	double mb_sec = secs > 0 ? b->bytes / secs / (1024 * 1024) : 0 ;
+
+	if (json) {
+
+		printf("%s\n    {\"name\": \"%s\", \"ops\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+			"\"latency_ns\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}, "
+			"\"bio_reads_per_op\": %.2f, \"bio_writes_per_op\": %.2f}",
+			results ? "," : "", b->name, b->ops, secs, ops_sec, mb_sec,
+			(unsigned long long)percentile(b, 0.50), (unsigned long long)percentile(b, 0.90),
+			(unsigned long long)percentile(b, 0.99), (unsigned long long)percentile(b, 0.999),
+			(unsigned long long)b->lat[b->ops - 1],
+			(double)b->reads / b->ops, (double)b->writes / b->ops) ;
+
+	} else {
+
+		printf("%-20s %8zu %12.0f %9.2f %9.1f %9.1f %9.1f %9.1f %8.2f %8.2f\n",
+			b->name, b->ops, ops_sec, mb_sec,
+			percentile(b, 0.50) / 1e3, percentile(b, 0.90) / 1e3, percentile(b, 0.99) / 1e3,
+			b->lat[b->ops - 1] / 1e3, (double)b->reads / b->ops, (double)b->writes / b->ops) ;
+
+	}
+	results++ ;
+	free(b->lat) ;
+
+}
+
+
+/*
+ * Helpers driving tfs through its FUSE operations
+ */
+static void fs_start() {
+
+	struct fuse_conn_info conn ;
+	memset(&conn, 0, sizeof(conn)) ;
+	tfs_ope.init(&conn) ;
+
+}
+
+static void fs_stop() {
+
+	tfs_ope.destroy(NULL) ;
+
+}
+
+static int fs_create(const char *path) {
+
+	struct fuse_file_info fi ;
+	memset(&fi, 0, sizeof(fi)) ;
+	int ret = tfs_ope.create(path, S_IFREG | 0666, &fi) ;
+	if (ret == 0) {
+
+		tfs_ope.release(path, &fi) ;
+
+	}
+
+	return ret ;
+}
+
+static int count_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+
+	(*(int *)buf)++ ;
+	return 0 ;
+}
+
+// File paths for the metadata workloads, spread over as many directories as they need
+static int file_path(char *path, size_t size, int i) {
+
+	return snprintf(path, size, "/d%d/f%d", i / DIR_FILES, i % DIR_FILES) ;
+}
+
+static int file_dirs(int n) {
+
+	return (n + DIR_FILES - 1) / DIR_FILES ;
+}
+
+static int make_files(int n, struct bench *b) {
+
+	char path[64] ;
+	int i ;
+	for (i = 0 ; i < file_dirs(n) ; i++) {
+
+		snprintf(path, sizeof(path), "/d%d", i) ;
+		if (tfs_ope.mkdir(path, S_IFDIR | 0755) != 0) {
+
+			return -1 ;
+
+		}
+
+	}
+
+	for (i = 0 ; i < n ; i++) {
+
+		file_path(path, sizeof(path), i) ;
+		if (b != NULL) {
+
+			sample_begin(b) ;
+
+		}
+		int ret = fs_create(path) ;
+		if (b != NULL) {
+
+			sample_end(b) ;
+
+		}
+		if (ret != 0) {
+
+			fprintf(stderr, "create %s: %d\n", path, ret) ;
+			return -1 ;
+
+		}
+
+	}
+
+	return 0 ;
+}
+
+static void shuffle(int *a, int n) {
+
+	int i ;
+	for (i = n - 1 ; i > 0 ; i--) {
+
+		int j = rand() % (i + 1) ;
+		int t = a[i] ;
+		a[i] = a[j] ;
+		a[j] = t ;
+
+	}
+
+}
+
+static int *random_order(int n) {
+
+	int * order = (int *)malloc(n * sizeof(int)) ;
+	int i ;
+	for (i = 0 ; i < n ; i++) {
+
+		order[i] = i ;
+
+	}
+	shuffle(order, n) ;
+
+	return order ;
+}
+
+
+/*
+ * Metadata workloads
+ */
+static void bench_create(const char *name, int n, int quota) {
+
+	struct bench b ;
+	fs_start() ;
+	if (quota) { // counted for the user and for a tree holding everything, with limits far off
+
+		char line[64] ;
+		int len = snprintf(line, sizeof(line), "quota user %u 0 %d\nquota tree / 0 %d\n", (unsigned)getuid(), MAX_INUM, MAX_INUM) ;
+		ctl_write(line, len) ;
+
+	}
+	bench_begin(&b, name, n) ;
+	make_files(n, &b) ;
+	bench_end(&b) ;
+	fs_stop() ;
+
+}
+
+static void bench_stat(int n) {
+
+	struct bench b ;
+	struct stat st ;
+	char path[64] ;
+	fs_start() ;
+	make_files(n, NULL) ;
+
+	int * order = random_order(n) ;
+	int i ;
+	bench_begin(&b, "stat", n) ;
+	for (i = 0 ; i < n ; i++) {
+
+		file_path(path, sizeof(path), order[i]) ;
+		sample_begin(&b) ;
+		tfs_ope.getattr(path, &st) ;
+		sample_end(&b) ;
+
+	}
+	bench_end(&b) ;
+
+	free(order) ;
+	fs_stop() ;
+
+}
+
+static void bench_unlink(int n) {
+
+	struct bench b ;
+	char path[64] ;
+	fs_start() ;
+	make_files(n, NULL) ;
+
+	int * order = random_order(n) ;
+	int i ;
+	bench_begin(&b, "unlink", n) ;
+	for (i = 0 ; i < n ; i++) {
+
+		file_path(path, sizeof(path), order[i]) ;
+		sample_begin(&b) ;
+		tfs_ope.unlink(path) ;
+		sample_end(&b) ;
+
+	}
+	bench_end(&b) ;
+
+	free(order) ;
+	fs_stop() ;
+
+}
+
+#define UNLINK_FILES 8
+
+/*
+ * Unlink of files of BENCH_FILE_SIZE / 4 bytes each, their blocks are freed in the background.
+ * writes/op is what the unlink itself writes.
+ */
+static void bench_unlink_large() {
+
+	struct bench b ;
+	struct fuse_file_info fi ;
+	char path[64] ;
+	size_t size = BENCH_FILE_SIZE / 4 ;
+	char * data = (char *)malloc(size) ;
+	int i ;
+
+	memset(&fi, 0, sizeof(fi)) ;
+	memset(data, 'u', size) ;
+	fs_start() ;
+	for (i = 0 ; i < UNLINK_FILES ; i++) {
+
+		snprintf(path, sizeof(path), "/large%d", i) ;
+		fs_create(path) ;
+		tfs_ope.write(path, data, size, 0, &fi) ;
+
+	}
+
+	bench_begin(&b, "unlink_large", UNLINK_FILES) ;
+	for (i = 0 ; i < UNLINK_FILES ; i++) {
+
+		snprintf(path, sizeof(path), "/large%d", i) ;
+		sample_begin(&b) ;
+		tfs_ope.unlink(path) ;
+		sample_end(&b) ;
+
+	}
+	bench_end(&b) ;
+
+	free(data) ;
+	fs_stop() ;
+
+}
+
+/*
+ * rmtree through /.tfs_ctl, one operation per directory of DIR_FILES files, against unlink above
+ * which takes one per file
+ */
+static void bench_rmtree(int n) {
+
+	struct bench b ;
+	char line[64] ;
+	int i ;
+	fs_start() ;
+	make_files(n, NULL) ;
+
+	bench_begin(&b, "rmtree", file_dirs(n)) ;
+	for (i = 0 ; i < file_dirs(n) ; i++) {
+
+		int len = snprintf(line, sizeof(line), "rmtree /d%d\n", i) ;
+		sample_begin(&b) ;
+		ctl_write(line, len) ;
+		sample_end(&b) ;
+
+	}
+	bench_end(&b) ;
+
+	fs_stop() ;
+
+}
+
+/*
+ * Breadth first tree with four subdirectories per directory, paths get longer as it fills up
+ */
+static void bench_mkdir_tree(int n) {
+
+	struct bench b ;
+	char ** paths = (char **)calloc(n + 1, sizeof(char *)) ;
+	int i ;
+	fs_start() ;
+
+	paths[0] = strdup("") ;
+	bench_begin(&b, "mkdir_tree", n) ;
+	for (i = 1 ; i <= n ; i++) {
+
+		char path[PATH_MAX] ;
+		snprintf(path, sizeof(path), "%s/t%d", paths[(i - 1) / 4], (i - 1) % 4) ;
+		paths[i] = strdup(path) ;
+
+		sample_begin(&b) ;
+		int ret = tfs_ope.mkdir(path, S_IFDIR | 0755) ;
+		sample_end(&b) ;
+		if (ret != 0) {
+
+			break ;
+
+		}
+
+	}
+	bench_end(&b) ;
+
+	for (i = 0 ; i <= n ; i++) {
+
+		free(paths[i]) ;
+
+	}
+	free(paths) ;
+	fs_stop() ;
+
+}
+
+/*
+ * Lookups spread over a directory filled to capacity, every other one a miss
+ */
+static void bench_lookup_large(int n) {
+
+	struct bench b ;
+	struct stat st ;
+	char path[64] ;
+	int i ;
+	fs_start() ;
+	make_files(DIR_FILES, NULL) ;
+
+	bench_begin(&b, "lookup_large", n) ;
+	for (i = 0 ; i < n ; i++) {
+
+		if (i % 2) {
+
+			snprintf(path, sizeof(path), "/d0/missing%d", i) ;
+
+		} else {
+
+			file_path(path, sizeof(path), rand() % DIR_FILES) ;
+
+		}
+		sample_begin(&b) ;
+		tfs_ope.getattr(path, &st) ;
+		sample_end(&b) ;
+
+	}
+	bench_end(&b) ;
+
+	fs_stop() ;
+
+}
+
+static void bench_readdir_large(int n) {
+
+	struct bench b ;
+	struct fuse_file_info fi ;
+	int i ;
+	fs_start() ;
+	make_files(DIR_FILES, NULL) ;
+
+	memset(&fi, 0, sizeof(fi)) ;
+	n = n / 10 > 0 ? n / 10 : 1 ; // each one walks the whole directory
+	bench_begin(&b, "readdir_large", n) ;
+	for (i = 0 ; i < n ; i++) {
+
+		int entries = 0 ;
+		sample_begin(&b) ;
+		tfs_ope.readdir("/d0", &entries, count_fill, 0, &fi) ;
+		sample_end(&b) ;
+
+	}
+	bench_end(&b) ;
+
+	fs_stop() ;
+
+}
+
+#define WALK_DIRS 8 // top-level directories of tree_walk
+#define WALK_FILE (3 * BLOCK_SIZE)
+
+static void walk_path(char *path, size_t size, int i) {
+
+	snprintf(path, size, "/w%d/s%d/f%d", i % WALK_DIRS, i / WALK_DIRS % 2, i / WALK_DIRS) ;
+
+}
+
+/*
+ * find/du -style walk of one top-level tree per operation, stat and read every file in it. The
+ * trees were filled a file at a time round robin and churned by deleting and creating half of
+ * the files again, record with -t and run tfs_replay on the trace to see how sequential it is.
+ */
+static void bench_tree_walk(int n) {
+
+	struct bench b ;
+	struct fuse_file_info fi ;
+	struct stat st ;
+	char path[64] ;
+	char * data = (char *)malloc(WALK_FILE) ;
+	int i, j, round ;
+	fs_start() ;
+
+	// Step 1: The trees, a subdirectory of each tree takes every other file
+	n = n < MAX_INUM - 1 - 3 * WALK_DIRS ? n : MAX_INUM - 1 - 3 * WALK_DIRS ;
+	memset(&fi, 0, sizeof(fi)) ;
+	memset(data, 'w', WALK_FILE) ;
+	for (i = 0 ; i < WALK_DIRS ; i++) {
+
+		snprintf(path, sizeof(path), "/w%d", i) ;
+		tfs_ope.mkdir(path, S_IFDIR | 0755) ;
+		for (j = 0 ; j < 2 ; j++) {
+
+			snprintf(path, sizeof(path), "/w%d/s%d", i, j) ;
+			tfs_ope.mkdir(path, S_IFDIR | 0755) ;
+
+		}
+
+	}
+
+	// Step 2: Files round robin over the trees, then half of them again
+	for (round = 0 ; round < 2 ; round++) {
+
+		for (i = round ; i < n ; i += round + 1) {
+
+			walk_path(path, sizeof(path), i) ;
+			if (round > 0) {
+
+				tfs_ope.unlink(path) ;
+
+			}
+			if (fs_create(path) != 0 || tfs_ope.write(path, data, WALK_FILE, 0, &fi) != WALK_FILE) {
+
+				fprintf(stderr, "tree_walk: can't write %s\n", path) ;
+				break ;
+
+			}
+
+		}
+
+	}
+	cache_sync(0, superblock->d_start_blk + MAX_DNUM, 1) ; // the walk starts cold
+
+	// Step 3: Walk each tree, the files of a subdirectory in the order readdir() gives them
+	bench_begin(&b, "tree_walk", WALK_DIRS) ;
+	for (i = 0 ; i < WALK_DIRS ; i++) {
+
+		sample_begin(&b) ;
+		for (j = 0 ; j < 2 ; j++) {
+
+			int entries = 0 ;
+			snprintf(path, sizeof(path), "/w%d/s%d", i, j) ;
+			tfs_ope.readdir(path, &entries, count_fill, 0, &fi) ;
+
+		}
+		for (j = i ; j < n ; j += WALK_DIRS) {
+
+			walk_path(path, sizeof(path), j) ;
+			tfs_ope.getattr(path, &st) ;
+			b.bytes += tfs_ope.read(path, data, WALK_FILE, 0, &fi) ;
+
+		}
+		sample_end(&b) ;
+
+	}
+	bench_end(&b) ;
+
+	free(data) ;
+	fs_stop() ;
+
+}
+
+
+#define DEFRAG_FILES 8
+
+/*
+ * The online defragmenter, unthrottled, on DEFRAG_FILES files that were written a block at a time
+ * round robin, so no two blocks of a file are next to each other. One operation per file moved,
+ * the fragmentation scores before and after go to stderr.
+ */
+static void bench_defrag() {
+
+	struct bench b ;
+	struct fuse_file_info fi ;
+	char path[64] ;
+	char * data = (char *)malloc(BLOCK_SIZE) ;
+	size_t blocks = BENCH_FILE_SIZE / DEFRAG_FILES / BLOCK_SIZE ;
+	size_t i ;
+	int f, ino ;
+
+	memset(&fi, 0, sizeof(fi)) ;
+	memset(data, 'd', BLOCK_SIZE) ;
+	fs_start() ;
+	for (f = 0 ; f < DEFRAG_FILES ; f++) {
+
+		snprintf(path, sizeof(path), "/frag%d", f) ;
+		fs_create(path) ;
+
+	}
+	for (i = 0 ; i < blocks ; i++) {
+
+		for (f = 0 ; f < DEFRAG_FILES ; f++) {
+
+			snprintf(path, sizeof(path), "/frag%d", f) ;
+			tfs_ope.write(path, data, BLOCK_SIZE, i * BLOCK_SIZE, &fi) ;
+
+		}
+
+	}
+
+	int rate = tfs_opts.defrag_rate ;
+	tfs_opts.defrag_rate = 0 ;
+	double before = defrag_score() ;
+	bench_begin(&b, "defrag", DEFRAG_FILES) ;
+	for (ino = 0 ; ino < MAX_INUM ; ino++) {
+
+		struct inode node ;
+		if (!get_bitmap(inoBitmap, ino) || readi(ino, &node) != 0 || node.type != 0) {
+
+			continue ;
+
+		}
+
+		sample_begin(&b) ;
+		b.bytes += defrag_file(ino, now_ns(), 0) * BLOCK_SIZE ;
+		sample_end(&b) ;
+
+	}
+	bench_end(&b) ;
+	fprintf(stderr, "defrag: fragmentation score %.1f -> %.1f\n", before, defrag_score()) ;
+	tfs_opts.defrag_rate = rate ;
+
+	free(data) ;
+	fs_stop() ;
+
+}
+
+/*
+ * Data workloads, each on a fresh file of BENCH_FILE_SIZE bytes
+ */
+static void bench_data(const char *kind, size_t size, int write, int random) {
+
+	struct bench b ;
+	struct fuse_file_info fi ;
+	char name[64] ;
+	char * buf = (char *)malloc(size) ;
+	size_t blocks = BENCH_FILE_SIZE / size ;
+	size_t ops = blocks < BENCH_MIN_OPS ? BENCH_MIN_OPS : blocks ;
+	size_t i ;
+
+	memset(buf, 'x', size) ;
+	memset(&fi, 0, sizeof(fi)) ;
+	fs_start() ;
+	fs_create("/file") ;
+
+	// Reads need something to read, random writes shouldn't be measuring allocation only
+	if (!write || random) {
+
+		for (i = 0 ; i < blocks ; i++) {
+
+			tfs_ope.write("/file", buf, size, i * size, &fi) ;
+
+		}
+
+	}
+
+	snprintf(name, sizeof(name), "%s_%zu", kind, size) ;
+	bench_begin(&b, name, ops) ;
+	for (i = 0 ; i < ops ; i++) {
+
+		off_t offset = (random ? (size_t)rand() % blocks : i % blocks) * size ;
+		int ret ;
+		sample_begin(&b) ;
+		if (write) {
+
+			ret = tfs_ope.write("/file", buf, size, offset, &fi) ;
+
+		} else {
+
+			ret = tfs_ope.read("/file", buf, size, offset, &fi) ;
+
+		}
+		sample_end(&b) ;
+		if (ret > 0) {
+
+			b.bytes += ret ;
+
+		}
+
+	}
+	bench_end(&b) ;
+
+	free(buf) ;
+	fs_stop() ;
+
+}
+
+/*
+ * A database's commit: write one block and fsync() it, next to a file with plenty of unsynced
+ * data that the fsync() shouldn't be paying for. Overwrites use fdatasync(), which only has
+ * the mtime to skip, appends use fsync() and have to write an indirect block and the bitmap too.
+ */
+static void bench_fsync(const char *name, int append) {
+
+	struct bench b ;
+	struct fuse_file_info fi ;
+	char * buf = (char *)malloc(BLOCK_SIZE) ;
+	size_t blocks = BENCH_FILE_SIZE / 4 / BLOCK_SIZE ;
+	size_t ops = blocks ;
+	size_t i ;
+
+	memset(buf, 'x', BLOCK_SIZE) ;
+	memset(&fi, 0, sizeof(fi)) ;
+	fs_start() ;
+	fs_create("/file") ;
+	fs_create("/other") ;
+	tfs_ope.open("/other", &fi) ;
+	for (i = 0 ; i < blocks ; i++) {
+
+		tfs_ope.write("/other", buf, BLOCK_SIZE, i * BLOCK_SIZE, &fi) ;
+
+	}
+
+	tfs_ope.open("/file", &fi) ;
+	if (!append) {
+
+		for (i = 0 ; i < blocks ; i++) {
+
+			tfs_ope.write("/file", buf, BLOCK_SIZE, i * BLOCK_SIZE, &fi) ;
+
+		}
+		tfs_ope.fsync("/file", 0, &fi) ;
+
+	}
+
+	bench_begin(&b, name, ops) ;
+	for (i = 0 ; i < ops ; i++) {
+
+		off_t offset = (append ? i : (size_t)rand() % blocks) * BLOCK_SIZE ;
+		sample_begin(&b) ;
+		if (tfs_ope.write("/file", buf, BLOCK_SIZE, offset, &fi) > 0) {
+
+			b.bytes += BLOCK_SIZE ;
+
+		}
+		tfs_ope.fsync("/file", !append, &fi) ;
+		sample_end(&b) ;
+
+	}
+	bench_end(&b) ;
+
+	tfs_ope.release("/file", &fi) ;
+	free(buf) ;
+	fs_stop() ;
+
+}
+
+/*
+ * copy_file_range() of the whole file through the "clone" command of /.tfs_ctl. Block aligned
+ * copies share the blocks and cost no data I/O, an odd destination offset has to copy it all.
+ */
+static void bench_clone(const char *name, int unaligned) {
+
+	struct bench b ;
+	struct fuse_file_info fi ;
+	char * buf = (char *)malloc(BLOCK_SIZE) ;
+	char cmd[128] ;
+	size_t blocks = BENCH_FILE_SIZE / BLOCK_SIZE ;
+	size_t ops = 32 ;
+	size_t i ;
+
+	memset(buf, 'x', BLOCK_SIZE) ;
+	memset(&fi, 0, sizeof(fi)) ;
+	fs_start() ;
+	fs_create("/file") ;
+	for (i = 0 ; i < blocks ; i++) {
+
+		tfs_ope.write("/file", buf, BLOCK_SIZE, i * BLOCK_SIZE, &fi) ;
+
+	}
+
+	if (unaligned) {
+
+		snprintf(cmd, sizeof(cmd), "clone /file /copy 0 1 %d\n", BENCH_FILE_SIZE) ;
+
+	} else {
+
+		snprintf(cmd, sizeof(cmd), "clone /file /copy\n") ;
+
+	}
+
+	bench_begin(&b, name, ops) ;
+	for (i = 0 ; i < ops ; i++) {
+
+		if (unaligned) {
+
+			fs_create("/copy") ;
+
+		}
+		sample_begin(&b) ;
+		if (tfs_ope.write("/.tfs_ctl", cmd, strlen(cmd), 0, &fi) > 0) {
+
+			b.bytes += BENCH_FILE_SIZE ;
+
+		}
+		sample_end(&b) ;
+		tfs_ope.unlink("/copy") ;
+
+	}
+	bench_end(&b) ;
+
+	free(buf) ;
+	fs_stop() ;
+
+}
+
+/*
+ * Sequential whole-block writes of a file made of a few distinct blocks repeated over and over,
+ * every fourth block all zeroes, like the padded records and copied artefacts -o dedup is for
+ */
+static void bench_dup_write() {
+
+	struct bench b ;
+	struct fuse_file_info fi ;
+	char * buf = (char *)malloc(BLOCK_SIZE) ;
+	size_t blocks = BENCH_FILE_SIZE / BLOCK_SIZE ;
+	size_t i ;
+
+	memset(&fi, 0, sizeof(fi)) ;
+	fs_start() ;
+	fs_create("/file") ;
+
+	bench_begin(&b, "dup_write", blocks) ;
+	for (i = 0 ; i < blocks ; i++) {
+
+		memset(buf, i % 4 == 3 ? 0 : 'a' + (int)(i % 16), BLOCK_SIZE) ;
+		sample_begin(&b) ;
+		if (tfs_ope.write("/file", buf, BLOCK_SIZE, i * BLOCK_SIZE, &fi) > 0) {
+
+			b.bytes += BLOCK_SIZE ;
+
+		}
+		sample_end(&b) ;
+
+	}
+	bench_end(&b) ;
+
+	free(buf) ;
+	fs_stop() ;
+
+}
+
+/*
+ * Sequential 64 KB writes, then reads, of text that compresses about as well as a log file.
+ * Compare writes/op and reads/op with and without -Z for what reaches the device.
+ */
+static void bench_log(int write) {
+
+	static const char * words[] = { "INFO", "WARN", "request", "served", "in", "ms", "from", "cache", "user", "GET" } ;
+	struct bench b ;
+	struct fuse_file_info fi ;
+	size_t size = 65536 ;
+	size_t chunks = BENCH_FILE_SIZE / size ;
+	char * text = (char *)malloc(BENCH_FILE_SIZE) ;
+	char * buf = (char *)malloc(size) ;
+	size_t len = 0 ;
+	size_t i ;
+
+	while (len < BENCH_FILE_SIZE) {
+
+		char line[128] ;
+		int n = snprintf(line, sizeof(line), "%08zu %s %s %s %d\n", len, words[rand() % 10], words[rand() % 10],
+			words[rand() % 10], rand() % 1000) ;
+		n = (size_t)n < BENCH_FILE_SIZE - len ? n : (int)(BENCH_FILE_SIZE - len) ;
+		memcpy(text + len, line, n) ;
+		len += n ;
+
+	}
+
+	memset(&fi, 0, sizeof(fi)) ;
+	fs_start() ;
+	fs_create("/file") ;
+	if (!write) {
+
+		for (i = 0 ; i < chunks ; i++) {
+
+			tfs_ope.write("/file", text + i * size, size, i * size, &fi) ;
+
+		}
+
+	}
+
+	bench_begin(&b, write ? "log_write" : "log_read", chunks) ;
+	for (i = 0 ; i < chunks ; i++) {
+
+		int ret ;
+		sample_begin(&b) ;
+		if (write) {
+
+			ret = tfs_ope.write("/file", text + i * size, size, i * size, &fi) ;
+
+		} else {
+
+			ret = tfs_ope.read("/file", buf, size, i * size, &fi) ;
+
+		}
+		sample_end(&b) ;
+		if (ret > 0) {
+
+			b.bytes += ret ;
+
+		}
+
+	}
+	bench_end(&b) ;
+
+	free(text) ;
+	free(buf) ;
+	fs_stop() ;
+
+}
+
+/*
+ * CRC32C of one block at a time with the table or the SSE4.2 implementation, what -o checksum
+ * adds to every block written and every block read from the device
+ */
+static void bench_crc(const char *name, int mode) {
+
+	struct bench b ;
+	size_t blocks = BENCH_FILE_SIZE / BLOCK_SIZE ;
+	char * data = (char *)malloc(BENCH_FILE_SIZE) ;
+	volatile uint32_t sink = 0 ;
+	size_t i ;
+
+	crc32c_setup() ;
+	if (mode > crc32c_mode) {
+
+		free(data) ;
+		return ; // no SSE4.2 here
+
+	}
+
+	int saved = crc32c_mode ;
+	crc32c_mode = mode ;
+	for (i = 0 ; i < BENCH_FILE_SIZE ; i++) {
+
+		data[i] = (char)rand() ;
+
+	}
+
+	bench_begin(&b, name, blocks) ;
+	for (i = 0 ; i < blocks ; i++) {
+
+		sample_begin(&b) ;
+		sink ^= crc32c(0, data + i * BLOCK_SIZE, BLOCK_SIZE) ;
+		sample_end(&b) ;
+		b.bytes += BLOCK_SIZE ;
+
+	}
+	bench_end(&b) ;
+
+	crc32c_mode = saved ;
+	free(data) ;
+
+}
+
+static int selected(const char *filter, const char *name) {
+
+	return filter == NULL || strncmp(name, filter, strlen(filter)) == 0 ;
+}
+
+int main(int argc, char *argv[]) {
+
+	static const size_t sizes[] = { 512, 4096, 65536, 1048576 } ;
+	const char * filter = NULL ;
+	int n = 1000 ;
+	unsigned int seed = 416 ;
+	int c ;
+	size_t i ;
+
+	while ((c = getopt(argc, argv, "n:s:w:c:jSt:DZK")) != -1) {
+
+		switch (c) {
+		case 'n': n = atoi(optarg) ; break ;
+		case 's': seed = strtoul(optarg, NULL, 0) ; break ;
+		case 'w': filter = optarg ; break ;
+		case 'c': tfs_opts.cache_blocks = atoi(optarg) ; break ;
+		case 'j': json = 1 ; break ;
+		case 'S': tfs_opts.stats = 1 ; break ;
+		case 't': tfs_opts.trace = optarg ; break ;
+		case 'D': tfs_opts.dedup = 1 ; break ;
+		case 'Z': tfs_opts.compress = 1 ; break ;
+		case 'K': tfs_opts.checksum = 1 ; break ;
+		default:
+			fprintf(stderr, "usage: %s [-n ops] [-s seed] [-w workload] [-c blocks] [-j] [-S] [-t trace] [-D] [-Z] [-K]\n", argv[0]) ;
+			return 1 ;
+		}
+
+	}
+
+	// Files plus their directories have to fit in the inode table next to the root
+	while (n > 1 && n + file_dirs(n) + 1 > MAX_INUM) {
+
+		n-- ;
+
+	}
+	srand(seed) ;
+
+	// Not the diskfile, tfs_init() then leaves diskfile_fd at -1 and does all I/O through the device.
+	// Every run starts from a fresh tfs_mkfs(), ram_open() finds nothing without -o ram_persist.
+	bench_device = ram_device ;
+	bench_device.read = bench_read ;
+	bench_device.write = bench_write ;
+	device = &bench_device ;
+
+	if (json) {
+
+		printf("{\"block_size\": %d, \"n\": %d, \"seed\": %u, \"results\": [", BLOCK_SIZE, n, seed) ;
+
+	} else {
+
+		printf("%-20s %8s %12s %9s %9s %9s %9s %9s %8s %8s\n", "workload", "ops", "ops/s", "MB/s",
+			"p50 us", "p90 us", "p99 us", "max us", "reads/op", "writes/op") ;
+
+	}
+
+	if (selected(filter, "create")) bench_create("create", n, 0) ;
+	if (selected(filter, "create_quota")) bench_create("create_quota", n, 1) ;
+	if (selected(filter, "stat")) bench_stat(n) ;
+	if (selected(filter, "unlink")) bench_unlink(n) ;
+	if (selected(filter, "unlink_large")) bench_unlink_large() ;
+	if (selected(filter, "rmtree")) bench_rmtree(n) ;
+	if (selected(filter, "mkdir_tree")) bench_mkdir_tree(n) ;
+	if (selected(filter, "lookup_large")) bench_lookup_large(n) ;
+	if (selected(filter, "readdir_large")) bench_readdir_large(n) ;
+	if (selected(filter, "tree_walk")) bench_tree_walk(n) ;
+	if (selected(filter, "defrag")) bench_defrag() ;
+	if (selected(filter, "fsync_overwrite")) bench_fsync("fsync_overwrite", 0) ;
+	if (selected(filter, "fsync_append")) bench_fsync("fsync_append", 1) ;
+	if (selected(filter, "clone")) bench_clone("clone", 0) ;
+	if (selected(filter, "copy_unaligned")) bench_clone("copy_unaligned", 1) ;
+	if (selected(filter, "dup_write")) bench_dup_write() ;
+	if (selected(filter, "log_write")) bench_log(1) ;
+	if (selected(filter, "log_read")) bench_log(0) ;
+	if (selected(filter, "crc32c_table")) bench_crc("crc32c_table", 0) ;
+	if (selected(filter, "crc32c_sse42")) bench_crc("crc32c_sse42", 1) ;
+
+	for (i = 0 ; i < sizeof(sizes) / sizeof(sizes[0]) ; i++) {
+
+		if (selected(filter, "seq_write")) bench_data("seq_write", sizes[i], 1, 0) ;
+		if (selected(filter, "seq_read")) bench_data("seq_read", sizes[i], 0, 0) ;
+		if (selected(filter, "rand_write")) bench_data("rand_write", sizes[i], 1, 1) ;
+		if (selected(filter, "rand_read")) bench_data("rand_read", sizes[i], 0, 1) ;
+
+	}
+
+	if (json) {
+
+		printf("\n]}\n") ;
+
+	}
+
+	if (tfs_opts.stats) {
+
+		size_t len ;
+		char * text = stats_render(&len) ;
+		fwrite(text, 1, len, stderr) ;
+		free(text) ;
+
+	}
+
+	return 0 ;
+}
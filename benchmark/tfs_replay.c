@@ -0,0 +1,618 @@
+/*
+ *	Tiny File System
+ *	File:	benchmark/tfs_replay.c
+ *
+ *	Offline analysis of block I/O traces recorded with tfs -o trace=<file> (see tfs_trace.h).
+ *	Nothing is mounted: the trace is summarised, run through simulated block caches of the
+ *	given sizes and policies, and optionally replayed against a diskfile through block.c.
+ *
+ *	Build (from the top level directory):
+ *		gcc -std=gnu99 -O2 -Wall -D_FILE_OFFSET_BITS=64 -I. benchmark/tfs_replay.c block.c -o tfs_replay
+ *
+ *	Usage: tfs_replay [-c sizes] [-p policy] [-W] [-d diskfile] [-j] trace
+ *		-c	comma separated cache sizes in blocks (default 64,256,1024,4096)
+ *		-p	lru, fifo, clock, min or all (default all), min is Belady's optimal policy
+ *		-W	write-through, by default writes stay in the cache until evicted (write-back)
+ *		-d	replay the accesses that miss the cache against this diskfile and time them,
+ *			the file is written to so never point it at a filesystem you care about
+ *		-j	print the results as JSON instead of a table
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "block.h"
+#include "tfs_trace.h"
+
+#define MAX_SIZES 16
+
+enum policy { POLICY_LRU, POLICY_FIFO, POLICY_CLOCK, POLICY_MIN, POLICY_COUNT } ;
+
+static const char * policy_names[POLICY_COUNT] = { "lru", "fifo", "clock", "min" } ;
+
+/*
+ * Trace, one entry per block, so a record with count n becomes n accesses
+ */
+struct access {
+
+	uint32_t blkno ;
+	uint8_t write ;
+	uint8_t op ;
+	uint64_t next ; // index of the next access to the same block, for MIN
+
+} ;
+
+static struct access * trace ;
+static size_t accesses ;
+static uint32_t max_blkno ;
+
+static int json = 0 ;
+
+
+static int cmp_rec(const void *a, const void *b) {
+
+	const struct tfs_trace_rec * x = (const struct tfs_trace_rec *)a ;
+	const struct tfs_trace_rec * y = (const struct tfs_trace_rec *)b ;
+	return x->ns < y->ns ? -1 : x->ns > y->ns ;
+}
+
+static int load_trace(const char *path) {
+
+	struct tfs_trace_hdr hdr ;
+	FILE * f = fopen(path, "r") ;
+	if (f == NULL) {
+
+		perror(path) ;
+		return -1 ;
+
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, TFS_TRACE_MAGIC, sizeof(hdr.magic)) != 0
+		|| hdr.version != TFS_TRACE_VERSION || hdr.block_size != BLOCK_SIZE) {
+
+		fprintf(stderr, "%s: not a tfs trace for %d byte blocks\n", path, BLOCK_SIZE) ;
+		fclose(f) ;
+		return -1 ;
+
+	}
+
+	// Step 1: Read every record, threads' records are interleaved so put them back in time order
+	size_t n = 0, cap = 4096 ;
+	struct tfs_trace_rec * recs = (struct tfs_trace_rec *)malloc(cap * sizeof(struct tfs_trace_rec)) ;
+	size_t got ;
+	while ((got = fread(recs + n, sizeof(struct tfs_trace_rec), cap - n, f)) > 0) {
+
+		n += got ;
+		if (n == cap) {
+
+			cap *= 2 ;
+			recs = (struct tfs_trace_rec *)realloc(recs, cap * sizeof(struct tfs_trace_rec)) ;
+
+		}
+
+	}
+	fclose(f) ;
+	qsort(recs, n, sizeof(struct tfs_trace_rec), cmp_rec) ;
+
+	// Step 2: Expand runs into single block accesses
+	size_t i, j, total = 0 ;
+	for (i = 0 ; i < n ; i++) {
+
+		total += recs[i].count ;
+
+	}
+
+	trace = (struct access *)malloc((total > 0 ? total : 1) * sizeof(struct access)) ;
+	accesses = 0 ;
+	max_blkno = 0 ;
+	for (i = 0 ; i < n ; i++) {
+
+		for (j = 0 ; j < recs[i].count ; j++) {
+
+			struct access * a = &trace[accesses++] ;
+			a->blkno = recs[i].blkno + j ;
+			a->write = recs[i].kind == TFS_TRACE_WRITE ;
+			a->op = recs[i].op < TFS_OP_COUNT ? recs[i].op : TFS_OP_NONE ;
+			if (a->blkno > max_blkno) {
+
+				max_blkno = a->blkno ;
+
+			}
+
+		}
+
+	}
+	free(recs) ;
+
+	// Step 3: Link each access to the next one of the same block, walking backwards
+	uint64_t * seen = (uint64_t *)malloc(((size_t)max_blkno + 1) * sizeof(uint64_t)) ;
+	for (i = 0 ; i <= max_blkno ; i++) {
+
+		seen[i] = UINT64_MAX ;
+
+	}
+	for (i = accesses ; i-- > 0 ; ) {
+
+		trace[i].next = seen[trace[i].blkno] ;
+		seen[trace[i].blkno] = i ;
+
+	}
+	free(seen) ;
+
+	return 0 ;
+}
+
+
+/*
+ * What the trace does on its own, before any cache
+ */
+static void summarize() {
+
+	uint64_t reads[TFS_OP_COUNT], writes[TFS_OP_COUNT] ;
+	uint64_t seq = 0, distance = 0, distinct = 0 ;
+	size_t i ;
+	memset(reads, 0, sizeof(reads)) ;
+	memset(writes, 0, sizeof(writes)) ;
+
+	uint8_t * touched = (uint8_t *)calloc((size_t)max_blkno + 1, 1) ;
+	for (i = 0 ; i < accesses ; i++) {
+
+		struct access * a = &trace[i] ;
+		if (a->write) {
+
+			writes[a->op]++ ;
+
+		} else {
+
+			reads[a->op]++ ;
+
+		}
+
+		if (!touched[a->blkno]) {
+
+			touched[a->blkno] = 1 ;
+			distinct++ ;
+
+		}
+
+		// Layout: how often the next block is the one right after, and how far we jump otherwise
+		if (i > 0) {
+
+			int64_t d = (int64_t)a->blkno - trace[i - 1].blkno ;
+			if (d == 1) {
+
+				seq++ ;
+
+			} else {
+
+				distance += d < 0 ? -d : d ;
+
+			}
+
+		}
+
+	}
+	free(touched) ;
+
+	double seq_pct = accesses > 1 ? 100.0 * seq / (accesses - 1) : 0 ;
+	double avg_jump = accesses > seq + 1 ? (double)distance / (accesses - 1 - seq) : 0 ;
+
+	if (json) {
+
+		printf("{\"accesses\": %zu, \"distinct_blocks\": %llu, \"sequential_pct\": %.2f, \"avg_jump\": %.1f, \"ops\": {",
+			accesses, (unsigned long long)distinct, seq_pct, avg_jump) ;
+		int first = 1 ;
+		for (i = 0 ; i < TFS_OP_COUNT ; i++) {
+
+			if (reads[i] + writes[i] > 0) {
+
+				printf("%s\"%s\": {\"reads\": %llu, \"writes\": %llu}", first ? "" : ", ", tfs_op_names[i],
+					(unsigned long long)reads[i], (unsigned long long)writes[i]) ;
+				first = 0 ;
+
+			}
+
+		}
+		printf("}, \"caches\": [") ;
+
+	} else {
+
+		printf("%zu block accesses, %llu distinct blocks, %.1f%% sequential, %.1f blocks per jump otherwise\n\n",
+			accesses, (unsigned long long)distinct, seq_pct, avg_jump) ;
+		printf("%-12s %12s %12s\n", "op", "reads", "writes") ;
+		for (i = 0 ; i < TFS_OP_COUNT ; i++) {
+
+			if (reads[i] + writes[i] > 0) {
+
+				printf("%-12s %12llu %12llu\n", tfs_op_names[i], (unsigned long long)reads[i], (unsigned long long)writes[i]) ;
+
+			}
+
+		}
+		printf("\n") ;
+
+	}
+
+}
+
+
+/*
+ * Simulated block cache, indexed by block number since traces only cover one small diskfile
+ */
+struct cache {
+
+	enum policy policy ;
+	size_t size ;
+	size_t used ;
+	int write_back ;
+
+	// Per block: slot in the cache or -1, and for MIN when the block is needed next
+	int64_t * slot_of ;
+
+	// Per slot
+	uint32_t * blk ;
+	uint8_t * dirty ;
+	uint8_t * ref ; // CLOCK
+	uint64_t * stamp ; // LRU: last use, FIFO: insertion
+	uint64_t * next_use ; // MIN
+	size_t hand ; // CLOCK
+
+	uint64_t hits ;
+	uint64_t misses ;
+	uint64_t dev_reads ;
+	uint64_t dev_writes ;
+
+} ;
+
+static void cache_init(struct cache *c, enum policy policy, size_t size, int write_back) {
+
+	memset(c, 0, sizeof(*c)) ;
+	c->policy = policy ;
+	c->size = size ;
+	c->write_back = write_back ;
+	c->slot_of = (int64_t *)malloc(((size_t)max_blkno + 1) * sizeof(int64_t)) ;
+	memset(c->slot_of, 0xff, ((size_t)max_blkno + 1) * sizeof(int64_t)) ;
+	c->blk = (uint32_t *)calloc(size, sizeof(uint32_t)) ;
+	c->dirty = (uint8_t *)calloc(size, 1) ;
+	c->ref = (uint8_t *)calloc(size, 1) ;
+	c->stamp = (uint64_t *)calloc(size, sizeof(uint64_t)) ;
+	c->next_use = (uint64_t *)calloc(size, sizeof(uint64_t)) ;
+
+}
+
+static void cache_free(struct cache *c) {
+
+	free(c->slot_of) ;
+	free(c->blk) ;
+	free(c->dirty) ;
+	free(c->ref) ;
+	free(c->stamp) ;
+	free(c->next_use) ;
+
+}
+
+/*
+ * Slot to evict, the scans are linear which is fine for the cache sizes worth simulating
+ */
+static size_t cache_victim(struct cache *c) {
+
+	size_t i, best = 0 ;
+	switch (c->policy) {
+	case POLICY_CLOCK:
+		while (c->ref[c->hand]) {
+
+			c->ref[c->hand] = 0 ;
+			c->hand = (c->hand + 1) % c->size ;
+
+		}
+		best = c->hand ;
+		c->hand = (c->hand + 1) % c->size ;
+		return best ;
+
+	case POLICY_MIN: // the block needed furthest in the future
+		for (i = 1 ; i < c->size ; i++) {
+
+			if (c->next_use[i] > c->next_use[best]) {
+
+				best = i ;
+
+			}
+
+		}
+		return best ;
+
+	default: // LRU and FIFO, oldest stamp
+		for (i = 1 ; i < c->size ; i++) {
+
+			if (c->stamp[i] < c->stamp[best]) {
+
+				best = i ;
+
+			}
+
+		}
+		return best ;
+	}
+}
+
+/*
+ * Returns 1 when the access has to go to the device, *evicted is set to a dirty block written back
+ */
+static int cache_access(struct cache *c, size_t i, int64_t *evicted) {
+
+	struct access * a = &trace[i] ;
+	int64_t slot = c->slot_of[a->blkno] ;
+	int dev = 0 ;
+	*evicted = -1 ;
+
+	if (slot >= 0) {
+
+		c->hits++ ;
+
+	} else {
+
+		c->misses++ ;
+
+		// Step 1: Find room, writing back what we throw out if it's dirty
+		if (c->used < c->size) {
+
+			slot = c->used++ ;
+
+		} else {
+
+			slot = cache_victim(c) ;
+			c->slot_of[c->blk[slot]] = -1 ;
+			if (c->dirty[slot]) {
+
+				c->dev_writes++ ;
+				*evicted = c->blk[slot] ;
+
+			}
+
+		}
+
+		// Step 2: Whole-block writes don't need the old contents
+		c->blk[slot] = a->blkno ;
+		c->slot_of[a->blkno] = slot ;
+		c->dirty[slot] = 0 ;
+		c->stamp[slot] = i ;
+		if (!a->write) {
+
+			c->dev_reads++ ;
+			dev = 1 ;
+
+		}
+
+	}
+
+	if (c->policy == POLICY_LRU) {
+
+		c->stamp[slot] = i ;
+
+	}
+	c->ref[slot] = 1 ;
+	c->next_use[slot] = a->next ;
+
+	if (a->write) {
+
+		if (c->write_back) {
+
+			c->dirty[slot] = 1 ;
+
+		} else {
+
+			c->dev_writes++ ;
+			dev = 1 ;
+
+		}
+
+	}
+
+	return dev ;
+}
+
+/*
+ * Replay against the device, only what missed the cache reaches it
+ */
+static double device_us(struct cache *c, size_t i, int dev, int64_t evicted, char *buf) {
+
+	struct timespec t0, t1 ;
+	clock_gettime(CLOCK_MONOTONIC, &t0) ;
+	if (evicted >= 0) {
+
+		bio_write(evicted, buf) ;
+
+	}
+	if (dev) {
+
+		if (trace[i].write) {
+
+			bio_write(trace[i].blkno, buf) ;
+
+		} else {
+
+			bio_read(trace[i].blkno, buf) ;
+
+		}
+
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1) ;
+
+	return (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3 ;
+}
+
+static void simulate(enum policy policy, size_t size, int write_back, const char *diskfile, int first) {
+
+	struct cache c ;
+	char * buf = diskfile != NULL ? (char *)calloc(1, BLOCK_SIZE) : NULL ;
+	double us = 0 ;
+	size_t i ;
+
+	cache_init(&c, policy, size, write_back) ;
+	for (i = 0 ; i < accesses ; i++) {
+
+		int64_t evicted ;
+		int dev = cache_access(&c, i, &evicted) ;
+		if (buf != NULL && (dev || evicted >= 0)) {
+
+			us += device_us(&c, i, dev, evicted, buf) ;
+
+		}
+
+	}
+
+	// Whatever is still dirty has to reach the device eventually
+	for (i = 0 ; i < c.used ; i++) {
+
+		if (c.dirty[i]) {
+
+			c.dev_writes++ ;
+			if (buf != NULL) {
+
+				bio_write(c.blk[i], buf) ;
+
+			}
+
+		}
+
+	}
+
+	double hit_pct = accesses > 0 ? 100.0 * c.hits / accesses : 0 ;
+	if (json) {
+
+		printf("%s\n    {\"policy\": \"%s\", \"size\": %zu, \"write_back\": %d, \"hits\": %llu, \"misses\": %llu, "
+			"\"hit_pct\": %.2f, \"dev_reads\": %llu, \"dev_writes\": %llu, \"device_ms\": %.3f}",
+			first ? "" : ",", policy_names[policy], size, write_back, (unsigned long long)c.hits,
+			(unsigned long long)c.misses, hit_pct, (unsigned long long)c.dev_reads,
+			(unsigned long long)c.dev_writes, us / 1000) ;
+
+	} else {
+
+		printf("%-8s %8zu %12llu %12llu %8.2f %12llu %12llu %12.3f\n", policy_names[policy], size,
+			(unsigned long long)c.hits, (unsigned long long)c.misses, hit_pct,
+			(unsigned long long)c.dev_reads, (unsigned long long)c.dev_writes, us / 1000) ;
+
+	}
+
+	cache_free(&c) ;
+	free(buf) ;
+
+}
+
+int main(int argc, char *argv[]) {
+
+	size_t sizes[MAX_SIZES] = { 64, 256, 1024, 4096 } ;
+	int nsizes = 4 ;
+	int policy = -1 ; // all
+	int write_back = 1 ;
+	const char * diskfile = NULL ;
+	int c, i, p ;
+
+	while ((c = getopt(argc, argv, "c:p:Wd:j")) != -1) {
+
+		switch (c) {
+		case 'c': {
+
+			char * list = strdup(optarg), * save = NULL, * tok ;
+			nsizes = 0 ;
+			for (tok = strtok_r(list, ",", &save) ; tok != NULL && nsizes < MAX_SIZES ; tok = strtok_r(NULL, ",", &save)) {
+
+				if (atol(tok) > 0) {
+
+					sizes[nsizes++] = atol(tok) ;
+
+				}
+
+			}
+			free(list) ;
+			break ;
+
+		}
+		case 'p':
+			for (policy = 0 ; policy < POLICY_COUNT && strcmp(optarg, policy_names[policy]) != 0 ; policy++) ;
+			if (policy == POLICY_COUNT) {
+
+				if (strcmp(optarg, "all") != 0) {
+
+					fprintf(stderr, "%s: unknown policy %s\n", argv[0], optarg) ;
+					return 1 ;
+
+				}
+				policy = -1 ;
+
+			}
+			break ;
+		case 'W': write_back = 0 ; break ;
+		case 'd': diskfile = optarg ; break ;
+		case 'j': json = 1 ; break ;
+		default:
+			fprintf(stderr, "usage: %s [-c sizes] [-p lru|fifo|clock|min|all] [-W] [-d diskfile] [-j] trace\n", argv[0]) ;
+			return 1 ;
+		}
+
+	}
+
+	if (optind >= argc || nsizes == 0) {
+
+		fprintf(stderr, "usage: %s [-c sizes] [-p lru|fifo|clock|min|all] [-W] [-d diskfile] [-j] trace\n", argv[0]) ;
+		return 1 ;
+
+	}
+
+	if (load_trace(argv[optind]) != 0) {
+
+		return 1 ;
+
+	}
+
+	if (diskfile != NULL) {
+
+		dev_init(diskfile) ;
+
+	}
+
+	summarize() ;
+	if (!json) {
+
+		printf("%-8s %8s %12s %12s %8s %12s %12s %12s\n", "policy", "blocks", "hits", "misses", "hit%",
+			"dev_reads", "dev_writes", "device_ms") ;
+
+	}
+
+	int first = 1 ;
+	for (p = 0 ; p < POLICY_COUNT ; p++) {
+
+		if (policy >= 0 && p != policy) {
+
+			continue ;
+
+		}
+
+		for (i = 0 ; i < nsizes ; i++) {
+
+			simulate(p, sizes[i], write_back, diskfile, first) ;
+			first = 0 ;
+
+		}
+
+	}
+
+	if (json) {
+
+		printf("\n]}\n") ;
+
+	}
+
+	if (diskfile != NULL) {
+
+		dev_close() ;
+
+	}
+	free(trace) ;
+
+	return 0 ;
+}
@@ -6,21 +6,36 @@
  */
 
 #define FUSE_USE_VERSION 26
+#define _GNU_SOURCE // O_DIRECT
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/xattr.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <lz4.h>
 
 #include "block.h"
 #include "tfs.h"
+#include "tfs_trace.h"
+#include "tfs_ext.h"
+#include "tfs_crc.h"
 
 char diskfile_path[PATH_MAX];
 
@@ -29,1185 +44,9602 @@ struct superblock * superblock ; // superblock
 bitmap_t inoBitmap ; // inode bitmap
 bitmap_t blknoBitmap ; // data bitmap
 
-/* 
- * Get available inode number from bitmap
+// Our own handles on the diskfile for run-sized transfers that bypass blk_read()/blk_write()
+int diskfile_fd = -1 ; // buffered
+int direct_fd = -1 ; // O_DIRECT, -1 if the host filesystem doesn't support it
+
+/*
+ * Mount options handled by tfs itself, everything else is passed on to FUSE
  */
-int get_avail_ino() {
+struct tfs_options {
+
+	int direct_io ; // treat every open as O_DIRECT
+	int lowlevel ; // serve the inode based low-level API instead of paths
+	int writeback_cache ; // let the kernel buffer and coalesce writes, where libfuse offers it
+	double attr_timeout ; // seconds the kernel may cache attributes
+	double entry_timeout ; // seconds the kernel may cache a name
+	double negative_timeout ; // seconds the kernel may cache a failed lookup, 0 to not cache
+	int stats ; // count calls, latencies and block I/O per operation, see /.tfs_stats
+	char * trace ; // file to record every block access to, see tfs_trace.h
+	int cache_blocks ; // blocks kept in memory, 0 to read and write the diskfile directly
+	int dirty_ratio ; // percent of the cache that may be dirty before writers wait
+	int dirty_background_ratio ; // percent of the cache that may be dirty before the flusher starts
+	double dirty_expire ; // seconds a block may stay dirty
+	char * snapshot ; // mount this snapshot read-only instead of the live tree, see /.tfs_ctl
+	int dedup ; // store blocks with the same contents once, and all-zero blocks not at all
+	int dedup_index ; // entries the dedup index may hold
+	int compress ; // compress full clusters of file data with LZ4, see tfs_ext.h
+	int checksum ; // keep a CRC32C of every block and check it on every read, see tfs_ext.h
+	int defrag_rate ; // blocks per second the defragmenter may move, 0 for no limit
+	int ram ; // keep the volume in memory instead of the diskfile, see struct tfs_dev
+	int ram_persist ; // -o ram, starting from the diskfile and written back to it on unmount
+
+} ;
+
+// Defaults for what main() doesn't set, -o overrides them
+struct tfs_options tfs_opts = {
+
+	.cache_blocks = 4096,
+	.dirty_ratio = 40,
+	.dirty_background_ratio = 10,
+	.dirty_expire = 5.0,
+	.dedup_index = 4096,
+	.defrag_rate = 1024
+
+} ;
+
+// fi->fh flags, the inode number + 1 is kept above them (0 for /.tfs_stats)
+#define TFS_FH_DIRECT 0x1
+#define TFS_FH_INO_SHIFT 16
+
+// The low-level session's channel, for cache invalidations we send to the kernel ourselves
+struct fuse_chan * ll_chan = NULL ;
+
+// FUSE reserves inode 0 and numbers the root 1, tfs inode n is FUSE inode n + 1
+#define TFS_INO(i) ((uint16_t)((i) - 1))
+#define FUSE_INO(i) ((fuse_ino_t)(i) + 1)
+
+// bmap() modes
+#define BMAP_LOOKUP 0 // never allocate, 0 means hole
+#define BMAP_ALLOC 1 // allocate missing blocks and zero them
+#define BMAP_FILL 2 // allocate missing blocks, caller overwrites the whole block
 
-	// Step 1: Read inode bitmap from disk
-	bio_read(superblock->i_bitmap_blk, inoBitmap) ;
-	
-	// Step 2: Traverse inode bitmap to find an available slot
-	int i ;
-	for (i = 0 ; i < MAX_INUM ; i++) {
+/*
+ * Per-operation statistics, enabled with -o stats
+ * Each thread counts into its own struct tfs_stats without locking, they are only summed up when
+ * someone reads /.tfs_stats or sends SIGUSR1
+ */
+#define TFS_HIST_BUCKETS 32 // bucket i counts latencies in [2^i, 2^(i+1)) ns, the last one everything slower
 
-		if (get_bitmap(inoBitmap, i) == 0) {
+struct tfs_op_stats {
 
-			break ;
+	uint64_t calls ;
+	uint64_t errors ; // path based operations only, low-level ones reply by themselves
+	uint64_t total_ns ;
+	uint64_t max_ns ;
+	uint64_t reads ; // blocks read from the diskfile
+	uint64_t writes ; // blocks written to the diskfile
+	uint64_t hist[TFS_HIST_BUCKETS] ;
 
-		} 
+} ;
 
-	}
+struct tfs_stats {
 
-	if (i >= MAX_INUM) {
+	struct tfs_op_stats op[TFS_OP_COUNT] ;
+	struct tfs_stats * next ;
 
-		return -1 ;
+} ;
 
-	}
+static struct tfs_stats * stats_list = NULL ; // counters of every running thread
+static struct tfs_stats stats_retired ; // what threads that have exited counted, folded together
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_key_t stats_key ; // hands a thread's counters to stats_retire() when it exits
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT ;
+static __thread struct tfs_stats * my_stats = NULL ;
+static __thread int my_op = TFS_OP_NONE ; // operation the block I/O of this thread is charged to
+static __thread uint16_t my_ino = TFS_TRACE_NO_INO ; // inode it is for, traces only
+static __thread uint32_t my_uid, my_gid ; // who it is for, what it creates is theirs
+static __thread int my_nospace ; // ENOSPC or EDQUOT while orphans were waiting to be freed, see reclaim_retry()
+static __thread int my_retrying ; // the operation is running again after reclaim_retry()
+static FILE * trace_file = NULL ; // -o trace, see below
 
-	// Step 3: Update inode bitmap and write to disk 
-	set_bitmap(inoBitmap, i) ;
-	bio_write(superblock->i_bitmap_blk, inoBitmap) ;
+#define TFS_STATS_NAME ".tfs_stats" // virtual file in the root directory
 
-	return i;
-}
+// Held for reading by every FUSE operation, for writing by background work on the tree
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER ;
 
-/* 
- * Get available data block number from bitmap
+/*
+ * -o dedup counters, kept under dedup_lock along with the index, see below
  */
-int get_avail_blkno() {
+struct tfs_dedup_stats {
 
-	// Step 1: Read data block bitmap from disk
-	bio_read(superblock->d_bitmap_blk, blknoBitmap) ;
-	
-	// Step 2: Traverse data block bitmap to find an available slot
-	int i ; 
-	for (i = 0 ; i < MAX_DNUM ; i++) {
+	uint64_t blocks ; // whole blocks written
+	uint64_t stored ; // of those, written to a block of their own
+	uint64_t shared ; // pointed at a block that already had the same contents
+	uint64_t zero ; // all zeroes, left as holes
+	uint64_t lookups ; // index lookups, one per block that isn't all zeroes
+	uint64_t hits ; // lookups that found a block with the same contents
+	uint64_t stale ; // lookups that found a block whose contents had changed
+	uint64_t evicted ; // entries pushed out to keep the index in its bounds
 
-		if (get_bitmap(blknoBitmap, i) == 0) {
+} ;
 
-			break ;
+static struct tfs_dedup_stats dedup_stats ;
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER ;
 
-		} 
+/*
+ * -o compress counters, updated with atomics
+ */
+struct tfs_compress_stats {
 
-	}
+	uint64_t clusters ; // stored compressed
+	uint64_t raw ; // full clusters that didn't compress and were stored as they are
+	uint64_t bytes_in ; // of the clusters stored compressed
+	uint64_t bytes_out ; // what they take on disk
+	uint64_t decompressed ; // clusters decompressed by reads and writes
 
-	if (i >= MAX_DNUM) {
+} ;
 
-		return -1 ;
+static struct tfs_compress_stats compress_stats ;
 
-	}
+/*
+ * -o checksum counters, updated with atomics
+ */
+struct tfs_csum_stats {
 
-	// Step 3: Update data block bitmap and write to disk 
-	set_bitmap(blknoBitmap, i) ;
-	bio_write(superblock->d_bitmap_blk, blknoBitmap) ;
+	uint64_t verified ; // blocks read from the diskfile whose checksum matched
+	uint64_t failed ; // and those whose didn't
 
-	return superblock->d_start_blk + i ;
-}
+} ;
 
-/* 
- * inode operations
+static struct tfs_csum_stats csum_stats ;
+
+/*
+ * Defragmenter progress, see defrag_pass(). The counters only change with fs_lock held for writing.
  */
-int readi(uint16_t ino, struct inode *inode) {
+struct tfs_defrag_stats {
 
-  // Step 1: Get the inode's on-disk block number
-  int block = superblock->i_start_blk + (ino / (BLOCK_SIZE / sizeof(struct inode))) ;
+	uint64_t passes ; // started
+	uint64_t files ; // moved into a run of their own
+	uint64_t skipped ; // fragmented but left where they are, no run was free for them
+	uint64_t blocks ; // moved
+	double before ; // fragmentation score when the last pass started, see defrag_score()
+	double after ; // and when it ended
+	int running ;
 
-  // Step 2: Get offset of the inode in the inode on-disk block
-  int offset = ino % (BLOCK_SIZE / sizeof(struct inode)) ;
+} ;
 
-  // Step 3: Read the block from disk and then copy into inode structure
-  struct inode * tempblock = (struct inode *)malloc(BLOCK_SIZE) ;
-  bio_read(block, (void *)tempblock) ;
-  tempblock = tempblock + offset ;
-  *inode = *tempblock ;
-  tempblock = tempblock - offset ;
-  free(tempblock) ;
+static struct tfs_defrag_stats defrag_stats ;
+static uint32_t * csums = NULL ; // per block number: its CRC32C, NULL while checksums are off, see below
+static __thread int my_csum_error = 0 ; // the operation on this thread read a block that failed its checksum
 
-	return 0;
-}
+struct op_timer {
 
-int writei(uint16_t ino, struct inode *inode) {
+	int op ; // -1 if stats are off
+	int prev ;
+	uint64_t start ;
 
-	// Step 1: Get the block number where this inode resides on disk
-	int block = superblock->i_start_blk + (ino / (BLOCK_SIZE / sizeof(struct inode))) ;
-	
-	// Step 2: Get the offset in the block where this inode resides on disk
-	int offset = ino % (BLOCK_SIZE / sizeof(struct inode)) ;
+} ;
 
-	// Step 3: Write inode to disk 
-	struct inode * tempblock = (struct inode *)malloc(BLOCK_SIZE) ;
-  	bio_read(block, (void *)tempblock) ;
-  	tempblock = tempblock + offset ;
-  	*tempblock = *inode ;
-  	tempblock = tempblock - offset ;
-	bio_write((const int)block, (const void *)tempblock) ;
-  	free(tempblock) ;
+static uint64_t now_ns() {
 
-	return 0;
+	struct timespec ts ;
+	clock_gettime(CLOCK_MONOTONIC, &ts) ;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec ;
 }
 
-
-/* 
- * directory operations
+/*
+ * Add one thread's counters to sum
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+static void stats_add(struct tfs_op_stats *sum, struct tfs_stats *t) {
 
-	//printf("called dir find\n") ;
-
-  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
-  struct inode * currenti = (struct inode *)malloc(sizeof(struct inode)) ;
-  readi(ino, currenti) ;
+	int op, i ;
+	for (op = 0 ; op < TFS_OP_COUNT ; op++) {
 
-  // Step 2: Get data block of current directory from inode
-  struct dirent * currentd = (struct dirent *)malloc(BLOCK_SIZE * sizeof(struct inode)) ;
-  //bio_read(currenti->direct_ptr, currentd) ;
+		struct tfs_op_stats * s = &t->op[op] ;
+		sum[op].calls += s->calls ;
+		sum[op].errors += s->errors ;
+		sum[op].total_ns += s->total_ns ;
+		sum[op].reads += s->reads ;
+		sum[op].writes += s->writes ;
+		if (s->max_ns > sum[op].max_ns) {
 
-  // Step 3: Read directory's data block and check each directory entry.
-  //If the name matches, then copy directory entry to dirent structure
-  int i, j ;
+			sum[op].max_ns = s->max_ns ;
 
-  for (i = 0 ; i < 16 ; i++) {
+		}
+		for (i = 0 ; i < TFS_HIST_BUCKETS ; i++) {
 
-	if (currenti->direct_ptr[i] == 0) { // Not found, so return early
+			sum[op].hist[i] += s->hist[i] ;
 
-		return -1 ;
+		}
 
 	}
 
-	bio_read(currenti->direct_ptr[i], currentd) ;
+}
+
+/*
+ * A thread is exiting, FUSE starts and stops workers as the load changes. Its counters go into
+ * stats_retired so the list only holds running threads.
+ */
+static void stats_retire(void *arg) {
 
-	for (j = 0 ; j < (BLOCK_SIZE / sizeof(struct dirent)) ; j++) {
+	struct tfs_stats * t = (struct tfs_stats *)arg ;
+	struct tfs_stats ** p ;
 
-	  	if (currentd->valid) {
+	pthread_mutex_lock(&stats_lock) ;
+	stats_add(stats_retired.op, t) ;
+	for (p = &stats_list ; *p != NULL ; p = &(*p)->next) {
 
-			//printf("%s and %s i = %d, j = %d\n", currentd->name, fname, i, j) ;
-		  	if (strcmp(currentd->name, fname) == 0 ) { // Found
+		if (*p == t) {
 
-			  *dirent = *currentd ;
-			  return 0 ;
+			*p = t->next ;
+			break ;
 
-		  	}
+		}
 
-	  	}
+	}
+	pthread_mutex_unlock(&stats_lock) ;
+	free(t) ;
+	my_stats = NULL ;
 
-	  currentd++ ;
+}
 
-  	}
+static void stats_key_init() {
 
-  }
+	pthread_key_create(&stats_key, stats_retire) ;
 
-	return -1;
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+static struct tfs_stats *stats_get() {
 
-	//printf("CALLED DIR ADD NAME = %s\n", fname) ;
+	if (my_stats == NULL) {
 
-	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-    struct dirent * currentd = (struct dirent *)malloc(BLOCK_SIZE * sizeof(struct inode)) ;
-	
-	// Step 2: Check if fname (directory name) is already used in other entries
-	int i, j ;
+		my_stats = (struct tfs_stats *)calloc(1, sizeof(struct tfs_stats)) ;
+		pthread_once(&stats_once, stats_key_init) ;
+		pthread_setspecific(stats_key, my_stats) ;
+		pthread_mutex_lock(&stats_lock) ;
+		my_stats->next = stats_list ;
+		stats_list = my_stats ;
+		pthread_mutex_unlock(&stats_lock) ;
 
-	for (i = 0 ; i < 16 ; i++) {
+	}
 
-		if (dir_inode.direct_ptr[i] == 0) {
+	return my_stats ;
+}
 
-			break ;
+static void op_begin(struct op_timer *t, int op) {
 
-		}
+	my_csum_error = 0 ;
+	if (!tfs_opts.stats && trace_file == NULL) {
 
-		bio_read(dir_inode.direct_ptr[i], currentd) ;
+		t->op = -1 ;
+		return ;
 
-		for (j = 0 ; j < (BLOCK_SIZE / sizeof(struct dirent)) ; j++) {
+	}
 
-	    	if (currentd->valid) {
+	t->op = op ;
+	t->prev = my_op ;
+	my_op = op ;
+	my_ino = TFS_TRACE_NO_INO ;
+	t->start = tfs_opts.stats ? now_ns() : 0 ;
 
-		  		if (strcmp(currentd->name, fname) == 0) { // name is already used
+}
 
-					//printf("found, failed\n") ;
-					return -1 ;
+static void op_end(struct op_timer *t, int failed) {
 
-				}
+	my_csum_error = 0 ;
+	if (t->op < 0) {
 
-			}
+		return ;
 
-		currentd++ ;
+	}
 
-		}
+	my_op = t->prev ;
+	if (!tfs_opts.stats) {
 
-	}
+		return ;
 
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
+	}
 
-	struct dirent * entry ;
+	uint64_t ns = now_ns() - t->start ;
+	struct tfs_op_stats * s = &stats_get()->op[t->op] ;
+	int bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0 ;
+	if (bucket >= TFS_HIST_BUCKETS) {
 
-	for (i = 0 ; i < 16 ; i++) {
+		bucket = TFS_HIST_BUCKETS - 1 ;
 
-		if (dir_inode.direct_ptr[i] == 0) { // Allocate a new data block for this directory if it does not exist
+	}
 
-			//printf("allocate new block at i = %d\n", i) ;
-			dir_inode.direct_ptr[i] = get_avail_blkno() ;
-			struct inode * newBlock = (struct inode *)malloc(BLOCK_SIZE) ;
-			bio_write(dir_inode.direct_ptr[i], (void *)newBlock) ;
-			free(newBlock) ;
-			dir_inode.vstat.st_blocks++ ;
-			if (i < 15) {
+	s->calls++ ;
+	s->errors += failed ;
+	s->total_ns += ns ;
+	if (ns > s->max_ns) {
 
-				dir_inode.direct_ptr[i + 1] = 0 ;
+		s->max_ns = ns ;
 
-			}
+	}
+	s->hist[bucket]++ ;
 
-		}
+}
 
-		bio_read(dir_inode.direct_ptr[i], currentd) ;
-		entry = currentd ;
-		//printf("new currentd\n") ;
+/*
+ * Charge blocks moved to or from the diskfile to the operation running on this thread
+ */
+static void stats_io(int write, int blocks) {
 
-		for (j = 0 ; j < (BLOCK_SIZE / sizeof(struct dirent)) ; j++) {
+	if (tfs_opts.stats) {
 
-			if (entry->valid == 0) {
+		struct tfs_op_stats * s = &stats_get()->op[my_op] ;
+		if (write) {
 
-				entry->ino = f_ino ;
-				strncpy(entry->name, fname, name_len + 1) ;
-				//printf("ENTRY NAME = %s j = %d\n", entry->name, j) ;
-				entry->valid = 1 ;
-				break ;
+			s->writes += blocks ;
 
-			}
+		} else {
 
-			entry++ ;
+			s->reads += blocks ;
 
 		}
 
-		if (entry->valid == 1) {
+	}
+
+}
+
+/*
+ * Latency below which a fraction p of the calls finished, going by the histogram
+ */
+static double hist_percentile_us(struct tfs_op_stats *s, double p) {
+
+	uint64_t seen = 0 ;
+	int i ;
+	for (i = 0 ; i < TFS_HIST_BUCKETS ; i++) {
+
+		seen += s->hist[i] ;
+		if (seen >= p * s->calls) {
 
-			//printf("ENTRY NAME = %s i = %d\n", entry->name, i) ;
 			break ;
 
 		}
 
 	}
 
-	// Update directory inode
-	struct inode * update = (struct inode *)malloc(sizeof(struct inode)) ;
-	*update = dir_inode ;
-	update->size = update->size + sizeof(struct dirent) ;
-	update->vstat.st_size = update->vstat.st_size + sizeof(struct dirent) ;
-	time(&update->vstat.st_mtime) ;
+	// Upper end of the bucket, but never past the slowest call actually seen
+	uint64_t ns = 1ULL << (i + 1) ;
+	return (double)(ns < s->max_ns ? ns : s->max_ns) / 1000 ;
+}
 
-	// Write directory entry
-	writei(update->ino, update) ;
-	bio_write(dir_inode.direct_ptr[i], currentd) ;
+/*
+ * Sum up every thread's counters and format them, the result is malloc'ed
+ */
+static char *stats_render(size_t *len) {
 
-	//printf("DIR ADD FINISHED\n") ;
+	struct tfs_op_stats sum[TFS_OP_COUNT] ;
+	struct tfs_stats * t ;
+	int op, i ;
+	memset(sum, 0, sizeof(sum)) ;
 
-	return 0;
-}
+	// Counters keep moving while we add them up, the snapshot is only approximate
+	pthread_mutex_lock(&stats_lock) ;
+	stats_add(sum, &stats_retired) ;
+	for (t = stats_list ; t != NULL ; t = t->next) {
 
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+		stats_add(sum, t) ;
 
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	struct dirent * currentd = (struct dirent *)malloc(BLOCK_SIZE) ;
-	
-	// Step 2: Check if fname exist
-	struct dirent * entry = (struct dirent *)malloc(sizeof(struct dirent)) ;
-	int i, j ;
+	}
+	pthread_mutex_unlock(&stats_lock) ;
 
-	for (i = 0 ; i < 16 ; i++) {
+	char * text = NULL ;
+	FILE * f = open_memstream(&text, len) ;
+	fprintf(f, "%-10s %10s %8s %10s %10s %10s %10s %12s %12s\n", "op", "calls", "errors",
+		"avg_us", "p50_us", "p99_us", "max_us", "blk_reads", "blk_writes") ;
+	for (op = 0 ; op < TFS_OP_COUNT ; op++) {
 
-		if (dir_inode.direct_ptr[i] == 0) {
+		struct tfs_op_stats * s = &sum[op] ;
+		if (s->calls == 0 && s->reads == 0 && s->writes == 0) {
 
-			return -1 ;
+			continue ;
 
 		}
 
-		bio_read(dir_inode.direct_ptr[i], currentd) ;
-		entry = currentd ;
+		if (s->calls == 0) { // I/O outside of any operation
 
-		for (j = 0 ; j < (BLOCK_SIZE / sizeof(struct dirent)) ; j++) {
+			fprintf(f, "%-10s %10s %8s %10s %10s %10s %10s %12llu %12llu\n", tfs_op_names[op], "-", "-", "-", "-", "-", "-",
+				(unsigned long long)s->reads, (unsigned long long)s->writes) ;
+			continue ;
 
-	    	if (entry->valid) {
+		}
 
-		  		if (strcmp(entry->name, fname) == 0) { // name is already used
+		fprintf(f, "%-10s %10llu %8llu %10.1f %10.1f %10.1f %10.1f %12llu %12llu\n", tfs_op_names[op],
+			(unsigned long long)s->calls, (unsigned long long)s->errors, (double)s->total_ns / s->calls / 1000,
+			hist_percentile_us(s, 0.5), hist_percentile_us(s, 0.99), (double)s->max_ns / 1000,
+			(unsigned long long)s->reads, (unsigned long long)s->writes) ;
 
-					break ;
-					
-				}
+	}
 
-			}
+	// Raw histograms, "<N" is the bucket of calls that took less than N ns
+	fprintf(f, "\n") ;
+	for (op = 0 ; op < TFS_OP_COUNT ; op++) {
+
+		if (sum[op].calls == 0) {
 
-		entry++ ;
+			continue ;
 
 		}
 
-		if (strcmp(entry->name, fname) == 0) { // name is already used
+		fprintf(f, "%-10s", tfs_op_names[op]) ;
+		for (i = 0 ; i < TFS_HIST_BUCKETS ; i++) {
 
-			break ;
-					
-		}
+			if (sum[op].hist[i] > 0) {
 
-	}
+				fprintf(f, " <%llu:%llu", 1ULL << (i + 1), (unsigned long long)sum[op].hist[i]) ;
 
-	if (i >= 16) {
+			}
 
-		return -1 ;
+		}
+		fprintf(f, "\n") ;
 
 	}
 
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
-	struct inode * update = (struct inode *)malloc(sizeof(struct inode)) ;
-	*update = dir_inode ;
-	update->size = update->size - sizeof(struct dirent) ;
-	update->vstat.st_size = update->vstat.st_size - sizeof(struct dirent) ;
-	entry->valid = 0 ;
-	writei(update->ino, update) ;
-	bio_write(dir_inode.direct_ptr[i], (const void *)currentd) ;
+	if (tfs_opts.dedup) {
 
-	return 0;
-}
+		struct tfs_dedup_stats d ;
+		pthread_mutex_lock(&dedup_lock) ;
+		d = dedup_stats ;
+		pthread_mutex_unlock(&dedup_lock) ;
 
-/* 
- * namei operation
- */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-	//printf("reached get node\n") ;
-	//printf("path: %s\n", path) ;
-	//ino = 0 ; 
-	char * delim = (char *)malloc(2 * sizeof(char)) ;
-	delim[0] = '/' ;
-	delim[1] = '\0' ; // Doing both in one line doesn't work
-	char * str = strtok(path, delim) ;
-	struct dirent * entry = (struct dirent *)malloc(sizeof(struct dirent)) ;
-	entry->ino = 0 ;
+		fprintf(f, "\ndedup      %llu blocks written, %llu stored, %llu shared, %llu zero, ratio %.2f\n",
+			(unsigned long long)d.blocks, (unsigned long long)d.stored, (unsigned long long)d.shared,
+			(unsigned long long)d.zero, d.stored > 0 ? (double)d.blocks / d.stored : 1.0) ;
+		fprintf(f, "dedup_idx  %d entries, %llu lookups, %llu hits (%.1f%%), %llu stale, %llu evicted\n",
+			tfs_opts.dedup_index, (unsigned long long)d.lookups, (unsigned long long)d.hits,
+			d.lookups > 0 ? 100.0 * d.hits / d.lookups : 0.0, (unsigned long long)d.stale,
+			(unsigned long long)d.evicted) ;
+
+	}
 
-	if (strcmp(path, delim) == 0) { // root
+	if (tfs_opts.compress) {
 
-		//printf("ROOT\n") ;
-		str = NULL ;
+		struct tfs_compress_stats *c = &compress_stats ;
+		fprintf(f, "\ncompress   %llu clusters compressed, %llu stored raw, %llu decompressed, ratio %.2f\n",
+			(unsigned long long)c->clusters, (unsigned long long)c->raw, (unsigned long long)c->decompressed,
+			c->bytes_out > 0 ? (double)c->bytes_in / c->bytes_out : 1.0) ;
 
 	}
 
-	while (str != NULL) {
+	if (defrag_stats.passes > 0) {
 
-		//printf("loop %s\n", str) ;
-		if (dir_find(entry->ino, (const char *)str, (size_t)strlen(str), entry) == -1) {
+		struct tfs_defrag_stats *d = &defrag_stats ;
+		fprintf(f, "\ndefrag     %llu passes, %s, score %.1f -> %.1f, %llu files moved, %llu blocks, %llu skipped\n",
+			(unsigned long long)d->passes, d->running ? "running" : "idle", d->before, d->running ? d->before : d->after,
+			(unsigned long long)d->files, (unsigned long long)d->blocks, (unsigned long long)d->skipped) ;
+
+	}
 
-			return -1 ;
+	if (csums != NULL) {
 
-		}
-		str = strtok(NULL, delim) ;
+		fprintf(f, "\nchecksum   %llu blocks verified, %llu failed (%s)\n",
+			(unsigned long long)csum_stats.verified, (unsigned long long)csum_stats.failed,
+			crc32c_mode == 1 ? "sse4.2" : "table") ;
 
 	}
+	fclose(f) ;
 
-	//printf("reached readi\n") ;
+	return text ;
+}
 
-	readi(entry->ino, inode) ;
+static int is_stats_name(uint16_t parent_ino, const char *name) {
 
-	return 0;
+	return tfs_opts.stats && parent_ino == 0 && strcmp(name, TFS_STATS_NAME) == 0 ;
 }
 
-/* 
- * Make file system
- */
-int tfs_mkfs() {
+static int is_stats_path(const char *path) {
 
-	// Call dev_init() to initialize (Create) Diskfile
-	dev_init(diskfile_path) ;
+	return tfs_opts.stats && strcmp(path, "/" TFS_STATS_NAME) == 0 ;
+}
 
-	// write superblock information
-	superblock = (struct superblock *)malloc(BLOCK_SIZE) ;
-	superblock->magic_num = MAGIC_NUM ;
-	superblock->max_inum = MAX_INUM ;
-	superblock->max_dnum = MAX_DNUM ;
-	superblock->i_bitmap_blk = 1 ;
-	superblock->d_bitmap_blk = 2 ;
-	superblock->i_start_blk = 3 ;
-	superblock->d_start_blk = 3 + ((sizeof(struct inode) * MAX_INUM) / BLOCK_SIZE) ;
-	bio_write(0, superblock) ;
-	
-	// initialize inode bitmap
-	inoBitmap = (bitmap_t)malloc(BLOCK_SIZE) ;
+static void stats_stat(struct stat *st) {
 
-	// initialize data block bitmap
-	blknoBitmap = (bitmap_t)malloc(BLOCK_SIZE) ;
+	// Size 0, the file is opened with direct_io so the kernel reads it anyway
+	memset(st, 0, sizeof(*st)) ;
+	st->st_mode = S_IFREG | 0444 ;
+	st->st_nlink = 1 ;
+	st->st_blksize = BLOCK_SIZE ;
+	time(&st->st_mtime) ;
 
-	// update bitmap information for root directory
-	set_bitmap(inoBitmap, 0) ;
-	bio_write(superblock->i_bitmap_blk, inoBitmap) ;
-	set_bitmap(blknoBitmap, 0) ;
-	bio_write(superblock->d_bitmap_blk, blknoBitmap) ;
+}
 
-	// update inode for root directory
-	struct inode * rootNode = (struct inode *)malloc(BLOCK_SIZE) ;
-	bio_read(superblock->i_start_blk, rootNode) ;
-	rootNode->ino = 0 ;
-	rootNode->valid = 1 ;
-	rootNode->link = 0 ;
-	rootNode->indirect_ptr[0] = 0 ;
-	rootNode->direct_ptr[0] = superblock->d_start_blk ;
-	rootNode->direct_ptr[1] = 0 ;
-	rootNode->type = 1 ;
+static int stats_open(struct fuse_file_info *fi) {
 
-	struct stat * r = (struct stat *)malloc(sizeof(struct stat)) ;
-	r->st_mode = S_IFDIR | 0755 ;
-	r->st_nlink = 2 ; // Need two links, "." for itself and ".." for the parent
-	time(&r->st_mtime) ;
-	r->st_blocks = 1 ;
-	r->st_blksize = BLOCK_SIZE ;
-	rootNode->vstat = *r ;
-	bio_write(superblock->i_start_blk, rootNode) ;
-	free(rootNode) ;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
 
-	struct dirent * rootDir = (struct dirent *)malloc(BLOCK_SIZE) ;
-	rootDir->ino = 0 ;
-	rootDir-> valid = 1 ;
-	char c[2] ;
-	c[0] = '.' ;
-	c[1] = '\0' ;
-	strncpy(rootDir->name, c, 2) ; // Current directory
-	//printf("rootDir name = %s\n", rootDir->name) ;
-	struct dirent * parent = rootDir + 1 ;
-	parent->ino = 0 ;
-	parent->valid = 1 ;
-	char p[3] ;
-	p[0] = '.' ;
-	p[1] = '.' ;
-	p[2] = '\0' ;
-	strncpy(parent->name, p, 3) ; // Parent directory
-	//printf("parent name = %s\n", (rootDir + 1)->name) ;
-	bio_write(superblock->d_start_blk, rootDir) ;
-	free(rootDir) ;
+		return -EACCES ;
 
-	return 0;
+	}
+
+	fi->direct_io = 1 ;
+	return 0 ;
 }
 
+static int stats_read(char *buffer, size_t size, off_t offset) {
 
-/* 
- * FUSE file operations
+	size_t len ;
+	char * text = stats_render(&len) ;
+	size_t n = 0 ;
+	if (offset < len) {
+
+		n = len - offset < size ? len - offset : size ;
+		memcpy(buffer, text + offset, n) ;
+
+	}
+	free(text) ;
+
+	return n ;
+}
+
+/*
+ * SIGUSR1 writes the same report to <diskfile>.stats. The handler only pokes a pipe,
+ * the report is put together on a thread of its own.
  */
-static void *tfs_init(struct fuse_conn_info *conn) {
+static int stats_pipe[2] = { -1, -1 } ;
 
-	//printf("INIT CALLED\n") ;
+static void stats_signal(int sig) {
 
-	// Step 1a: If disk file is not found, call mkfs
-	if(dev_open(diskfile_path) == -1) {
+	char c = 0 ;
+	ssize_t n = write(stats_pipe[1], &c, 1) ;
+	(void)n ;
 
-		//printf("running mkfs\n") ;
-		tfs_mkfs() ;
-		return NULL ;
+}
 
-	}
+static void *stats_dumper(void *arg) {
 
-  // Step 1b: If disk file is found, just initialize in-memory data structures
+	char path[PATH_MAX + 8] ;
+	char c ;
+	snprintf(path, sizeof(path), "%s.stats", diskfile_path) ;
+
+	while (read(stats_pipe[0], &c, 1) == 1) {
+
+		size_t len ;
+		char * text = stats_render(&len) ;
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) ;
+		if (fd >= 0) {
+
+			ssize_t n = write(fd, text, len) ;
+			(void)n ;
+			close(fd) ;
+
+		}
+		free(text) ;
+
+	}
+
+	return NULL ;
+}
+
+static void stats_start() {
+
+	pthread_t thread ;
+	if (!tfs_opts.stats || stats_pipe[0] >= 0 || pipe(stats_pipe) != 0) {
+
+		return ;
+
+	}
+
+	if (pthread_create(&thread, NULL, stats_dumper, NULL) == 0) {
+
+		pthread_detach(thread) ;
+		signal(SIGUSR1, stats_signal) ;
+
+	}
+
+}
+
+/*
+ * Block I/O tracing, enabled with -o trace=<file>
+ * Each thread appends to a ring of its own, the only thing it shares with the flusher thread that
+ * drains the rings into the file are the head and tail indices. A thread never waits for the
+ * flusher, it wakes it up when its ring gets half full and drops and counts records once it is full.
+ */
+#define TFS_TRACE_RING 65536 // records per thread, a power of two
+
+struct tfs_trace_ring {
+
+	struct tfs_trace_rec rec[TFS_TRACE_RING] ;
+	uint64_t head ; // next slot the owning thread fills, stored with release semantics
+	uint64_t tail ; // next slot the flusher writes out, stored with release semantics
+	uint64_t dropped ;
+	uint32_t thread ;
+	struct tfs_trace_ring * next ;
+
+} ;
+
+static struct tfs_trace_ring * trace_rings = NULL ;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER ; // protects the list of rings, not their contents
+static pthread_key_t trace_key ; // hands a thread's ring to trace_retire() when it exits
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT ;
+static uint64_t trace_dropped = 0 ; // by threads that have exited
+static __thread struct tfs_trace_ring * my_ring = NULL ;
+static uint32_t trace_threads = 0 ;
+static uint64_t trace_start ;
+static pthread_t trace_thread ;
+static sem_t trace_wakeup ;
+static int trace_stop ;
+
+static void trace_ino(uint16_t ino) {
+
+	my_ino = ino ;
+
+}
+
+static void trace_retire(void *arg) ;
+
+static void trace_key_init() {
+
+	pthread_key_create(&trace_key, trace_retire) ;
+
+}
+
+static void trace_io(int kind, int blkno, int count) {
+
+	if (trace_file == NULL) {
+
+		return ;
+
+	}
+
+	struct tfs_trace_ring * r = my_ring ;
+	if (r == NULL) {
+
+		r = (struct tfs_trace_ring *)calloc(1, sizeof(struct tfs_trace_ring)) ;
+		pthread_once(&trace_once, trace_key_init) ;
+		pthread_setspecific(trace_key, r) ;
+		pthread_mutex_lock(&trace_lock) ;
+		r->thread = trace_threads++ ;
+		r->next = trace_rings ;
+		trace_rings = r ;
+		pthread_mutex_unlock(&trace_lock) ;
+		my_ring = r ;
+
+	}
+
+	uint64_t head = r->head ;
+	uint64_t queued = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ;
+	if (queued >= TFS_TRACE_RING) {
+
+		r->dropped++ ;
+		return ;
+
+	}
+
+	if (queued == TFS_TRACE_RING / 2) {
+
+		sem_post(&trace_wakeup) ;
+
+	}
+
+	struct tfs_trace_rec * rec = &r->rec[head & (TFS_TRACE_RING - 1)] ;
+	rec->ns = now_ns() - trace_start ;
+	rec->blkno = blkno ;
+	rec->thread = r->thread ;
+	rec->ino = my_ino ;
+	rec->count = count ;
+	rec->kind = kind ;
+	rec->op = my_op ;
+	rec->reserved = 0 ;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE) ;
+
+}
+
+/*
+ * Write out whatever ring r holds, the slots are handed back only once they are in the file.
+ * Called with trace_lock held.
+ */
+static void trace_drain_ring(struct tfs_trace_ring *r) {
+
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ;
+	uint64_t tail = r->tail ;
+	while (tail < head) {
+
+		// Up to the end of the ring in one go, the rest after wrapping around
+		size_t slot = tail & (TFS_TRACE_RING - 1) ;
+		size_t n = TFS_TRACE_RING - slot ;
+		if (n > head - tail) {
+
+			n = head - tail ;
+
+		}
+
+		fwrite(&r->rec[slot], sizeof(struct tfs_trace_rec), n, trace_file) ;
+		tail += n ;
+
+	}
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE) ;
+
+}
+
+static void trace_drain() {
+
+	struct tfs_trace_ring * r ;
+
+	pthread_mutex_lock(&trace_lock) ;
+	for (r = trace_rings ; r != NULL ; r = r->next) {
+
+		trace_drain_ring(r) ;
+
+	}
+	pthread_mutex_unlock(&trace_lock) ;
+
+}
+
+/*
+ * A thread is exiting, what its ring still holds is written out before the ring goes
+ */
+static void trace_retire(void *arg) {
+
+	struct tfs_trace_ring * r = (struct tfs_trace_ring *)arg ;
+	struct tfs_trace_ring ** p ;
+
+	pthread_mutex_lock(&trace_lock) ;
+	if (trace_file != NULL) {
+
+		trace_drain_ring(r) ;
+
+	}
+	trace_dropped += r->dropped ;
+	for (p = &trace_rings ; *p != NULL ; p = &(*p)->next) {
+
+		if (*p == r) {
+
+			*p = r->next ;
+			break ;
+
+		}
+
+	}
+	pthread_mutex_unlock(&trace_lock) ;
+	free(r) ;
+	my_ring = NULL ;
+
+}
+
+static void *trace_flusher(void *arg) {
+
+	while (!__atomic_load_n(&trace_stop, __ATOMIC_ACQUIRE)) {
+
+		struct timespec ts ;
+		trace_drain() ;
+
+		// Every 50 ms, or as soon as a ring fills up
+		clock_gettime(CLOCK_REALTIME, &ts) ;
+		ts.tv_nsec += 50000000 ;
+		if (ts.tv_nsec >= 1000000000) {
+
+			ts.tv_sec++ ;
+			ts.tv_nsec -= 1000000000 ;
+
+		}
+		sem_timedwait(&trace_wakeup, &ts) ;
+
+	}
+
+	return NULL ;
+}
+
+static void trace_open() {
+
+	struct tfs_trace_hdr hdr ;
+	if (tfs_opts.trace == NULL || trace_file != NULL) {
+
+		return ;
+
+	}
+
+	FILE * f = fopen(tfs_opts.trace, "w") ;
+	if (f == NULL) {
+
+		perror(tfs_opts.trace) ;
+		return ;
+
+	}
+
+	memset(&hdr, 0, sizeof(hdr)) ;
+	memcpy(hdr.magic, TFS_TRACE_MAGIC, sizeof(hdr.magic)) ;
+	hdr.version = TFS_TRACE_VERSION ;
+	hdr.block_size = BLOCK_SIZE ;
+	hdr.start_ns = trace_start = now_ns() ;
+	fwrite(&hdr, sizeof(hdr), 1, f) ;
+
+	trace_stop = 0 ;
+	sem_init(&trace_wakeup, 0, 0) ;
+	trace_file = f ;
+	if (pthread_create(&trace_thread, NULL, trace_flusher, NULL) != 0) {
+
+		trace_file = NULL ;
+		fclose(f) ;
+		sem_destroy(&trace_wakeup) ;
+
+	}
+
+}
+
+static void trace_close() {
+
+	struct tfs_trace_ring * r ;
+	uint64_t dropped = 0 ;
+	if (trace_file == NULL) {
+
+		return ;
+
+	}
+
+	__atomic_store_n(&trace_stop, 1, __ATOMIC_RELEASE) ;
+	sem_post(&trace_wakeup) ;
+	pthread_join(trace_thread, NULL) ;
+	trace_drain() ;
+	sem_destroy(&trace_wakeup) ;
+
+	// The rings stay allocated, threads that traced still point at theirs. One that exits now
+	// frees its own.
+	pthread_mutex_lock(&trace_lock) ;
+	fclose(trace_file) ;
+	trace_file = NULL ;
+	dropped = trace_dropped ;
+	trace_dropped = 0 ;
+	for (r = trace_rings ; r != NULL ; r = r->next) {
+
+		dropped += r->dropped ;
+		r->dropped = 0 ;
+
+	}
+	pthread_mutex_unlock(&trace_lock) ;
+	if (dropped > 0) {
+
+		fprintf(stderr, "tfs: %llu trace records dropped, the flusher fell behind\n", (unsigned long long)dropped) ;
+
+	}
+
+}
+
+/*
+ * Block devices
+ * tfs moves whole blocks through device, which main() points at the diskfile (block.c) or with
+ * -o ram at a volume kept in memory. Only the diskfile gets diskfile_fd and direct_fd, the
+ * transfers that would bypass blk_read()/blk_write() go through them on any other device.
+ */
+struct tfs_dev {
+
+	const char * name ;
+	int (*open)(const char *path) ; // 0 if there is a filesystem to mount, -1 for tfs_mkfs() to make one
+	void (*init)(const char *path) ; // an empty device for tfs_mkfs()
+	void (*close)() ;
+	int (*read)(const int blkno, void *buf) ; // BLOCK_SIZE, or <= 0 and buf zeroed, as bio_read() does
+	int (*write)(const int blkno, const void *buf) ;
+
+} ;
+
+static struct tfs_dev file_device = { "diskfile", dev_open, dev_init, dev_close, bio_read, bio_write } ;
+
+/*
+ * -o ram: the volume is one anonymous mapping, in huge pages if the kernel has
+ * some reserved and as transparent huge pages otherwise, so random blocks don't each cost a TLB
+ * miss. FUSE threads run on any CPU, so its pages are interleaved over the NUMA nodes instead of
+ * all landing on the node of whoever touched them first. It starts empty and is gone on unmount,
+ * -o ram_persist starts from the diskfile instead and writes the volume back to it on unmount.
+ * A diskfile grows past DISK_SIZE once the allocator gets to the blocks past it, so the mapping
+ * covers every block the layout can address. Pages nobody wrote to cost nothing.
+ */
+#define RAM_BLOCKS (3 + (sizeof(struct inode) * MAX_INUM) / BLOCK_SIZE + MAX_DNUM) // as tfs_mkfs() lays it out
+#define RAM_HUGE_PAGE (2 * 1024 * 1024)
+#define RAM_MPOL_INTERLEAVE 3 // MPOL_INTERLEAVE from <numaif.h>, which is libnuma's
+
+static char * ram_base = NULL ;
+static size_t ram_len ;
+static const char * ram_path ; // the diskfile, -o ram_persist only
+
+static void ram_map() {
+
+	if (ram_base != NULL) {
+
+		return ;
+
+	}
+
+	size_t size = (size_t)RAM_BLOCKS * BLOCK_SIZE > DISK_SIZE ? (size_t)RAM_BLOCKS * BLOCK_SIZE : DISK_SIZE ;
+	ram_len = (size + RAM_HUGE_PAGE - 1) & ~(size_t)(RAM_HUGE_PAGE - 1) ;
+	void * p = mmap(NULL, ram_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0) ;
+	if (p == MAP_FAILED) {
+
+		p = mmap(NULL, ram_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) ;
+		if (p == MAP_FAILED) {
+
+			perror("tfs: -o ram") ;
+			exit(EXIT_FAILURE) ;
+
+		}
+		madvise(p, ram_len, MADV_HUGEPAGE) ;
+
+	}
+
+	// Nothing is touched yet. The kernel leaves out the nodes we may not use, and a kernel without
+	// NUMA fails the call, which is fine too.
+	unsigned long nodes = ~0UL ;
+	syscall(SYS_mbind, p, ram_len, RAM_MPOL_INTERLEAVE, &nodes, sizeof(nodes) * 8, 0) ;
+	ram_base = (char *)p ;
+
+}
+
+/*
+ * Move the volume from or to fd, 0 or -1. Going out it stops after the last block that isn't
+ * zeroes, but never writes less than DISK_SIZE bytes.
+ */
+static int ram_file(int fd, int out) {
+
+	size_t len = ram_len ;
+	while (out && len > DISK_SIZE) {
+
+		const char * b = ram_base + len - BLOCK_SIZE ;
+		if (b[0] != 0 || memcmp(b, b + 1, BLOCK_SIZE - 1) != 0) {
+
+			break ;
+
+		}
+		len -= BLOCK_SIZE ;
+
+	}
+
+	size_t done = 0 ;
+	while (done < len) {
+
+		ssize_t n = out ? pwrite(fd, ram_base + done, len - done, done)
+			: pread(fd, ram_base + done, len - done, done) ;
+		if (n < 0 && errno == EINTR) {
+
+			continue ;
+
+		}
+		if (n <= 0) {
+
+			return (n == 0 && !out) ? 0 : -1 ; // a short diskfile, the rest stays zeroes
+
+		}
+		done += n ;
+
+	}
+
+	return 0 ;
+}
+
+static int ram_open(const char *path) {
+
+	ram_map() ;
+	if (!tfs_opts.ram_persist) {
+
+		return -1 ;
+
+	}
+
+	ram_path = path ;
+	int fd = open(path, O_RDONLY) ;
+	if (fd < 0) {
+
+		return -1 ;
+
+	}
+	struct stat st ;
+	int ret = (fstat(fd, &st) == 0 && st.st_size > 0 && ram_file(fd, 0) == 0) ? 0 : -1 ;
+	close(fd) ;
+
+	return ret ;
+}
+
+static void ram_init(const char *path) {
+
+	ram_map() ;
+	ram_path = path ;
+
+}
+
+static void ram_close() {
+
+	if (ram_base == NULL) {
+
+		return ;
+
+	}
+
+	if (tfs_opts.ram_persist) {
+
+		int fd = open(ram_path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR) ;
+		if (fd < 0 || ram_file(fd, 1) != 0 || fdatasync(fd) != 0) {
+
+			fprintf(stderr, "tfs: writing the volume back to %s: %s\n", ram_path, strerror(errno)) ;
+
+		}
+		if (fd >= 0) {
+
+			close(fd) ;
+
+		}
+
+	}
+
+	munmap(ram_base, ram_len) ;
+	ram_base = NULL ;
+
+}
+
+static int ram_read(const int blkno, void *buf) {
+
+	if (blkno < 0 || (size_t)blkno >= ram_len / BLOCK_SIZE) {
+
+		memset(buf, 0, BLOCK_SIZE) ;
+		return -1 ;
+
+	}
+
+	memcpy(buf, ram_base + (size_t)blkno * BLOCK_SIZE, BLOCK_SIZE) ;
+	return BLOCK_SIZE ;
+}
+
+static int ram_write(const int blkno, const void *buf) {
+
+	if (blkno < 0 || (size_t)blkno >= ram_len / BLOCK_SIZE) {
+
+		return -1 ;
+
+	}
+
+	memcpy(ram_base + (size_t)blkno * BLOCK_SIZE, buf, BLOCK_SIZE) ;
+	return BLOCK_SIZE ;
+}
+
+static struct tfs_dev ram_device = { "ram", ram_open, ram_init, ram_close, ram_read, ram_write } ;
+
+static struct tfs_dev * device = &file_device ; // see main()
+
+/*
+ * Block checksums, -o checksum, see tfs_ext.h
+ * The whole table is kept in memory. A block's checksum is entered as its contents are handed
+ * to the block layer and checked whenever they are read back from the diskfile, the cache doesn't
+ * check what it holds already. csum_flush() writes the table back after the blocks it covers.
+ * A block that fails its check reads as EIO. The read-modify-write paths stop there, and the call
+ * that read it fails with EIO (TFS_TIMED, ll_reply_err) instead of replying as if it had worked.
+ * Background threads clear the flag before each batch.
+ */
+static const uint32_t * csum_blks ; // where the table goes, ext->csum_blk
+static int csum_end ; // first block number past the data region, nothing from there on is covered
+static uint32_t csum_dirty ; // table blocks changed since the last csum_flush(), set with atomics
+static pthread_mutex_t csum_lock = PTHREAD_MUTEX_INITIALIZER ; // one csum_flush() at a time
+
+static void csum_flush() ; // needs the superblock extension, further down
+
+/*
+ * Whether blkno's checksum is in the table, block 0 and the table's own blocks are checked through block 0
+ */
+static int csum_covered(int blkno) {
+
+	int i ;
+	if (csums == NULL || blkno <= 0 || blkno >= csum_end) {
+
+		return 0 ;
+
+	}
+
+	for (i = 0 ; i < CSUM_BLOCKS ; i++) {
+
+		if ((int)csum_blks[i] == blkno) {
+
+			return 0 ;
+
+		}
+
+	}
+
+	return 1 ;
+}
+
+/*
+ * Checksum of block 0 as if its csum_self were zero
+ */
+static uint32_t super_crc(const char *data) {
+
+	static const uint32_t zero = 0 ;
+	uint32_t crc = crc32c(0, data, TFS_CSUM_SELF) ;
+	crc = crc32c(crc, &zero, sizeof(zero)) ;
+	return crc32c(crc, data + TFS_CSUM_SELF + sizeof(zero), BLOCK_SIZE - TFS_CSUM_SELF - sizeof(zero)) ;
+}
+
+/*
+ * blkno is about to hold data, enter its checksum. Block 0 gets its own written into it.
+ */
+static void csum_seal(int blkno, char *data) {
+
+	if (csums == NULL) {
+
+		return ;
+
+	}
+
+	if (blkno == 0) {
+
+		uint32_t crc = super_crc(data) ;
+		memcpy(data + TFS_CSUM_SELF, &crc, sizeof(crc)) ;
+
+	} else if (csum_covered(blkno)) {
+
+		__atomic_store_n(&csums[blkno], crc32c(0, data, BLOCK_SIZE), __ATOMIC_RELAXED) ;
+		__atomic_fetch_or(&csum_dirty, 1U << (blkno / CSUMS_PER_BLOCK), __ATOMIC_RELAXED) ;
+
+	}
+
+}
+
+/*
+ * data was just read from blkno on the diskfile, -EIO if it isn't what was last written there
+ */
+static int csum_check(int blkno, const char *data) {
+
+	uint32_t expect, crc ;
+	if (csums == NULL) {
+
+		return 0 ;
+
+	}
+
+	if (blkno == 0) {
+
+		memcpy(&expect, data + TFS_CSUM_SELF, sizeof(expect)) ;
+		crc = super_crc(data) ;
+
+	} else if (csum_covered(blkno)) {
+
+		expect = __atomic_load_n(&csums[blkno], __ATOMIC_RELAXED) ;
+		crc = crc32c(0, data, BLOCK_SIZE) ;
+
+	} else {
+
+		return 0 ;
+
+	}
+
+	if (crc == expect) {
+
+		__atomic_fetch_add(&csum_stats.verified, 1, __ATOMIC_RELAXED) ;
+		return 0 ;
+
+	}
+
+	__atomic_fetch_add(&csum_stats.failed, 1, __ATOMIC_RELAXED) ;
+	my_csum_error = 1 ;
+	fprintf(stderr, "tfs: block %d: checksum %08x, expected %08x\n", blkno, crc, expect) ;
+	return -EIO ;
+}
+
+/*
+ * Block cache, -o cache_blocks=0 turns it off
+ * blk_write() only dirties the cached copy. A flusher thread writes dirty blocks back in block
+ * order once they are older than -o dirty_expire seconds or once more than dirty_background_ratio
+ * percent of the cache is dirty. Writers that find more than dirty_ratio percent dirty write back
+ * the oldest blocks themselves before going on.
+ * One lock covers the whole cache. Missing blocks are read with it held, writebacks drop it and
+ * flag their blocks instead, which are then neither evicted nor written to until they are on disk.
+ */
+#define CACHE_BATCH 256 // blocks written back per round
+
+struct cblock {
+
+	int blkno ;
+	uint16_t ino ; // inode whose operation dirtied it last, see trace_ino(), TFS_TRACE_NO_INO if shared
+	uint8_t dirty ;
+	uint8_t meta ; // says where data is (indirect blocks, inodes, bitmaps), written after the data
+	uint8_t writeback ; // being written back without the lock held, never dirty meanwhile
+	uint8_t bad ; // failed its checksum when it was read, reads fail until it is overwritten
+	uint64_t dirtied ; // now_ns() when it went from clean to dirty
+	struct cblock * hnext ;
+	struct cblock * lru_prev, * lru_next ; // most recently used first
+	struct cblock * dirty_prev, * dirty_next ; // oldest dirty first
+	struct cblock * ino_prev, * ino_next ; // dirty blocks of the same inode
+	char data[BLOCK_SIZE] ;
+
+} ;
+
+/*
+ * Blocks one thread is writing back, sorted by block number
+ */
+struct cache_batch {
+
+	struct cblock * blocks[CACHE_BATCH] ;
+	int count ;
+	struct cache_batch * next ;
+
+} ;
+
+static struct cblock ** cache_hash = NULL ; // NULL while the cache is off
+static unsigned int cache_mask ;
+static int cache_count = 0 ;
+static int cache_dirty = 0 ;
+static int dirty_limit, dirty_background ; // dirty blocks that make writers wait and wake the flusher
+static struct cblock * lru_head = NULL, * lru_tail = NULL ;
+static struct cblock * dirty_head = NULL, * dirty_tail = NULL ;
+static struct cache_batch * cache_inflight = NULL ;
+static struct cblock * ino_dirty[MAX_INUM] ; // what fsync() has to write, without looking at the rest
+static uint8_t ino_changed[MAX_INUM] ; // more than the timestamps changed since the last fsync()
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_cond_t cache_wake ; // wakes the flusher, on CLOCK_MONOTONIC
+static pthread_cond_t cache_done = PTHREAD_COND_INITIALIZER ; // a writeback finished
+static pthread_t cache_thread ;
+static int cache_stop ;
+
+static struct cblock *cache_lookup(int blkno) {
+
+	struct cblock * b = cache_hash[(unsigned int)blkno & cache_mask] ;
+	while (b != NULL && b->blkno != blkno) {
+
+		b = b->hnext ;
+
+	}
+
+	return b ;
+}
+
+static void lru_unlink(struct cblock *b) {
+
+	if (b->lru_prev != NULL) {
+
+		b->lru_prev->lru_next = b->lru_next ;
+
+	} else {
+
+		lru_head = b->lru_next ;
+
+	}
+
+	if (b->lru_next != NULL) {
+
+		b->lru_next->lru_prev = b->lru_prev ;
+
+	} else {
+
+		lru_tail = b->lru_prev ;
+
+	}
+
+}
+
+static void lru_push(struct cblock *b) {
+
+	b->lru_prev = NULL ;
+	b->lru_next = lru_head ;
+	if (lru_head != NULL) {
+
+		lru_head->lru_prev = b ;
+
+	} else {
+
+		lru_tail = b ;
+
+	}
+	lru_head = b ;
+
+}
+
+static void ino_link(struct cblock *b) {
+
+	if (b->ino == TFS_TRACE_NO_INO) {
+
+		return ;
+
+	}
+
+	b->ino_prev = NULL ;
+	b->ino_next = ino_dirty[b->ino] ;
+	if (b->ino_next != NULL) {
+
+		b->ino_next->ino_prev = b ;
+
+	}
+	ino_dirty[b->ino] = b ;
+
+}
+
+static void ino_unlink(struct cblock *b) {
+
+	if (b->ino == TFS_TRACE_NO_INO) {
+
+		return ;
+
+	}
+
+	if (b->ino_prev != NULL) {
+
+		b->ino_prev->ino_next = b->ino_next ;
+
+	} else {
+
+		ino_dirty[b->ino] = b->ino_next ;
+
+	}
+
+	if (b->ino_next != NULL) {
+
+		b->ino_next->ino_prev = b->ino_prev ;
+
+	}
+
+}
+
+static void set_dirty(struct cblock *b, int meta) {
+
+	// Blocks in front of the data region are shared by every inode, sync_ino() looks for them itself
+	uint16_t ino = TFS_TRACE_NO_INO ;
+	if (superblock != NULL && b->blkno >= (int)superblock->d_start_blk && my_ino < MAX_INUM) {
+
+		ino = my_ino ;
+
+	} else {
+
+		meta = 1 ;
+
+	}
+
+	b->meta = meta ;
+	if (b->dirty) {
+
+		if (b->ino != ino) {
+
+			ino_unlink(b) ;
+			b->ino = ino ;
+			ino_link(b) ;
+
+		}
+		return ;
+
+	}
+
+	b->ino = ino ;
+	ino_link(b) ;
+	b->dirty = 1 ;
+	b->dirtied = now_ns() ;
+	b->dirty_next = NULL ;
+	b->dirty_prev = dirty_tail ;
+	if (dirty_tail != NULL) {
+
+		dirty_tail->dirty_next = b ;
+
+	} else {
+
+		dirty_head = b ;
+
+	}
+	dirty_tail = b ;
+	cache_dirty++ ;
+
+}
+
+static void set_clean(struct cblock *b) {
+
+	if (!b->dirty) {
+
+		return ;
+
+	}
+
+	ino_unlink(b) ;
+
+	if (b->dirty_prev != NULL) {
+
+		b->dirty_prev->dirty_next = b->dirty_next ;
+
+	} else {
+
+		dirty_head = b->dirty_next ;
+
+	}
+
+	if (b->dirty_next != NULL) {
+
+		b->dirty_next->dirty_prev = b->dirty_prev ;
+
+	} else {
+
+		dirty_tail = b->dirty_prev ;
+
+	}
+
+	b->dirty = 0 ;
+	cache_dirty-- ;
+
+}
+
+/*
+ * Forget a clean block that isn't being written back
+ */
+static void cache_remove(struct cblock *b) {
+
+	struct cblock ** p = &cache_hash[(unsigned int)b->blkno & cache_mask] ;
+	while (*p != b) {
+
+		p = &(*p)->hnext ;
+
+	}
+
+	*p = b->hnext ;
+	lru_unlink(b) ;
+	cache_count-- ;
+	free(b) ;
+
+}
+
+/*
+ * Data before metadata, so an inode doesn't point at blocks that aren't written yet, then by block number
+ */
+static int cmp_blkno(const void *a, const void *b) {
+
+	const struct cblock * x = *(struct cblock * const *)a ;
+	const struct cblock * y = *(struct cblock * const *)b ;
+	if (x->meta != y->meta) {
+
+		return x->meta - y->meta ;
+
+	}
+
+	return x->blkno - y->blkno ;
+}
+
+/*
+ * Write back a batch of dirty blocks in that order. Called with the lock held, drops it while writing.
+ * Writers of these blocks wait until they are on disk, so they are written straight from the cache.
+ */
+static void cache_write_batch(struct cache_batch *batch) {
+
+	int i ;
+
+	qsort(batch->blocks, batch->count, sizeof(struct cblock *), cmp_blkno) ;
+	for (i = 0 ; i < batch->count ; i++) {
+
+		set_clean(batch->blocks[i]) ;
+		batch->blocks[i]->writeback = 1 ;
+
+	}
+	batch->next = cache_inflight ;
+	cache_inflight = batch ;
+
+	pthread_mutex_unlock(&cache_lock) ;
+	for (i = 0 ; i < batch->count ; i++) {
+
+		device->write(batch->blocks[i]->blkno, batch->blocks[i]->data) ;
+
+	}
+	pthread_mutex_lock(&cache_lock) ;
+
+	struct cache_batch ** p = &cache_inflight ;
+	while (*p != batch) {
+
+		p = &(*p)->next ;
+
+	}
+	*p = batch->next ;
+
+	for (i = 0 ; i < batch->count ; i++) {
+
+		batch->blocks[i]->writeback = 0 ;
+
+	}
+	pthread_cond_broadcast(&cache_done) ;
+
+}
+
+/*
+ * Cached copy of blkno, read from the disk unless the caller is about to overwrite all of it.
+ * Called with the lock held.
+ */
+static struct cblock *cache_get(int blkno, int read) {
+
+	struct cblock * b = cache_lookup(blkno) ;
+
+	// Step 1: Make room by evicting the least recently used clean block
+	while (b == NULL && cache_count >= tfs_opts.cache_blocks) {
+
+		struct cblock * victim = lru_tail ;
+		while (victim != NULL && (victim->dirty || victim->writeback)) {
+
+			victim = victim->lru_prev ;
+
+		}
+
+		if (victim != NULL) {
+
+			cache_remove(victim) ;
+			break ;
+
+		}
+
+		// Everything is dirty or being written, clean the oldest block ourselves or wait for a writeback
+		struct cache_batch batch ;
+		batch.count = 0 ;
+		if (dirty_head != NULL) {
+
+			batch.blocks[batch.count++] = dirty_head ;
+
+		}
+
+		if (batch.count > 0) {
+
+			cache_write_batch(&batch) ;
+
+		} else {
+
+			pthread_cond_wait(&cache_done, &cache_lock) ;
+
+		}
+
+		// Someone else may have brought the block in while the lock was dropped
+		b = cache_lookup(blkno) ;
+
+	}
+
+	// Step 2: Bring the block in
+	if (b == NULL) {
+
+		b = (struct cblock *)malloc(sizeof(struct cblock)) ;
+		b->blkno = blkno ;
+		b->ino = TFS_TRACE_NO_INO ;
+		b->dirty = 0 ;
+		b->writeback = 0 ;
+		b->bad = 0 ;
+		if (read) {
+
+			device->read(blkno, b->data) ;
+			b->bad = csum_check(blkno, b->data) != 0 ;
+
+		}
+
+		struct cblock ** slot = &cache_hash[(unsigned int)blkno & cache_mask] ;
+		b->hnext = *slot ;
+		*slot = b ;
+		cache_count++ ;
+
+	} else {
+
+		lru_unlink(b) ;
+
+	}
+
+	lru_push(b) ;
+	return b ;
+}
+
+static int cache_inflight_has(int ino) {
+
+	struct cache_batch * batch ;
+	int i ;
+
+	for (batch = cache_inflight ; batch != NULL ; batch = batch->next) {
+
+		for (i = 0 ; i < batch->count ; i++) {
+
+			if (ino < 0 || batch->blocks[i]->ino == ino) {
+
+				return 1 ;
+
+			}
+
+		}
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Write back the dirty data blocks of inode ino, or its dirty indirect blocks if meta is set, and wait
+ * for the writebacks of its blocks that are already under way. Only the inode's own list is looked
+ * at, unless ino < 0 which writes back every dirty block.
+ */
+static void cache_flush_ino(int ino, int meta) {
+
+	if (cache_hash == NULL) {
+
+		return ;
+
+	}
+
+	pthread_mutex_lock(&cache_lock) ;
+	for (;;) {
+
+		struct cache_batch batch ;
+		struct cblock * b ;
+
+		batch.count = 0 ;
+		if (ino < 0) {
+
+			for (b = dirty_head ; b != NULL && batch.count < CACHE_BATCH ; b = b->dirty_next) {
+
+				batch.blocks[batch.count++] = b ;
+
+			}
+
+		} else {
+
+			for (b = ino_dirty[ino] ; b != NULL && batch.count < CACHE_BATCH ; b = b->ino_next) {
+
+				if (b->meta == meta) {
+
+					batch.blocks[batch.count++] = b ;
+
+				}
+
+			}
+
+		}
+
+		if (batch.count > 0) {
+
+			cache_write_batch(&batch) ;
+
+		} else if (cache_inflight_has(ino)) {
+
+			pthread_cond_wait(&cache_done, &cache_lock) ;
+
+		} else {
+
+			break ;
+
+		}
+
+	}
+	pthread_mutex_unlock(&cache_lock) ;
+
+}
+
+/*
+ * Write back those of n distinct blocks that are dirty, and wait for those already being written.
+ * Those can't have been written to since their writeback started, so they are not written again.
+ */
+static void cache_flush_blocks(const int *blknos, int n) {
+
+	struct cache_batch batch ;
+	struct cblock * b ;
+	int i ;
+
+	if (cache_hash == NULL) {
+
+		return ;
+
+	}
+
+	pthread_mutex_lock(&cache_lock) ;
+	batch.count = 0 ;
+	for (i = 0 ; i < n ; i++) {
+
+		b = cache_lookup(blknos[i]) ;
+		if (b != NULL && b->dirty) {
+
+			batch.blocks[batch.count++] = b ;
+
+		}
+
+	}
+
+	if (batch.count > 0) {
+
+		cache_write_batch(&batch) ;
+
+	}
+
+	for (i = 0 ; i < n ; i++) {
+
+		while ((b = cache_lookup(blknos[i])) != NULL && b->writeback) {
+
+			pthread_cond_wait(&cache_done, &cache_lock) ;
+
+		}
+
+	}
+	pthread_mutex_unlock(&cache_lock) ;
+
+}
+
+/*
+ * Make the diskfile hold the latest contents of blocks [start, start + count) before they are
+ * accessed without going through the cache, and forget the cached copies if that access is a write
+ */
+static void cache_sync(int start, int count, int drop) {
+
+	int blkno ;
+	if (cache_hash == NULL) {
+
+		return ;
+
+	}
+
+	pthread_mutex_lock(&cache_lock) ;
+	for (blkno = start ; blkno < start + count ; blkno++) {
+
+		struct cblock * b ;
+		while ((b = cache_lookup(blkno)) != NULL && b->writeback) {
+
+			pthread_cond_wait(&cache_done, &cache_lock) ;
+
+		}
+
+		if (b == NULL) {
+
+			continue ;
+
+		}
+
+		if (b->dirty) {
+
+			device->write(blkno, b->data) ;
+			set_clean(b) ;
+
+		}
+
+		if (drop) {
+
+			cache_remove(b) ;
+
+		}
+
+	}
+	pthread_mutex_unlock(&cache_lock) ;
+
+}
+
+/*
+ * blkno was freed, whatever it holds in the cache needn't reach the disk any more
+ */
+static void cache_discard(int blkno) {
+
+	if (cache_hash == NULL) {
+
+		return ;
+
+	}
+
+	pthread_mutex_lock(&cache_lock) ;
+	struct cblock * b = cache_lookup(blkno) ;
+	if (b != NULL && !b->writeback) {
+
+		set_clean(b) ;
+		cache_remove(b) ;
+
+	}
+	pthread_mutex_unlock(&cache_lock) ;
+
+}
+
+static void *cache_flusher(void *arg) {
+
+	uint64_t expire = (uint64_t)(tfs_opts.dirty_expire * 1e9) ;
+
+	pthread_mutex_lock(&cache_lock) ;
+	while (!cache_stop) {
+
+		struct cache_batch batch ;
+		struct cblock * b ;
+		uint64_t now = now_ns() ;
+
+		// Step 1: Oldest first, everything while over the background limit, below it whatever has expired
+		batch.count = 0 ;
+		for (b = dirty_head ; b != NULL && batch.count < CACHE_BATCH ; b = b->dirty_next) {
+
+			if (cache_dirty - batch.count <= dirty_background && now - b->dirtied < expire) {
+
+				break ;
+
+			}
+			batch.blocks[batch.count++] = b ;
+
+		}
+
+		if (batch.count > 0) {
+
+			cache_write_batch(&batch) ;
+			continue ;
+
+		}
+
+		// Step 2: Checksums of what was written since the last round go into the cache in turn
+		if (__atomic_load_n(&csum_dirty, __ATOMIC_RELAXED) != 0) {
+
+			pthread_mutex_unlock(&cache_lock) ;
+			csum_flush() ;
+			pthread_mutex_lock(&cache_lock) ;
+			continue ;
+
+		}
+
+		// Step 3: Sleep until the oldest dirty block expires or a writer needs us
+		uint64_t wake = (dirty_head != NULL ? dirty_head->dirtied : now) + expire ;
+
+		struct timespec ts ;
+		ts.tv_sec = wake / 1000000000ULL ;
+		ts.tv_nsec = wake % 1000000000ULL ;
+		pthread_cond_timedwait(&cache_wake, &cache_lock, &ts) ;
+
+	}
+	pthread_mutex_unlock(&cache_lock) ;
+
+	return NULL ;
+}
+
+static void cache_open() {
+
+	pthread_condattr_t attr ;
+	unsigned int buckets = 1 ;
+
+	if (tfs_opts.cache_blocks <= 0 || cache_hash != NULL) {
+
+		return ;
+
+	}
+
+	while (buckets < (unsigned int)tfs_opts.cache_blocks) {
+
+		buckets <<= 1 ;
+
+	}
+	cache_hash = (struct cblock **)calloc(buckets, sizeof(struct cblock *)) ;
+	cache_mask = buckets - 1 ;
+
+	dirty_limit = (long)tfs_opts.cache_blocks * tfs_opts.dirty_ratio / 100 ;
+	if (dirty_limit < 1) {
+
+		dirty_limit = 1 ;
+
+	}
+	dirty_background = (long)tfs_opts.cache_blocks * tfs_opts.dirty_background_ratio / 100 ;
+	if (dirty_background > dirty_limit) {
+
+		dirty_background = dirty_limit ;
+
+	}
+
+	pthread_condattr_init(&attr) ;
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ;
+	pthread_cond_init(&cache_wake, &attr) ;
+	pthread_condattr_destroy(&attr) ;
+
+	// Dirty blocks would pile up without a flusher, rather go without the cache
+	cache_stop = 0 ;
+	if (pthread_create(&cache_thread, NULL, cache_flusher, NULL) != 0) {
+
+		pthread_cond_destroy(&cache_wake) ;
+		free(cache_hash) ;
+		cache_hash = NULL ;
+
+	}
+
+}
+
+static void cache_close() {
+
+	if (cache_hash == NULL) {
+
+		return ;
+
+	}
+
+	pthread_mutex_lock(&cache_lock) ;
+	cache_stop = 1 ;
+	pthread_cond_signal(&cache_wake) ;
+	pthread_cond_broadcast(&cache_done) ;
+	pthread_mutex_unlock(&cache_lock) ;
+	pthread_join(cache_thread, NULL) ;
+
+	cache_flush_ino(-1, 0) ;
+	while (lru_head != NULL) {
+
+		cache_remove(lru_head) ;
+
+	}
+	pthread_cond_destroy(&cache_wake) ;
+	free(cache_hash) ;
+	cache_hash = NULL ;
+	memset(ino_changed, 0, sizeof(ino_changed)) ;
+
+}
+
+/*
+ * All of tfs goes through these instead of calling the device itself. Stats and traces
+ * count the blocks tfs asks for, whether the cache has them or not.
+ */
+static int blk_read(int blkno, void *buf) {
+
+	stats_io(0, 1) ;
+	trace_io(TFS_TRACE_READ, blkno, 1) ;
+	if (cache_hash == NULL) {
+
+		int ret = device->read(blkno, buf) ;
+		return (ret >= 0 && csum_check(blkno, buf) != 0) ? -EIO : ret ;
+
+	}
+
+	pthread_mutex_lock(&cache_lock) ;
+	struct cblock * b = cache_get(blkno, 1) ;
+	memcpy(buf, b->data, BLOCK_SIZE) ;
+	int bad = b->bad ;
+	pthread_mutex_unlock(&cache_lock) ;
+	if (bad) {
+
+		my_csum_error = 1 ;
+		return -EIO ;
+
+	}
+
+	return BLOCK_SIZE ;
+}
+
+static int cache_write(int blkno, const void *buf, int meta) {
+
+	stats_io(1, 1) ;
+	trace_io(TFS_TRACE_WRITE, blkno, 1) ;
+	if (cache_hash == NULL && csums != NULL) {
+
+		char * copy = (char *)malloc(BLOCK_SIZE) ;
+		memcpy(copy, buf, BLOCK_SIZE) ;
+		csum_seal(blkno, copy) ;
+		int ret = device->write(blkno, copy) ;
+		free(copy) ;
+		return ret ;
+
+	}
+	if (cache_hash == NULL) {
+
+		return device->write(blkno, buf) ;
+
+	}
+
+	pthread_mutex_lock(&cache_lock) ;
+	struct cblock * b ;
+	while ((b = cache_get(blkno, 0))->writeback) {
+
+		pthread_cond_wait(&cache_done, &cache_lock) ;
+
+	}
+	memcpy(b->data, buf, BLOCK_SIZE) ;
+	csum_seal(blkno, b->data) ;
+	b->bad = 0 ;
+	set_dirty(b, meta) ;
+
+	// Throttle writers that dirty blocks faster than the flusher cleans them
+	if (cache_dirty > dirty_background) {
+
+		pthread_cond_signal(&cache_wake) ;
+
+	}
+	while (cache_dirty > dirty_limit && !cache_stop) {
+
+		struct cache_batch batch ;
+		struct cblock * d ;
+		batch.count = 0 ;
+		for (d = dirty_head ; d != NULL && batch.count < CACHE_BATCH && cache_dirty - batch.count > dirty_background ; d = d->dirty_next) {
+
+			batch.blocks[batch.count++] = d ;
+
+		}
+
+		if (batch.count > 0) {
+
+			cache_write_batch(&batch) ;
+
+		} else {
+
+			pthread_cond_wait(&cache_done, &cache_lock) ;
+
+		}
+
+	}
+	pthread_mutex_unlock(&cache_lock) ;
+	return BLOCK_SIZE ;
+}
+
+static int blk_write(int blkno, const void *buf) {
+
+	return cache_write(blkno, buf, 0) ;
+}
+
+/*
+ * For blocks that only say where file data is, they are written back after the data itself
+ */
+static int blk_write_meta(int blkno, const void *buf) {
+
+	return cache_write(blkno, buf, 1) ;
+}
+
+/*
+ * Placement
+ * The inode table and the data blocks the diskfile has room for are cut into TFS_GROUPS groups,
+ * group g's inodes and blocks being the g-th of each. Files get an inode in their directory's
+ * group and blocks after the ones before them, starting in their inode's group. Directories below
+ * the top stay with their parent while its group has room, top-level ones are spread over the
+ * groups with more room than most (Orlov), so unrelated trees don't share a group and a tree walk
+ * reads mostly one group at a time.
+ */
+#define TFS_GROUPS 16
+#define INODES_PER_GROUP (MAX_INUM / TFS_GROUPS)
+
+static int top_group = 0 ; // where the search for the next top-level directory's group starts
+
+/*
+ * Data blocks the device made room for, the bitmap goes on past them
+ */
+static int disk_blocks() {
+
+	int n = (DISK_SIZE) / BLOCK_SIZE - (int)superblock->d_start_blk ;
+	return n < MAX_DNUM ? n : MAX_DNUM ;
+}
+
+static int free_bits(bitmap_t b, int first, int count) {
+
+	int i, n = 0 ;
+	for (i = first ; i < first + count ; i++) {
+
+		n += !get_bitmap(b, i) ;
+
+	}
+
+	return n ;
+}
+
+/*
+ * First data block of the group inode ino is in, where its data starts looking
+ */
+static int group_goal(uint16_t ino) {
+
+	return superblock->d_start_blk + (ino / INODES_PER_GROUP) * (disk_blocks() / TFS_GROUPS) ;
+}
+
+/*
+ * Group for a new inode in directory parent_ino, the bitmaps are in memory
+ */
+static int place_group(uint16_t parent_ino, int dir) {
+
+	int ifree[TFS_GROUPS], bfree[TFS_GROUPS] ;
+	int iavg = 0, bavg = 0 ;
+	int per = disk_blocks() / TFS_GROUPS ;
+	int g, k ;
+	int pg = parent_ino / INODES_PER_GROUP ;
+
+	// Step 1: Files go with their directory
+	if (!dir) {
+
+		return pg ;
+
+	}
+
+	// Step 2: Free inodes and blocks per group, and on average
+	for (g = 0 ; g < TFS_GROUPS ; g++) {
+
+		ifree[g] = free_bits(inoBitmap, g * INODES_PER_GROUP, INODES_PER_GROUP) ;
+		bfree[g] = free_bits(blknoBitmap, g * per, per) ;
+		iavg += ifree[g] ;
+		bavg += bfree[g] ;
+
+	}
+	iavg /= TFS_GROUPS ;
+	bavg /= TFS_GROUPS ;
+
+	// Step 3: Below the top, the parent's group while it has at least half the average room
+	if (parent_ino != 0 && ifree[pg] > 0 && ifree[pg] >= iavg / 2 && bfree[pg] >= bavg / 2) {
+
+		return pg ;
+
+	}
+
+	// Step 4: Otherwise the next group with at least the average room, a new one for each top-level directory
+	int from = parent_ino == 0 ? top_group : pg + 1 ;
+	for (k = 0 ; k < TFS_GROUPS ; k++) {
+
+		g = (from + k) % TFS_GROUPS ;
+		if (ifree[g] > 0 && ifree[g] >= iavg && bfree[g] >= bavg) {
+
+			if (parent_ino == 0) {
+
+				top_group = (g + 1) % TFS_GROUPS ;
+
+			}
+			return g ;
+
+		}
+
+	}
+
+	return pg ;
+}
+
+static void orphan_wanted(int err) ; // there is no room left, but orphans may make some, see below
+
+/* 
+ * Get available inode number from bitmap, for a new node in directory parent_ino
+ */
+int get_avail_ino(uint16_t parent_ino, int dir) {
+
+	// Step 1: Read inode bitmap from disk, and the data bitmap to see where there is room
+	if (blk_read(superblock->i_bitmap_blk, inoBitmap) < 0 || blk_read(superblock->d_bitmap_blk, blknoBitmap) < 0) {
+
+		return -1 ;
+
+	}
+	
+	// Step 2: Traverse inode bitmap to find an available slot, from the start of the group placement picked
+	int first = place_group(parent_ino, dir) * INODES_PER_GROUP ;
+	int k, i = 0 ;
+	for (k = 0 ; k < MAX_INUM ; k++) {
+
+		i = (first + k) % MAX_INUM ;
+		if (get_bitmap(inoBitmap, i) == 0) {
+
+			break ;
+
+		} 
+
+	}
+
+	if (k >= MAX_INUM) {
+
+		orphan_wanted(ENOSPC) ;
+		return -1 ;
+
+	}
+
+	// Step 3: Update inode bitmap and write to disk 
+	set_bitmap(inoBitmap, i) ;
+	blk_write(superblock->i_bitmap_blk, inoBitmap) ;
+
+	return i;
+}
+
+/*
+ * Only pointers inside the data region are ever handed out by get_avail_blkno()
+ */
+static int valid_blkno(int blkno) {
+
+	return blkno >= (int)superblock->d_start_blk && blkno < (int)superblock->d_start_blk + MAX_DNUM ;
+}
+
+/* 
+ * Get available data block number from bitmap, the first one from goal on
+ */
+int get_avail_blkno_near(int goal) {
+
+	// Step 1: Read data block bitmap from disk
+	if (blk_read(superblock->d_bitmap_blk, blknoBitmap) < 0) {
+
+		return -1 ;
+
+	}
+	
+	// Step 2: Traverse data block bitmap to find an available slot, skipping full bytes. Wrap around
+	// at the end of the diskfile, the blocks past it only come last.
+	int end = disk_blocks() ;
+	int first = valid_blkno(goal) && goal - (int)superblock->d_start_blk < end ? goal - superblock->d_start_blk : 0 ;
+	int k, i = 0 ; 
+	for (k = 0 ; k < MAX_DNUM ; k++) {
+
+		i = k < end ? (first + k) % end : k ;
+		if (i % 8 == 0 && blknoBitmap[i / 8] == 0xFF && (k < end ? k + 8 <= end && i + 8 <= end : 1)) {
+
+			k += 7 ;
+			continue ;
+
+		}
+		if (get_bitmap(blknoBitmap, i) == 0) {
+
+			break ;
+
+		} 
+
+	}
+
+	if (k >= MAX_DNUM) {
+
+		orphan_wanted(ENOSPC) ;
+		return -1 ;
+
+	}
+
+	// Step 3: Update data block bitmap and write to disk 
+	set_bitmap(blknoBitmap, i) ;
+	blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+
+	return superblock->d_start_blk + i ;
+}
+
+/*
+ * count free data blocks in a row, the first run of them from goal on, wrapping around at the
+ * end of the diskfile. Returns the first block of the run or -1 if there is none.
+ */
+int get_avail_run(int goal, int count) {
+
+	if (blk_read(superblock->d_bitmap_blk, blknoBitmap) < 0) {
+
+		return -1 ;
+
+	}
+
+	int end = disk_blocks() ;
+	int first = valid_blkno(goal) && goal - (int)superblock->d_start_blk < end ? goal - superblock->d_start_blk : 0 ;
+	int k, i, len = 0 ;
+	for (k = 0 ; k < end + count && count > 0 && count <= end ; k++) {
+
+		i = (first + k) % end ;
+		if (i == 0) {
+
+			len = 0 ; // a run doesn't wrap
+
+		}
+		len = get_bitmap(blknoBitmap, i) ? 0 : len + 1 ;
+		if (len == count) {
+
+			int start = i - count + 1 ;
+			for (i = start ; i < start + count ; i++) {
+
+				set_bitmap(blknoBitmap, i) ;
+
+			}
+			blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+			return superblock->d_start_blk + start ;
+
+		}
+
+	}
+
+	return -1 ;
+}
+
+/*
+ * The lowest free data block, for blocks nothing in particular is near
+ */
+int get_avail_blkno() {
+
+	return get_avail_blkno_near(0) ;
+}
+
+/*
+ * Where block index of a file should go: right after the block before it if it has one, else
+ * the start of its inode's group
+ */
+static int file_goal(struct inode *node, int prev) {
+
+	return valid_blkno(prev) ? prev + 1 : group_goal(node->ino) ;
+}
+
+/*
+ * Deduplication index, -o dedup
+ * Maps a 64-bit hash of a data block's contents to the block, in sets of DEDUP_WAYS entries
+ * with a round robin victim once a set is full, so it never grows past -o dedup_index entries.
+ * It only lives in memory and fills up again from the writes after a mount. A hash is only a
+ * hint: whoever finds a block through it compares the contents before sharing it. Each block
+ * has at most one entry, which goes away when the block is freed, so nothing but file data is
+ * ever found.
+ */
+#define DEDUP_WAYS 4
+
+struct dedup_entry {
+
+	uint64_t hash ;
+	int blkno ; // 0 if the entry is free
+
+} ;
+
+static struct dedup_entry * dedup_index = NULL ;
+static uint8_t * dedup_victim ; // next entry to replace, per set
+static uint32_t * dedup_slot ; // per data block: its entry + 1, 0 if it has none
+static unsigned int dedup_mask ; // sets - 1
+
+/*
+ * Hash of a whole block, with whether it is all zeroes on the side
+ */
+static uint64_t block_hash(const void *buf, int *zero) {
+
+	const char * p = (const char *)buf ;
+	uint64_t h = 0x9E3779B97F4A7C15ULL ;
+	uint64_t any = 0 ;
+	int i ;
+	for (i = 0 ; i < BLOCK_SIZE ; i += sizeof(uint64_t)) {
+
+		uint64_t w ;
+		memcpy(&w, p + i, sizeof(w)) ; // FUSE's buffers needn't be aligned
+		any |= w ;
+		h ^= w * 0xC2B2AE3D27D4EB4FULL ;
+		h = ((h << 31) | (h >> 33)) * 0x9E3779B97F4A7C15ULL ;
+
+	}
+	h ^= h >> 33 ;
+	h *= 0xFF51AFD7ED558CCDULL ;
+	h ^= h >> 33 ;
+
+	*zero = any == 0 ;
+	return h ;
+}
+
+static void dedup_open() {
+
+	unsigned int sets = 1 ;
+	if (!tfs_opts.dedup) {
+
+		return ;
+
+	}
+
+	// Round down to a power of two number of sets
+	while (sets * 2 * DEDUP_WAYS <= (unsigned int)tfs_opts.dedup_index) {
+
+		sets *= 2 ;
+
+	}
+	tfs_opts.dedup_index = sets * DEDUP_WAYS ;
+	dedup_mask = sets - 1 ;
+	dedup_index = (struct dedup_entry *)calloc(sets * DEDUP_WAYS, sizeof(struct dedup_entry)) ;
+	dedup_victim = (uint8_t *)calloc(sets, sizeof(uint8_t)) ;
+	dedup_slot = (uint32_t *)calloc(MAX_DNUM, sizeof(uint32_t)) ;
+	memset(&dedup_stats, 0, sizeof(dedup_stats)) ;
+
+}
+
+static void dedup_close() {
+
+	free(dedup_index) ;
+	free(dedup_victim) ;
+	free(dedup_slot) ;
+	dedup_index = NULL ;
+
+}
+
+/*
+ * Block last seen with these contents, 0 if none
+ */
+static int dedup_lookup(uint64_t hash) {
+
+	struct dedup_entry * set = dedup_index + (hash & dedup_mask) * DEDUP_WAYS ;
+	int blkno = 0 ;
+	int i ;
+	pthread_mutex_lock(&dedup_lock) ;
+	for (i = 0 ; i < DEDUP_WAYS ; i++) {
+
+		if (set[i].blkno != 0 && set[i].hash == hash) {
+
+			blkno = set[i].blkno ;
+			break ;
+
+		}
+
+	}
+	pthread_mutex_unlock(&dedup_lock) ;
+
+	return blkno ;
+}
+
+/*
+ * Drop blkno's entry, if it has one. The caller holds dedup_lock.
+ */
+static void dedup_unlink(int blkno) {
+
+	int i = blkno - superblock->d_start_blk ;
+	if (i < 0 || i >= MAX_DNUM || dedup_slot[i] == 0) {
+
+		return ;
+
+	}
+
+	struct dedup_entry * e = &dedup_index[dedup_slot[i] - 1] ;
+	if (e->blkno == blkno) {
+
+		e->blkno = 0 ;
+
+	}
+	dedup_slot[i] = 0 ;
+
+}
+
+static void dedup_insert(uint64_t hash, int blkno) {
+
+	unsigned int set = hash & dedup_mask ;
+	struct dedup_entry * e = dedup_index + set * DEDUP_WAYS ;
+	int i ;
+	pthread_mutex_lock(&dedup_lock) ;
+	dedup_unlink(blkno) ; // whatever it held before
+
+	// A free entry if the set has one, otherwise the set's next victim
+	for (i = 0 ; i < DEDUP_WAYS && e[i].blkno != 0 ; i++) ;
+	if (i == DEDUP_WAYS) {
+
+		i = dedup_victim[set] ;
+		dedup_victim[set] = (i + 1) % DEDUP_WAYS ;
+		dedup_unlink(e[i].blkno) ;
+		dedup_stats.evicted++ ;
+
+	}
+
+	e[i].hash = hash ;
+	e[i].blkno = blkno ;
+	dedup_slot[blkno - superblock->d_start_blk] = set * DEDUP_WAYS + i + 1 ;
+	pthread_mutex_unlock(&dedup_lock) ;
+
+}
+
+/*
+ * blkno was freed, it may come back as anything
+ */
+static void dedup_forget(int blkno) {
+
+	if (dedup_index == NULL) {
+
+		return ;
+
+	}
+
+	pthread_mutex_lock(&dedup_lock) ;
+	dedup_unlink(blkno) ;
+	pthread_mutex_unlock(&dedup_lock) ;
+
+}
+
+static void dedup_count(uint64_t *counter) {
+
+	pthread_mutex_lock(&dedup_lock) ;
+	(*counter)++ ;
+	pthread_mutex_unlock(&dedup_lock) ;
+
+}
+
+/*
+ * Extended attribute blocks by the hash of their contents, see tfs_ext.h
+ * Like the dedup index it only lives in memory, fills up again from the sets written after a
+ * mount and is only a hint. A block loses its entry when it is freed or rewritten.
+ */
+#define XATTR_INDEX 1024
+
+struct xattr_entry {
+
+	uint64_t hash ;
+	int blkno ; // 0 if the entry is free
+
+} ;
+
+static struct xattr_entry xattr_index[XATTR_INDEX] ;
+static uint16_t xattr_slot[MAX_DNUM] ; // per data block: its entry + 1, 0 if it has none
+static pthread_mutex_t xattr_lock = PTHREAD_MUTEX_INITIALIZER ;
+
+static void xattr_open() {
+
+	memset(xattr_index, 0, sizeof(xattr_index)) ;
+	memset(xattr_slot, 0, sizeof(xattr_slot)) ;
+
+}
+
+static int xattr_lookup(uint64_t hash) {
+
+	pthread_mutex_lock(&xattr_lock) ;
+	struct xattr_entry * e = &xattr_index[hash % XATTR_INDEX] ;
+	int blkno = e->hash == hash ? e->blkno : 0 ;
+	pthread_mutex_unlock(&xattr_lock) ;
+
+	return blkno ;
+}
+
+/*
+ * blkno was freed or is about to hold another set
+ */
+static void xattr_forget(int blkno) {
+
+	int i = blkno - superblock->d_start_blk ;
+	if (i < 0 || i >= MAX_DNUM || __atomic_load_n(&xattr_slot[i], __ATOMIC_RELAXED) == 0) {
+
+		return ;
+
+	}
+
+	// Looked at again under the lock, xattr_insert() may have taken the slot away since
+	pthread_mutex_lock(&xattr_lock) ;
+	if (xattr_slot[i] != 0) {
+
+		struct xattr_entry * e = &xattr_index[xattr_slot[i] - 1] ;
+		if (e->blkno == blkno) {
+
+			e->blkno = 0 ;
+
+		}
+		xattr_slot[i] = 0 ;
+
+	}
+	pthread_mutex_unlock(&xattr_lock) ;
+
+}
+
+static void xattr_insert(uint64_t hash, int blkno) {
+
+	xattr_forget(blkno) ;
+	pthread_mutex_lock(&xattr_lock) ;
+	struct xattr_entry * e = &xattr_index[hash % XATTR_INDEX] ;
+	if (e->blkno != 0) {
+
+		xattr_slot[e->blkno - superblock->d_start_blk] = 0 ; // replaced, the most recent set wins
+
+	}
+	e->hash = hash ;
+	e->blkno = blkno ;
+	xattr_slot[blkno - superblock->d_start_blk] = hash % XATTR_INDEX + 1 ;
+	pthread_mutex_unlock(&xattr_lock) ;
+
+}
+
+/*
+ * Shared blocks and snapshots, see tfs_ext.h
+ * Nothing is shared until the first snapshot is taken. From then on whatever is about to write
+ * a block first makes it the live tree's own: the inode table block through cow_itable(), the
+ * block itself through cow_block(), each copy adding an owner to what it points at.
+ */
+static struct tfs_super_ext * ext ; // lives in superblock's buffer and is written back with it
+static uint16_t * shares ; // per data block: owners - 1, the ref_blk blocks in memory
+static uint32_t ref_dirty ; // ref_blk blocks changed since the last ref_flush()
+static uint32_t * itable_map ; // inode table being served, ext->itable or a snapshot's
+
+#define TFS_CTL_NAME ".tfs_ctl" // virtual file in the root directory, snapshots are taken and listed through it
+
+static int read_only() {
+
+	return tfs_opts.snapshot != NULL ;
+}
+
+/*
+ * Called once superblock is in memory, an image that never had a snapshot gets an empty extension
+ */
+static void ext_load() {
+
+	int i ;
+	ext = (struct tfs_super_ext *)((char *)superblock + TFS_EXT_OFFSET) ;
+	if (ext->magic != TFS_EXT_MAGIC) {
+
+		memset(ext, 0, sizeof(struct tfs_super_ext)) ;
+		ext->magic = TFS_EXT_MAGIC ;
+
+	}
+
+	shares = (uint16_t *)calloc(MAX_DNUM, sizeof(uint16_t)) ;
+	for (i = 0 ; i < REF_BLOCKS ; i++) {
+
+		if (ext->ref_blk[i] != 0) {
+
+			blk_read(ext->ref_blk[i], shares + i * REFS_PER_BLOCK) ;
+
+		}
+
+	}
+	ref_dirty = 0 ;
+	itable_map = ext->itable ;
+
+}
+
+static void ext_write() {
+
+	blk_write_meta(0, superblock) ;
+
+}
+
+/*
+ * Block of the inode table holding ino
+ */
+static int itable_blk(uint16_t ino) {
+
+	int t = ino / INODES_PER_BLOCK ;
+	return itable_map[t] != 0 ? (int)itable_map[t] : (int)superblock->i_start_blk + t ;
+}
+
+/*
+ * Whether some snapshot names blkno as slot t of its inode table
+ */
+static int table_in_snapshot(int t, int blkno) {
+
+	int k ;
+	for (k = 0 ; k < MAX_SNAPSHOTS ; k++) {
+
+		if (ext->snap[k].name[0] != '\0' && ext->snap[k].itable[t] == blkno) {
+
+			return 1 ;
+
+		}
+
+	}
+
+	return 0 ;
+}
+
+static int shared(int blkno) {
+
+	return valid_blkno(blkno) && shares[blkno - superblock->d_start_blk] > 0 ;
+}
+
+/*
+ * Give blkno one more owner, -1 if its count can't go any higher
+ */
+static int share(int blkno) {
+
+	if (!valid_blkno(blkno)) {
+
+		return 0 ;
+
+	}
+
+	int i = blkno - superblock->d_start_blk ;
+	if (shares[i] == REF_MAX) {
+
+		return -1 ;
+
+	}
+
+	shares[i]++ ;
+	ref_dirty |= 1U << (i / REFS_PER_BLOCK) ;
+	return 0 ;
+}
+
+/*
+ * Take an owner away from blkno, freeing it (and what an indirect block points at) with the
+ * last one. The caller writes back the data bitmap and calls ref_flush().
+ */
+static void put_block(int blkno, int indirect) {
+
+	if (!valid_blkno(blkno)) {
+
+		return ;
+
+	}
+
+	int i = blkno - superblock->d_start_blk ;
+	if (shares[i] > 0) {
+
+		shares[i]-- ;
+		ref_dirty |= 1U << (i / REFS_PER_BLOCK) ;
+		return ;
+
+	}
+
+	if (indirect) {
+
+		int * ptrs = (int *)malloc(BLOCK_SIZE) ;
+		int j ;
+		if (blk_read(blkno, ptrs) < 0) { // better to leak what it points at than free at random
+
+			memset(ptrs, 0, BLOCK_SIZE) ;
+
+		}
+		for (j = 0 ; j < (BLOCK_SIZE / sizeof(int)) ; j++) {
+
+			put_block(ptrs[j], 0) ;
+
+		}
+		free(ptrs) ;
+
+	}
+
+	unset_bitmap(blknoBitmap, i) ;
+	dedup_forget(blkno) ;
+	xattr_forget(blkno) ;
+
+}
+
+static void ref_flush() {
+
+	int i ;
+	for (i = 0 ; i < REF_BLOCKS ; i++) {
+
+		if (ref_dirty & (1U << i)) {
+
+			blk_write_meta(ext->ref_blk[i], shares + i * REFS_PER_BLOCK) ;
+
+		}
+
+	}
+	ref_dirty = 0 ;
+
+}
+
+/*
+ * Room for the reference counts, taken from the data region the first time anything is shared
+ */
+static int ref_init() {
+
+	int i ;
+	if (ext->ref_blk[0] != 0) {
+
+		return 0 ;
+
+	}
+
+	for (i = 0 ; i < REF_BLOCKS ; i++) {
+
+		int blkno = get_avail_blkno() ;
+		if (blkno < 0) {
+
+			while (--i >= 0) {
+
+				unset_bitmap(blknoBitmap, ext->ref_blk[i] - superblock->d_start_blk) ;
+				ext->ref_blk[i] = 0 ;
+
+			}
+			blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+			return -ENOSPC ;
+
+		}
+
+		ext->ref_blk[i] = blkno ;
+		blk_write_meta(blkno, shares + i * REFS_PER_BLOCK) ; // all zero, nothing is shared yet
+
+	}
+
+	ext_write() ;
+	return 0 ;
+}
+
+/*
+ * Write back the table blocks whose checksums changed, and block 0 with their own checksums
+ */
+static void csum_flush() {
+
+	int i ;
+	if (csums == NULL || read_only()) {
+
+		return ;
+
+	}
+
+	pthread_mutex_lock(&csum_lock) ;
+	uint32_t dirty = __atomic_exchange_n(&csum_dirty, 0, __ATOMIC_ACQ_REL) ;
+	if (dirty != 0) {
+
+		uint32_t * copy = (uint32_t *)malloc(BLOCK_SIZE) ;
+		for (i = 0 ; i < CSUM_BLOCKS ; i++) {
+
+			if (dirty & (1U << i)) {
+
+				// Entries keep changing underneath, the copy is what gets written and checksummed
+				memcpy(copy, csums + i * CSUMS_PER_BLOCK, BLOCK_SIZE) ;
+				ext->csum_crc[i] = crc32c(0, copy, BLOCK_SIZE) ;
+				blk_write_meta(ext->csum_blk[i], copy) ;
+
+			}
+
+		}
+		free(copy) ;
+		ext_write() ;
+
+	}
+	pthread_mutex_unlock(&csum_lock) ;
+
+}
+
+/*
+ * Checksum every block in use, the first time a filesystem is mounted with -o checksum.
+ * Whatever the blocks hold now is taken to be right.
+ */
+static int csum_enable() {
+
+	int i, blkno ;
+	uint32_t * table = (uint32_t *)calloc(CSUM_BLOCKS * CSUMS_PER_BLOCK, sizeof(uint32_t)) ;
+	char * buf = (char *)malloc(BLOCK_SIZE) ;
+
+	// Step 1: Room for the table, from the data region like the reference counts
+	for (i = 0 ; i < CSUM_BLOCKS ; i++) {
+
+		blkno = get_avail_blkno() ;
+		if (blkno < 0) {
+
+			while (--i >= 0) {
+
+				unset_bitmap(blknoBitmap, ext->csum_blk[i] - superblock->d_start_blk) ;
+				ext->csum_blk[i] = 0 ;
+
+			}
+			blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+			free(table) ;
+			free(buf) ;
+			return -ENOSPC ;
+
+		}
+		ext->csum_blk[i] = blkno ;
+
+	}
+
+	// Step 2: Every block in front of the data region and every data block in use
+	csum_end = superblock->d_start_blk + MAX_DNUM ;
+	csum_blks = ext->csum_blk ;
+	for (blkno = 1 ; blkno < csum_end ; blkno++) {
+
+		if (blkno >= (int)superblock->d_start_blk && !get_bitmap(blknoBitmap, blkno - superblock->d_start_blk)) {
+
+			continue ;
+
+		}
+
+		blk_read(blkno, buf) ;
+		table[blkno] = crc32c(0, buf, BLOCK_SIZE) ;
+
+	}
+	free(buf) ;
+
+	// Step 3: From now on every write keeps it up to date
+	csums = table ;
+	ext->features |= TFS_FEATURE_CSUM ;
+	csum_dirty = (1U << CSUM_BLOCKS) - 1 ;
+	csum_flush() ;
+	return 0 ;
+}
+
+/*
+ * Called once superblock is in memory. A table block that doesn't match its checksum any more is
+ * rebuilt from what the blocks it covers hold, so they are no longer checked against garbage.
+ */
+static void csum_open() {
+
+	int i, j ;
+	crc32c_setup() ;
+	if (!(ext->features & TFS_FEATURE_CSUM)) {
+
+		if (tfs_opts.checksum && !read_only() && csum_enable() != 0) {
+
+			fprintf(stderr, "tfs: no room for the checksum table, checksums are off\n") ;
+
+		}
+		return ;
+
+	}
+
+	if (super_crc((char *)superblock) != ext->csum_self) {
+
+		fprintf(stderr, "tfs: block 0: checksum mismatch, the superblock may be damaged\n") ;
+
+	}
+
+	uint32_t * table = (uint32_t *)malloc(CSUM_BLOCKS * CSUMS_PER_BLOCK * sizeof(uint32_t)) ;
+	char * buf = (char *)malloc(BLOCK_SIZE) ;
+	csum_end = superblock->d_start_blk + MAX_DNUM ;
+	csum_blks = ext->csum_blk ;
+	csum_dirty = 0 ;
+	for (i = 0 ; i < CSUM_BLOCKS ; i++) {
+
+		uint32_t * part = table + i * CSUMS_PER_BLOCK ;
+		blk_read(ext->csum_blk[i], part) ;
+		if (crc32c(0, part, BLOCK_SIZE) == ext->csum_crc[i]) {
+
+			continue ;
+
+		}
+
+		fprintf(stderr, "tfs: checksums of blocks %d to %d are damaged, rebuilding them\n",
+			(int)(i * CSUMS_PER_BLOCK), (int)((i + 1) * CSUMS_PER_BLOCK - 1)) ;
+		for (j = 0 ; j < CSUMS_PER_BLOCK ; j++) {
+
+			int blkno = i * CSUMS_PER_BLOCK + j ;
+			if (blkno > 0 && blkno < csum_end) {
+
+				blk_read(blkno, buf) ;
+				part[j] = crc32c(0, buf, BLOCK_SIZE) ;
+
+			}
+
+		}
+		csum_dirty |= 1U << i ;
+
+	}
+	free(buf) ;
+
+	csums = table ;
+
+	// The bitmaps were read before there was anything to check them against
+	csum_check(superblock->i_bitmap_blk, (char *)inoBitmap) ;
+	csum_check(superblock->d_bitmap_blk, (char *)blknoBitmap) ;
+	csum_flush() ;
+
+}
+
+/*
+ * Every block an inode points at directly gets one more owner, what is behind its indirect
+ * blocks is counted through them
+ */
+static void share_ptrs(struct inode *node) {
+
+	share(node->link) ; // the extended attributes
+	if (SYMLINK_IS_INLINE(node)) {
+
+		return ; // the pointers are the link's target
+
+	}
+
+	int i ;
+	for (i = 0 ; i < 16 ; i++) {
+
+		if (node->direct_ptr[i] == 0 && node->type == 1) {
+
+			break ; // directories end at their first empty pointer
+
+		}
+		share(node->direct_ptr[i]) ;
+
+	}
+
+	for (i = 0 ; i < 8 ; i++) {
+
+		share(node->indirect_ptr[i]) ;
+
+	}
+
+}
+
+static void put_ptrs(struct inode *node) {
+
+	put_block(node->link, 0) ;
+	if (SYMLINK_IS_INLINE(node)) {
+
+		return ; // the pointers are the link's target
+
+	}
+
+	int i ;
+	for (i = 0 ; i < 16 ; i++) {
+
+		if (node->direct_ptr[i] == 0 && node->type == 1) {
+
+			break ;
+
+		}
+		put_block(node->direct_ptr[i], 0) ;
+
+	}
+
+	for (i = 0 ; i < 8 ; i++) {
+
+		put_block(node->indirect_ptr[i], 1) ;
+
+	}
+
+}
+
+/*
+ * Make the inode table block holding ino the live tree's own before it is written, snapshots
+ * naming it keep the original. The block's home in the inode table is reused once free again.
+ */
+static int cow_itable(uint16_t ino) {
+
+	int t = ino / INODES_PER_BLOCK ;
+	int blkno = itable_blk(ino) ;
+	if (!table_in_snapshot(t, blkno)) {
+
+		return 0 ;
+
+	}
+
+	// Step 1: Find a place for the copy
+	int home = superblock->i_start_blk + t ;
+	int copy = home ;
+	if (blkno == home || table_in_snapshot(t, home)) {
+
+		copy = get_avail_blkno() ;
+		if (copy < 0) {
+
+			return -ENOSPC ;
+
+		}
+
+	}
+
+	// Step 2: Both copies point at the same blocks from now on
+	struct inode * table = (struct inode *)malloc(BLOCK_SIZE) ;
+	int i ;
+	blk_read(blkno, table) ;
+	for (i = 0 ; i < INODES_PER_BLOCK ; i++) {
+
+		if (table[i].valid) {
+
+			share_ptrs(&table[i]) ;
+
+		}
+
+	}
+	ref_flush() ;
+	blk_write_meta(copy, table) ;
+	free(table) ;
+
+	// Step 3: Switch the live tree over
+	ext->itable[t] = copy == home ? 0 : copy ;
+	ext_write() ;
+
+	return 0 ;
+}
+
+/*
+ * Make blkno the caller's own before it is written and return the block to write to instead,
+ * with copy set its contents come along, otherwise the caller overwrites all of it
+ * The inode pointing at it must have been through cow_itable() already.
+ */
+static int cow_block(int blkno, int copy) {
+
+	if (!shared(blkno)) {
+
+		return blkno ;
+
+	}
+
+	// A copy of what failed its checksum would pass it
+	char * b = NULL ;
+	if (copy) {
+
+		b = (char *)malloc(BLOCK_SIZE) ;
+		if (blk_read(blkno, b) < 0) {
+
+			free(b) ;
+			return -EIO ;
+
+		}
+
+	}
+
+	int new = get_avail_blkno_near(blkno) ;
+	if (new < 0) {
+
+		free(b) ;
+		return -ENOSPC ;
+
+	}
+
+	if (copy) {
+
+		blk_write(new, b) ;
+		free(b) ;
+
+	}
+
+	put_block(blkno, 0) ;
+	ref_flush() ;
+	return new ;
+}
+
+/*
+ * cow_block() for an indirect block whose pointers the caller has read into ptrs
+ */
+static int cow_indirect(int blkno, int *ptrs) {
+
+	if (!shared(blkno)) {
+
+		return blkno ;
+
+	}
+
+	int new = get_avail_blkno_near(blkno) ;
+	if (new < 0) {
+
+		return -ENOSPC ;
+
+	}
+
+	int j ;
+	for (j = 0 ; j < (BLOCK_SIZE / sizeof(int)) ; j++) {
+
+		share(ptrs[j]) ;
+
+	}
+	put_block(blkno, 1) ;
+	ref_flush() ;
+	blk_write_meta(new, ptrs) ;
+	return new ;
+}
+
+static int snapshot_find(const char *name) {
+
+	int k ;
+	for (k = 0 ; k < MAX_SNAPSHOTS ; k++) {
+
+		if (ext->snap[k].name[0] != '\0' && strncmp(ext->snap[k].name, name, SNAP_NAME_LEN) == 0) {
+
+			return k ;
+
+		}
+
+	}
+
+	return -1 ;
+}
+
+/*
+ * Freeze the live tree under name. Only the map of the inode table is copied, every block
+ * stays where it is and is copied when the live tree next writes it.
+ */
+static int snapshot_create(const char *name) {
+
+	int k, t ;
+	if (name[0] == '\0' || strlen(name) >= SNAP_NAME_LEN) {
+
+		return -EINVAL ;
+
+	}
+	if (snapshot_find(name) >= 0) {
+
+		return -EEXIST ;
+
+	}
+
+	// Step 1: A free slot, and room for reference counts the first time
+	for (k = 0 ; k < MAX_SNAPSHOTS && ext->snap[k].name[0] != '\0' ; k++) ;
+	if (k == MAX_SNAPSHOTS) {
+
+		return -ENOSPC ;
+
+	}
+
+	int ret = ref_init() ;
+	if (ret != 0) {
+
+		return ret ;
+
+	}
+
+	// Step 2: Name the live inode table
+	struct tfs_snapshot * s = &ext->snap[k] ;
+	for (t = 0 ; t < ITABLE_BLOCKS ; t++) {
+
+		s->itable[t] = itable_blk(t * INODES_PER_BLOCK) ;
+
+	}
+	s->created = time(NULL) ;
+	strcpy(s->name, name) ;
+	ext_write() ;
+
+	// Step 3: Everything it names goes to disk now, a read-only mount may read it from there at once
+	csum_flush() ;
+	cache_flush_ino(-1, 0) ;
+	if (diskfile_fd >= 0 && fdatasync(diskfile_fd) != 0) {
+
+		return -errno ;
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Drop a snapshot, giving back the blocks nothing else owns
+ */
+static int snapshot_delete(const char *name) {
+
+	int k = snapshot_find(name) ;
+	int t, i ;
+	if (k < 0) {
+
+		return -ENOENT ;
+
+	}
+
+	// Step 1: Forget it first, its inode table blocks that nobody else names are then unused
+	uint32_t itable[ITABLE_BLOCKS] ;
+	memcpy(itable, ext->snap[k].itable, sizeof(itable)) ;
+	memset(&ext->snap[k], 0, sizeof(struct tfs_snapshot)) ;
+
+	// Step 2: Those blocks' inodes give up what they point at
+	struct inode * table = (struct inode *)malloc(BLOCK_SIZE) ;
+	for (t = 0 ; t < ITABLE_BLOCKS ; t++) {
+
+		if (itable[t] == itable_blk(t * INODES_PER_BLOCK) || table_in_snapshot(t, itable[t])) {
+
+			continue ;
+
+		}
+
+		blk_read(itable[t], table) ;
+		for (i = 0 ; i < INODES_PER_BLOCK ; i++) {
+
+			if (table[i].valid) {
+
+				put_ptrs(&table[i]) ;
+
+			}
+
+		}
+
+		if (valid_blkno(itable[t])) {
+
+			unset_bitmap(blknoBitmap, itable[t] - superblock->d_start_blk) ;
+
+		}
+
+	}
+	free(table) ;
+
+	ref_flush() ;
+	blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+	ext_write() ;
+
+	return 0 ;
+}
+
+/*
+ * /.tfs_ctl: reading lists the snapshots, writing runs commands, one per line:
+ *	snapshot <name>		freeze the live tree, mount it with -o snapshot=<name>
+ *	delete <name>		drop a snapshot
+ *	clone <src> <dst> ...	copy a file or a range of it, sharing its blocks, see ctl_clone()
+ *	defrag			move fragmented files into runs of their own in the background
+ *	defrag stop		stop it after its current batch
+ *	rmtree <path>		remove a directory and everything below it, see ctl_rmtree()
+ *	quota <kind> <id> ...	set or drop a user, group or tree quota, see ctl_quota()
+ * Reading also lists the quotas, what they count and their limits, 0 for none.
+ */
+static int is_ctl_name(uint16_t parent_ino, const char *name) {
+
+	return !read_only() && parent_ino == 0 && strcmp(name, TFS_CTL_NAME) == 0 ;
+}
+
+static int is_ctl_path(const char *path) {
+
+	return !read_only() && strcmp(path, "/" TFS_CTL_NAME) == 0 ;
+}
+
+/*
+ * Quotas, see tfs_ext.h
+ * Usage is charged in writei() from the difference between the inode on disk and the one written,
+ * so whatever allocates or frees is counted without knowing about quotas. Limits are checked
+ * before allocating, together with what the inode allocated since it was last written, which
+ * quota_written keeps so an allocation doesn't have to read the inode back.
+ */
+static struct tfs_quota * quotas = NULL ; // the quota_blk block in memory, NULL while there are none
+static pthread_mutex_t quota_lock = PTHREAD_MUTEX_INITIALIZER ; // one change to the table at a time, charging takes no lock
+static uint32_t quota_written[MAX_INUM] ; // st_blocks + 1 of each inode as writei() last wrote it, 0 until known
+
+static void quota_load() {
+
+	if (ext->quota_blk != 0) {
+
+		quotas = (struct tfs_quota *)malloc(BLOCK_SIZE) ;
+		blk_read(ext->quota_blk, quotas) ;
+
+	}
+
+}
+
+static struct tfs_quota *quota_find(int kind, uint32_t id) {
+
+	int i ;
+	for (i = 0 ; quotas != NULL && i < QUOTAS_PER_BLOCK ; i++) {
+
+		if (__atomic_load_n(&quotas[i].kind, __ATOMIC_ACQUIRE) == kind && quotas[i].id == id) {
+
+			return &quotas[i] ;
+
+		}
+
+	}
+
+	return NULL ;
+}
+
+/*
+ * The quotas node is counted in, at most one of each kind
+ */
+static int quota_owners(struct inode *node, struct tfs_quota **q) {
+
+	int n = 0 ;
+	if ((q[n] = quota_find(QUOTA_USER, node->vstat.st_uid)) != NULL) {
+
+		n++ ;
+
+	}
+	if ((q[n] = quota_find(QUOTA_GROUP, node->vstat.st_gid)) != NULL) {
+
+		n++ ;
+
+	}
+	if (QUOTA_TREE(node) != 0 && (q[n] = quota_find(QUOTA_DIR, QUOTA_TREE(node) - 1)) != NULL) {
+
+		n++ ;
+
+	}
+
+	return n ;
+}
+
+static int quota_add(struct inode *node, int sign) {
+
+	struct tfs_quota * q[3] ;
+	int n = quota_owners(node, q), i ;
+	for (i = 0 ; i < n ; i++) {
+
+		__atomic_add_fetch(&q[i]->blocks, (uint32_t)(sign * (int)node->vstat.st_blocks), __ATOMIC_RELAXED) ;
+		__atomic_add_fetch(&q[i]->inodes, (uint32_t)sign, __ATOMIC_RELAXED) ;
+
+	}
+
+	return n ;
+}
+
+/*
+ * writei() is about to replace old with new
+ */
+static void quota_charge(struct inode *old, struct inode *new) {
+
+	if (quotas == NULL || read_only()) {
+
+		return ;
+
+	}
+
+	if (old->valid == new->valid && old->vstat.st_blocks == new->vstat.st_blocks && old->vstat.st_uid == new->vstat.st_uid
+		&& old->vstat.st_gid == new->vstat.st_gid && QUOTA_TREE(old) == QUOTA_TREE(new)) {
+
+		return ;
+
+	}
+
+	int n = 0 ;
+	if (old->valid) {
+
+		n += quota_add(old, -1) ;
+
+	}
+	if (new->valid) {
+
+		n += quota_add(new, 1) ;
+
+	}
+	if (n > 0) {
+
+		blk_write_meta(ext->quota_blk, quotas) ;
+
+	}
+
+}
+
+/*
+ * Whether a name in directory parent would take node into another tree than the one it is counted
+ * in, rename() and link() refuse that with EXDEV. A tree's own directory takes its tree along.
+ */
+static int quota_crosses(struct inode *node, struct inode *parent) {
+
+	return quotas != NULL && QUOTA_TREE(node) != QUOTA_TREE(parent) && QUOTA_TREE(node) != (dev_t)node->ino + 1 ;
+}
+
+/* 
+ * inode operations
+ */
+int readi(uint16_t ino, struct inode *inode) {
+
+  // Step 1: Get the inode's on-disk block number
+  int block = itable_blk(ino) ;
+
+  // Step 2: Get offset of the inode in the inode on-disk block
+  int offset = ino % (BLOCK_SIZE / sizeof(struct inode)) ;
+
+  // Step 3: Read the block from disk and then copy into inode structure
+  struct inode * tempblock = (struct inode *)malloc(BLOCK_SIZE) ;
+  trace_ino(ino) ;
+  int ret = blk_read(block, (void *)tempblock) ;
+  tempblock = tempblock + offset ;
+  *inode = *tempblock ;
+  tempblock = tempblock - offset ;
+  free(tempblock) ;
+
+	return ret < 0 ? ret : 0 ;
+}
+
+/*
+ * fdatasync() may skip an inode if only its timestamps changed since the last fsync()
+ */
+static int inode_changed(struct inode *old, struct inode *new) {
+
+	struct inode tmp = *new ;
+	tmp.vstat.st_atim = old->vstat.st_atim ;
+	tmp.vstat.st_mtim = old->vstat.st_mtim ;
+	tmp.vstat.st_ctim = old->vstat.st_ctim ;
+	return memcmp(&tmp, old, sizeof(struct inode)) != 0 ;
+}
+
+int writei(uint16_t ino, struct inode *inode) {
+
+	// Step 1: Get the block number where this inode resides on disk, the live tree's own copy of it
+	if (cow_itable(ino) != 0) {
+
+		return -1 ;
+
+	}
+	int block = itable_blk(ino) ;
+	
+	// Step 2: Get the offset in the block where this inode resides on disk
+	int offset = ino % (BLOCK_SIZE / sizeof(struct inode)) ;
+
+	// Step 3: Write inode to disk 
+	struct inode * tempblock = (struct inode *)malloc(BLOCK_SIZE) ;
+	trace_ino(ino) ;
+	if (blk_read(block, (void *)tempblock) < 0) {
+
+		free(tempblock) ;
+		return -1 ;
+
+	}
+  	tempblock = tempblock + offset ;
+	int changed = inode_changed(tempblock, inode) ;
+	quota_charge(tempblock, inode) ;
+	__atomic_store_n(&quota_written[ino], inode->valid ? (uint32_t)inode->vstat.st_blocks + 1 : 1, __ATOMIC_RELAXED) ;
+  	*tempblock = *inode ;
+  	tempblock = tempblock - offset ;
+	blk_write_meta(block, tempblock) ;
+  	free(tempblock) ;
+
+	// Only once the new inode is in the cache, an fsync() clearing this in between writes it back anyway
+	if (changed) {
+
+		__atomic_store_n(&ino_changed[ino], 1, __ATOMIC_RELEASE) ;
+
+	}
+
+	return 0;
+}
+
+/*
+ * -EDQUOT if node can't have blocks more blocks and inodes more inodes, 0 if it can. Orphans still
+ * count until they are freed, so the operation is retried once after freeing them.
+ */
+static int quota_allow(struct inode *node, int blocks, int inodes) {
+
+	struct tfs_quota * q[3] ;
+	int n, i, pending = 0 ;
+	if (quotas == NULL || (n = quota_owners(node, q)) == 0) {
+
+		return 0 ;
+
+	}
+
+	if (node->valid) {
+
+		uint32_t written = __atomic_load_n(&quota_written[node->ino], __ATOMIC_RELAXED) ;
+		if (written == 0) { // not written since the mount, once from the disk
+
+			struct inode disk ;
+			readi(node->ino, &disk) ;
+			uint32_t known = disk.valid ? (uint32_t)disk.vstat.st_blocks + 1 : 1 ;
+			if (__atomic_compare_exchange_n(&quota_written[node->ino], &written, known, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+
+				written = known ; // else a writei() got there first and written is what it stored
+
+			}
+
+		}
+		pending = (int)node->vstat.st_blocks - (int)(written - 1) ;
+
+	}
+
+	for (i = 0 ; i < n ; i++) {
+
+		if ((q[i]->block_limit != 0 && (int64_t)q[i]->blocks + pending + blocks > q[i]->block_limit)
+			|| (q[i]->inode_limit != 0 && (int64_t)q[i]->inodes + inodes > q[i]->inode_limit)) {
+
+			orphan_wanted(EDQUOT) ;
+			return -EDQUOT ;
+
+		}
+
+	}
+
+	return 0 ;
+}
+
+/* 
+ * Map logical block index of a file to its on-disk block number
+ * Returns 0 for a hole, -ENOSPC if the disk is full, -EFBIG past the last indirect block and
+ * -EINVAL before the first block
+ */
+int bmap(struct inode *node, int index, int mode) {
+
+	int blkno ;
+	if (index < 0) {
+
+		return -EINVAL ;
+
+	}
+	trace_ino(node->ino) ;
+
+	// Blocks about to be written must not be shared with a snapshot, starting with the inode's own
+	if (mode != BMAP_LOOKUP && cow_itable(node->ino) != 0) {
+
+		return -ENOSPC ;
+
+	}
+
+	// Step 1: Direct blocks live in the inode itself
+	if (index < 16) {
+
+		if (node->direct_ptr[index] != 0 && mode != BMAP_LOOKUP) {
+
+			blkno = cow_block(node->direct_ptr[index], mode == BMAP_ALLOC) ;
+			if (blkno < 0) {
+
+				return blkno ;
+
+			}
+			node->direct_ptr[index] = blkno ;
+
+		}
+
+		if (node->direct_ptr[index] == 0 && mode != BMAP_LOOKUP) {
+
+			blkno = quota_allow(node, 1, 0) ;
+			if (blkno < 0) {
+
+				return blkno ;
+
+			}
+
+			blkno = get_avail_blkno_near(file_goal(node, index > 0 ? node->direct_ptr[index - 1] : 0)) ;
+			if (blkno < 0) {
+
+				return -ENOSPC ;
+
+			}
+
+			if (mode == BMAP_ALLOC) {
+
+				char * zero = (char *)calloc(1, BLOCK_SIZE) ;
+				blk_write(blkno, zero) ;
+				free(zero) ;
+
+			}
+
+			node->direct_ptr[index] = blkno ;
+			node->vstat.st_blocks++ ;
+
+		}
+
+		return node->direct_ptr[index] ;
+
+	}
+
+	// Step 2: Find the indirect block holding the pointer, allocating it if needed
+	int off = (index - 16) % (BLOCK_SIZE / sizeof(int)) ;
+	int blk = (index - 16) / (BLOCK_SIZE / sizeof(int)) ;
+
+	if (blk >= 8) {
+
+		return -EFBIG ;
+
+	}
+
+	int * ptrs = (int *)calloc(1, BLOCK_SIZE) ;
+
+	if (node->indirect_ptr[blk] == 0) {
+
+		if (mode == BMAP_LOOKUP) {
+
+			free(ptrs) ;
+			return 0 ;
+
+		}
+
+		blkno = get_avail_blkno_near(file_goal(node, blk > 0 ? node->indirect_ptr[blk - 1] : node->direct_ptr[15])) ;
+		if (blkno < 0) {
+
+			free(ptrs) ;
+			return -ENOSPC ;
+
+		}
+
+		node->indirect_ptr[blk] = blkno ;
+		blk_write_meta(blkno, ptrs) ; // a fresh indirect block has no pointers yet
+
+	} else {
+
+		if (blk_read(node->indirect_ptr[blk], ptrs) < 0) {
+
+			free(ptrs) ;
+			return -EIO ;
+
+		}
+		if (mode != BMAP_LOOKUP) {
+
+			blkno = cow_indirect(node->indirect_ptr[blk], ptrs) ;
+			if (blkno < 0) {
+
+				free(ptrs) ;
+				return blkno ;
+
+			}
+			node->indirect_ptr[blk] = blkno ;
+
+		}
+
+	}
+
+	// Step 3: Allocate the data block itself, or copy it if it is shared
+	blkno = ptrs[off] ;
+	if (blkno != 0 && mode != BMAP_LOOKUP && shared(blkno)) {
+
+		blkno = cow_block(blkno, mode == BMAP_ALLOC) ;
+		if (blkno < 0) {
+
+			free(ptrs) ;
+			return blkno ;
+
+		}
+
+		ptrs[off] = blkno ;
+		blk_write_meta(node->indirect_ptr[blk], ptrs) ;
+
+	} else if (blkno == 0 && mode != BMAP_LOOKUP) {
+
+		blkno = quota_allow(node, 1, 0) ;
+		if (blkno < 0) {
+
+			free(ptrs) ;
+			return blkno ;
+
+		}
+
+		blkno = get_avail_blkno_near(file_goal(node, off > 0 ? ptrs[off - 1] : node->indirect_ptr[blk])) ;
+		if (blkno < 0) {
+
+			free(ptrs) ;
+			return -ENOSPC ;
+
+		}
+
+		if (mode == BMAP_ALLOC) {
+
+			char * zero = (char *)calloc(1, BLOCK_SIZE) ;
+			blk_write(blkno, zero) ;
+			free(zero) ;
+
+		}
+
+		ptrs[off] = blkno ;
+		blk_write_meta(node->indirect_ptr[blk], ptrs) ;
+		node->vstat.st_blocks++ ;
+
+	}
+
+	free(ptrs) ;
+	return blkno ;
+}
+
+/*
+ * Point logical block index of a file at blkno, or make it a hole with 0, and give up the block
+ * it pointed at before. The caller has already counted blkno's new owner.
+ */
+static int bmap_set(struct inode *node, int index, int blkno) {
+
+	int old ;
+	if (index < 0) {
+
+		return -EINVAL ;
+
+	}
+	trace_ino(node->ino) ;
+	if (cow_itable(node->ino) != 0) {
+
+		return -ENOSPC ;
+
+	}
+
+	// Step 1: Direct blocks live in the inode itself
+	if (index < 16) {
+
+		old = node->direct_ptr[index] ;
+		node->direct_ptr[index] = blkno ;
+
+	} else {
+
+		// Step 2: Otherwise in an indirect block of its own
+		int off = (index - 16) % (BLOCK_SIZE / sizeof(int)) ;
+		int blk = (index - 16) / (BLOCK_SIZE / sizeof(int)) ;
+		if (blk >= 8) {
+
+			return -EFBIG ;
+
+		}
+
+		int * ptrs = (int *)calloc(1, BLOCK_SIZE) ;
+		int ind = node->indirect_ptr[blk] ;
+		if (ind == 0) {
+
+			ind = blkno != 0 ? get_avail_blkno_near(group_goal(node->ino)) : 0 ;
+
+		} else if (blk_read(ind, ptrs) < 0) {
+
+			free(ptrs) ;
+			return -EIO ;
+
+		} else {
+
+			ind = cow_indirect(ind, ptrs) ;
+
+		}
+		if (ind <= 0) {
+
+			free(ptrs) ;
+			return ind < 0 ? -ENOSPC : 0 ; // a hole where there is no indirect block yet is one already
+
+		}
+
+		node->indirect_ptr[blk] = ind ;
+		old = ptrs[off] ;
+		ptrs[off] = blkno ;
+		blk_write_meta(ind, ptrs) ;
+		free(ptrs) ;
+
+	}
+
+	// Step 3: The old block loses its owner, a compressed cluster's length is no block of its own
+	if (old <= 0 && blkno > 0) {
+
+		node->vstat.st_blocks++ ;
+
+	} else if (old > 0 && blkno <= 0) {
+
+		node->vstat.st_blocks-- ;
+
+	}
+	if (old > 0) {
+
+		put_block(old, 0) ;
+		ref_flush() ;
+		blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+		if (valid_blkno(old) && !get_bitmap(blknoBitmap, old - superblock->d_start_blk)) {
+
+			cache_discard(old) ;
+
+		}
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Write a whole block of a file with -o dedup: all zeroes become a hole, contents some block
+ * already has make the file point at that block, anything else is written as usual
+ */
+static int dedup_write(struct inode *node, int index, const char *buf) {
+
+	int zero, ret ;
+	uint64_t hash = block_hash(buf, &zero) ;
+	int cur = bmap(node, index, BMAP_LOOKUP) ;
+	dedup_count(&dedup_stats.blocks) ;
+
+	// Step 1: Zeroes need no block at all
+	if (zero) {
+
+		dedup_count(&dedup_stats.zero) ;
+		return cur == 0 ? 0 : bmap_set(node, index, 0) ;
+
+	}
+
+	// Step 2: Look for the same contents, the hash alone could be a collision or out of date
+	int found = dedup_lookup(hash) ;
+	dedup_count(&dedup_stats.lookups) ;
+	if (found > 0) {
+
+		char * b = (char *)malloc(BLOCK_SIZE) ;
+		int same = blk_read(found, b) >= 0 && memcmp(b, buf, BLOCK_SIZE) == 0 ;
+		free(b) ;
+		dedup_count(same ? &dedup_stats.hits : &dedup_stats.stale) ;
+
+		if (same && found == cur) { // Rewritten with what it already holds
+
+			dedup_count(&dedup_stats.shared) ;
+			return 0 ;
+
+		}
+
+		if (same && ref_init() == 0 && share(found) == 0) {
+
+			ret = bmap_set(node, index, found) ;
+			if (ret != 0) {
+
+				put_block(found, 0) ;
+
+			}
+			ref_flush() ;
+			if (ret == 0) {
+
+				dedup_count(&dedup_stats.shared) ;
+
+			}
+			return ret ;
+
+		}
+
+	}
+
+	// Step 3: New contents, write them and remember where they are
+	int blkno = bmap(node, index, BMAP_FILL) ;
+	if (blkno < 0) {
+
+		return blkno ;
+
+	}
+	blk_write(blkno, buf) ;
+	dedup_insert(hash, blkno) ;
+	dedup_count(&dedup_stats.stored) ;
+
+	return 0 ;
+}
+
+/*
+ * Compressed clusters, see tfs_ext.h
+ * Plain blocks of a file are compressed once their cluster is full, so appends go to plain
+ * blocks first and a cluster is compressed by the write that reaches its end. Writes into a
+ * compressed cluster put the whole cluster together in memory and store it again. Nothing
+ * else ever sees a compressed cluster's pointers: reads and writes that could bypass the
+ * block layer (O_DIRECT, splicing) check for them first and take the long way.
+ */
+static uint32_t cluster_gen = 1 ; // bumped whenever a compressed cluster is stored or dropped
+static __thread char * cluster_cache = NULL ; // last cluster this thread decompressed
+static __thread int cluster_cache_blk ; // its first block
+static __thread uint32_t cluster_cache_gen ;
+static pthread_key_t cluster_key ; // frees cluster_cache when its thread exits
+static pthread_once_t cluster_once = PTHREAD_ONCE_INIT ;
+
+static void cluster_key_init() {
+
+	pthread_key_create(&cluster_key, free) ;
+
+}
+
+/*
+ * The CLUSTER_BLOCKS pointers of cluster c, 0 for holes
+ */
+static void cluster_ptrs(struct inode *node, int c, int *ptrs) {
+
+	int first = c * CLUSTER_BLOCKS ;
+	int per = BLOCK_SIZE / sizeof(int) ;
+	memset(ptrs, 0, CLUSTER_BLOCKS * sizeof(int)) ;
+
+	if (first < 16) {
+
+		memcpy(ptrs, node->direct_ptr + first, CLUSTER_BLOCKS * sizeof(int)) ;
+		return ;
+
+	}
+
+	int blk = (first - 16) / per ;
+	if (blk < 8 && node->indirect_ptr[blk] != 0) {
+
+		int * ind = (int *)malloc(BLOCK_SIZE) ;
+		blk_read(node->indirect_ptr[blk], ind) ;
+		memcpy(ptrs, ind + (first - 16) % per, CLUSTER_BLOCKS * sizeof(int)) ;
+		free(ind) ;
+
+	}
+
+}
+
+static int cluster_compressed(struct inode *node, int c) {
+
+	int ptrs[CLUSTER_BLOCKS] ;
+	cluster_ptrs(node, c, ptrs) ;
+	return ptrs[CLUSTER_BLOCKS - 1] < 0 ;
+}
+
+/*
+ * Whether any cluster of [offset, offset + size) is compressed
+ */
+static int range_compressed(struct inode *node, off_t offset, size_t size) {
+
+	int c ;
+	if (!(ext->features & TFS_FEATURE_CLUSTERS) || size == 0) {
+
+		return 0 ;
+
+	}
+
+	for (c = offset / CLUSTER_SIZE ; c <= (offset + size - 1) / CLUSTER_SIZE ; c++) {
+
+		if (cluster_compressed(node, c)) {
+
+			return 1 ;
+
+		}
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Decompressed contents of compressed cluster c, NULL if they are corrupt. Each thread keeps
+ * the last cluster it decompressed, so reading one block after the other decompresses once.
+ */
+static const char *cluster_get(struct inode *node, int c) {
+
+	int ptrs[CLUSTER_BLOCKS] ;
+	uint32_t gen = __atomic_load_n(&cluster_gen, __ATOMIC_ACQUIRE) ;
+	cluster_ptrs(node, c, ptrs) ;
+	if (cluster_cache != NULL && cluster_cache_blk == ptrs[0] && cluster_cache_gen == gen) {
+
+		return cluster_cache ;
+
+	}
+	if (cluster_cache == NULL) {
+
+		cluster_cache = (char *)malloc(CLUSTER_SIZE) ;
+		pthread_once(&cluster_once, cluster_key_init) ;
+		pthread_setspecific(cluster_key, cluster_cache) ;
+
+	}
+	cluster_cache_blk = 0 ;
+
+	// Step 1: Gather the stream from its blocks
+	int clen = -ptrs[CLUSTER_BLOCKS - 1] ;
+	int k = (clen + BLOCK_SIZE - 1) / BLOCK_SIZE ;
+	int j, n = -1 ;
+	if (clen <= 0 || clen > CLUSTER_MAX) {
+
+		return NULL ;
+
+	}
+
+	char * in = (char *)malloc(CLUSTER_MAX) ;
+	for (j = 0 ; j < k && ptrs[j] > 0 && blk_read(ptrs[j], in + j * BLOCK_SIZE) >= 0 ; j++) ;
+
+	// Step 2: Decompress it, whatever it doesn't fill is zeroes
+	if (j == k) {
+
+		n = LZ4_decompress_safe(in, cluster_cache, clen, CLUSTER_SIZE) ;
+
+	}
+	free(in) ;
+	if (n < 0) {
+
+		return NULL ;
+
+	}
+
+	memset(cluster_cache + n, 0, CLUSTER_SIZE - n) ;
+	cluster_cache_blk = ptrs[0] ;
+	cluster_cache_gen = gen ;
+	__atomic_fetch_add(&compress_stats.decompressed, 1, __ATOMIC_RELAXED) ;
+
+	return cluster_cache ;
+}
+
+/*
+ * All of cluster c into image, compressed or not
+ */
+static int cluster_read(struct inode *node, int c, char *image) {
+
+	int ptrs[CLUSTER_BLOCKS] ;
+	int j ;
+	cluster_ptrs(node, c, ptrs) ;
+
+	if (ptrs[CLUSTER_BLOCKS - 1] < 0) {
+
+		const char * data = cluster_get(node, c) ;
+		if (data == NULL) {
+
+			return -EIO ;
+
+		}
+		memcpy(image, data, CLUSTER_SIZE) ;
+		return 0 ;
+
+	}
+
+	for (j = 0 ; j < CLUSTER_BLOCKS ; j++) {
+
+		if (ptrs[j] > 0) {
+
+			if (blk_read(ptrs[j], image + j * BLOCK_SIZE) < 0) {
+
+				return -EIO ;
+
+			}
+
+		} else {
+
+			memset(image + j * BLOCK_SIZE, 0, BLOCK_SIZE) ;
+
+		}
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Point all of cluster c at ptrs in one go and give up the blocks it pointed at before, like
+ * bmap_set() does for one block. The caller has already counted the new owners.
+ */
+static int cluster_set(struct inode *node, int c, const int *ptrs) {
+
+	int first = c * CLUSTER_BLOCKS ;
+	int per = BLOCK_SIZE / sizeof(int) ;
+	int old[CLUSTER_BLOCKS] ;
+	int * slots = node->direct_ptr + first ;
+	int * ind = NULL ;
+	int blkno = 0 ;
+	int j ;
+	trace_ino(node->ino) ;
+	if (cow_itable(node->ino) != 0) {
+
+		return -ENOSPC ;
+
+	}
+
+	// Step 1: The pointers are in the inode, or all in the same indirect block
+	if (first >= 16) {
+
+		int blk = (first - 16) / per ;
+		if (blk >= 8) {
+
+			return -EFBIG ;
+
+		}
+
+		ind = (int *)calloc(1, BLOCK_SIZE) ;
+		blkno = node->indirect_ptr[blk] ;
+		if (blkno == 0) {
+
+			blkno = get_avail_blkno_near(group_goal(node->ino)) ;
+
+		} else if (blk_read(blkno, ind) < 0) {
+
+			free(ind) ;
+			return -EIO ;
+
+		} else {
+
+			blkno = cow_indirect(blkno, ind) ;
+
+		}
+		if (blkno < 0) {
+
+			free(ind) ;
+			return -ENOSPC ;
+
+		}
+		node->indirect_ptr[blk] = blkno ;
+		slots = ind + (first - 16) % per ;
+
+	}
+
+	memcpy(old, slots, sizeof(old)) ;
+	memcpy(slots, ptrs, sizeof(old)) ;
+	if (ind != NULL) {
+
+		blk_write_meta(blkno, ind) ;
+		free(ind) ;
+
+	}
+
+	// Step 2: The old blocks lose their owner, what is freed needn't be written back any more
+	for (j = 0 ; j < CLUSTER_BLOCKS ; j++) {
+
+		node->vstat.st_blocks += (ptrs[j] > 0) - (old[j] > 0) ;
+		if (old[j] > 0) {
+
+			put_block(old[j], 0) ;
+
+		}
+
+	}
+	ref_flush() ;
+	blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+	for (j = 0 ; j < CLUSTER_BLOCKS ; j++) {
+
+		if (valid_blkno(old[j]) && !get_bitmap(blknoBitmap, old[j] - superblock->d_start_blk)) {
+
+			cache_discard(old[j]) ;
+
+		}
+
+	}
+	__atomic_fetch_add(&cluster_gen, 1, __ATOMIC_RELEASE) ;
+
+	return 0 ;
+}
+
+/*
+ * Store the full cluster c compressed, 1 if it doesn't get at least a block smaller
+ */
+static int cluster_store(struct inode *node, int c, const char *image) {
+
+	char * out = (char *)malloc(CLUSTER_MAX) ;
+	int clen = LZ4_compress_default(image, out, CLUSTER_SIZE, CLUSTER_MAX) ; // 0 if it doesn't fit
+	int k = (clen + BLOCK_SIZE - 1) / BLOCK_SIZE ;
+	int blknos[CLUSTER_BLOCKS] ;
+	int j, ret ;
+
+	if (clen <= 0) {
+
+		free(out) ;
+		__atomic_fetch_add(&compress_stats.raw, 1, __ATOMIC_RELAXED) ;
+		return 1 ;
+
+	}
+	ret = quota_allow(node, k, 0) ; // what the cluster has now is only given back afterwards
+	if (ret < 0) {
+
+		free(out) ;
+		return ret ;
+
+	}
+
+	// Step 1: The stream goes to blocks of its own, so nothing is lost if we run out of them
+	memset(out + clen, 0, k * BLOCK_SIZE - clen) ;
+	for (j = 0 ; j < k ; j++) {
+
+		blknos[j] = get_avail_blkno_near(file_goal(node, j > 0 ? blknos[j - 1] : 0)) ;
+		if (blknos[j] < 0) {
+
+			while (--j >= 0) {
+
+				put_block(blknos[j], 0) ;
+
+			}
+			blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+			free(out) ;
+			return -ENOSPC ;
+
+		}
+		blk_write(blknos[j], out + j * BLOCK_SIZE) ;
+
+	}
+	free(out) ;
+	for ( ; j < CLUSTER_BLOCKS ; j++) {
+
+		blknos[j] = 0 ;
+
+	}
+	blknos[CLUSTER_BLOCKS - 1] = -clen ;
+
+	// Step 2: Point the cluster at them
+	ret = cluster_set(node, c, blknos) ;
+	if (ret != 0) {
+
+		for (j = 0 ; j < k ; j++) {
+
+			put_block(blknos[j], 0) ;
+
+		}
+		blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+		return ret ;
+
+	}
+
+	if (!(ext->features & TFS_FEATURE_CLUSTERS)) {
+
+		ext->features |= TFS_FEATURE_CLUSTERS ;
+		ext_write() ;
+
+	}
+	__atomic_fetch_add(&compress_stats.clusters, 1, __ATOMIC_RELAXED) ;
+	__atomic_fetch_add(&compress_stats.bytes_in, CLUSTER_SIZE, __ATOMIC_RELAXED) ;
+	__atomic_fetch_add(&compress_stats.bytes_out, k * BLOCK_SIZE, __ATOMIC_RELAXED) ;
+
+	return 0 ;
+}
+
+
+/* 
+ * directory operations
+ */
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+
+	//printf("called dir find\n") ;
+
+  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
+  struct inode currenti ;
+  if (readi(ino, &currenti) < 0) {
+
+	return -EIO ;
+
+  }
+
+  // Step 2: Get data block of current directory from inode
+  struct dirent * currentd = (struct dirent *)malloc(BLOCK_SIZE) ;
+
+  // Step 3: Read directory's data block and check each directory entry.
+  //If the name matches, then copy directory entry to dirent structure
+  int i, j ;
+
+  for (i = 0 ; i < 16 ; i++) {
+
+	if (currenti.direct_ptr[i] == 0) { // Not found, so return early
+
+		break ;
+
+	}
+
+	if (blk_read(currenti.direct_ptr[i], currentd) < 0) {
+
+		free(currentd) ;
+		return -EIO ;
+
+	}
+
+	for (j = 0 ; j < (BLOCK_SIZE / sizeof(struct dirent)) ; j++) {
+
+	  	if (currentd[j].valid && strcmp(currentd[j].name, fname) == 0) { // Found
+
+			*dirent = currentd[j] ;
+			free(currentd) ;
+			return 0 ;
+
+	  	}
+
+  	}
+
+  }
+
+	free(currentd) ;
+	return -1;
+}
+
+/*
+ * Returns 0, -EEXIST if fname is taken, -ENOSPC if neither the directory nor the disk has room
+ * for it, or -EIO
+ */
+int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+
+	//printf("CALLED DIR ADD NAME = %s\n", fname) ;
+
+	if (name_len >= sizeof(((struct dirent *)0)->name)) {
+
+		return -ENAMETOOLONG ;
+
+	}
+
+	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
+	struct dirent * currentd = (struct dirent *)malloc(BLOCK_SIZE) ;
+	trace_ino(dir_inode.ino) ;
+	
+	// Step 2: Check if fname (directory name) is already used in other entries, remembering the first free slot
+	int i, j ;
+	int freeBlk = -1, freeSlot = -1 ;
+
+	for (i = 0 ; i < 16 ; i++) {
+
+		if (dir_inode.direct_ptr[i] == 0) {
+
+			break ;
+
+		}
+
+		if (blk_read(dir_inode.direct_ptr[i], currentd) < 0) {
+
+			free(currentd) ;
+			return -EIO ;
+
+		}
+
+		for (j = 0 ; j < (BLOCK_SIZE / sizeof(struct dirent)) ; j++) {
+
+	    	if (currentd[j].valid) {
+
+		  		if (strcmp(currentd[j].name, fname) == 0) { // name is already used
+
+					free(currentd) ;
+					return -EEXIST ;
+
+				}
+
+			} else if (freeBlk < 0) {
+
+				freeBlk = i ;
+				freeSlot = j ;
+
+			}
+
+		}
+
+	}
+
+	// Step 3: Add directory entry in dir_inode's data block and write to disk
+	if (cow_itable(dir_inode.ino) != 0) {
+
+		free(currentd) ;
+		return -ENOSPC ;
+
+	}
+
+	if (freeBlk < 0) { // Allocate a new data block for this directory if every entry is taken
+
+		int blkno = i < 16 ? get_avail_blkno_near(file_goal(&dir_inode, i > 0 ? dir_inode.direct_ptr[i - 1] : 0)) : -1 ;
+		if (blkno < 0) {
+
+			free(currentd) ;
+			return -ENOSPC ;
+
+		}
+
+		dir_inode.direct_ptr[i] = blkno ;
+		if (i < 15) {
+
+			dir_inode.direct_ptr[i + 1] = 0 ;
+
+		}
+		dir_inode.vstat.st_blocks++ ;
+		memset(currentd, 0, BLOCK_SIZE) ;
+		freeBlk = i ;
+		freeSlot = 0 ;
+
+	} else {
+
+		if (blk_read(dir_inode.direct_ptr[freeBlk], currentd) < 0) {
+
+			free(currentd) ;
+			return -EIO ;
+
+		}
+		int blkno = cow_block(dir_inode.direct_ptr[freeBlk], 0) ;
+		if (blkno < 0) {
+
+			free(currentd) ;
+			return blkno ;
+
+		}
+		dir_inode.direct_ptr[freeBlk] = blkno ;
+
+	}
+
+	struct dirent * entry = &currentd[freeSlot] ;
+	entry->ino = f_ino ;
+	strncpy(entry->name, fname, name_len + 1) ;
+	entry->len = name_len ;
+	entry->valid = 1 ;
+
+	// Update directory inode
+	dir_inode.size = dir_inode.size + sizeof(struct dirent) ;
+	dir_inode.vstat.st_size = dir_inode.vstat.st_size + sizeof(struct dirent) ;
+	time(&dir_inode.vstat.st_mtime) ;
+
+	// Write directory entry
+	writei(dir_inode.ino, &dir_inode) ;
+	blk_write(dir_inode.direct_ptr[freeBlk], currentd) ;
+	free(currentd) ;
+
+	//printf("DIR ADD FINISHED\n") ;
+
+	return 0;
+}
+
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+
+	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
+	struct dirent * currentd = (struct dirent *)malloc(BLOCK_SIZE) ;
+	trace_ino(dir_inode.ino) ;
+	
+	// Step 2: Check if fname exist
+	int i, j ;
+
+	for (i = 0 ; i < 16 ; i++) {
+
+		if (dir_inode.direct_ptr[i] == 0) {
+
+			break ;
+
+		}
+
+		if (blk_read(dir_inode.direct_ptr[i], currentd) < 0) {
+
+			free(currentd) ;
+			return -EIO ;
+
+		}
+
+		for (j = 0 ; j < (BLOCK_SIZE / sizeof(struct dirent)) ; j++) {
+
+	    	if (currentd[j].valid && strcmp(currentd[j].name, fname) == 0) {
+
+				// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+				int blkno = cow_itable(dir_inode.ino) == 0 ? cow_block(dir_inode.direct_ptr[i], 0) : -ENOSPC ;
+				if (blkno < 0) {
+
+					free(currentd) ;
+					return blkno ;
+
+				}
+				dir_inode.direct_ptr[i] = blkno ;
+				currentd[j].valid = 0 ;
+				dir_inode.size = dir_inode.size - sizeof(struct dirent) ;
+				dir_inode.vstat.st_size = dir_inode.vstat.st_size - sizeof(struct dirent) ;
+				time(&dir_inode.vstat.st_mtime) ;
+				writei(dir_inode.ino, &dir_inode) ;
+				blk_write(dir_inode.direct_ptr[i], (const void *)currentd) ;
+				free(currentd) ;
+				return 0 ;
+
+			}
+
+		}
+
+	}
+
+	free(currentd) ;
+	return -ENOENT ;
+}
+
+/*
+ * Point the entry fname of a directory at f_ino instead, one block write whatever it named before.
+ * Returns 0, -ENOENT if there is no such entry, -ENOSPC or -EIO.
+ */
+int dir_relink(struct inode dir_inode, const char *fname, uint16_t f_ino) {
+
+	struct dirent * currentd = (struct dirent *)malloc(BLOCK_SIZE) ;
+	trace_ino(dir_inode.ino) ;
+
+	int i, j ;
+	for (i = 0 ; i < 16 ; i++) {
+
+		if (dir_inode.direct_ptr[i] == 0) {
+
+			break ;
+
+		}
+
+		if (blk_read(dir_inode.direct_ptr[i], currentd) < 0) {
+
+			free(currentd) ;
+			return -EIO ;
+
+		}
+
+		for (j = 0 ; j < (BLOCK_SIZE / sizeof(struct dirent)) ; j++) {
+
+			if (currentd[j].valid && strcmp(currentd[j].name, fname) == 0) {
+
+				int blkno = cow_itable(dir_inode.ino) == 0 ? cow_block(dir_inode.direct_ptr[i], 0) : -ENOSPC ;
+				if (blkno < 0) {
+
+					free(currentd) ;
+					return blkno ;
+
+				}
+				dir_inode.direct_ptr[i] = blkno ;
+				currentd[j].ino = f_ino ;
+				time(&dir_inode.vstat.st_mtime) ;
+				writei(dir_inode.ino, &dir_inode) ;
+				blk_write(dir_inode.direct_ptr[i], (const void *)currentd) ;
+				free(currentd) ;
+				return 0 ;
+
+			}
+
+		}
+
+	}
+
+	free(currentd) ;
+	return -ENOENT ;
+}
+
+/*
+ * Call fn for every valid entry of a directory, starting at entry slot offset
+ * fn gets the slot to resume from and stops the walk by returning non-zero
+ */
+int dir_iterate(struct inode *dir_inode, off_t offset, int (*fn)(void *, struct dirent *, off_t), void *ctx) {
+
+	struct dirent * currentd = (struct dirent *)malloc(BLOCK_SIZE) ;
+	int per = BLOCK_SIZE / sizeof(struct dirent) ;
+	int i, j ;
+
+	for (i = offset / per ; i < 16 ; i++) {
+
+		if (dir_inode->direct_ptr[i] == 0) {
+
+			break ;
+
+		}
+
+		blk_read(dir_inode->direct_ptr[i], currentd) ;
+
+		for (j = (i == offset / per) ? offset % per : 0 ; j < per ; j++) {
+
+			if (currentd[j].valid && fn(ctx, &currentd[j], (off_t)i * per + j + 1) != 0) {
+
+				free(currentd) ;
+				return 0 ;
+
+			}
+
+		}
+
+	}
+
+	free(currentd) ;
+	return 0 ;
+}
+
+static int count_entry(void *ctx, struct dirent *entry, off_t next) {
+
+	if (strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0) {
+
+		(*(int *)ctx)++ ;
+		return 1 ;
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Whether a directory has no entries besides "." and ".."
+ */
+static int dir_empty(struct inode *dir_inode) {
+
+	int found = 0 ;
+	dir_iterate(dir_inode, 0, count_entry, &found) ;
+	return found == 0 ;
+}
+
+/* 
+ * namei operation
+ */
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+	
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	// Note: You could either implement it in a iterative way or recursive way
+	// Walk a copy, strtok_r() writes into its string and callers still need theirs
+	char * copy = strdup(path) ;
+	char * save = NULL ;
+	char * str = strtok_r(copy, "/", &save) ;
+	struct dirent entry ;
+	entry.ino = ino ;
+
+	while (str != NULL) {
+
+		//printf("loop %s\n", str) ;
+		int ret = dir_find(entry.ino, (const char *)str, (size_t)strlen(str), &entry) ;
+		if (ret != 0) {
+
+			free(copy) ;
+			return ret == -1 ? -ENOENT : ret ; // only a missing name is ENOENT, a bad block is EIO
+
+		}
+		str = strtok_r(NULL, "/", &save) ;
+
+	}
+
+	free(copy) ;
+
+	//printf("reached readi\n") ;
+
+	if (readi(entry.ino, inode) < 0) {
+
+		return -EIO ;
+
+	}
+
+	return 0;
+}
+
+/* 
+ * Make file system
+ */
+int tfs_mkfs() {
+
+	// Initialize (Create) the device, the diskfile unless -o ram
+	device->init(diskfile_path) ;
+
+	// write superblock information
+	superblock = (struct superblock *)calloc(1, BLOCK_SIZE) ;
+	superblock->magic_num = MAGIC_NUM ;
+	superblock->max_inum = MAX_INUM ;
+	superblock->max_dnum = MAX_DNUM ;
+	superblock->i_bitmap_blk = 1 ;
+	superblock->d_bitmap_blk = 2 ;
+	superblock->i_start_blk = 3 ;
+	superblock->d_start_blk = 3 + ((sizeof(struct inode) * MAX_INUM) / BLOCK_SIZE) ;
+	ext_load() ;
+	blk_write(0, superblock) ;
+	
+	// initialize inode bitmap
+	inoBitmap = (bitmap_t)calloc(1, BLOCK_SIZE) ;
+
+	// initialize data block bitmap
+	blknoBitmap = (bitmap_t)calloc(1, BLOCK_SIZE) ;
+
+	// update bitmap information for root directory
+	set_bitmap(inoBitmap, 0) ;
+	blk_write(superblock->i_bitmap_blk, inoBitmap) ;
+	set_bitmap(blknoBitmap, 0) ;
+	blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+
+	// update inode for root directory
+	struct inode * rootNode = (struct inode *)malloc(BLOCK_SIZE) ;
+	blk_read(superblock->i_start_blk, rootNode) ;
+	rootNode->ino = 0 ;
+	rootNode->valid = 1 ;
+	rootNode->link = 0 ;
+	rootNode->indirect_ptr[0] = 0 ;
+	rootNode->direct_ptr[0] = superblock->d_start_blk ;
+	rootNode->direct_ptr[1] = 0 ;
+	rootNode->type = 1 ;
+
+	struct stat * r = (struct stat *)calloc(1, sizeof(struct stat)) ;
+	r->st_mode = S_IFDIR | 0755 ;
+	r->st_nlink = 2 ; // Need two links, "." for itself and ".." for the parent
+	time(&r->st_mtime) ;
+	r->st_blocks = 1 ;
+	r->st_blksize = BLOCK_SIZE ;
+	rootNode->vstat = *r ;
+	free(r) ;
+	blk_write(superblock->i_start_blk, rootNode) ;
+	free(rootNode) ;
+
+	struct dirent * rootDir = (struct dirent *)calloc(1, BLOCK_SIZE) ;
+	rootDir->ino = 0 ;
+	rootDir-> valid = 1 ;
+	char c[2] ;
+	c[0] = '.' ;
+	c[1] = '\0' ;
+	strncpy(rootDir->name, c, 2) ; // Current directory
+	//printf("rootDir name = %s\n", rootDir->name) ;
+	struct dirent * parent = rootDir + 1 ;
+	parent->ino = 0 ;
+	parent->valid = 1 ;
+	char p[3] ;
+	p[0] = '.' ;
+	p[1] = '.' ;
+	p[2] = '\0' ;
+	strncpy(parent->name, p, 3) ; // Parent directory
+	//printf("parent name = %s\n", (rootDir + 1)->name) ;
+	blk_write(superblock->d_start_blk, rootDir) ;
+	free(rootDir) ;
+
+	return 0;
+}
+
+
+/*
+ * Operations on inode numbers, shared by the path based and the low-level FUSE front ends
+ */
+
+/*
+ * Release every data block of an inode, including its indirect blocks and its attributes
+ * Blocks a snapshot still has only lose this owner, -ENOSPC if the inode's own table block
+ * couldn't be copied away from one
+ */
+static int free_blocks(struct inode *node) {
+
+	trace_ino(node->ino) ;
+	if (cow_itable(node->ino) != 0) {
+
+		return -ENOSPC ;
+
+	}
+
+	put_ptrs(node) ; // Large file support, indirect blocks take what they point at with them
+	node->link = 0 ;
+	memset(node->direct_ptr, 0, sizeof(node->direct_ptr)) ;
+	memset(node->indirect_ptr, 0, sizeof(node->indirect_ptr)) ;
+
+	node->vstat.st_blocks = 0 ;
+	ref_flush() ;
+	blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+
+	return 0 ;
+}
+
+/*
+ * Create name in directory parent_ino, a directory if type is 1, a symbolic link to target if it
+ * is TFS_SYMLINK and a regular file otherwise
+ */
+static int make_node(uint16_t parent_ino, const char *name, int type, const char *target, struct inode *node) {
+
+	if (read_only()) {
+
+		return -EROFS ;
+
+	}
+
+	// Step 1: Call readi() to get inode of parent directory
+	struct inode parent ;
+	readi(parent_ino, &parent) ;
+	if (!parent.valid || parent.type != 1) {
+
+		return -ENOTDIR ;
+
+	}
+
+	if (strlen(name) >= sizeof(((struct dirent *)0)->name)) {
+
+		return -ENAMETOOLONG ;
+
+	}
+
+	if (is_stats_name(parent_ino, name) || is_ctl_name(parent_ino, name)) {
+
+		return -EEXIST ;
+
+	}
+
+	size_t target_len = type == TFS_SYMLINK ? strlen(target) : 0 ;
+	if (target_len >= BLOCK_SIZE) {
+
+		return -ENAMETOOLONG ;
+
+	}
+
+	// Step 2: Call get_avail_ino() to get an available inode number, and a data block for a directory's entries or a long link
+	struct inode owner ;
+	memset(&owner, 0, sizeof(owner)) ;
+	owner.vstat.st_uid = my_uid ;
+	owner.vstat.st_gid = my_gid ;
+	QUOTA_TREE(&owner) = QUOTA_TREE(&parent) ;
+	int ret = quota_allow(&owner, type == 1 || target_len >= SYMLINK_INLINE, 1) ;
+	if (ret < 0) {
+
+		return ret ;
+
+	}
+
+	int avail = get_avail_ino(parent_ino, type == 1) ;
+	if (avail < 0) {
+
+		return -ENOSPC ;
+
+	}
+
+	memset(node, 0, sizeof(struct inode)) ;
+	if (type == 1 || target_len >= SYMLINK_INLINE) {
+
+		node->direct_ptr[0] = get_avail_blkno_near(group_goal(avail)) ;
+		if (node->direct_ptr[0] < 0) {
+
+			unset_bitmap(inoBitmap, avail) ;
+			blk_write(superblock->i_bitmap_blk, inoBitmap) ;
+			return -ENOSPC ;
+
+		}
+
+	}
+
+	// Step 3: Call dir_add() to add directory entry of target to parent directory
+	ret = dir_add(parent, avail, name, strlen(name)) ;
+	if (ret != 0) {
+
+		free_blocks(node) ;
+		unset_bitmap(inoBitmap, avail) ;
+		blk_write(superblock->i_bitmap_blk, inoBitmap) ;
+		return ret ;
+
+	}
+
+	// Step 4: Update inode for target
+	node->valid = 1 ;
+	node->ino = avail ;
+	node->link = 0 ;
+	node->type = type ;
+	node->vstat.st_nlink = 1 ;
+	node->vstat.st_ino = avail ;
+	node->vstat.st_blksize = BLOCK_SIZE ;
+	node->vstat.st_uid = owner.vstat.st_uid ;
+	node->vstat.st_gid = owner.vstat.st_gid ;
+	QUOTA_TREE(node) = QUOTA_TREE(&owner) ;
+	time(&node->vstat.st_mtime) ;
+
+	if (type == 1) {
+
+		node->size = sizeof(struct dirent) * 2 ; // Unix convention
+		node->vstat.st_mode = S_IFDIR | 0755 ; // Directory
+		node->vstat.st_blocks = 1 ;
+
+		struct dirent * entries = (struct dirent *)calloc(1, BLOCK_SIZE) ;
+		entries[0].ino = avail ;
+		entries[0].valid = 1 ;
+		strcpy(entries[0].name, ".") ; // Current directory
+		entries[0].len = 1 ;
+		entries[1].ino = parent_ino ;
+		entries[1].valid = 1 ;
+		strcpy(entries[1].name, "..") ; // Parent directory
+		entries[1].len = 2 ;
+		blk_write(node->direct_ptr[0], (const void *)entries) ;
+		free(entries) ;
+
+	} else if (type == TFS_SYMLINK) {
+
+		node->size = target_len ;
+		node->vstat.st_mode = S_IFLNK | 0777 ; // Symbolic link
+		if (target_len < SYMLINK_INLINE) {
+
+			memcpy(SYMLINK_DATA(node), target, target_len) ; // No block to read back, readlink() has it with the inode
+
+		} else {
+
+			char * block = (char *)calloc(1, BLOCK_SIZE) ;
+			memcpy(block, target, target_len) ;
+			blk_write(node->direct_ptr[0], block) ;
+			node->vstat.st_blocks = 1 ;
+			free(block) ;
+
+		}
+
+	} else {
+
+		node->size = 0 ;
+		node->vstat.st_mode = S_IFREG | 0666 ; // File
+
+	}
+	node->vstat.st_size = node->size ;
+
+	// Step 5: Call writei() to write inode to disk
+	writei(avail, node) ;
+
+	return 0 ;
+}
+
+/*
+ * Orphans, see tfs_ext.h
+ * Dropping the last name of an inode only puts it on the orphan list, the reclaimer thread frees
+ * orphans with fs_lock held for writing, up to RECLAIM_BLOCKS blocks' worth at a time, with one
+ * write of each bitmap per batch. An allocation that finds no room while there are orphans fails
+ * with my_nospace set, and the operation wrappers free everything on the list and run it once
+ * more, so a file deleted just before isn't in the way. Operations only hold fs_lock for
+ * reading, orphan_lock keeps their changes to the head of the list apart.
+ */
+#define RECLAIM_BLOCKS 4096
+#define RECLAIM_DELAY_MS 20 // after the first orphan shows up, to let more of an rm -r gather
+
+static pthread_t reclaim_thread ;
+static int reclaim_started = 0 ;
+static int reclaim_quit = 0 ;
+static int reclaim_stuck = 0 ; // everything left on the list is still busy, see ll_refs
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER ; // ext->orphans
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_cond_t reclaim_wake = PTHREAD_COND_INITIALIZER ;
+
+/*
+ * What the kernel holds of each inode through the low-level API: a lookup for every entry we
+ * replied until it forgets them, and one for every open handle until it is released. An orphan
+ * the kernel still holds stays on the list, so its blocks and its number aren't handed out again
+ * under an open handle. ll_generation tells apart the inodes that had the same number.
+ */
+static uint64_t ll_refs[MAX_INUM] ;
+static uint32_t ll_generation[MAX_INUM] ;
+
+/*
+ * Let the reclaimer go on, it has just been given something to free
+ */
+static void reclaim_kick(int first) {
+
+	if (first || __atomic_load_n(&reclaim_stuck, __ATOMIC_ACQUIRE)) {
+
+		pthread_mutex_lock(&reclaim_lock) ;
+		reclaim_stuck = 0 ;
+		pthread_cond_signal(&reclaim_wake) ;
+		pthread_mutex_unlock(&reclaim_lock) ;
+
+	}
+
+}
+
+static void orphan_wanted(int err) {
+
+	if (__atomic_load_n(&ext->orphans, __ATOMIC_ACQUIRE) != 0 && !read_only()) {
+
+		my_nospace = err ;
+
+	}
+
+}
+
+/*
+ * Put node at the head of the orphan list, block 0 is left for the caller to write. The caller
+ * holds orphan_lock.
+ */
+static int orphan_push(struct inode *node) {
+
+	node->vstat.st_nlink = 0 ;
+	ORPHAN_NEXT(node) = ext->orphans ;
+	time(&node->vstat.st_ctime) ;
+	if (writei(node->ino, node) != 0) {
+
+		return -ENOSPC ;
+
+	}
+	__atomic_store_n(&ext->orphans, node->ino + 1, __ATOMIC_RELEASE) ;
+
+	return 0 ;
+}
+
+/*
+ * Put node, which just lost its last name, on the orphan list: one inode and block 0 written
+ */
+static int orphan_add(struct inode *node) {
+
+	pthread_mutex_lock(&orphan_lock) ;
+	int first = ext->orphans == 0 ;
+	if (orphan_push(node) != 0) {
+
+		pthread_mutex_unlock(&orphan_lock) ;
+		return -ENOSPC ;
+
+	}
+	ext_write() ;
+	pthread_mutex_unlock(&orphan_lock) ;
+
+	// The reclaimer only sleeps while the list is empty or all busy
+	reclaim_kick(first) ;
+
+	return 0 ;
+}
+
+struct child_list {
+
+	uint16_t ino[MAX_INUM] ;
+	int n ;
+
+} ;
+
+static int collect_entry(void *ctx, struct dirent *entry, off_t next) {
+
+	struct child_list * c = (struct child_list *)ctx ;
+	if (strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0 && c->n < MAX_INUM) {
+
+		c->ino[c->n++] = entry->ino ;
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Everything an orphaned directory names loses that name, by inode number and without touching
+ * the directory's own blocks. What is left without a name joins the list ahead of what is there.
+ */
+static void orphan_children(struct inode *dir, struct child_list *children) {
+
+	int i ;
+	children->n = 0 ;
+	dir_iterate(dir, 0, collect_entry, children) ;
+
+	for (i = 0 ; i < children->n ; i++) {
+
+		struct inode child ;
+		uint16_t ino = children->ino[i] ;
+		if (ino == 0 || ino >= MAX_INUM || readi(ino, &child) != 0 || !child.valid || child.vstat.st_nlink == 0) {
+
+			continue ;
+
+		}
+
+		if (child.type != 1 && child.vstat.st_nlink > 1) {
+
+			child.vstat.st_nlink-- ; // named outside the tree as well
+			time(&child.vstat.st_ctime) ;
+			writei(ino, &child) ;
+
+		} else {
+
+			orphan_push(&child) ;
+
+		}
+
+	}
+
+}
+
+/*
+ * Free orphans from the head of the list until about max_blocks blocks are given back. The caller
+ * holds fs_lock for writing, nothing else allocates or frees meanwhile. Returns the number of
+ * orphans freed, those the kernel still holds go back on the list as they are.
+ * A directory on the list still has its entries, removed with REMOVE_TREE, and hands them on to
+ * the list when it is taken off, so a whole tree goes in batches like any other orphans.
+ */
+static int orphan_reclaim(int max_blocks) {
+
+	struct inode * batch ;
+	int n = 0, blocks = 0, i ;
+
+	if (ext->orphans == 0 || read_only()) {
+
+		return 0 ;
+
+	}
+	batch = (struct inode *)malloc(MAX_INUM * sizeof(struct inode)) ;
+	struct child_list * children = (struct child_list *)malloc(sizeof(struct child_list)) ;
+	struct child_list * busy = (struct child_list *)malloc(sizeof(struct child_list)) ;
+	busy->n = 0 ;
+
+	// Step 1: Take a batch off the list, each inode gone before its blocks are, so a crash in
+	// between leaks blocks instead of freeing them twice. A damaged list ends where it goes wrong.
+	pthread_mutex_lock(&orphan_lock) ;
+	while (ext->orphans != 0 && blocks < max_blocks && n < MAX_INUM) {
+
+		uint16_t ino = ext->orphans - 1 ;
+		struct inode * node = &batch[n] ;
+		if (ino == 0 || ino >= MAX_INUM || readi(ino, node) != 0 || !node->valid || node->vstat.st_nlink != 0) {
+
+			ext->orphans = 0 ;
+			break ;
+
+		}
+		if (cow_itable(ino) != 0) {
+
+			break ;
+
+		}
+
+		ext->orphans = ORPHAN_NEXT(node) <= MAX_INUM ? ORPHAN_NEXT(node) : 0 ;
+		if (__atomic_load_n(&ll_refs[ino], __ATOMIC_ACQUIRE) != 0 && busy->n < MAX_INUM) {
+
+			busy->ino[busy->n++] = ino ;
+			continue ;
+
+		}
+		if (node->type == 1) {
+
+			orphan_children(node, children) ;
+
+		}
+
+		struct inode gone ;
+		memset(&gone, 0, sizeof(gone)) ;
+		gone.ino = ino ;
+		writei(ino, &gone) ;
+		unset_bitmap(inoBitmap, ino) ;
+		ll_generation[ino]++ ;
+		blocks += node->vstat.st_blocks + 1 ;
+		n++ ;
+
+	}
+	if (n > 0) {
+
+		blk_write(superblock->i_bitmap_blk, inoBitmap) ;
+
+	}
+	for (i = 0 ; i < busy->n ; i++) {
+
+		struct inode node ;
+		readi(busy->ino[i], &node) ;
+		orphan_push(&node) ;
+
+	}
+	ext_write() ;
+	pthread_mutex_unlock(&orphan_lock) ;
+
+	// Step 2: Then what they pointed at
+	for (i = 0 ; i < n ; i++) {
+
+		trace_ino(batch[i].ino) ;
+		put_ptrs(&batch[i]) ;
+
+	}
+	if (n > 0) {
+
+		ref_flush() ;
+		blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+
+	}
+
+	free(batch) ;
+	free(children) ;
+	free(busy) ;
+	return n ;
+}
+
+static void *reclaim_main(void *arg) {
+
+	pthread_mutex_lock(&reclaim_lock) ;
+	while (!reclaim_quit) {
+
+		if (__atomic_load_n(&ext->orphans, __ATOMIC_ACQUIRE) == 0 || reclaim_stuck) {
+
+			pthread_cond_wait(&reclaim_wake, &reclaim_lock) ;
+			continue ;
+
+		}
+
+		struct timespec until ;
+		clock_gettime(CLOCK_REALTIME, &until) ;
+		until.tv_nsec += RECLAIM_DELAY_MS * 1000000L ;
+		until.tv_sec += until.tv_nsec / 1000000000L ;
+		until.tv_nsec %= 1000000000L ;
+		while (!reclaim_quit && pthread_cond_timedwait(&reclaim_wake, &reclaim_lock, &until) == 0) ; // only reclaim_close() signals now
+		if (reclaim_quit) {
+
+			break ;
+
+		}
+		pthread_mutex_unlock(&reclaim_lock) ;
+
+		// Busy orphans are only let go by operations, which wait for fs_lock, so none is missed
+		pthread_rwlock_wrlock(&fs_lock) ;
+		my_csum_error = 0 ; // a block that failed in the last batch doesn't hold up this one
+		int freed = orphan_reclaim(RECLAIM_BLOCKS) ;
+		pthread_mutex_lock(&reclaim_lock) ;
+		reclaim_stuck = freed == 0 && ext->orphans != 0 ;
+		pthread_rwlock_unlock(&fs_lock) ;
+
+	}
+	pthread_mutex_unlock(&reclaim_lock) ;
+
+	return NULL ;
+}
+
+/*
+ * At mount: free what a crash (or the last unmount) left on the list, then start the reclaimer
+ */
+static void reclaim_open() {
+
+	// The kernel holds nothing of a fresh mount
+	memset(ll_refs, 0, sizeof(ll_refs)) ;
+	if (read_only()) {
+
+		return ;
+
+	}
+
+	while (orphan_reclaim(MAX_DNUM) > 0) ;
+
+	reclaim_quit = 0 ;
+	reclaim_stuck = 0 ;
+	reclaim_started = pthread_create(&reclaim_thread, NULL, reclaim_main, NULL) == 0 ;
+
+}
+
+/*
+ * At unmount: stop the reclaimer, orphans still on the list are freed by the next mount
+ */
+static void reclaim_close() {
+
+	if (!reclaim_started) {
+
+		return ;
+
+	}
+
+	pthread_mutex_lock(&reclaim_lock) ;
+	reclaim_quit = 1 ;
+	pthread_cond_signal(&reclaim_wake) ;
+	pthread_mutex_unlock(&reclaim_lock) ;
+	pthread_join(reclaim_thread, NULL) ;
+	reclaim_started = 0 ;
+
+}
+
+/*
+ * After an operation failed for lack of room while there were orphans: trade fs_lock for the
+ * write lock, free them all and take the read lock again. 1 if the operation should run again.
+ */
+static int reclaim_retry() {
+
+	if (!my_nospace || my_retrying) {
+
+		return 0 ;
+
+	}
+
+	my_nospace = 0 ;
+	pthread_rwlock_unlock(&fs_lock) ;
+	pthread_rwlock_wrlock(&fs_lock) ;
+	while (orphan_reclaim(MAX_DNUM) > 0) ;
+	pthread_rwlock_unlock(&fs_lock) ;
+	pthread_rwlock_rdlock(&fs_lock) ;
+
+	return 1 ;
+}
+
+/*
+ * One name of target goes away, the inode goes on the orphan list with the last one
+ * Directories only ever have one.
+ */
+static int drop_link(struct inode *target) {
+
+	if (target->type != 1 && target->vstat.st_nlink > 1) {
+
+		target->vstat.st_nlink-- ;
+		time(&target->vstat.st_ctime) ;
+		return writei(target->ino, target) == 0 ? 0 : -ENOSPC ;
+
+	}
+
+	return orphan_add(target) ;
+}
+
+#define REMOVE_TREE 2 // remove_node(): a directory, with whatever is in it
+
+/*
+ * Remove name from directory parent_ino, dir says whether a directory is expected
+ * With REMOVE_TREE the directory needn't be empty, it goes on the orphan list as it is and the
+ * reclaimer takes what it names with it, see orphan_reclaim()
+ */
+static int remove_node(uint16_t parent_ino, const char *name, int dir) {
+
+	// Step 1: Call dir_find() and readi() to get inode of target
+	struct dirent entry ;
+	if (read_only()) {
+
+		return -EROFS ;
+
+	}
+	if (is_stats_name(parent_ino, name) || is_ctl_name(parent_ino, name)) {
+
+		return -EPERM ;
+
+	}
+
+	int ret = dir_find(parent_ino, name, strlen(name), &entry) ;
+	if (ret != 0) {
+
+		return ret == -EIO ? -EIO : -ENOENT ; // “No such file or directory.”
+
+	}
+
+	struct inode target ;
+	if (readi(entry.ino, &target) < 0) {
+
+		return -EIO ;
+
+	}
+	if (dir && target.type != 1) {
+
+		return -ENOTDIR ;
+
+	}
+	if (!dir && target.type == 1) {
+
+		return -EISDIR ;
+
+	}
+	if (dir == 1 && !dir_empty(&target)) {
+
+		return -ENOTEMPTY ;
+
+	}
+
+	// Step 2: Make sure target can be written, then call dir_remove() to remove its directory entry
+	if (cow_itable(target.ino) != 0) {
+
+		return -ENOSPC ;
+
+	}
+	struct inode parent ;
+	readi(parent_ino, &parent) ;
+	dir_remove(parent, name, strlen(name)) ;
+
+	// Step 3: Only then drop the link, target becomes an orphan with its last name
+	return drop_link(&target) ;
+}
+
+/*
+ * Give inode ino another name in directory parent_ino, node is what it looks like after
+ */
+static int link_node(uint16_t ino, uint16_t parent_ino, const char *name, struct inode *node) {
+
+	if (read_only()) {
+
+		return -EROFS ;
+
+	}
+
+	// Step 1: Call readi() to get the inode and the directory the name goes in
+	struct inode parent ;
+	struct dirent entry ;
+	if (readi(ino, node) < 0 || readi(parent_ino, &parent) < 0) {
+
+		return -EIO ;
+
+	}
+	if (!node->valid) {
+
+		return -ENOENT ;
+
+	}
+	if (node->type == 1) {
+
+		return -EPERM ; // No hard links to directories
+
+	}
+	if (!parent.valid || parent.type != 1) {
+
+		return -ENOTDIR ;
+
+	}
+	if (quota_crosses(node, &parent)) {
+
+		return -EXDEV ;
+
+	}
+	if (strlen(name) >= sizeof(((struct dirent *)0)->name)) {
+
+		return -ENAMETOOLONG ;
+
+	}
+	int ret = is_stats_name(parent_ino, name) || is_ctl_name(parent_ino, name) ? 0 : dir_find(parent_ino, name, strlen(name), &entry) ;
+	if (ret == 0 || ret == -EIO) {
+
+		return ret == 0 ? -EEXIST : -EIO ;
+
+	}
+
+	// Step 2: Count the name before it exists, a crash in between leaves a count fsck lowers and never a name too many
+	node->vstat.st_nlink++ ;
+	time(&node->vstat.st_ctime) ;
+	if (writei(ino, node) != 0) {
+
+		return -ENOSPC ;
+
+	}
+
+	// Step 3: Call dir_add() to add the entry
+	ret = dir_add(parent, ino, name, strlen(name)) ;
+	if (ret != 0) {
+
+		node->vstat.st_nlink-- ;
+		writei(ino, node) ;
+		return ret ;
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Move from in directory from_parent to to in directory to_parent, replacing what to named
+ * Only directory entries change, no data moves. Without a journal the new name is written
+ * before the old one goes, a crash in between leaves both for fsck and never neither.
+ */
+static int rename_node(uint16_t from_parent, const char *from, uint16_t to_parent, const char *to) {
+
+	if (read_only()) {
+
+		return -EROFS ;
+
+	}
+	if (is_stats_name(from_parent, from) || is_ctl_name(from_parent, from) || is_stats_name(to_parent, to) || is_ctl_name(to_parent, to)) {
+
+		return -EPERM ;
+
+	}
+	if (strcmp(from, ".") == 0 || strcmp(from, "..") == 0 || strcmp(to, ".") == 0 || strcmp(to, "..") == 0) {
+
+		return -EINVAL ;
+
+	}
+	if (strlen(to) >= sizeof(((struct dirent *)0)->name)) {
+
+		return -ENAMETOOLONG ;
+
+	}
+
+	// Step 1: Call dir_find() and readi() to get the inode being moved and the directory it moves to
+	struct dirent src, dst ;
+	struct inode node, parent, old ;
+	int ret = dir_find(from_parent, from, strlen(from), &src) ;
+	if (ret != 0) {
+
+		return ret == -EIO ? -EIO : -ENOENT ;
+
+	}
+	if (readi(src.ino, &node) < 0 || readi(to_parent, &parent) < 0) {
+
+		return -EIO ;
+
+	}
+	if (!parent.valid || parent.type != 1) {
+
+		return -ENOTDIR ;
+
+	}
+	if (quota_crosses(&node, &parent)) {
+
+		return -EXDEV ;
+
+	}
+
+	// Step 2: A directory can't move below itself, walk up from where it goes
+	if (node.type == 1 && from_parent != to_parent) {
+
+		uint16_t up = to_parent ;
+		while (up != node.ino && up != 0) {
+
+			if (dir_find(up, "..", 2, &dst) != 0) {
+
+				return -EIO ;
+
+			}
+			up = dst.ino ;
+
+		}
+		if (up == node.ino) {
+
+			return -EINVAL ;
+
+		}
+
+	}
+
+	// Step 3: Whatever to names already has to be of the same kind, and an empty directory if it is one
+	ret = dir_find(to_parent, to, strlen(to), &dst) ;
+	if (ret == -EIO) {
+
+		return -EIO ;
+
+	}
+	int replace = ret == 0 ;
+	if (replace) {
+
+		if (dst.ino == src.ino) {
+
+			return 0 ; // Two names of one file, nothing to do
+
+		}
+		if (readi(dst.ino, &old) < 0) {
+
+			return -EIO ;
+
+		}
+		if (node.type == 1 && old.type != 1) {
+
+			return -ENOTDIR ;
+
+		}
+		if (node.type != 1 && old.type == 1) {
+
+			return -EISDIR ;
+
+		}
+		if (old.type == 1 && old.size > sizeof(struct dirent) * 2) {
+
+			return -ENOTEMPTY ;
+
+		}
+
+	}
+
+	// Step 4: The new name, pointing the entry there at the inode if there is one, else dir_add()
+	ret = replace ? dir_relink(parent, to, src.ino) : dir_add(parent, src.ino, to, strlen(to)) ;
+	if (ret != 0) {
+
+		return ret ;
+
+	}
+
+	// Step 5: Call dir_remove() for the old name, from_parent may be the directory that just changed
+	readi(from_parent, &parent) ;
+	dir_remove(parent, from, strlen(from)) ;
+
+	// Step 6: A directory in a new parent has a new ".."
+	if (node.type == 1 && from_parent != to_parent) {
+
+		dir_relink(node, "..", to_parent) ;
+
+	}
+
+	// Step 7: What was replaced lost a name
+	if (replace) {
+
+		drop_link(&old) ;
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Copy the target of symbolic link node into buffer, cut to size with the terminating NUL
+ */
+static int read_link(struct inode *node, char *buffer, size_t size) {
+
+	if (node->type != TFS_SYMLINK) {
+
+		return -EINVAL ;
+
+	}
+	if (size == 0) {
+
+		return 0 ;
+
+	}
+
+	size_t len = node->size < size - 1 ? node->size : size - 1 ;
+	if (SYMLINK_IS_INLINE(node)) {
+
+		memcpy(buffer, SYMLINK_DATA(node), len) ;
+
+	} else {
+
+		char * block = (char *)malloc(BLOCK_SIZE) ;
+		int ret = blk_read(node->direct_ptr[0], block) ;
+		memcpy(buffer, block, len) ;
+		free(block) ;
+		if (ret < 0) {
+
+			return -EIO ;
+
+		}
+
+	}
+	buffer[len] = '\0' ;
+
+	return 0 ;
+}
+
+/*
+ * Extended attributes, see tfs_ext.h
+ * Read the set of node into buffer, an empty one if it has none. Files without attributes don't
+ * cost more than their inode.
+ */
+static int xattr_load(struct inode *node, void *buffer) {
+
+	struct tfs_xattr_hdr * hdr = (struct tfs_xattr_hdr *)buffer ;
+	if (node->link == 0) {
+
+		memset(buffer, 0, BLOCK_SIZE) ;
+		hdr->magic = XATTR_MAGIC ;
+		hdr->used = sizeof(struct tfs_xattr_hdr) ;
+		return 0 ;
+
+	}
+
+	trace_ino(node->ino) ;
+	if (blk_read(node->link, buffer) < 0 || hdr->magic != XATTR_MAGIC || hdr->used > BLOCK_SIZE) {
+
+		return -EIO ;
+
+	}
+
+	// Entries have to add up to the size, nothing past the block is ever looked at
+	struct tfs_xattr_entry * e = XATTR_FIRST(hdr) ;
+	uint32_t i ;
+	for (i = 0 ; i < hdr->count && (char *)e + sizeof(struct tfs_xattr_entry) <= (char *)buffer + hdr->used ; i++) {
+
+		e = XATTR_NEXT(e) ;
+
+	}
+
+	return i == hdr->count && (char *)e == (char *)buffer + hdr->used ? 0 : -EIO ;
+}
+
+/*
+ * Order of entry e and name, like strcmp()
+ */
+static int xattr_cmp(struct tfs_xattr_entry *e, const char *name, size_t len) {
+
+	int c = memcmp(XATTR_NAME(e), name, e->name_len < len ? e->name_len : len) ;
+	return c != 0 ? c : (int)e->name_len - (int)len ;
+}
+
+static struct tfs_xattr_entry *xattr_find(struct tfs_xattr_hdr *hdr, const char *name) {
+
+	struct tfs_xattr_entry * e = XATTR_FIRST(hdr) ;
+	uint32_t i ;
+	for (i = 0 ; i < hdr->count ; i++, e = XATTR_NEXT(e)) {
+
+		if (xattr_cmp(e, name, strlen(name)) == 0) {
+
+			return e ;
+
+		}
+
+	}
+
+	return NULL ;
+}
+
+/*
+ * Add an entry at the end of a set, the caller keeps them sorted and checked it fits
+ */
+static void xattr_append(struct tfs_xattr_hdr *hdr, const char *name, size_t len, const char *value, size_t size) {
+
+	struct tfs_xattr_entry * e = (struct tfs_xattr_entry *)((char *)hdr + hdr->used) ;
+	e->name_len = len ;
+	e->value_len = size ;
+	memcpy(XATTR_NAME(e), name, len) ;
+	memcpy(XATTR_VALUE(e), value, size) ;
+	hdr->count++ ;
+	hdr->used += XATTR_ENTRY_SIZE(len, size) ;
+
+}
+
+/*
+ * Value of attribute name, its length if size is 0
+ */
+static int xattr_get(struct inode *node, const char *name, char *value, size_t size) {
+
+	char * buffer = (char *)malloc(BLOCK_SIZE) ;
+	int ret = xattr_load(node, buffer) ;
+	if (ret == 0) {
+
+		struct tfs_xattr_entry * e = xattr_find((struct tfs_xattr_hdr *)buffer, name) ;
+		if (e == NULL) {
+
+			ret = -ENODATA ;
+
+		} else if (size == 0) {
+
+			ret = e->value_len ;
+
+		} else if (size < e->value_len) {
+
+			ret = -ERANGE ;
+
+		} else {
+
+			memcpy(value, XATTR_VALUE(e), e->value_len) ;
+			ret = e->value_len ;
+
+		}
+
+	}
+	free(buffer) ;
+
+	return ret ;
+}
+
+/*
+ * Names of all attributes, each NUL terminated, their length if size is 0
+ */
+static int xattr_list(struct inode *node, char *list, size_t size) {
+
+	char * buffer = (char *)malloc(BLOCK_SIZE) ;
+	int ret = xattr_load(node, buffer) ;
+	if (ret == 0) {
+
+		struct tfs_xattr_hdr * hdr = (struct tfs_xattr_hdr *)buffer ;
+		struct tfs_xattr_entry * e = XATTR_FIRST(hdr) ;
+		uint32_t i ;
+		for (i = 0 ; i < hdr->count ; i++, e = XATTR_NEXT(e)) {
+
+			if (size > 0 && ret + e->name_len + 1 > size) {
+
+				ret = -ERANGE ;
+				break ;
+
+			}
+			if (size > 0) {
+
+				memcpy(list + ret, XATTR_NAME(e), e->name_len) ;
+				list[ret + e->name_len] = '\0' ;
+
+			}
+			ret += e->name_len + 1 ;
+
+		}
+
+	}
+	free(buffer) ;
+
+	return ret ;
+}
+
+/*
+ * Make set the attributes of node: the block some other inode has with the same set if there is
+ * one, else its own block rewritten in place unless a snapshot or another file still has it
+ */
+static int xattr_store(struct inode *node, char *set) {
+
+	struct tfs_xattr_hdr * hdr = (struct tfs_xattr_hdr *)set ;
+	int old = node->link ;
+	int blkno = 0 ;
+	int zero ;
+
+	// Step 1: Make the inode's table block the live tree's own, so shared() sees a snapshot's claim
+	if (cow_itable(node->ino) != 0) {
+
+		return -ENOSPC ;
+
+	}
+
+	// Step 2: Look for the same set, which the hash alone could be wrong about
+	if (hdr->count > 0) {
+
+		uint64_t hash = block_hash(set, &zero) ;
+		int found = xattr_lookup(hash) ;
+		if (found > 0 && found != old) {
+
+			char * b = (char *)malloc(BLOCK_SIZE) ;
+			if (blk_read(found, b) >= 0 && memcmp(b, set, BLOCK_SIZE) == 0 && ref_init() == 0 && share(found) == 0) {
+
+				blkno = found ;
+
+			}
+			free(b) ;
+
+		}
+
+		// Step 3: New set, written to a block of its own
+		if (blkno == 0) {
+
+			blkno = (old != 0 && !shared(old)) ? old : get_avail_blkno_near(group_goal(node->ino)) ;
+			if (blkno < 0) {
+
+				return -ENOSPC ;
+
+			}
+			trace_ino(node->ino) ;
+			blk_write(blkno, set) ;
+			xattr_insert(hash, blkno) ;
+
+		}
+
+	}
+
+	// Step 4: Point the inode at it, then let go of the old block
+	node->link = blkno ;
+	time(&node->vstat.st_ctime) ;
+	writei(node->ino, node) ;
+	if (old != 0 && old != blkno) {
+
+		put_block(old, 0) ;
+		blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+
+	}
+	ref_flush() ;
+
+	return 0 ;
+}
+
+/*
+ * Set attribute name to size bytes of value, or remove it if value is NULL
+ */
+static int xattr_set(struct inode *node, const char *name, const char *value, size_t size, int flags) {
+
+	size_t len = strlen(name) ;
+	if (read_only()) {
+
+		return -EROFS ;
+
+	}
+	if (len == 0 || len > 255) {
+
+		return -ERANGE ;
+
+	}
+
+	// Step 1: The current set, and whether name is in it
+	char * old = (char *)malloc(BLOCK_SIZE) ;
+	int ret = xattr_load(node, old) ;
+	if (ret != 0) {
+
+		free(old) ;
+		return ret ;
+
+	}
+
+	struct tfs_xattr_hdr * hdr = (struct tfs_xattr_hdr *)old ;
+	struct tfs_xattr_entry * cur = xattr_find(hdr, name) ;
+	size_t used = hdr->used - (cur != NULL ? XATTR_ENTRY_SIZE(cur->name_len, cur->value_len) : 0) + (value != NULL ? XATTR_ENTRY_SIZE(len, size) : 0) ;
+	if (cur != NULL && (flags & XATTR_CREATE)) {
+
+		ret = -EEXIST ;
+
+	} else if (cur == NULL && (value == NULL || (flags & XATTR_REPLACE))) {
+
+		ret = -ENODATA ;
+
+	} else if (used > BLOCK_SIZE) {
+
+		ret = -ENOSPC ;
+
+	}
+	if (ret != 0) {
+
+		free(old) ;
+		return ret ;
+
+	}
+
+	// Step 2: The new set, name takes its place in the order
+	char * set = (char *)calloc(1, BLOCK_SIZE) ;
+	struct tfs_xattr_hdr * new = (struct tfs_xattr_hdr *)set ;
+	struct tfs_xattr_entry * e = XATTR_FIRST(hdr) ;
+	int placed = value == NULL ;
+	uint32_t i ;
+	new->magic = XATTR_MAGIC ;
+	new->used = sizeof(struct tfs_xattr_hdr) ;
+	for (i = 0 ; i < hdr->count ; i++, e = XATTR_NEXT(e)) {
+
+		int c = xattr_cmp(e, name, len) ;
+		if (c > 0 && !placed) {
+
+			xattr_append(new, name, len, value, size) ;
+			placed = 1 ;
+
+		}
+		if (c != 0) {
+
+			xattr_append(new, XATTR_NAME(e), e->name_len, XATTR_VALUE(e), e->value_len) ;
+
+		}
+
+	}
+	if (!placed) {
+
+		xattr_append(new, name, len, value, size) ;
+
+	}
+	free(old) ;
+
+	// Step 3: Store it
+	ret = xattr_store(node, set) ;
+	free(set) ;
+
+	return ret ;
+}
+
+/*
+ * Remember per open which inode it is for and whether aligned reads and writes may bypass the block layer
+ */
+static void set_open_flags(struct fuse_file_info *fi, uint16_t ino) {
+
+	fi->fh = (uint64_t)(ino + 1) << TFS_FH_INO_SHIFT ;
+	if ((fi->flags & O_DIRECT) || tfs_opts.direct_io) {
+
+		fi->direct_io = 1 ; // Keep the kernel page cache out of it as well
+		fi->fh |= TFS_FH_DIRECT ;
+
+	}
+
+}
+
+/*
+ * Inode an open file is for, -1 for /.tfs_stats
+ */
+static int fh_ino(struct fuse_file_info *fi) {
+
+	return (int)(fi->fh >> TFS_FH_INO_SHIFT) - 1 ;
+}
+
+/*
+ * Write back what the cache holds of an inode, data before whatever points at it, so a crash
+ * never leaves the inode pointing at blocks that don't hold their data yet. Only the inode's own
+ * dirty blocks are looked at, plus the few it shares with other inodes.
+ * With datasync set the metadata is left to the flusher if only timestamps changed, with barrier
+ * set the diskfile is flushed to stable storage once at the end.
+ */
+static int sync_ino(uint16_t ino, int datasync, int barrier) {
+
+	// Step 1: The data blocks its operations dirtied
+	cache_flush_ino(ino, 0) ;
+
+	// Step 2: Then its indirect blocks, the bitmaps and the inode itself
+	int changed = __atomic_exchange_n(&ino_changed[ino], 0, __ATOMIC_ACQ_REL) ;
+	if (changed || !datasync) {
+
+		int shared[4 + REF_BLOCKS] ;
+		int n = 0, i ;
+		shared[n++] = superblock->d_bitmap_blk ;
+		shared[n++] = superblock->i_bitmap_blk ;
+		shared[n++] = itable_blk(ino) ;
+		shared[n++] = 0 ; // where the inode table is and the snapshots
+		for (i = 0 ; i < REF_BLOCKS && ext->ref_blk[i] != 0 ; i++) {
+
+			shared[n++] = ext->ref_blk[i] ;
+
+		}
+		cache_flush_ino(ino, 1) ;
+		cache_flush_blocks(shared, n) ;
+
+	}
+
+	// Step 3: The checksums of all of it, even for datasync, and block 0 with theirs
+	if (csums != NULL) {
+
+		int table[CSUM_BLOCKS + 1] ;
+		int i ;
+		csum_flush() ;
+		for (i = 0 ; i < CSUM_BLOCKS ; i++) {
+
+			table[i] = csum_blks[i] ;
+
+		}
+		table[CSUM_BLOCKS] = 0 ;
+		cache_flush_blocks(table, CSUM_BLOCKS + 1) ;
+
+	}
+
+	// Step 4: One barrier for all of it
+	if (barrier && diskfile_fd >= 0 && fdatasync(diskfile_fd) != 0) {
+
+		return -errno ;
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Where block first + i of a file goes for direct_rw(), writing unless fresh is NULL. A hole gets
+ * a block that isn't zeroed, which fresh[i] remembers, and a shared block is copied first, so a
+ * write that never reaches the disk leaves the file as it was once direct_release() is done.
+ */
+static int direct_bmap(struct inode *node, int first, int i, char *fresh) {
+
+	int cur = bmap(node, first + i, BMAP_LOOKUP) ;
+	if (fresh == NULL || cur < 0) {
+
+		return cur ;
+
+	}
+
+	if (cur == 0) {
+
+		int blkno = bmap(node, first + i, BMAP_FILL) ;
+		fresh[i] = blkno > 0 ;
+		return blkno ;
+
+	}
+
+	return bmap(node, first + i, shared(cur) ? BMAP_ALLOC : BMAP_FILL) ;
+}
+
+/*
+ * Give back the blocks from block i on that direct_bmap() found holes and that were never written
+ */
+static void direct_release(struct inode *node, int first, char *fresh, int i, int count) {
+
+	for ( ; fresh != NULL && i < count ; i++) {
+
+		if (fresh[i]) {
+
+			bmap_set(node, first + i, 0) ;
+
+		}
+
+	}
+
+	free(fresh) ;
+
+}
+
+/*
+ * Direct I/O: move whole blocks between the caller's buffer and the diskfile,
+ * one pread()/pwrite() per physically contiguous run of blocks
+ */
+static int direct_rw(struct inode *node, char *buffer, size_t size, off_t offset, int write) {
+
+	int first = offset / BLOCK_SIZE ;
+	int count = size / BLOCK_SIZE ;
+	int fd = ((uintptr_t)buffer % BLOCK_SIZE == 0 && direct_fd >= 0) ? direct_fd : diskfile_fd ;
+	char * fresh = write ? (char *)calloc(count > 0 ? count : 1, 1) : NULL ;
+	int i = 0 ;
+
+	while (i < count) {
+
+		int start = direct_bmap(node, first, i, fresh) ;
+		if (start < 0) {
+
+			direct_release(node, first, fresh, i, count) ;
+			return i > 0 ? i * BLOCK_SIZE : start ;
+
+		}
+
+		if (start == 0) { // Hole, only possible when reading
+
+			memset(buffer + (i * BLOCK_SIZE), 0, BLOCK_SIZE) ;
+			i++ ;
+			continue ;
+
+		}
+
+		// Extend the run while the next logical block is physically adjacent. Looked up first, only
+		// a hole or the very next block is worth mapping for writing.
+		int run = 1 ;
+		while (i + run < count) {
+
+			int next = bmap(node, first + i + run, BMAP_LOOKUP) ;
+			if (write && (next == 0 || next == start + run)) {
+
+				next = direct_bmap(node, first, i + run, fresh) ;
+
+			}
+			if (next != start + run) {
+
+				break ;
+
+			}
+			run++ ;
+
+		}
+
+		cache_sync(start, run, write) ;
+
+		ssize_t n ;
+		if (write) {
+
+			n = pwrite(fd, buffer + (i * BLOCK_SIZE), run * BLOCK_SIZE, (off_t)start * BLOCK_SIZE) ;
+
+		} else {
+
+			n = pread(fd, buffer + (i * BLOCK_SIZE), run * BLOCK_SIZE, (off_t)start * BLOCK_SIZE) ;
+
+		}
+
+		if (n != run * BLOCK_SIZE) {
+
+			direct_release(node, first, fresh, i, count) ;
+			return i > 0 ? i * BLOCK_SIZE : -EIO ;
+
+		}
+
+		// The cache never saw these blocks, their checksums are entered or checked here
+		int j ;
+		for (j = 0 ; j < run && csums != NULL ; j++) {
+
+			char * data = buffer + (i + j) * BLOCK_SIZE ;
+			if (write) {
+
+				csum_seal(start + j, data) ;
+
+			} else if (csum_check(start + j, data) != 0) {
+
+				return i + j > 0 ? (i + j) * BLOCK_SIZE : -EIO ;
+
+			}
+
+		}
+
+		stats_io(write, run) ;
+		trace_io(write ? TFS_TRACE_WRITE : TFS_TRACE_READ, start, run) ;
+		i += run ;
+
+	}
+
+	free(fresh) ;
+	return size ;
+}
+
+/*
+ * Only whole, aligned blocks can skip the block layer
+ */
+static int use_direct_io(struct fuse_file_info *fi, size_t size, off_t offset) {
+
+	return fi != NULL && (fi->fh & TFS_FH_DIRECT) && diskfile_fd >= 0
+		&& size > 0 && offset % BLOCK_SIZE == 0 && size % BLOCK_SIZE == 0 ;
+}
+
+static int read_file(struct inode *node, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	if (offset >= node->size) {
+
+		return 0 ;
+
+	}
+
+	// Direct reads may still transfer the whole last block, the caller's buffer is big enough
+	size_t avail = node->size - offset ;
+	int clusters = range_compressed(node, offset, size) ;
+	if (use_direct_io(fi, size, offset) && !clusters) {
+
+		int ret = direct_rw(node, buffer, size, offset, 0) ;
+		return (ret > 0 && ret > avail) ? (int)avail : ret ;
+
+	}
+
+	if (size > avail) {
+
+		size = avail ;
+
+	}
+
+	// Step 1: Based on size and offset, read its data blocks from disk
+	char * b = (char *)malloc(BLOCK_SIZE) ;
+	size_t done = 0 ;
+	while (done < size) {
+
+		int blk = (offset + done) / BLOCK_SIZE ;
+		int off = (offset + done) % BLOCK_SIZE ;
+		size_t len = BLOCK_SIZE - off ;
+		if (len > size - done) {
+
+			len = size - done ;
+
+		}
+
+		// A compressed cluster is copied from up to its end in one go
+		if (clusters && cluster_compressed(node, blk / CLUSTER_BLOCKS)) {
+
+			const char * data = cluster_get(node, blk / CLUSTER_BLOCKS) ;
+			if (data == NULL) {
+
+				free(b) ;
+				return done > 0 ? (int)done : -EIO ;
+
+			}
+
+			off = (offset + done) % CLUSTER_SIZE ;
+			len = CLUSTER_SIZE - off < size - done ? CLUSTER_SIZE - off : size - done ;
+			memcpy(buffer + done, data + off, len) ;
+			done += len ;
+			continue ;
+
+		}
+
+		int blkno = bmap(node, blk, BMAP_LOOKUP) ;
+		int ret = 0 ;
+
+		// Step 2: copy the correct amount of data from offset to buffer
+		if (blkno <= 0) { // Hole
+
+			memset(buffer + done, 0, len) ;
+
+		} else if (len == BLOCK_SIZE) { // Whole block, no need to stage it
+
+			ret = blk_read(blkno, buffer + done) ;
+
+		} else {
+
+			ret = blk_read(blkno, b) ;
+			memcpy(buffer + done, b + off, len) ;
+
+		}
+
+		if (blkno < 0 || ret < 0) {
+
+			free(b) ;
+			return done > 0 ? (int)done : -EIO ;
+
+		}
+
+		done += len ;
+
+	}
+
+	free(b) ;
+
+	// Note: this function should return the amount of bytes you copied to buffer
+	return done ;
+}
+
+/*
+ * Write through the block layer, one block at a time
+ */
+static int write_blocks(struct inode *node, const char *buffer, size_t size, off_t offset) {
+
+	int bytesWritten = 0 ;
+
+	// Step 1: Based on size and offset, read its data blocks from disk
+	char * b = (char *)malloc(BLOCK_SIZE) ;
+	int err = 0 ;
+	while (bytesWritten < size) {
+
+		int blk = (offset + bytesWritten) / BLOCK_SIZE ;
+		int off = (offset + bytesWritten) % BLOCK_SIZE ;
+		int len = BLOCK_SIZE - off ;
+		if (len > size - bytesWritten) {
+
+			len = size - bytesWritten ;
+
+		}
+
+		// Step 2: Write the correct amount of data from offset to disk
+		if (tfs_opts.dedup) { // Always a whole block, partial ones merged with what is there
+
+			const char * data = buffer + bytesWritten ;
+			if (len < BLOCK_SIZE) {
+
+				int blkno = bmap(node, blk, BMAP_LOOKUP) ;
+				if (blkno > 0 && blk_read(blkno, b) < 0) {
+
+					err = -EIO ;
+					break ;
+
+				} else if (blkno <= 0) {
+
+					memset(b, 0, BLOCK_SIZE) ;
+
+				}
+				memcpy(b + off, data, len) ;
+				data = b ;
+
+			}
+
+			int ret = dedup_write(node, blk, data) ;
+			if (ret < 0) {
+
+				err = ret ;
+				break ;
+
+			}
+
+		} else if (len == BLOCK_SIZE) { // Whole block, straight from the caller's buffer
+
+			int blkno = bmap(node, blk, BMAP_FILL) ;
+			if (blkno < 0) {
+
+				err = blkno ;
+				break ;
+
+			}
+
+			blk_write(blkno, buffer + bytesWritten) ;
+
+		} else {
+
+			int blkno = bmap(node, blk, BMAP_ALLOC) ;
+			if (blkno < 0) {
+
+				err = blkno ;
+				break ;
+
+			}
+
+			if (blk_read(blkno, b) < 0) {
+
+				err = -EIO ;
+				break ;
+
+			}
+			memcpy(b + off, buffer + bytesWritten, len) ;
+			blk_write(blkno, b) ;
+
+		}
+
+		bytesWritten += len ;
+
+	}
+	free(b) ;
+
+	if (bytesWritten == 0 && err < 0) {
+
+		return err ;
+
+	}
+
+	return bytesWritten ;
+}
+
+/*
+ * Write to a file that is being compressed, or has compressed clusters in the way, cluster by cluster
+ */
+static int cluster_write(struct inode *node, const char *buffer, size_t size, off_t offset) {
+
+	off_t end = offset + size > node->size ? offset + size : node->size ;
+	char * image = NULL ;
+	size_t done = 0 ;
+	int ret = 0 ;
+
+	while (done < size) {
+
+		off_t pos = offset + done ;
+		int c = pos / CLUSTER_SIZE ;
+		off_t start = (off_t)c * CLUSTER_SIZE ;
+		size_t len = start + CLUSTER_SIZE - pos ;
+		if (len > size - done) {
+
+			len = size - done ;
+
+		}
+
+		int compressed = cluster_compressed(node, c) ;
+		int full = start + CLUSTER_SIZE <= end ;
+
+		// Step 1: Plain clusters stay plain until they are full
+		if (!compressed && !(tfs_opts.compress && full)) {
+
+			ret = write_blocks(node, buffer + done, len, pos) ;
+			if (ret > 0) {
+
+				done += ret ;
+
+			}
+			if (ret < (int)len) {
+
+				break ;
+
+			}
+			continue ;
+
+		}
+
+		// Step 2: Otherwise put the whole cluster together and try to compress it
+		if (image == NULL) {
+
+			image = (char *)malloc(CLUSTER_SIZE) ;
+
+		}
+		ret = len < CLUSTER_SIZE ? cluster_read(node, c, image) : 0 ;
+		if (ret == 0) {
+
+			memcpy(image + (pos - start), buffer + done, len) ;
+			ret = tfs_opts.compress && full ? cluster_store(node, c, image) : 1 ;
+
+		}
+
+		// Step 3: What doesn't compress (or isn't to be) is written as plain blocks
+		if (ret == 1 && compressed) {
+
+			static const int holes[CLUSTER_BLOCKS] ;
+			size_t n = end - start < CLUSTER_SIZE ? end - start : CLUSTER_SIZE ;
+			ret = cluster_set(node, c, holes) ;
+			if (ret == 0) {
+
+				ret = write_blocks(node, image, n, start) ;
+				ret = ret == (int)n ? 0 : (ret < 0 ? ret : -ENOSPC) ;
+
+			}
+
+		} else if (ret == 1) {
+
+			ret = write_blocks(node, buffer + done, len, pos) ;
+			ret = ret == (int)len ? 0 : (ret < 0 ? ret : -ENOSPC) ;
+
+		}
+		if (ret < 0) {
+
+			break ;
+
+		}
+		done += len ;
+
+	}
+	free(image) ;
+
+	return done > 0 ? (int)done : ret ;
+}
+
+static int write_file(struct inode *node, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	int bytesWritten = 0 ;
+	if (read_only()) {
+
+		return -EROFS ;
+
+	}
+
+	// Deduplicated and compressed writes have to look at every block, they never bypass the block layer
+	if (!tfs_opts.dedup && !tfs_opts.compress && use_direct_io(fi, size, offset) && !range_compressed(node, offset, size)) {
+
+		bytesWritten = direct_rw(node, (char *)buffer, size, offset, 1) ;
+
+	} else if (tfs_opts.compress || range_compressed(node, offset, size)) {
+
+		bytesWritten = cluster_write(node, buffer, size, offset) ;
+
+	} else {
+
+		bytesWritten = write_blocks(node, buffer, size, offset) ;
+
+	}
+
+	// Update the inode info and write it to disk
+	if (bytesWritten > 0) {
+
+		if (offset + bytesWritten > node->size) {
+
+			node->size = offset + bytesWritten ;
+			node->vstat.st_size = node->size ;
+
+		}
+		time(&node->vstat.st_mtime) ;
+
+	}
+	writei(node->ino, node) ;
+
+	// Ran out of room with orphans around: the wrapper frees them and the whole write is done again
+	if (bytesWritten >= 0 && bytesWritten < (int)size && my_nospace && !my_retrying) {
+
+		return -my_nospace ;
+
+	}
+
+	// Note: this function should return the amount of bytes you write to disk
+	return bytesWritten;
+}
+
+/*
+ * Append len bytes at diskfile position pos to v, or a zero-filled hole if pos < 0
+ * Pieces that are contiguous on disk are merged so FUSE can move them in one go
+ */
+static void bufvec_add(struct fuse_bufvec *v, off_t pos, size_t len) {
+
+	struct fuse_buf * last = v->count > 0 ? &v->buf[v->count - 1] : NULL ;
+
+	if (pos >= 0) {
+
+		if (last != NULL && (last->flags & FUSE_BUF_IS_FD) && last->pos + last->size == pos) {
+
+			last->size += len ;
+			return ;
+
+		}
+
+		struct fuse_buf * b = &v->buf[v->count++] ;
+		b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK ;
+		b->fd = diskfile_fd ;
+		b->pos = pos ;
+		b->size = len ;
+		b->mem = NULL ;
+
+	} else {
+
+		if (last != NULL && !(last->flags & FUSE_BUF_IS_FD)) {
+
+			last->mem = realloc(last->mem, last->size + len) ;
+			memset((char *)last->mem + last->size, 0, len) ;
+			last->size += len ;
+			return ;
+
+		}
+
+		struct fuse_buf * b = &v->buf[v->count++] ;
+		b->flags = 0 ;
+		b->fd = -1 ;
+		b->mem = calloc(1, len) ;
+		b->size = len ;
+
+	}
+
+}
+
+/*
+ * Room for one piece per block touched by [offset, offset + size)
+ */
+static struct fuse_bufvec *alloc_bufvec(size_t size, off_t offset) {
+
+	size_t pieces = (offset % BLOCK_SIZE + size + BLOCK_SIZE - 1) / BLOCK_SIZE + 1 ;
+	struct fuse_bufvec * v = (struct fuse_bufvec *)calloc(1, sizeof(struct fuse_bufvec) + pieces * sizeof(struct fuse_buf)) ;
+	v->count = 0 ;
+	return v ;
+}
+
+static void free_bufvec(struct fuse_bufvec *v) {
+
+	size_t i ;
+	for (i = 0 ; i < v->count ; i++) {
+
+		free(v->buf[i].mem) ;
+
+	}
+	free(v) ;
+
+}
+
+/*
+ * The ranges handed out stay valid only while fs_lock is held, after that the defragmenter or the
+ * reclaimer may give the blocks to someone else. Only a caller that replies before dropping it may
+ * ask to splice, the high-level API replies after the wrapper is done and gets a copy.
+ */
+static int read_file_buf(struct inode *node, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi, int splice) {
+
+	// Direct opens need an aligned buffer for O_DIRECT, and without our own diskfile handle there is nothing
+	// to splice from. Compressed clusters have nothing on disk that could be spliced either, and
+	// checksums have to be checked before the data goes anywhere.
+	if (!splice || diskfile_fd < 0 || csums != NULL || use_direct_io(fi, size, offset) || range_compressed(node, offset, size)) {
+
+		struct fuse_bufvec * v = alloc_bufvec(size, offset) ;
+		if (posix_memalign(&v->buf[0].mem, BLOCK_SIZE, size > 0 ? size : 1) != 0) {
+
+			free(v) ;
+			return -ENOMEM ;
+
+		}
+
+		v->count = 1 ;
+		int ret = read_file(node, v->buf[0].mem, size, offset, fi) ;
+		if (ret < 0) {
+
+			free_bufvec(v) ;
+			return ret ;
+
+		}
+
+		v->buf[0].size = ret ;
+		*bufp = v ;
+		return 0 ;
+
+	}
+
+	if (offset >= node->size) {
+
+		size = 0 ;
+
+	} else if (offset + size > node->size) {
+
+		size = node->size - offset ;
+
+	}
+
+	// Step 1: Describe each block as a range of the diskfile instead of copying it
+	struct fuse_bufvec * v = alloc_bufvec(size, offset) ;
+	size_t done = 0 ;
+	while (done < size) {
+
+		int blk = (offset + done) / BLOCK_SIZE ;
+		int off = (offset + done) % BLOCK_SIZE ;
+		size_t len = BLOCK_SIZE - off ;
+		if (len > size - done) {
+
+			len = size - done ;
+
+		}
+
+		int blkno = bmap(node, blk, BMAP_LOOKUP) ;
+		if (blkno > 0) {
+
+			cache_sync(blkno, 1, 0) ;
+			stats_io(0, 1) ;
+			trace_io(TFS_TRACE_READ, blkno, 1) ;
+
+		}
+		bufvec_add(v, blkno > 0 ? (off_t)blkno * BLOCK_SIZE + off : -1, len) ;
+		done += len ;
+
+	}
+
+	*bufp = v ;
+	return 0 ;
+}
+
+static int write_file_buf(struct inode *node, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+
+	size_t size = fuse_buf_size(buf) ;
+	if (read_only()) {
+
+		return -EROFS ;
+
+	}
+
+	// Direct opens need an aligned buffer for O_DIRECT, and without our own diskfile handle there is nothing
+	// to splice into. Deduplication, compression and checksums have to see the data before it goes anywhere.
+	if (diskfile_fd < 0 || tfs_opts.dedup || tfs_opts.compress || csums != NULL || use_direct_io(fi, size, offset)
+		|| range_compressed(node, offset, size)) {
+
+		char * mem ;
+		if (posix_memalign((void **)&mem, BLOCK_SIZE, size > 0 ? size : 1) != 0) {
+
+			return -ENOMEM ;
+
+		}
+
+		struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size) ;
+		tmp.buf[0].mem = mem ;
+		ssize_t n = fuse_buf_copy(&tmp, buf, 0) ;
+		int ret = n < 0 ? (int)n : write_file(node, mem, n, offset, fi) ;
+		free(mem) ;
+		return ret ;
+
+	}
+
+	// Step 1: Allocate every block up front and describe them as ranges of the diskfile
+	struct fuse_bufvec * v = alloc_bufvec(size, offset) ;
+	size_t mapped = 0 ;
+	int err = 0 ;
+	while (mapped < size) {
+
+		int blk = (offset + mapped) / BLOCK_SIZE ;
+		int off = (offset + mapped) % BLOCK_SIZE ;
+		size_t len = BLOCK_SIZE - off ;
+		if (len > size - mapped) {
+
+			len = size - mapped ;
+
+		}
+
+		int blkno = bmap(node, blk, len == BLOCK_SIZE ? BMAP_FILL : BMAP_ALLOC) ;
+		if (blkno < 0) {
+
+			err = blkno ;
+			break ;
+
+		}
+
+		cache_sync(blkno, 1, 1) ; // Also writes back the zeroes of a newly allocated partial block
+		stats_io(1, 1) ;
+		trace_io(TFS_TRACE_WRITE, blkno, 1) ;
+		bufvec_add(v, (off_t)blkno * BLOCK_SIZE + off, len) ;
+		mapped += len ;
+
+	}
+
+	// Nothing has been taken from buf yet, the wrapper can free the orphans and start over
+	if (err < 0 && my_nospace && !my_retrying) {
+
+		free(v) ;
+		writei(node->ino, node) ;
+		return -my_nospace ;
+
+	}
+
+	// Step 2: Let FUSE move the data, splicing straight from the request pipe when it can
+	ssize_t n = 0 ;
+	if (mapped > 0) {
+
+		n = fuse_buf_copy(v, buf, FUSE_BUF_SPLICE_NONBLOCK) ;
+
+	}
+	free(v) ;
+
+	// Step 3: Update the inode info and write it to disk
+	if (n > 0) {
+
+		if (offset + n > node->size) {
+
+			node->size = offset + n ;
+			node->vstat.st_size = node->size ;
+
+		}
+		time(&node->vstat.st_mtime) ;
+
+	}
+	writei(node->ino, node) ;
+
+	if (n == 0 && err < 0) {
+
+		return err ;
+
+	}
+
+	return n ;
+}
+
+
+/*
+ * Let dst's block didx be src's block sidx, 1 if it can't take another owner and has to be copied
+ */
+static int clone_block(struct inode *src, int sidx, struct inode *dst, int didx) {
+
+	int s = bmap(src, sidx, BMAP_LOOKUP) ;
+	int d = bmap(dst, didx, BMAP_LOOKUP) ;
+	if (s < 0 || d < 0) {
+
+		return s < 0 ? s : d ;
+
+	}
+	if (s == d) {
+
+		return 0 ;
+
+	}
+
+	if (s != 0 && share(s) != 0) {
+
+		return 1 ;
+
+	}
+
+	int ret = bmap_set(dst, didx, s) ;
+	if (ret != 0) {
+
+		put_block(s, 0) ; // back to the owners it had
+
+	}
+	ref_flush() ;
+
+	return ret ;
+}
+
+/*
+ * Let dst's indirect block dblk be src's indirect block sblk, with every block it points at
+ */
+static int clone_indirect(struct inode *src, int sblk, struct inode *dst, int dblk) {
+
+	int s = src->indirect_ptr[sblk] ;
+	int d = dst->indirect_ptr[dblk] ;
+	int * ptrs = (int *)calloc(1, BLOCK_SIZE) ;
+	int j, blocks = 0 ;
+	if (s == d) {
+
+		free(ptrs) ;
+		return 0 ;
+
+	}
+	if (s != 0 && share(s) != 0) {
+
+		free(ptrs) ;
+		return 1 ;
+
+	}
+	if (cow_itable(dst->ino) != 0) {
+
+		put_block(s, 0) ;
+		ref_flush() ;
+		free(ptrs) ;
+		return -ENOSPC ;
+
+	}
+
+	// The block counts move along with the pointers
+	if (s != 0) {
+
+		blk_read(s, ptrs) ;
+		for (j = 0 ; j < (BLOCK_SIZE / sizeof(int)) ; j++) {
+
+			blocks += ptrs[j] > 0 ;
+
+		}
+
+	}
+	if (d != 0) {
+
+		blk_read(d, ptrs) ;
+		for (j = 0 ; j < (BLOCK_SIZE / sizeof(int)) ; j++) {
+
+			blocks -= ptrs[j] > 0 ;
+
+		}
+		put_block(d, 1) ;
+		blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+
+	}
+	ref_flush() ;
+	free(ptrs) ;
+
+	dst->indirect_ptr[dblk] = s ;
+	dst->vstat.st_blocks += blocks ;
+	return 0 ;
+}
+
+/*
+ * Let dst's cluster cd be src's cluster cs, compressed or not, 1 if a block of it can't take another owner
+ */
+static int clone_cluster(struct inode *src, int cs, struct inode *dst, int cd) {
+
+	int ptrs[CLUSTER_BLOCKS] ;
+	int j, ret ;
+	cluster_ptrs(src, cs, ptrs) ;
+
+	for (j = 0 ; j < CLUSTER_BLOCKS ; j++) {
+
+		if (ptrs[j] > 0 && share(ptrs[j]) != 0) {
+
+			while (--j >= 0) {
+
+				put_block(ptrs[j], 0) ;
+
+			}
+			ref_flush() ;
+			return 1 ;
+
+		}
+
+	}
+
+	ret = cluster_set(dst, cd, ptrs) ;
+	if (ret != 0) {
+
+		for (j = 0 ; j < CLUSTER_BLOCKS ; j++) {
+
+			put_block(ptrs[j], 0) ;
+
+		}
+		ref_flush() ;
+
+	}
+
+	return ret ;
+}
+
+/*
+ * copy_file_range() within the filesystem: whole blocks at the same offset into a block on both
+ * sides are shared with the source, either side copies them once it writes them again (reflink).
+ * The rest is copied through the block cache COPY_CHUNK bytes at a time. Returns the bytes copied.
+ * src and dst must be the same struct inode if they are the same file.
+ */
+#define COPY_CHUNK (64 * BLOCK_SIZE)
+
+static int copy_range(struct inode *src, off_t off_in, struct inode *dst, off_t off_out, size_t len) {
+
+	if (read_only()) {
+
+		return -EROFS ;
+
+	}
+	if (src->type == 1 || dst->type == 1) {
+
+		return -EISDIR ;
+
+	}
+	if (src->type == TFS_SYMLINK || dst->type == TFS_SYMLINK) {
+
+		return -EINVAL ;
+
+	}
+
+	// Step 1: Nothing before the start of either file or past the end of the source, and no overlap within one file
+	if (off_in < 0 || off_out < 0) {
+
+		return -EINVAL ;
+
+	}
+	if (off_in >= src->size) {
+
+		return 0 ;
+
+	}
+	if (len > src->size - off_in) {
+
+		len = src->size - off_in ;
+
+	}
+	if (src == dst && off_in < off_out + len && off_out < off_in + len) {
+
+		return -EINVAL ;
+
+	}
+	int ret = quota_allow(dst, (len + BLOCK_SIZE - 1) / BLOCK_SIZE, 0) ; // as if none of it were there yet
+	if (ret < 0) {
+
+		return ret ;
+
+	}
+
+	// Step 2: Blocks can only be shared if they line up, and once there are reference counts
+	int aligned = off_in % BLOCK_SIZE == off_out % BLOCK_SIZE && ref_init() == 0 ;
+	char * buf = NULL ;
+	size_t done = 0 ;
+	int err = 0 ;
+
+	while (done < len) {
+
+		off_t in = off_in + done ;
+		off_t out = off_out + done ;
+		size_t n = len - done ;
+		int sidx = in / BLOCK_SIZE - 16 ;
+		int didx = out / BLOCK_SIZE - 16 ;
+		int per = BLOCK_SIZE / sizeof(int) ;
+
+		// All of an indirect block at the same place on both sides, share the indirect block itself
+		if (aligned && in % BLOCK_SIZE == 0 && sidx >= 0 && didx >= 0 && sidx % per == 0 && didx % per == 0
+			&& sidx / per < 8 && didx / per < 8
+			&& (n >= (size_t)per * BLOCK_SIZE || (in + n == src->size && out + n >= dst->size))) {
+
+			n = n < (size_t)per * BLOCK_SIZE ? n : (size_t)per * BLOCK_SIZE ;
+			err = clone_indirect(src, sidx / per, dst, didx / per) ;
+			if (err < 0) {
+
+				break ;
+
+			}
+			if (err == 0) {
+
+				done += n ;
+				continue ;
+
+			}
+
+		}
+
+		// A compressed cluster on either side only goes as a whole, or by copying what is in it
+		int compressed = range_compressed(src, in, 1) || range_compressed(dst, out, 1) ;
+		if (compressed && aligned && in % CLUSTER_SIZE == 0 && out % CLUSTER_SIZE == 0 && n >= CLUSTER_SIZE) {
+
+			n = CLUSTER_SIZE ;
+			err = clone_cluster(src, in / CLUSTER_SIZE, dst, out / CLUSTER_SIZE) ;
+			if (err < 0) {
+
+				break ;
+
+			}
+			if (err == 0) {
+
+				done += n ;
+				continue ;
+
+			}
+
+		}
+
+		// A whole block, or the source's last one if nothing of the destination follows it
+		if (aligned && !compressed && in % BLOCK_SIZE == 0 && (n >= BLOCK_SIZE || (in + n == src->size && out + n >= dst->size))) {
+
+			n = n < BLOCK_SIZE ? n : BLOCK_SIZE ;
+			err = clone_block(src, in / BLOCK_SIZE, dst, out / BLOCK_SIZE) ;
+			if (err < 0) {
+
+				break ;
+
+			}
+			if (err == 0) {
+
+				done += n ;
+				continue ;
+
+			}
+
+		}
+
+		// Step 3: Copy the rest, up to where sharing can start again
+		if (buf == NULL) {
+
+			buf = (char *)malloc(COPY_CHUNK) ;
+
+		}
+		if (n > COPY_CHUNK) {
+
+			n = COPY_CHUNK ;
+
+		}
+		if (aligned && in % BLOCK_SIZE != 0 && n > BLOCK_SIZE - in % BLOCK_SIZE) {
+
+			n = BLOCK_SIZE - in % BLOCK_SIZE ;
+
+		}
+		if (aligned && compressed) { // Sharing may start again after the cluster(s)
+
+			size_t left = CLUSTER_SIZE - (in % CLUSTER_SIZE > out % CLUSTER_SIZE ? in % CLUSTER_SIZE : out % CLUSTER_SIZE) ;
+			n = n < left ? n : left ;
+
+		}
+
+		int r = read_file(src, buf, n, in, NULL) ;
+		if (r > 0) {
+
+			r = write_file(dst, buf, r, out, NULL) ;
+
+		}
+		if (r <= 0) {
+
+			err = r ;
+			break ;
+
+		}
+		done += r ;
+
+	}
+	free(buf) ;
+
+	// Step 4: The destination grows to take what was shared
+	if (done > 0) {
+
+		if (off_out + done > dst->size) {
+
+			dst->size = off_out + done ;
+			dst->vstat.st_size = dst->size ;
+
+		}
+		time(&dst->vstat.st_mtime) ;
+		writei(dst->ino, dst) ;
+
+	}
+
+	return done > 0 ? (int)done : err ;
+}
+
+
+/*
+ * Online defragmentation, started through /.tfs_ctl
+ * A thread of its own walks the inode table for files whose blocks are not in one run, takes
+ * a free run for all of them and moves them there DEFRAG_BATCH blocks at a time. Every FUSE
+ * operation holds fs_lock for reading, the defragmenter takes it for writing for one batch and
+ * sleeps in between to stay under -o defrag_rate. A batch is written to the run and made durable
+ * before the file points at it, and the old blocks are only freed after that, so a crash leaves
+ * either copy in the file (and at worst the run's unused blocks allocated until tfs_fsck -r).
+ * Blocks shared with a snapshot, a clone or through dedup stay where they are, compressed files
+ * are left alone.
+ */
+#define DEFRAG_BATCH 64
+
+static pthread_t defrag_thread ;
+static int defrag_joinable = 0 ; // defrag_thread has to be joined before the next pass
+static int defrag_stop = 0 ; // asks the running pass to finish after its batch
+
+/*
+ * The data block pointers of a file in logical order, 0 for holes, malloc'ed. n is set to their number.
+ */
+static int *file_map(struct inode *node, int *n) {
+
+	int per = BLOCK_SIZE / sizeof(int) ;
+	int count = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE ;
+	int blk ;
+	count = count < 16 + 8 * per ? count : 16 + 8 * per ;
+
+	int * map = (int *)calloc(count > 0 ? count : 1, sizeof(int)) ;
+	memcpy(map, node->direct_ptr, (count < 16 ? count : 16) * sizeof(int)) ;
+	for (blk = 0 ; blk < 8 && 16 + blk * per < count ; blk++) {
+
+		int first = 16 + blk * per ;
+		if (node->indirect_ptr[blk] != 0) {
+
+			int * ptrs = (int *)malloc(BLOCK_SIZE) ;
+			blk_read(node->indirect_ptr[blk], ptrs) ;
+			memcpy(map + first, ptrs, (count - first < per ? count - first : per) * sizeof(int)) ;
+			free(ptrs) ;
+
+		}
+
+	}
+
+	*n = count ;
+	return map ;
+}
+
+/*
+ * Blocks in use and how many of them don't follow the one before. Negative pointers (compressed
+ * clusters) count as -1 blocks, the caller leaves such a file alone.
+ */
+static int map_breaks(const int *map, int n, int *used) {
+
+	int i, prev = 0, breaks = 0 ;
+	*used = 0 ;
+	for (i = 0 ; i < n ; i++) {
+
+		if (map[i] < 0) {
+
+			*used = -1 ;
+			return 0 ;
+
+		}
+		if (map[i] == 0) {
+
+			continue ;
+
+		}
+
+		breaks += prev != 0 && map[i] != prev + 1 ;
+		prev = map[i] ;
+		(*used)++ ;
+
+	}
+
+	return breaks ;
+}
+
+/*
+ * Fragmentation score of the live tree: of all the steps from one block of a file to its next,
+ * the percentage that isn't to the very next block on disk. 0 means every file is one run.
+ */
+static double defrag_score() {
+
+	struct inode node ;
+	uint64_t steps = 0, breaks = 0 ;
+	int ino ;
+	for (ino = 0 ; ino < MAX_INUM ; ino++) {
+
+		if (!get_bitmap(inoBitmap, ino) || readi(ino, &node) != 0 || !node.valid || node.type != 0 || node.vstat.st_nlink == 0) {
+
+			continue ;
+
+		}
+
+		int n, used ;
+		int * map = file_map(&node, &n) ;
+		int b = map_breaks(map, n, &used) ;
+		if (used > 1) {
+
+			steps += used - 1 ;
+			breaks += b ;
+
+		}
+		free(map) ;
+
+	}
+
+	return steps > 0 ? 100.0 * breaks / steps : 0.0 ;
+}
+
+/*
+ * Write the blocks in buf to blknos, which go up: one pwrite() per run of them, like direct_rw()
+ */
+static int defrag_write(const int *blknos, char *buf, int n) {
+
+	int i = 0, j ;
+	while (i < n) {
+
+		int run = 1 ;
+		while (i + run < n && blknos[i + run] == blknos[i] + run) {
+
+			run++ ;
+
+		}
+
+		if (diskfile_fd < 0) {
+
+			for (j = 0 ; j < run ; j++) {
+
+				blk_write(blknos[i + j], buf + (i + j) * BLOCK_SIZE) ;
+
+			}
+
+		} else {
+
+			cache_sync(blknos[i], run, 1) ;
+			if (pwrite(diskfile_fd, buf + i * BLOCK_SIZE, run * BLOCK_SIZE, (off_t)blknos[i] * BLOCK_SIZE) != run * BLOCK_SIZE) {
+
+				return -EIO ;
+
+			}
+			for (j = 0 ; j < run && csums != NULL ; j++) {
+
+				csum_seal(blknos[i] + j, buf + (i + j) * BLOCK_SIZE) ;
+
+			}
+			stats_io(1, run) ;
+			trace_io(TFS_TRACE_WRITE, blknos[i], run) ;
+
+		}
+		i += run ;
+
+	}
+
+	// Before anything points at them
+	if (diskfile_fd >= 0 && fdatasync(diskfile_fd) != 0) {
+
+		return -errno ;
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Move the blocks with ordinals [from, from + DEFRAG_BATCH) among those ino uses to run + their
+ * ordinal, unless that slot is taken already. Called with fs_lock held for writing, returns the
+ * blocks moved, 0 once there is nothing left to move or the file is gone.
+ */
+static int defrag_batch(uint16_t ino, int run, int used, char *taken, int from) {
+
+	struct inode node ;
+	int idx[DEFRAG_BATCH], old[DEFRAG_BATCH], new[DEFRAG_BATCH] ;
+	int per = BLOCK_SIZE / sizeof(int) ;
+	int n, b = 0, i, o = 0, ret = 0 ;
+
+	// Step 1: The file as it is now, it may have changed since the last batch
+	if (!get_bitmap(inoBitmap, ino) || readi(ino, &node) != 0 || !node.valid || node.type != 0 || node.vstat.st_nlink == 0) {
+
+		return 0 ;
+
+	}
+	int * map = file_map(&node, &n) ;
+	for (i = 0 ; i < n && b < DEFRAG_BATCH && o < from + DEFRAG_BATCH && o < used ; i++) {
+
+		if (map[i] < 0) {
+
+			b = 0 ; // compressed since
+			break ;
+
+		}
+		if (map[i] == 0) {
+
+			continue ;
+
+		}
+		if (o >= from && !taken[o] && (map[i] < run || map[i] >= run + used) && !shared(map[i])
+			&& (i < 16 || !shared(node.indirect_ptr[(i - 16) / per]))) {
+
+			idx[b] = i ;
+			old[b] = map[i] ;
+			new[b] = run + o ;
+			b++ ;
+
+		}
+		o++ ;
+
+	}
+	free(map) ;
+	if (my_csum_error) { // the map came from a block that failed its checksum
+
+		return -EIO ;
+
+	}
+	if (b == 0) {
+
+		return 0 ;
+
+	}
+	if (cow_itable(ino) != 0) { // now, so that writei() can't fail halfway through
+
+		return -ENOSPC ;
+
+	}
+
+	// Step 2: Copy the data into the run
+	char * buf = (char *)malloc(b * BLOCK_SIZE) ;
+	for (i = 0 ; i < b && ret == 0 ; i++) {
+
+		ret = blk_read(old[i], buf + i * BLOCK_SIZE) < 0 ? -EIO : 0 ;
+
+	}
+	if (ret == 0) {
+
+		ret = defrag_write(new, buf, b) ;
+
+	}
+	free(buf) ;
+	if (ret != 0) {
+
+		return ret ;
+
+	}
+
+	// Step 3: Point the file at the copies, an indirect block at a time. None of them is shared,
+	// they are written in place.
+	int * ptrs = (int *)malloc(BLOCK_SIZE) ;
+	int blk = -1 ;
+	for (i = 0 ; i <= b ; i++) {
+
+		int next = i < b && idx[i] >= 16 ? (idx[i] - 16) / per : -1 ;
+		if (blk >= 0 && next != blk) {
+
+			blk_write_meta(node.indirect_ptr[blk], ptrs) ;
+
+		}
+		if (i == b) {
+
+			break ;
+
+		}
+
+		if (next < 0) {
+
+			node.direct_ptr[idx[i]] = new[i] ;
+
+		} else {
+
+			if (next != blk) {
+
+				blk_read(node.indirect_ptr[next], ptrs) ;
+
+			}
+			ptrs[(idx[i] - 16) % per] = new[i] ;
+
+		}
+		blk = next ;
+
+	}
+	free(ptrs) ;
+	writei(ino, &node) ;
+
+	// Step 4: Only then give up the old blocks
+	for (i = 0 ; i < b ; i++) {
+
+		taken[new[i] - run] = 1 ;
+		put_block(old[i], 0) ;
+
+	}
+	ref_flush() ;
+	blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+	for (i = 0 ; i < b ; i++) {
+
+		cache_discard(old[i]) ;
+
+	}
+
+	return b ;
+}
+
+/*
+ * Sleep until moved blocks are no more than -o defrag_rate allows since start
+ */
+static void defrag_throttle(uint64_t start, uint64_t moved) {
+
+	if (tfs_opts.defrag_rate <= 0) {
+
+		return ;
+
+	}
+
+	uint64_t due = start + moved * 1000000000ULL / tfs_opts.defrag_rate ;
+	uint64_t now = now_ns() ;
+	if (due > now) {
+
+		struct timespec ts = { (due - now) / 1000000000ULL, (due - now) % 1000000000ULL } ;
+		nanosleep(&ts, NULL) ;
+
+	}
+
+}
+
+/*
+ * One file: a run for all of its blocks, then the blocks batch by batch. Returns the blocks moved.
+ */
+static uint64_t defrag_file(uint16_t ino, uint64_t start, uint64_t moved) {
+
+	struct inode node ;
+	int n, used = 0, breaks = 0, run = -1 ;
+
+	// Step 1: Is it worth it, and is there room
+	pthread_rwlock_wrlock(&fs_lock) ;
+	my_csum_error = 0 ;
+	if (get_bitmap(inoBitmap, ino) && readi(ino, &node) == 0 && node.valid && node.type == 0 && node.vstat.st_nlink > 0) {
+
+		int * map = file_map(&node, &n) ;
+		breaks = map_breaks(map, n, &used) ;
+		free(map) ;
+
+	}
+	if (breaks > 0) {
+
+		run = get_avail_run(group_goal(ino), used) ;
+		defrag_stats.skipped += run < 0 ;
+
+	}
+	pthread_rwlock_unlock(&fs_lock) ;
+	if (run < 0) {
+
+		return 0 ;
+
+	}
+
+	// Step 2: Move it, other operations get in between the batches
+	char * taken = (char *)calloc(used, 1) ;
+	uint64_t done = 0 ;
+	int from, i ;
+	for (from = 0 ; from < used && !__atomic_load_n(&defrag_stop, __ATOMIC_ACQUIRE) ; from += DEFRAG_BATCH) {
+
+		pthread_rwlock_wrlock(&fs_lock) ;
+		my_csum_error = 0 ;
+		int ret = defrag_batch(ino, run, used, taken, from) ;
+		pthread_rwlock_unlock(&fs_lock) ;
+		if (ret < 0) {
+
+			break ;
+
+		}
+		done += ret ;
+		defrag_throttle(start, moved + done) ;
+
+	}
+
+	// Step 3: Give back whatever of the run nothing was moved to
+	pthread_rwlock_wrlock(&fs_lock) ;
+	for (i = 0 ; i < used ; i++) {
+
+		if (!taken[i]) {
+
+			unset_bitmap(blknoBitmap, run + i - superblock->d_start_blk) ;
+
+		}
+
+	}
+	blk_write(superblock->d_bitmap_blk, blknoBitmap) ;
+	defrag_stats.files += done > 0 ;
+	defrag_stats.blocks += done ;
+	pthread_rwlock_unlock(&fs_lock) ;
+	free(taken) ;
+
+	return done ;
+}
+
+/*
+ * One pass over every file, scored before and after
+ */
+static void defrag_pass() {
+
+	uint64_t start = now_ns(), moved = 0 ;
+	int ino ;
+
+	pthread_rwlock_wrlock(&fs_lock) ;
+	defrag_stats.passes++ ;
+	defrag_stats.before = defrag_score() ;
+	pthread_rwlock_unlock(&fs_lock) ;
+
+	for (ino = 0 ; ino < MAX_INUM && !__atomic_load_n(&defrag_stop, __ATOMIC_ACQUIRE) ; ino++) {
+
+		moved += defrag_file(ino, start, moved) ;
+
+	}
+
+	pthread_rwlock_wrlock(&fs_lock) ;
+	defrag_stats.after = defrag_score() ;
+	pthread_rwlock_unlock(&fs_lock) ;
+
+}
+
+static void *defrag_main(void *arg) {
+
+	defrag_pass() ;
+	__atomic_store_n(&defrag_stats.running, 0, __ATOMIC_RELEASE) ;
+	return NULL ;
+}
+
+/*
+ * Start a pass in the background, called from an operation, with fs_lock held for reading
+ */
+static int defrag_start() {
+
+	if (__atomic_load_n(&defrag_stats.running, __ATOMIC_ACQUIRE)) {
+
+		return -EBUSY ;
+
+	}
+	if (defrag_joinable) {
+
+		pthread_join(defrag_thread, NULL) ; // finished already
+		defrag_joinable = 0 ;
+
+	}
+
+	defrag_stop = 0 ;
+	defrag_stats.running = 1 ;
+	if (pthread_create(&defrag_thread, NULL, defrag_main, NULL) != 0) {
+
+		defrag_stats.running = 0 ;
+		return -EAGAIN ;
+
+	}
+	defrag_joinable = 1 ;
+
+	return 0 ;
+}
+
+/*
+ * Stop the pass after its current batch, and with wait set (never from an operation) wait for it
+ */
+static void defrag_halt(int wait) {
+
+	__atomic_store_n(&defrag_stop, 1, __ATOMIC_RELEASE) ;
+	if (wait && defrag_joinable) {
+
+		pthread_join(defrag_thread, NULL) ;
+		defrag_joinable = 0 ;
+
+	}
+
+}
+
+
+/* 
+ * FUSE file operations
+ */
+static void *tfs_init(struct fuse_conn_info *conn) {
+
+	//printf("INIT CALLED\n") ;
+
+	cache_open() ; // Before anything is read or written, mkfs included
+
+	// Step 1a: If the device holds no filesystem yet (no disk file), call mkfs
+	if(device->open(diskfile_path) == -1) {
+
+		//printf("running mkfs\n") ;
+		tfs_mkfs() ;
+
+	} else {
+
+  // Step 1b: If disk file is found, just initialize in-memory data structures
   // and read superblock from disk
   superblock = (struct superblock *)malloc(BLOCK_SIZE) ;
-  bio_read(0, superblock) ;
+  blk_read(0, superblock) ;
   inoBitmap = (bitmap_t)malloc(BLOCK_SIZE) ;
-  bio_read(superblock->i_bitmap_blk, inoBitmap) ;
+  blk_read(superblock->i_bitmap_blk, inoBitmap) ;
   blknoBitmap = (bitmap_t)malloc(BLOCK_SIZE) ;
-  bio_read(superblock->d_bitmap_blk, blknoBitmap) ;
+  blk_read(superblock->d_bitmap_blk, blknoBitmap) ;
+	ext_load() ;
+	quota_load() ;
+
+	// A snapshot is served through its own inode table, main() made sure it exists
+	int k = read_only() ? snapshot_find(tfs_opts.snapshot) : -1 ;
+	if (k >= 0) {
+
+		itable_map = ext->snap[k].itable ;
+
+	}
+
+	}
+
+	// Step 2: Check every block from now on with -o checksum, or if it was ever mounted with it
+	csum_open() ;
+	my_csum_error = 0 ;
+
+	// Step 3: Open the diskfile again for direct I/O, O_DIRECT isn't supported everywhere (e.g. tmpfs).
+	// Other devices have no file, what would bypass blk_read()/blk_write() goes through them then.
+	if (device == &file_device) {
+
+		diskfile_fd = open(diskfile_path, O_RDWR) ;
+		direct_fd = open(diskfile_path, O_RDWR | O_DIRECT) ;
+
+	}
+
+	// Step 4: Ask for the request pipe to be spliced, write_buf and the low-level read hand out diskfile ranges
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE) ;
+
+	// Step 5: Let the kernel keep several reads in flight and send writes larger than a page
+	conn->async_read = 1 ;
+	conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES) ;
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+	if (tfs_opts.writeback_cache) {
+
+		conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE ;
+
+	}
+#endif
+
+	// Step 6: libfuse has already capped max_write at its request buffer and max_readahead at what
+	// the kernel offered (or at -o max_write/max_readahead), keep both whole blocks so big requests
+	// line up with direct_rw() runs
+	if (conn->max_write >= BLOCK_SIZE) {
+
+		conn->max_write -= conn->max_write % BLOCK_SIZE ;
+
+	}
+	if (conn->max_readahead >= BLOCK_SIZE) {
+
+		conn->max_readahead -= conn->max_readahead % BLOCK_SIZE ;
+
+	}
+
+	// Step 7: Listen for SIGUSR1 stats dumps, start recording block I/O, set up the dedup and xattr indexes
+	stats_start() ;
+	trace_open() ;
+	dedup_open() ;
+	xattr_open() ;
+
+	// Step 8: Free what was unlinked but not yet freed when the diskfile was last in use
+	reclaim_open() ;
+
+	return NULL;
+}
+
+static void tfs_destroy(void *userdata) {
+
+	defrag_halt(1) ;
+	reclaim_close() ;
+	trace_close() ;
+
+	// Step 1: Write back the checksums and the block cache, then de-allocate in-memory data structures
+	csum_flush() ;
+	cache_close() ;
+	free(csums) ;
+	csums = NULL ;
+	free(superblock) ;
+	superblock = NULL ;
+	free(shares) ;
+	shares = NULL ;
+	free(quotas) ;
+	quotas = NULL ;
+	memset(quota_written, 0, sizeof(quota_written)) ;
+	dedup_close() ;
+	free(inoBitmap) ;
+	free(blknoBitmap) ;
+
+	// Step 2: Close diskfile, -o ram_persist writes the volume back to it here
+	if (direct_fd >= 0) {
+
+		close(direct_fd) ;
+		direct_fd = -1 ;
+
+	}
+	if (diskfile_fd >= 0) {
+
+		close(diskfile_fd) ;
+		diskfile_fd = -1 ;
+
+	}
+	device->close() ;
+
+}
+
+/*
+ * Use dirname() and basename() to separate path into the inode of its parent directory and the target name
+ * The name is malloc'ed and must be freed by the caller
+ */
+static int split_path(const char *path, struct inode *parent, char **name) {
+
+	char * directoryPath = strdup(path) ;
+	char * baseName = strdup(path) ;
+
+	int found = get_node_by_path(dirname(directoryPath), 0, parent) ;
+	if (found != 0) {
+
+		free(directoryPath) ;
+		free(baseName) ;
+		return found ; // “No such file or directory.” unless the walk hit a bad block
+
+	}
+
+	*name = strdup(basename(baseName)) ;
+	free(directoryPath) ;
+	free(baseName) ;
+
+	return 0 ;
+}
+
+static void ctl_stat(struct stat *st) {
+
+	memset(st, 0, sizeof(*st)) ;
+	st->st_mode = S_IFREG | 0644 ;
+	st->st_nlink = 1 ;
+	st->st_blksize = BLOCK_SIZE ;
+	time(&st->st_mtime) ;
+
+}
+
+static int ctl_open(struct fuse_file_info *fi) {
+
+	fi->direct_io = 1 ;
+	return 0 ;
+}
+
+static int find_name(void *ctx, struct dirent *entry, off_t next) {
+
+	struct dirent * want = (struct dirent *)ctx ;
+	if (entry->ino == want->ino && strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0) {
+
+		*want = *entry ;
+		return 1 ;
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Path of directory ino, found by walking up through ".."
+ */
+static void dir_path(uint16_t ino, char *path, size_t size) {
+
+	char * rest = strdup("") ;
+	int depth = 0 ;
+	while (ino != 0 && depth++ < MAX_INUM) {
+
+		struct dirent up ;
+		struct inode parent ;
+		struct dirent entry ;
+		if (dir_find(ino, "..", 2, &up) != 0 || readi(up.ino, &parent) != 0) {
+
+			break ;
+
+		}
+
+		memset(&entry, 0, sizeof(entry)) ;
+		entry.ino = ino ;
+		dir_iterate(&parent, 0, find_name, &entry) ;
+
+		char * longer = (char *)malloc(strlen(entry.name) + strlen(rest) + 2) ;
+		sprintf(longer, "/%s%s", entry.name, rest) ;
+		free(rest) ;
+		rest = longer ;
+		ino = up.ino ;
+
+	}
+
+	snprintf(path, size, "%s", rest[0] != '\0' ? rest : "/") ;
+	free(rest) ;
+
+}
+
+static int ctl_read(char *buffer, size_t size, off_t offset) {
+
+	char text[MAX_SNAPSHOTS * (SNAP_NAME_LEN + 32) + QUOTAS_PER_BLOCK * 320] ;
+	size_t len = 0 ;
+	int k ;
+	for (k = 0 ; k < MAX_SNAPSHOTS ; k++) {
+
+		if (ext->snap[k].name[0] != '\0') {
+
+			char when[32] ;
+			struct tm tm ;
+			time_t created = ext->snap[k].created ;
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&created, &tm)) ;
+			len += snprintf(text + len, sizeof(text) - len, "%s\t%s\n", ext->snap[k].name, when) ;
+
+		}
+
+	}
+
+	// quota <kind> <id or path> <blocks> <block limit> <inodes> <inode limit>
+	for (k = 0 ; quotas != NULL && k < QUOTAS_PER_BLOCK && len < sizeof(text) ; k++) {
+
+		struct tfs_quota q = quotas[k] ;
+		char id[256] ; // a longer path is cut short
+		if (q.kind == 0) {
+
+			continue ;
+
+		}
+		if (q.kind == QUOTA_DIR) {
+
+			dir_path(q.id, id, sizeof(id)) ;
+
+		} else {
+
+			snprintf(id, sizeof(id), "%u", q.id) ;
+
+		}
+		len += snprintf(text + len, sizeof(text) - len, "quota\t%s\t%s\t%u\t%u\t%u\t%u\n",
+			q.kind == QUOTA_USER ? "user" : q.kind == QUOTA_GROUP ? "group" : "tree", id, q.blocks, q.block_limit, q.inodes, q.inode_limit) ;
+
+	}
+	if (len > sizeof(text)) {
+
+		len = sizeof(text) ;
+
+	}
+
+	size_t n = 0 ;
+	if (offset < len) {
+
+		n = len - offset < size ? len - offset : size ;
+		memcpy(buffer, text + offset, n) ;
+
+	}
+
+	return n ;
+}
+
+/*
+ * The low-level session lets the kernel keep file data and names, tell it about what a command
+ * changed without going through it. The high-level API caches neither and has no channel.
+ */
+static void ctl_inval_inode(uint16_t ino, off_t offset, off_t len) {
+
+	if (ll_chan != NULL) {
+
+		fuse_lowlevel_notify_inval_inode(ll_chan, FUSE_INO(ino), offset, len) ;
+
+	}
+
+}
+
+static void ctl_inval_entry(uint16_t parent, const char *name) {
+
+	if (ll_chan != NULL) {
+
+		fuse_lowlevel_notify_inval_entry(ll_chan, FUSE_INO(parent), name, strlen(name)) ;
+
+	}
+
+}
+
+/*
+ * clone <src> <dst> [<src offset> <dst offset> <length>]
+ * Without a range dst is created as a copy of all of src, with one the range is copied into
+ * an existing dst like copy_file_range() does
+ */
+static int ctl_clone(int argc, char **argv) {
+
+	struct inode src, dst, parent ;
+	char * name ;
+	int found = get_node_by_path(argv[1], 0, &src) ;
+	if (found != 0) {
+
+		return found ;
+
+	}
+
+	if (argc == 3) {
+
+		int ret = split_path(argv[2], &parent, &name) ;
+		if (ret == 0) {
+
+			ret = make_node(parent.ino, name, 0, NULL, &dst) ;
+			if (ret == 0) {
+
+				ctl_inval_entry(parent.ino, name) ; // it may have been looked up as missing
+
+			}
+			free(name) ;
+
+		}
+		if (ret != 0) {
+
+			return ret ;
+
+		}
+
+		ret = copy_range(&src, 0, &dst, 0, src.size) ;
+		return ret < 0 ? ret : 0 ;
+
+	}
+
+	found = get_node_by_path(argv[2], 0, &dst) ;
+	if (found != 0) {
+
+		return found ;
+
+	}
+
+	long long off_in = strtoll(argv[3], NULL, 0), off_out = strtoll(argv[4], NULL, 0), len = strtoll(argv[5], NULL, 0) ;
+	if (off_in < 0 || off_out < 0 || len < 0) {
+
+		return -EINVAL ;
+
+	}
+
+	// Same file, both sides have to see each other's changes
+	struct inode * out = dst.ino == src.ino ? &src : &dst ;
+	int ret = copy_range(&src, off_in, out, off_out, len) ;
+	if (ret > 0) {
+
+		ctl_inval_inode(dst.ino, off_out, ret) ;
+
+	}
+	return ret < 0 ? ret : 0 ;
+}
+
+/*
+ * rmtree <path>
+ * One directory entry is removed, what was below it is unlinked and freed by the reclaimer
+ * without a path lookup per entry
+ */
+static int ctl_rmtree(const char *path) {
+
+	struct inode parent ;
+	char * name ;
+	int ret = split_path(path, &parent, &name) ;
+	if (ret != 0) {
+
+		return ret ;
+
+	}
+
+	ret = remove_node(parent.ino, name, REMOVE_TREE) ;
+	if (ret == 0) {
+
+		ctl_inval_entry(parent.ino, name) ;
+
+	}
+	free(name) ;
+	return ret ;
+}
+
+/*
+ * A free slot in the quota table, the first one takes a block for it. Called with quota_lock held.
+ */
+static struct tfs_quota *quota_slot() {
+
+	int i ;
+	if (quotas == NULL) {
+
+		int blkno = get_avail_blkno() ;
+		if (blkno < 0) {
+
+			return NULL ;
+
+		}
+
+		struct tfs_quota * table = (struct tfs_quota *)calloc(1, BLOCK_SIZE) ;
+		blk_write_meta(blkno, table) ;
+		ext->quota_blk = blkno ;
+		ext_write() ;
+		__atomic_store_n(&quotas, table, __ATOMIC_RELEASE) ;
+
+	}
+
+	for (i = 0 ; i < QUOTAS_PER_BLOCK ; i++) {
+
+		if (quotas[i].kind == 0) {
+
+			return &quotas[i] ;
+
+		}
+
+	}
+
+	return NULL ;
+}
+
+/*
+ * Move every inode of directory dir's tree from tag to retag, what is counted follows in writei().
+ * Directories tagged with anything else are trees of their own further down and are left alone.
+ */
+static void quota_retag(uint16_t dir, dev_t tag, dev_t retag) {
+
+	uint16_t * stack = (uint16_t *)malloc(MAX_INUM * sizeof(uint16_t)) ;
+	struct child_list * children = (struct child_list *)malloc(sizeof(struct child_list)) ;
+	int depth = 0, i ;
+	struct inode node ;
+
+	readi(dir, &node) ;
+	QUOTA_TREE(&node) = retag ;
+	writei(dir, &node) ;
+	stack[depth++] = dir ;
+
+	while (depth > 0) {
+
+		readi(stack[--depth], &node) ;
+		children->n = 0 ;
+		dir_iterate(&node, 0, collect_entry, children) ;
+
+		for (i = 0 ; i < children->n ; i++) {
+
+			struct inode child ;
+			if (readi(children->ino[i], &child) != 0 || !child.valid || QUOTA_TREE(&child) != tag) {
+
+				continue ;
+
+			}
+
+			QUOTA_TREE(&child) = retag ;
+			writei(child.ino, &child) ;
+			if (child.type == 1 && depth < MAX_INUM) {
+
+				stack[depth++] = child.ino ;
+
+			}
+
+		}
+
+	}
+
+	free(children) ;
+	free(stack) ;
+
+}
+
+/*
+ * quota user|group <id> <blocks> <inodes>
+ * quota tree <path> <blocks> <inodes>
+ * quota user|group|tree <id or path> off
+ * Limits of 0 only count. A new quota starts out with what is already there: a scan of the inode
+ * table for a user or group, a walk of the directory's tree for a tree, which is counted from then
+ * on in everything created below it.
+ */
+static int ctl_quota(int argc, char **argv) {
+
+	int kind = strcmp(argv[1], "user") == 0 ? QUOTA_USER : strcmp(argv[1], "group") == 0 ? QUOTA_GROUP
+		: strcmp(argv[1], "tree") == 0 ? QUOTA_DIR : 0 ;
+	int off = argc == 4 && strcmp(argv[3], "off") == 0 ;
+	struct inode dir ;
+	uint32_t id ;
+	int i, ret = 0 ;
+
+	if (kind == 0 || (argc == 4 && !off)) {
+
+		return -EINVAL ;
+
+	}
+	if (kind == QUOTA_DIR) {
+
+		int found = get_node_by_path(argv[2], 0, &dir) ;
+		if (found != 0) {
+
+			return found ;
+
+		}
+		if (dir.type != 1) {
+
+			return -ENOTDIR ;
+
+		}
+		id = dir.ino ;
+
+	} else {
+
+		id = strtoul(argv[2], NULL, 0) ;
+
+	}
+
+	pthread_mutex_lock(&quota_lock) ;
+	struct tfs_quota * q = quota_find(kind, id) ;
+
+	// Step 1: Off, a tree's inodes go back to the tree around it first
+	if (off) {
+
+		struct dirent up ;
+		struct inode parent ;
+
+		if (q == NULL) {
+
+			ret = -ENOENT ;
+
+		} else if (kind == QUOTA_DIR && dir.ino != 0 && (dir_find(dir.ino, "..", 2, &up) != 0 || readi(up.ino, &parent) != 0)) {
+
+			ret = -EIO ; // nowhere to give the tree back to, the quota stays
+
+		} else {
+
+			if (kind == QUOTA_DIR) {
+
+				quota_retag(dir.ino, QUOTA_TREE(&dir), dir.ino == 0 ? 0 : QUOTA_TREE(&parent)) ;
+
+			}
+			__atomic_store_n(&q->kind, 0, __ATOMIC_RELEASE) ;
+			memset(q, 0, sizeof(*q)) ;
+			blk_write_meta(ext->quota_blk, quotas) ;
+
+		}
+		pthread_mutex_unlock(&quota_lock) ;
+		return ret ;
+
+	}
+
+	// Step 2: New limits for a quota that is there already
+	if (q != NULL) {
+
+		q->block_limit = strtoul(argv[3], NULL, 0) ;
+		q->inode_limit = strtoul(argv[4], NULL, 0) ;
+		blk_write_meta(ext->quota_blk, quotas) ;
+		pthread_mutex_unlock(&quota_lock) ;
+		return 0 ;
+
+	}
+
+	// Step 3: A new one, counted from what is there
+	q = quota_slot() ;
+	if (q == NULL) {
+
+		pthread_mutex_unlock(&quota_lock) ;
+		return -ENOSPC ;
+
+	}
+	q->id = id ;
+	q->blocks = 0 ;
+	q->inodes = 0 ;
+	q->block_limit = strtoul(argv[3], NULL, 0) ;
+	q->inode_limit = strtoul(argv[4], NULL, 0) ;
+
+	if (kind == QUOTA_DIR) {
+
+		__atomic_store_n(&q->kind, kind, __ATOMIC_RELEASE) ;
+		quota_retag(dir.ino, QUOTA_TREE(&dir), (dev_t)dir.ino + 1) ;
+
+	} else {
+
+		for (i = 0 ; i < MAX_INUM ; i++) {
+
+			struct inode node ;
+			if (get_bitmap(inoBitmap, i) && readi(i, &node) == 0 && node.valid
+				&& (kind == QUOTA_USER ? node.vstat.st_uid : node.vstat.st_gid) == id) {
+
+				q->blocks += node.vstat.st_blocks ;
+				q->inodes++ ;
+
+			}
+
+		}
+		__atomic_store_n(&q->kind, kind, __ATOMIC_RELEASE) ;
+
+	}
+	blk_write_meta(ext->quota_blk, quotas) ;
+	pthread_mutex_unlock(&quota_lock) ;
+
+	return 0 ;
+}
+
+static int ctl_write(const char *buffer, size_t size) {
+
+	char * text = strndup(buffer, size) ;
+	char * save = NULL ;
+	char * line ;
+	int ret = 0 ;
+
+	for (line = strtok_r(text, "\n", &save) ; line != NULL && ret == 0 ; line = strtok_r(NULL, "\n", &save)) {
+
+		// Split into words, names can't have blanks in them here
+		char * argv[8] ;
+		char * word_save = NULL ;
+		int argc = 0 ;
+		char * word = strtok_r(line, " \t", &word_save) ;
+		while (word != NULL && argc < 8) {
+
+			argv[argc++] = word ;
+			word = strtok_r(NULL, " \t", &word_save) ;
+
+		}
+
+		if (argc == 2 && strcmp(argv[0], "snapshot") == 0) {
+
+			ret = snapshot_create(argv[1]) ;
+
+		} else if (argc == 2 && strcmp(argv[0], "delete") == 0) {
+
+			ret = snapshot_delete(argv[1]) ;
+
+		} else if ((argc == 3 || argc == 6) && strcmp(argv[0], "clone") == 0) {
+
+			ret = ctl_clone(argc, argv) ;
+
+		} else if (argc == 1 && strcmp(argv[0], "defrag") == 0) {
+
+			ret = defrag_start() ;
+
+		} else if (argc == 2 && strcmp(argv[0], "defrag") == 0 && strcmp(argv[1], "stop") == 0) {
+
+			defrag_halt(0) ;
+
+		} else if (argc == 2 && strcmp(argv[0], "rmtree") == 0) {
+
+			ret = ctl_rmtree(argv[1]) ;
+
+		} else if ((argc == 4 || argc == 5) && strcmp(argv[0], "quota") == 0) {
+
+			ret = ctl_quota(argc, argv) ;
+
+		} else {
+
+			ret = -EINVAL ;
+
+		}
+
+	}
+	free(text) ;
+
+	return ret < 0 ? ret : (int)size ;
+}
+
+static int ctl_write_buf(struct fuse_bufvec *buf) {
+
+	size_t size = fuse_buf_size(buf) ;
+	char * mem = (char *)malloc(size > 0 ? size : 1) ;
+	struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size) ;
+	tmp.buf[0].mem = mem ;
+	ssize_t n = fuse_buf_copy(&tmp, buf, 0) ;
+	int ret = n < 0 ? (int)n : ctl_write(mem, n) ;
+	free(mem) ;
+	return ret ;
+}
+
+static int tfs_getattr(const char *path, struct stat *stbuf) {
+
+	//printf("reached attr\n") ;
+	if (is_stats_path(path)) {
+
+		stats_stat(stbuf) ;
+		return 0 ;
+
+	}
+	if (is_ctl_path(path)) {
+
+		ctl_stat(stbuf) ;
+		return 0 ;
+
+	}
+
+	// Step 1: call get_node_by_path() to get inode from path
+	struct inode in ;
+	int found = get_node_by_path(path, 0, &in) ;
+	if (found != 0) {
+
+		return found ; // “No such file or directory.”
+
+	}
+
+	// Step 2: fill attribute of file into stbuf from inode
+	*stbuf = in.vstat ;
+
+	return 0;
+}
+
+static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode in ;
+	int found = get_node_by_path(path, 0, &in) ;
+	if (found == 0 && in.valid) {
+
+		return 0 ;
+
+	}
+
+	// Step 2: If not find, return -1
+
+    return found == -EIO ? found : -1;
+}
+
+struct readdir_ctx {
+
+	void * buffer ;
+	fuse_fill_dir_t filler ;
+
+} ;
+
+static int readdir_fill(void *ctx, struct dirent *entry, off_t next) {
+
+	struct readdir_ctx * r = (struct readdir_ctx *)ctx ;
+	struct inode k ;
+	readi(entry->ino, &k) ;
+
+	// Call the filler function with arguments of buf, the null-terminated filename and the address of your struct stat
+	return r->filler(r->buffer, entry->name, &k.vstat, 0) ;
+}
+
+static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode in ;
+	int found = get_node_by_path(path, 0, &in) ;
+	if (found != 0) {
+
+		return found ; // “No such file or directory.”
+
+	} 
+	
+	// Step 2: Read directory entries from its data blocks, and copy them to filler
+	struct readdir_ctx r = { buffer, filler } ;
+	dir_iterate(&in, 0, readdir_fill, &r) ;
+
+	return 0;
+}
+
+
+static int tfs_mkdir(const char *path, mode_t mode) {
+
+	//printf("MKDIR CALLED\n") ;
+
+	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+	struct inode parent, node ;
+	char * baseName ;
+	int ret = split_path(path, &parent, &baseName) ;
+	if (ret != 0) {
+
+		return ret ;
+
+	}
+
+	// Step 3: Call make_node() to allocate, link and write the new directory
+	ret = make_node(parent.ino, baseName, 1, NULL, &node) ;
+	free(baseName) ;
+
+	//printf("MKDIR FINISHED\n") ;
+
+	return ret;
+}
+
+static int tfs_rmdir(const char *path) {
+
+	//printf("RMDIR CALLED\n") ;
+
+	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+	struct inode parent ;
+	char * baseName ;
+	int ret = split_path(path, &parent, &baseName) ;
+	if (ret != 0) {
+
+		return ret ;
+
+	}
+
+	// Step 3: Call remove_node() to free the directory and remove its entry
+	ret = remove_node(parent.ino, baseName, 1) ;
+	free(baseName) ;
+
+	return ret;
+}
+
+static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+    return 0;
+}
+
+static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+
+	//printf("PATH: %s\n", path) ;
+
+	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+	struct inode parent, node ;
+	char * baseName ;
+	int ret = split_path(path, &parent, &baseName) ;
+	if (ret != 0) {
+
+		return ret ;
+
+	}
+
+	// Step 3: Call make_node() to allocate, link and write the new file
+	ret = make_node(parent.ino, baseName, 0, NULL, &node) ;
+	free(baseName) ;
+
+	if (ret == 0) {
+
+		set_open_flags(fi, node.ino) ;
+
+	}
+
+	//printf("written\n") ;
+
+	return ret;
+}
+
+static int tfs_open(const char *path, struct fuse_file_info *fi) {
+
+	//printf("CALLED OPEN PATH = %s\n", path) ;
+	if (is_stats_path(path)) {
+
+		return stats_open(fi) ;
+
+	}
+	if (is_ctl_path(path)) {
+
+		return ctl_open(fi) ;
+
+	}
+	if (read_only() && (fi->flags & O_ACCMODE) != O_RDONLY) {
+
+		return -EROFS ;
+
+	}
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	struct inode in ;
+	int found = get_node_by_path(path, 0, &in) ;
+	if (found == 0 && in.valid) {
+
+		set_open_flags(fi, in.ino) ;
+		return 0 ;
+
+	}
+
+	// Step 2: If not find, return -1
+
+    return found == -EIO ? found : -1;
+}
+
+static int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	//printf("READ CALLED\n") ;
+	if (is_stats_path(path)) {
+
+		return stats_read(buffer, size, offset) ;
+
+	}
+	if (is_ctl_path(path)) {
+
+		return ctl_read(buffer, size, offset) ;
+
+	}
+
+	// Step 1: You could call get_node_by_path() to get inode from path
+	struct inode node ;
+	int found = get_node_by_path(path, 0, &node) ;
+	if (found != 0) {
+
+		return found ; // “No such file or directory.”
+
+	}
+
+	// Step 2: Based on size and offset, read its data blocks from disk
+	return read_file(&node, buffer, size, offset, fi) ;
+}
+
+static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	//printf("WRITE CALLED path = %s\n", path) ;
+	if (is_ctl_path(path)) {
+
+		return ctl_write(buffer, size) ;
+
+	}
+
+	// Step 1: You could call get_node_by_path() to get inode from path
+	struct inode node ;
+	int found = get_node_by_path(path, 0, &node) ;
+	if (found != 0) {
+
+		//printf("Failed?\n") ;
+		return found ;
+
+	}
+
+	// Step 2: Based on size and offset, write its data blocks to disk
+	return write_file(&node, buffer, size, offset, fi) ;
+}
+
+static int tfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+
+	if (is_stats_path(path) || is_ctl_path(path)) {
+
+		struct fuse_bufvec * v = alloc_bufvec(size, offset) ;
+		v->buf[0].mem = malloc(size > 0 ? size : 1) ;
+		v->buf[0].size = is_ctl_path(path) ? ctl_read(v->buf[0].mem, size, offset) : stats_read(v->buf[0].mem, size, offset) ;
+		v->count = 1 ;
+		*bufp = v ;
+		return 0 ;
+
+	}
+
+	struct inode node ;
+	int found = get_node_by_path(path, 0, &node) ;
+	if (found != 0) {
+
+		return found ;
+
+	}
+
+	return read_file_buf(&node, bufp, size, offset, fi, 0) ;
+}
+
+static int tfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+
+	struct inode node ;
+	if (is_ctl_path(path)) {
+
+		return ctl_write_buf(buf) ;
+
+	}
+
+	int found = get_node_by_path(path, 0, &node) ;
+	if (found != 0) {
+
+		return found ;
+
+	}
+
+	return write_file_buf(&node, buf, offset, fi) ;
+}
+
+static int tfs_unlink(const char *path) {
+
+	//printf("UNLINK CALLED\n") ;
+
+	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
+	// Step 2: Call get_node_by_path() to get inode of parent directory
+	struct inode parent ;
+	char * baseName ;
+	int ret = split_path(path, &parent, &baseName) ;
+	if (ret != 0) {
+
+		return ret ;
+
+	}
+
+	// Step 3: Call remove_node() to free the file and remove its entry
+	ret = remove_node(parent.ino, baseName, 0) ;
+	free(baseName) ;
+
+	//printf("UNLINK FINISHED\n") ;
+
+	return ret;
+}
+
+static int tfs_rename(const char *from, const char *to) {
+
+	// Step 1: Use dirname() and basename() to separate both paths into parent directory and name
+	struct inode from_parent, to_parent ;
+	char * fromName ;
+	char * toName ;
+	int ret = split_path(from, &from_parent, &fromName) ;
+	if (ret != 0) {
+
+		return ret ;
+
+	}
+	ret = split_path(to, &to_parent, &toName) ;
+	if (ret != 0) {
+
+		free(fromName) ;
+		return ret ;
+
+	}
+
+	// Step 2: Call rename_node() to move the entry
+	ret = rename_node(from_parent.ino, fromName, to_parent.ino, toName) ;
+	free(fromName) ;
+	free(toName) ;
+
+	return ret ;
+}
+
+static int tfs_link(const char *from, const char *to) {
+
+	// Step 1: Call get_node_by_path() to get the inode being linked, and split_path() for where the new name goes
+	struct inode node, parent ;
+	char * baseName ;
+	int found = get_node_by_path(from, 0, &node) ;
+	if (found != 0) {
+
+		return found ;
+
+	}
+	int ret = split_path(to, &parent, &baseName) ;
+	if (ret != 0) {
+
+		return ret ;
+
+	}
+
+	// Step 2: Call link_node() to count and add the name
+	ret = link_node(node.ino, parent.ino, baseName, &node) ;
+	free(baseName) ;
+
+	return ret ;
+}
+
+static int tfs_symlink(const char *target, const char *path) {
+
+	struct inode parent, node ;
+	char * baseName ;
+	int ret = split_path(path, &parent, &baseName) ;
+	if (ret != 0) {
+
+		return ret ;
+
+	}
+
+	// Call make_node() to allocate, link and write the new symbolic link with its target
+	ret = make_node(parent.ino, baseName, TFS_SYMLINK, target, &node) ;
+	free(baseName) ;
+
+	return ret ;
+}
+
+static int tfs_readlink(const char *path, char *buffer, size_t size) {
+
+	struct inode node ;
+	int found = get_node_by_path(path, 0, &node) ;
+	if (found != 0) {
+
+		return found ;
+
+	}
+
+	return read_link(&node, buffer, size) ;
+}
+
+static int tfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+
+	struct inode node ;
+	if (is_stats_path(path) || is_ctl_path(path)) {
+
+		return -EPERM ;
+
+	}
+	int found = get_node_by_path(path, 0, &node) ;
+	if (found != 0) {
+
+		return found ;
+
+	}
+
+	return xattr_set(&node, name, value, size, flags) ;
+}
+
+static int tfs_getxattr(const char *path, const char *name, char *value, size_t size) {
+
+	struct inode node ;
+	if (is_stats_path(path) || is_ctl_path(path)) {
+
+		return -ENODATA ;
+
+	}
+	int found = get_node_by_path(path, 0, &node) ;
+	if (found != 0) {
+
+		return found ;
+
+	}
+
+	return xattr_get(&node, name, value, size) ;
+}
+
+static int tfs_listxattr(const char *path, char *list, size_t size) {
+
+	struct inode node ;
+	if (is_stats_path(path) || is_ctl_path(path)) {
+
+		return 0 ;
+
+	}
+	int found = get_node_by_path(path, 0, &node) ;
+	if (found != 0) {
+
+		return found ;
+
+	}
+
+	return xattr_list(&node, list, size) ;
+}
+
+static int tfs_removexattr(const char *path, const char *name) {
+
+	struct inode node ;
+	if (is_stats_path(path) || is_ctl_path(path)) {
+
+		return -EPERM ;
+
+	}
+	int found = get_node_by_path(path, 0, &node) ;
+	if (found != 0) {
+
+		return found ;
+
+	}
+
+	return xattr_set(&node, name, NULL, 0, 0) ;
+}
+
+static int tfs_truncate(const char *path, off_t size) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+    return 0;
+}
+
+static int tfs_release(const char *path, struct fuse_file_info *fi) {
+
+	// Last close of this open, nothing of the file may be left only in memory
+	int ino = fh_ino(fi) ;
+	return ino < 0 ? 0 : sync_ino(ino, 0, 0) ;
+}
+
+static int tfs_flush(const char * path, struct fuse_file_info * fi) {
+
+	// close(), write back this file only, other files' dirty blocks stay with the flusher
+	int ino = fh_ino(fi) ;
+	return ino < 0 ? 0 : sync_ino(ino, 0, 0) ;
+}
+
+static int tfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+
+	int ino = fh_ino(fi) ;
+	return ino < 0 ? 0 : sync_ino(ino, datasync, 1) ;
+}
+
+static int tfs_utimens(const char *path, const struct timespec tv[2]) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+    return 0;
+}
+
+/*
+ * tfs_ope points at these, they time the operation for -o stats and charge its block I/O to it.
+ * An operation that ran into a block failing its checksum fails with EIO, whatever it made of that.
+ * They also keep the defragmenter out while they run.
+ */
+#define TFS_TIMED(op, fn, params, args) \
+static int fn##_timed params { \
+	struct op_timer t ; \
+	struct fuse_context * ctx = fuse_get_context() ; \
+	my_uid = ctx != NULL ? ctx->uid : getuid() ; \
+	my_gid = ctx != NULL ? ctx->gid : getgid() ; \
+	pthread_rwlock_rdlock(&fs_lock) ; \
+	op_begin(&t, op) ; \
+	int ret = fn args ; \
+	if ((ret == -ENOSPC || ret == -EDQUOT) && reclaim_retry()) { \
+		my_retrying = 1 ; \
+		ret = fn args ; \
+		my_retrying = 0 ; \
+	} \
+	my_nospace = 0 ; \
+	if (my_csum_error) { \
+		ret = -EIO ; \
+	} \
+	op_end(&t, ret < 0) ; \
+	pthread_rwlock_unlock(&fs_lock) ; \
+	return ret ; \
+}
+
+TFS_TIMED(TFS_OP_GETATTR, tfs_getattr, (const char *path, struct stat *stbuf), (path, stbuf))
+TFS_TIMED(TFS_OP_OPENDIR, tfs_opendir, (const char *path, struct fuse_file_info *fi), (path, fi))
+TFS_TIMED(TFS_OP_READDIR, tfs_readdir, (const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), (path, buffer, filler, offset, fi))
+TFS_TIMED(TFS_OP_RELEASEDIR, tfs_releasedir, (const char *path, struct fuse_file_info *fi), (path, fi))
+TFS_TIMED(TFS_OP_MKDIR, tfs_mkdir, (const char *path, mode_t mode), (path, mode))
+TFS_TIMED(TFS_OP_RMDIR, tfs_rmdir, (const char *path), (path))
+TFS_TIMED(TFS_OP_CREATE, tfs_create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+TFS_TIMED(TFS_OP_OPEN, tfs_open, (const char *path, struct fuse_file_info *fi), (path, fi))
+TFS_TIMED(TFS_OP_READ, tfs_read, (const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi), (path, buffer, size, offset, fi))
+TFS_TIMED(TFS_OP_WRITE, tfs_write, (const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi), (path, buffer, size, offset, fi))
+TFS_TIMED(TFS_OP_READ, tfs_read_buf, (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi), (path, bufp, size, offset, fi))
+TFS_TIMED(TFS_OP_WRITE, tfs_write_buf, (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi), (path, buf, offset, fi))
+TFS_TIMED(TFS_OP_UNLINK, tfs_unlink, (const char *path), (path))
+TFS_TIMED(TFS_OP_TRUNCATE, tfs_truncate, (const char *path, off_t size), (path, size))
+TFS_TIMED(TFS_OP_FLUSH, tfs_flush, (const char *path, struct fuse_file_info *fi), (path, fi))
+TFS_TIMED(TFS_OP_FSYNC, tfs_fsync, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+TFS_TIMED(TFS_OP_UTIMENS, tfs_utimens, (const char *path, const struct timespec tv[2]), (path, tv))
+TFS_TIMED(TFS_OP_RELEASE, tfs_release, (const char *path, struct fuse_file_info *fi), (path, fi))
+TFS_TIMED(TFS_OP_RENAME, tfs_rename, (const char *from, const char *to), (from, to))
+TFS_TIMED(TFS_OP_LINK, tfs_link, (const char *from, const char *to), (from, to))
+TFS_TIMED(TFS_OP_SYMLINK, tfs_symlink, (const char *target, const char *path), (target, path))
+TFS_TIMED(TFS_OP_READLINK, tfs_readlink, (const char *path, char *buffer, size_t size), (path, buffer, size))
+TFS_TIMED(TFS_OP_SETXATTR, tfs_setxattr, (const char *path, const char *name, const char *value, size_t size, int flags), (path, name, value, size, flags))
+TFS_TIMED(TFS_OP_GETXATTR, tfs_getxattr, (const char *path, const char *name, char *value, size_t size), (path, name, value, size))
+TFS_TIMED(TFS_OP_LISTXATTR, tfs_listxattr, (const char *path, char *list, size_t size), (path, list, size))
+TFS_TIMED(TFS_OP_REMOVEXATTR, tfs_removexattr, (const char *path, const char *name), (path, name))
+
+static struct fuse_operations tfs_ope = {
+	.init		= tfs_init,
+	.destroy	= tfs_destroy,
+
+	.getattr	= tfs_getattr_timed,
+	.readdir	= tfs_readdir_timed,
+	.opendir	= tfs_opendir_timed,
+	.releasedir	= tfs_releasedir_timed,
+	.mkdir		= tfs_mkdir_timed,
+	.rmdir		= tfs_rmdir_timed,
+
+	.create		= tfs_create_timed,
+	.open		= tfs_open_timed,
+	.read 		= tfs_read_timed,
+	.write		= tfs_write_timed,
+	.read_buf	= tfs_read_buf_timed,
+	.write_buf	= tfs_write_buf_timed,
+	.unlink		= tfs_unlink_timed,
+	.rename		= tfs_rename_timed,
+	.link		= tfs_link_timed,
+	.symlink	= tfs_symlink_timed,
+	.readlink	= tfs_readlink_timed,
+	.setxattr	= tfs_setxattr_timed,
+	.getxattr	= tfs_getxattr_timed,
+	.listxattr	= tfs_listxattr_timed,
+	.removexattr	= tfs_removexattr_timed,
+
+	.truncate   = tfs_truncate_timed,
+	.flush      = tfs_flush_timed,
+	.fsync      = tfs_fsync_timed,
+	.utimens    = tfs_utimens_timed,
+	.release	= tfs_release_timed
+};
+
+
+// Built with -DTFS_NO_MAIN when another program (e.g. benchmark/tfs_bench.c) drives tfs_ope itself,
+// the low-level front end and main() are left out then
+#ifndef TFS_NO_MAIN
+
+/*
+ * Low-level FUSE operations
+ * The kernel hands us inode numbers directly, so nothing is resolved by path, see FUSE_INO()
+ */
+
+// Virtual files are numbered past the last real inode
+#define TFS_STATS_INO FUSE_INO(MAX_INUM) // /.tfs_stats
+#define TFS_CTL_INO FUSE_INO(MAX_INUM + 1) // /.tfs_ctl
+
+/*
+ * Lookups and opens the kernel holds on an inode, an orphan is kept until they are all given back
+ */
+static void ll_ref(uint16_t ino, uint64_t n) {
+
+	if (ino < MAX_INUM) {
+
+		__atomic_add_fetch(&ll_refs[ino], n, __ATOMIC_ACQ_REL) ;
+
+	}
+
+}
+
+static void ll_unref(uint16_t ino, uint64_t n) {
+
+	if (ino < MAX_INUM && __atomic_sub_fetch(&ll_refs[ino], n, __ATOMIC_ACQ_REL) == 0) {
+
+		reclaim_kick(0) ;
+
+	}
+
+}
+
+/*
+ * Read the inode behind a FUSE inode number, -ENOENT if it is out of range or freed
+ */
+static int ll_readi(fuse_ino_t ino, struct inode *node) {
+
+	if (ino < FUSE_ROOT_ID || ino > MAX_INUM) {
+
+		return -ENOENT ;
+
+	}
+
+	int ret = readi(TFS_INO(ino), node) ;
+	if (ret < 0) {
+
+		return ret ;
+
+	}
+
+	return node->valid ? 0 : -ENOENT ;
+}
+
+static __thread int my_held ; // an error ll_reply_err() didn't send, the operation runs again
+
+/*
+ * Every error the low-level handlers reply goes through here. ENOSPC and EDQUOT with orphans
+ * around are held back for TFS_LL_TIMED to free them and run the handler again, see reclaim_retry().
+ * Like TFS_TIMED, an operation that read a block failing its checksum fails with EIO whatever it
+ * was going to reply.
+ */
+static void ll_reply_err(fuse_req_t req, int err) {
+
+	if (my_csum_error) {
+
+		err = EIO ;
+
+	}
+	if ((err == ENOSPC || err == EDQUOT) && my_nospace && !my_retrying) {
+
+		my_held = err ;
+		return ;
+
+	}
+
+	fuse_reply_err(req, err) ;
+
+}
+
+static void ll_attr(struct inode *node, struct stat *st) {
+
+	*st = node->vstat ;
+	st->st_ino = FUSE_INO(node->ino) ;
+
+}
+
+static void ll_reply_entry(fuse_req_t req, struct inode *node) {
+
+	if (my_csum_error) {
+
+		ll_reply_err(req, EIO) ;
+		return ;
+
+	}
+
+	struct fuse_entry_param e ;
+	memset(&e, 0, sizeof(e)) ;
+	e.ino = FUSE_INO(node->ino) ;
+	e.generation = ll_generation[node->ino] ;
+	e.attr_timeout = tfs_opts.attr_timeout ;
+	e.entry_timeout = tfs_opts.entry_timeout ;
+	ll_attr(node, &e.attr) ;
+	ll_ref(node->ino, 1) ;
+	fuse_reply_entry(req, &e) ;
+
+}
+
+/*
+ * Our own writes to a direct handle never pass through the page cache, drop what other
+ * handles of the inode may have cached of the range instead of letting it go stale
+ */
+static void ll_inval(fuse_ino_t ino, struct fuse_file_info *fi, off_t offset, off_t size) {
+
+	if (ll_chan != NULL && (fi->fh & TFS_FH_DIRECT) && size > 0) {
+
+		fuse_lowlevel_notify_inval_inode(ll_chan, ino, offset, size) ;
+
+	}
+
+}
+
+static void tfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+
+	tfs_init(conn) ;
+
+}
+
+static void tfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+
+	struct dirent entry ;
+	struct inode node ;
+	if (parent == FUSE_ROOT_ID && is_stats_name(0, name)) {
+
+		struct fuse_entry_param e ;
+		memset(&e, 0, sizeof(e)) ;
+		e.ino = TFS_STATS_INO ;
+		stats_stat(&e.attr) ;
+		e.attr.st_ino = e.ino ;
+		fuse_reply_entry(req, &e) ;
+		return ;
+
+	}
+	if (parent == FUSE_ROOT_ID && is_ctl_name(0, name)) {
+
+		struct fuse_entry_param e ;
+		memset(&e, 0, sizeof(e)) ;
+		e.ino = TFS_CTL_INO ;
+		ctl_stat(&e.attr) ;
+		e.attr.st_ino = e.ino ;
+		fuse_reply_entry(req, &e) ;
+		return ;
+
+	}
+
+	int ret = (parent < FUSE_ROOT_ID || parent > MAX_INUM) ? -ENOENT : dir_find(TFS_INO(parent), name, strlen(name), &entry) ;
+	if (ret == -EIO || (ret == 0 && readi(entry.ino, &node) < 0) || my_csum_error) {
+
+		ll_reply_err(req, EIO) ;
+		return ;
+
+	}
+	if (ret != 0) {
+
+		// An entry with inode 0 tells the kernel to cache the miss, it is dropped again when the name is created
+		if (tfs_opts.negative_timeout > 0) {
+
+			struct fuse_entry_param e ;
+			memset(&e, 0, sizeof(e)) ;
+			e.entry_timeout = tfs_opts.negative_timeout ;
+			fuse_reply_entry(req, &e) ;
+			return ;
+
+		}
+
+		ll_reply_err(req, ENOENT) ;
+		return ;
+
+	}
+
+	ll_reply_entry(req, &node) ;
+
+}
+
+static void tfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+
+	if (ino >= FUSE_ROOT_ID && ino <= MAX_INUM) {
+
+		ll_unref(TFS_INO(ino), nlookup) ;
+
+	}
+	fuse_reply_none(req) ;
+
+}
+
+static void tfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+
+	struct inode node ;
+	struct stat st ;
+	if (ino == TFS_STATS_INO && tfs_opts.stats) {
+
+		stats_stat(&st) ;
+		st.st_ino = ino ;
+		fuse_reply_attr(req, &st, 0) ;
+		return ;
+
+	}
+	if (ino == TFS_CTL_INO && !read_only()) {
+
+		ctl_stat(&st) ;
+		st.st_ino = ino ;
+		fuse_reply_attr(req, &st, 0) ;
+		return ;
+
+	}
+
+	if (ll_readi(ino, &node) != 0 || my_csum_error) {
+
+		ll_reply_err(req, ENOENT) ;
+		return ;
+
+	}
+
+	ll_attr(&node, &st) ;
+	fuse_reply_attr(req, &st, tfs_opts.attr_timeout) ;
+
+}
+
+static void tfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+
+	// Like tfs_truncate() and tfs_utimens(), changes are accepted and ignored
+	tfs_ll_getattr(req, ino, fi) ;
+
+}
+
+static void tfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+
+	struct inode node ;
+	int ret = make_node(TFS_INO(parent), name, 1, NULL, &node) ;
+	if (ret != 0) {
+
+		ll_reply_err(req, -ret) ;
+		return ;
+
+	}
+
+	ll_reply_entry(req, &node) ;
+
+}
+
+static void tfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+
+	struct inode node ;
+	struct fuse_entry_param e ;
+	int ret = make_node(TFS_INO(parent), name, 0, NULL, &node) ;
+	if (ret != 0 || my_csum_error) {
+
+		ll_reply_err(req, -ret) ;
+		return ;
+
+	}
+
+	set_open_flags(fi, node.ino) ;
+	memset(&e, 0, sizeof(e)) ;
+	e.ino = FUSE_INO(node.ino) ;
+	e.generation = ll_generation[node.ino] ;
+	e.attr_timeout = tfs_opts.attr_timeout ;
+	e.entry_timeout = tfs_opts.entry_timeout ;
+	ll_attr(&node, &e.attr) ;
+	ll_ref(node.ino, 2) ; // the entry and the handle
+	fuse_reply_create(req, &e, fi) ;
+
+}
 
+static void tfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+
+	ll_reply_err(req, -remove_node(TFS_INO(parent), name, 0)) ;
 
-	return NULL;
 }
 
-static void tfs_destroy(void *userdata) {
+static void tfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
 
-	// Step 1: De-allocate in-memory data structures
-	free(superblock) ;
-	free(inoBitmap) ;
-	free(blknoBitmap) ;
+	ll_reply_err(req, -remove_node(TFS_INO(parent), name, 1)) ;
+
+}
 
-	// Step 2: Close diskfile
-	dev_close() ;
+static void tfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+
+	ll_reply_err(req, -rename_node(TFS_INO(parent), name, TFS_INO(newparent), newname)) ;
 
 }
 
-static int tfs_getattr(const char *path, struct stat *stbuf) {
+static void tfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
 
-	//printf("reached attr\n") ;
-	// Step 1: call get_node_by_path() to get inode from path
-	struct inode * in = (struct inode *)malloc(sizeof(struct inode)) ;
-	if (get_node_by_path(path, 0, in) != 0) {
+	struct inode node ;
+	int ret = ll_readi(ino, &node) ;
+	if (ret == 0) {
 
-		return -ENOENT ; // “No such file or directory.”
+		ret = link_node(node.ino, TFS_INO(newparent), newname, &node) ;
 
 	}
+	if (ret != 0) {
 
-	// Step 2: fill attribute of file into stbuf from inode
-	*stbuf = in->vstat ;
-/*
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink  = 2;
-		time(&stbuf->st_mtime);
-		stbuf->st_uid = getuid() ; // st_uid getuid()
-		stbuf->st_gid = getgid() ;// st_gid getgid()
-		stbuf->st_atime = time(NULL) ;
-		stbuf->st_mtime = time(NULL) ;
-		// st_nlink
-		// st_size
-		// st_mtime
-		// st_mode
-		*/
-		
+		ll_reply_err(req, -ret) ;
+		return ;
 
-	return 0;
-}
+	}
 
-static int tfs_opendir(const char *path, struct fuse_file_info *fi) {
+	ll_reply_entry(req, &node) ;
 
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode * in = (struct inode *)malloc(sizeof(struct inode)) ;
-	if (get_node_by_path(path, 0, in) == 0) {
+}
 
-		if (in->valid) {
+static void tfs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
 
-		free(in) ;
-		return 0 ;
+	struct inode node ;
+	int ret = make_node(TFS_INO(parent), name, TFS_SYMLINK, link, &node) ;
+	if (ret != 0) {
 
-		}
+		ll_reply_err(req, -ret) ;
+		return ;
 
 	}
-	free(in) ;
-
-	// Step 2: If not find, return -1
 
-    return -1;
-	
+	ll_reply_entry(req, &node) ;
 
 }
 
-static int tfs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+static void tfs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
 
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode * in = (struct inode *)malloc(sizeof(struct inode)) ;
-	if (get_node_by_path(path, 0, in) != 0) {
+	struct inode node ;
+	int ret = ll_readi(ino, &node) ;
+	if (ret != 0) {
 
-		return -ENOENT ; // “No such file or directory.”
+		ll_reply_err(req, -ret) ;
+		return ;
 
-	} 
-	
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	int i ;
-	for (i = 0 ; i < 16 ; i++) {
+	}
 
-		if (in->direct_ptr[i] == 0) {
+	char * target = (char *)malloc(node.size + 1) ;
+	ret = read_link(&node, target, node.size + 1) ;
+	if (ret != 0 || my_csum_error) {
 
-			break ;
+		ll_reply_err(req, -ret) ;
 
-		}
+	} else {
 
-		struct dirent * entry = (struct dirent *)malloc(BLOCK_SIZE) ;
-		bio_read(in->direct_ptr[i], entry) ;
-		int j ;
-		for (j = 0 ; j < (BLOCK_SIZE / sizeof(struct dirent)) ; j++) {
+		fuse_reply_readlink(req, target) ;
+
+	}
+	free(target) ;
 
-			if (entry->valid == 1) {
+}
 
-				struct inode * k = (struct inode *)malloc(sizeof(struct inode)) ;
-				readi(entry->ino, k) ;
-				filler(buffer, entry->name, &k->vstat, 0) ; // 3. Call the filler function with arguments of buf, the null-terminated filename, the address of your struct stat (or NULL if you have none), and the offset of the next directory entry.
+static void tfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags) {
 
-			}
+	struct inode node ;
+	int ret = ll_readi(ino, &node) ;
+	if (ret == 0) {
 
-			entry++ ;
+		ret = xattr_set(&node, name, value, size, flags) ;
 
-		}
 	}
+	ll_reply_err(req, -ret) ;
 
+}
 
-	/*
-
-	1. Find the first directory entry following the given offset (see below).
-	2. Optionally, create a struct stat that describes the file as for getattr (but FUSE only looks at st_ino and the file-type bits of st_mode).
-	3. Call the filler function with arguments of buf, the null-terminated filename, the address of your struct stat (or NULL if you have none), and the offset of the next directory entry.
-	4. If filler returns nonzero, or if there are no more files, return 0.
-	5. Find the next file in the directory.
-	6. Go back to step 2.
+/*
+ * getxattr and listxattr: size 0 asks for the length, anything else for the bytes
+ */
+static void ll_reply_xattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
 
-	*/
+	struct inode node ;
+	char * buffer = size > 0 ? (char *)malloc(size) : NULL ;
+	int ret = (ino == TFS_STATS_INO || ino == TFS_CTL_INO) ? (name != NULL ? -ENODATA : 0) : ll_readi(ino, &node) ;
+	if (ret == 0 && ino <= MAX_INUM) {
 
+		ret = name != NULL ? xattr_get(&node, name, buffer, size) : xattr_list(&node, buffer, size) ;
 
-	return 0;
-}
+	}
 
+	if (ret < 0 || my_csum_error) {
 
-static int tfs_mkdir(const char *path, mode_t mode) {
+		ll_reply_err(req, -ret) ;
 
-	//printf("MKDIR CALLED\n") ;
+	} else if (size == 0) {
 
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	char * directoryPath = (char *)malloc(strlen(path) + 1) ;
-	strcpy(directoryPath, path) ;
-	dirname(directoryPath) ;
-	//printf("dirPath: %s\n", directoryPath) ;
-	char * baseName = (char *)malloc(strlen(path) + 1) ;
-	strcpy(baseName, path) ;
-	//printf("Before baseName %s\n", baseName) ;
-	baseName = basename(baseName) ;
-	//printf("baseName: %s\n", baseName) ;
+		fuse_reply_xattr(req, ret) ;
 
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode * parentNode = (struct inode *)malloc(sizeof(struct inode)) ;
-	//printf("getting parent\n") ;
-	if (get_node_by_path(directoryPath, 0, parentNode) != 0) {
+	} else {
 
-		return -ENOENT ; // “No such file or directory.”
+		fuse_reply_buf(req, buffer, ret) ;
 
 	}
+	free(buffer) ;
 
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int avail = get_avail_ino() ;
+}
 
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	dir_add(*parentNode, avail, (const char *)baseName, (size_t)strlen(baseName)) ;
+static void tfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
 
-	// Step 5: Update inode for target directory
-	struct inode * update = (struct inode *)malloc(sizeof(struct inode)) ;
-	update->valid = 1 ;
-	update->ino = avail ;
-	update->link = 0 ;
-	update->direct_ptr[0] = get_avail_blkno() ;
-	struct inode * tempblock = (struct inode *)malloc(BLOCK_SIZE) ;
-	bio_write(update->direct_ptr[0], (void *)tempblock) ;
-	free(tempblock) ;
-	update->direct_ptr[1] = 0 ;
-	update->indirect_ptr[0] = 0 ;
-	update->type = 1 ;
-	update->size = sizeof(struct dirent) * 2; // Unix convention
-	struct stat * r = (struct stat *)malloc(sizeof(struct stat)) ;
-	r->st_mode = S_IFDIR | 0755 ; // Directory
-	r->st_nlink = 1 ;
-	r->st_ino = update->ino ;
-	time(&r->st_mtime) ;
-	r->st_blocks = 1 ;
-	r->st_blksize = BLOCK_SIZE ;
-	r->st_size = update->size ;
-	update->vstat = *r ;
-	free(r) ;
+	ll_reply_xattr(req, ino, name, size) ;
 
-	// Step 6: Call writei() to write inode to disk
-	writei(avail, update) ;
+}
 
-	struct dirent * rootDir = (struct dirent *)malloc(BLOCK_SIZE) ;
-	rootDir->ino = avail ;
-	rootDir-> valid = 1 ;
-	char c[2] ;
-	c[0] = '.' ;
-	c[1] = '\0' ;
-	strncpy(rootDir->name, c, 2) ; // Current directory
-	//printf("rootDir name = %s\n", rootDir->name) ;
-	struct dirent * parent = rootDir + 1 ;
-	parent->ino = parent->ino ;
-	parent->valid = 1 ;
-	char p[3] ;
-	p[0] = '.' ;
-	p[1] = '.' ;
-	p[2] = '\0' ;
-	strncpy(parent->name, p, 3) ; // Parent directory
-	//printf("parent name = %s\n", (rootDir + 1)->name) ;
-	bio_write(update->direct_ptr[0], (const void *)rootDir) ;
-	free(rootDir) ;
-	
-	//printf("MKDIR FINISHED\n") ;
+static void tfs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+
+	ll_reply_xattr(req, ino, NULL, size) ;
 
-	return 0;
 }
 
-static int tfs_rmdir(const char *path) {
+static void tfs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
 
-	//printf("RMDIR CALLED\n") ;
+	tfs_ll_setxattr(req, ino, name, NULL, 0, 0) ;
 
-	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	char * directoryPath = (char *)malloc(strlen(path) + 1) ;
-	strcpy(directoryPath, path) ;
-	dirname(directoryPath) ;
-	//printf("dirPath: %s\n", directoryPath) ;
-	char * baseName = (char *)malloc(strlen(path) + 1) ;
-	strcpy(baseName, path) ;
-	//printf("Before baseName %s\n", baseName) ;
-	baseName = basename(baseName) ;
-	//printf("baseName: %s\n", baseName) ;
+}
 
-	// Step 2: Call get_node_by_path() to get inode of target directory
-	struct inode * target = (struct inode *)malloc(sizeof(struct inode)) ;
-	if (get_node_by_path(path, 0, target) != 0) {
+static void tfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 
-		return -ENOENT ; // “No such file or directory.”
+	struct inode node ;
+	if (ino == TFS_STATS_INO && tfs_opts.stats) {
 
-	}
+		int ret = stats_open(fi) ;
+		if (ret != 0) {
 
-	// Step 3: Clear data block bitmap of target directory
-	int i ;
-	for (i = 0 ; i < 16 ; i++) {
+			ll_reply_err(req, -ret) ;
 
-		if (target->direct_ptr[i] == 0) {
+		} else {
 
-			break ;
+			fuse_reply_open(req, fi) ;
 
 		}
+		return ;
+
+	}
+
+	if (ino == TFS_CTL_INO && !read_only()) {
 
-		unset_bitmap(blknoBitmap, target->direct_ptr[i] - superblock->d_start_blk) ;
-		target->direct_ptr[i] = 0 ;
+		ctl_open(fi) ;
+		fuse_reply_open(req, fi) ;
+		return ;
 
 	}
 
-	bio_write(superblock->d_bitmap_blk, blknoBitmap) ;
+	if (ll_readi(ino, &node) != 0 || my_csum_error) {
 
-	// Step 4: Clear inode bitmap and its data block
-	target->valid = 0 ;
-	unset_bitmap(inoBitmap, target->ino) ;
-	bio_write(superblock->i_bitmap_blk, inoBitmap) ;
-	writei(target->ino, target) ;
-	free(target) ;
+		ll_reply_err(req, ENOENT) ;
+		return ;
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-	struct inode * parent = (struct inode *)malloc(sizeof(struct inode)) ;
-	if (get_node_by_path(directoryPath, 0, parent) != 0) {
+	}
+	if (read_only() && (fi->flags & O_ACCMODE) != O_RDONLY) {
 
-		return -ENOENT ; // “No such file or directory.”
+		ll_reply_err(req, EROFS) ;
+		return ;
 
 	}
 
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-	dir_remove(*parent, (const char *)baseName, (size_t)strlen(baseName)) ;
+	// File data only changes through the kernel, or through /.tfs_ctl, which invalidates what it
+	// changed, so the cache is still good on the next open
+	set_open_flags(fi, TFS_INO(ino)) ;
+	fi->keep_cache = !fi->direct_io ;
+	ll_ref(TFS_INO(ino), 1) ;
+	fuse_reply_open(req, fi) ;
 
-	return 0;
 }
 
-static int tfs_releasedir(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
+static void tfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-static int tfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	struct inode node ;
+	struct fuse_bufvec * v ;
+	if (ino == TFS_STATS_INO && tfs_opts.stats) {
 
-	//printf("PATH: %s\n", path) ;
+		char * buf = (char *)malloc(size > 0 ? size : 1) ;
+		fuse_reply_buf(req, buf, stats_read(buf, size, offset)) ;
+		free(buf) ;
+		return ;
 
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	char * directoryPath = (char *)malloc(strlen(path) + 1) ;
-	strcpy(directoryPath, path) ;
-	dirname(directoryPath) ;
-	//printf("dirPath: %s\n", directoryPath) ;
-	char * baseName = (char *)malloc(strlen(path) + 1) ;
-	strcpy(baseName, path) ;
-	//printf("Before baseName %s\n", baseName) ;
-	baseName = basename(baseName) ;
-	//printf("baseName: %s\n", baseName) ;
+	}
+	if (ino == TFS_CTL_INO && !read_only()) {
 
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode * parent = (struct inode *)malloc(sizeof(struct inode)) ;
-	if (get_node_by_path(directoryPath, 0, parent) != 0) {
+		char * buf = (char *)malloc(size > 0 ? size : 1) ;
+		fuse_reply_buf(req, buf, ctl_read(buf, size, offset)) ;
+		free(buf) ;
+		return ;
+
+	}
+
+	int ret = ll_readi(ino, &node) ;
+	if (ret == 0) {
 
-		return -ENOENT ; // “No such file or directory.”
+		ret = read_file_buf(&node, &v, size, offset, fi, 1) ; // replied to before the lock goes
 
 	}
+	if (ret == 0 && my_csum_error) {
 
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int avail = get_avail_ino() ;
+		free_bufvec(v) ;
+		ret = -EIO ;
 
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	dir_add(*parent, avail, (const char *)baseName, strlen(baseName)) ;
+	}
+	if (ret != 0) {
 
-	// Step 5: Update inode for target file
-	struct inode * update = (struct inode *)malloc(sizeof(struct inode)) ;
-	update->valid = 1 ;
-	update->ino = avail ;
-	update->link = 0 ;
-	update->direct_ptr[0] = get_avail_blkno() ;
-	update->direct_ptr[1] = 0 ;
-	update->indirect_ptr[0] = 0 ;
-	update->type = 0 ;
-	update->size = 0 ;
-	struct stat * ustat = (struct stat *)malloc(sizeof(struct stat)) ;
-	ustat->st_mode = S_IFREG | 0666 ; // File
-	ustat->st_nlink = 1 ;
-	ustat->st_ino = update->ino ;
-	ustat->st_size = update->size ;
-	ustat->st_blocks = 1 ;
-	time(&ustat->st_mtime) ;
-	update->vstat = *ustat ;
+		ll_reply_err(req, -ret) ;
+		return ;
 
-	// Step 6: Call writei() to write inode to disk
-	writei(avail, update) ;
+	}
 
-	//printf("written\n") ;
+	fuse_reply_data(req, v, FUSE_BUF_SPLICE_MOVE) ;
+	free_bufvec(v) ;
 
-	return 0;
 }
 
-static int tfs_open(const char *path, struct fuse_file_info *fi) {
+static void tfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-	//printf("CALLED OPEN PATH = %s\n", path) ;
+	struct inode node ;
+	int ret = ll_readi(ino, &node) ;
+	if (ino == TFS_CTL_INO && !read_only()) {
 
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode * in = (struct inode *)malloc(sizeof(struct inode)) ;
-	if (get_node_by_path(path, 0, in) == 0) {
+		ret = ctl_write(buffer, size) ;
 
-		if (in->valid) {
+	} else if (ret == 0) {
 
-		free(in) ;
-		return 0 ;
+		ret = write_file(&node, buffer, size, offset, fi) ;
 
-		}
+	}
+	if (ret < 0 || my_csum_error) {
+
+		ll_reply_err(req, -ret) ;
+		return ;
 
 	}
-	free(in) ;
 
-	// Step 2: If not find, return -1
+	ll_inval(ino, fi, offset, ret) ;
+	fuse_reply_write(req, ret) ;
 
-    return -1;
 }
 
-static int tfs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+static void tfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
 
-	//printf("READ CALLED\n") ;
+	struct inode node ;
+	int ret = ll_readi(ino, &node) ;
+	if (ino == TFS_CTL_INO && !read_only()) {
 
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode * node = (struct inode *)malloc(sizeof(struct inode)) ;
-	if (get_node_by_path(path, 0, node) != 0) {
+		ret = ctl_write_buf(buf) ;
 
-		return -ENOENT ; // “No such file or directory.”
+	} else if (ret == 0) {
+
+		ret = write_file_buf(&node, buf, offset, fi) ;
 
 	}
+	if (ret < 0 || my_csum_error) {
 
-	// Step 2: Based on size and offset, read its data blocks from disk
-	int i ;
-	char * b = (char *)malloc(BLOCK_SIZE) ;
-	int fileSize = size + offset ;
-	int bytes = ((node->vstat.st_blocks * BLOCK_SIZE) - offset) ;
-	for (i = 0 ; i < (int)size && i < bytes ; i++) {
+		ll_reply_err(req, -ret) ;
+		return ;
 
-		if (offset >= fileSize) {
+	}
 
-			break ;
+	ll_inval(ino, fi, offset, ret) ;
+	fuse_reply_write(req, ret) ;
 
-		}
+}
 
-		int blk = offset / BLOCK_SIZE ;
-		int off ;
+static void tfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 
-		if (blk > 15) { // Large file support
+	int ret = ino >= TFS_STATS_INO ? 0 : sync_ino(TFS_INO(ino), 0, 0) ;
+	if (ino < TFS_STATS_INO) {
 
-			off = (blk - 16) % (BLOCK_SIZE / sizeof(int)) ; // have to change offset first since block number gets changed
-			blk = (blk - 16) / (BLOCK_SIZE / sizeof(int)) ;
-			bio_read(node->indirect_ptr[blk], b) ;
-			int * w = *(int *)(b + (off * sizeof(int))) ;
-			bio_read(w, b) ;
+		ll_unref(TFS_INO(ino), 1) ;
 
-		} else {
+	}
+	ll_reply_err(req, -ret) ;
 
-			bio_read(node->direct_ptr[blk], b) ;
-			
-		}
-		char * a = b ;
-		int j = 0 ;
-		for ( ; i < (int)size && i < bytes ; i++) {
+}
 
-			if (offset >= fileSize || j >= BLOCK_SIZE) {
+static void tfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 
-				break ;
+	ll_reply_err(req, ino >= TFS_STATS_INO ? 0 : -sync_ino(TFS_INO(ino), 0, 0)) ;
 
-			}
+}
 
-			char c = *b ; // Need this or readi gets invalid argument
-			*buffer = c ;
-			buffer++ ;
-			offset++ ;
-			j++ ;
-			b++ ;
+static void tfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
 
-		}
+	ll_reply_err(req, ino >= TFS_STATS_INO ? 0 : -sync_ino(TFS_INO(ino), datasync, 1)) ;
 
-		b = a ;
+}
 
-	}
+static void tfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 
-	// Step 3: copy the correct amount of data from offset to buffer
-	i-- ;
+	ll_unref(TFS_INO(ino), 1) ;
+	ll_reply_err(req, 0) ;
 
-	// Note: this function should return the amount of bytes you copied to buffer
-	//printf("READ returning %d\n", i ) ;
-	return i ;
 }
 
-static int tfs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-
-	//printf("WRITE CALLED path = %s\n", path) ;
+static void tfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode * node = (struct inode *)malloc(sizeof(struct inode)) ;
-	
-	if (get_node_by_path(path, 0, node) != 0) {
+	struct inode node ;
+	if (ll_readi(ino, &node) != 0 || my_csum_error) {
 
-		//printf("Failed?\n") ;
-		return -ENOENT ;
+		ll_reply_err(req, ENOENT) ;
+		return ;
 
 	}
+	if (node.type != 1) {
 
-	// Step 2: Based on size and offset, read its data blocks from disk
-	int i ;
-	char * b = (char *)malloc(BLOCK_SIZE) ;
-	int bytesWritten = 0 ;
-	for (i = offset ; i < (offset + size) ; i++) {
-
-		int blk = i / BLOCK_SIZE ;
-		int w = 0 ;
+		ll_reply_err(req, ENOTDIR) ;
+		return ;
 
-		//printf("blk = %d\n", blk) ;
+	}
 
-		if (blk > 15) { // Large file support
+	ll_ref(node.ino, 1) ;
+	fuse_reply_open(req, fi) ;
 
-			int off = (blk - 16) % (BLOCK_SIZE / sizeof(int)) ; // have to set offset first since block number gets changed
-			blk = (blk - 16) / (BLOCK_SIZE / sizeof(int)) ; // indirect block number
-			//printf("large = %d %d\n", off, blk) ;
-			if (node->indirect_ptr[blk] == 0) {
+}
 
-				node->indirect_ptr[blk] = get_avail_blkno() ;
-				//printf("NEWER BLOCK %d\n", node->indirect_ptr[blk]) ;
-				if (blk < 7) {
+struct ll_dirbuf {
 
-					node->indirect_ptr[blk + 1] = 0 ;
+	fuse_req_t req ;
+	char * buf ;
+	size_t size ;
+	size_t used ;
 
-				}
+} ;
 
-				struct inode * newBlock = (struct inode *)malloc(BLOCK_SIZE) ;
-				bio_write(node->indirect_ptr[blk], newBlock) ;
-				free(newBlock) ;
+static int ll_readdir_fill(void *ctx, struct dirent *entry, off_t next) {
 
-			}
+	struct ll_dirbuf * d = (struct ll_dirbuf *)ctx ;
+	struct stat st ;
 
-			bio_read(node->indirect_ptr[blk], b) ;
-			//printf("read b = %s\n", b) ;
-			b = b + (off * sizeof(int)) ;
-			int temp = *(int *)b ;
+	// Only st_ino and the type bits are looked at, and the kernel copes with an unknown type
+	memset(&st, 0, sizeof(st)) ;
+	st.st_ino = FUSE_INO(entry->ino) ;
 
-			if (temp == 0) {
-				
-				//printf("temp = %d b = %s\n", temp, b) ;
-				*(int *)b = get_avail_blkno() ; // indirect pointer points to block of direct pointers
-				temp = *(int *)b ;
-				node->vstat.st_blocks++ ;
-				//printf("new block %d\n", temp) ;
+	size_t len = fuse_add_direntry(d->req, d->buf + d->used, d->size - d->used, entry->name, &st, next) ;
+	if (len > d->size - d->used) {
 
-			}
+		return 1 ; // Full, the kernel asks again from next
 
-			b = b - (off * sizeof(int)) ;
-			bio_write(node->indirect_ptr[blk], b) ;
-			bio_read(temp, b) ;
-			w = temp ; 
+	}
 
-		} else {
+	d->used += len ;
+	return 0 ;
+}
 
-			if (node->direct_ptr[blk] == 0) {
+static void tfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-				node->direct_ptr[blk] = get_avail_blkno() ;
-				if (blk < 15) {
+	struct inode node ;
+	if (ll_readi(ino, &node) != 0) {
 
-					node->direct_ptr[blk + 1] = 0 ;
+		ll_reply_err(req, ENOENT) ;
+		return ;
 
-				}
-				struct inode * newBlock = (struct inode *)malloc(BLOCK_SIZE) ;
-				bio_write(node->direct_ptr[blk], newBlock) ;
-				node->vstat.st_blocks++ ;
-				free(newBlock) ;
+	}
 
-			}
+	struct ll_dirbuf d = { req, (char *)malloc(size), size, 0 } ;
+	dir_iterate(&node, offset, ll_readdir_fill, &d) ;
+	if (my_csum_error) {
 
-			bio_read(node->direct_ptr[blk], b) ;
-			w = node->direct_ptr[blk] ;
+		ll_reply_err(req, EIO) ;
 
-		}
+	} else {
 
-		char * a = b ;
-		int j = 0 ;
-		
-		for ( ; i < (offset + size) ; i++) {
+		fuse_reply_buf(req, d.buf, d.used) ;
 
-			*b = *buffer ;
-			node->size++ ;
-			node->vstat.st_size++ ;
-			b++ ;
-			j++ ;
-			buffer++ ;
-			bytesWritten++ ;
-			time(&node->vstat.st_mtime) ;
+	}
+	free(d.buf) ;
 
-			if (j >= BLOCK_SIZE) {
+}
+/*
+ * Timing for -o stats like TFS_TIMED, errors are replied straight to the kernel and not counted
+ */
+#define TFS_LL_TIMED(op, fn, params, args) \
+static void fn##_timed params { \
+	struct op_timer t ; \
+	const struct fuse_ctx * ctx = fuse_req_ctx(req) ; \
+	my_uid = ctx->uid ; \
+	my_gid = ctx->gid ; \
+	pthread_rwlock_rdlock(&fs_lock) ; \
+	op_begin(&t, op) ; \
+	fn args ; \
+	if (my_held != 0 && reclaim_retry()) { \
+		my_held = 0 ; \
+		my_retrying = 1 ; \
+		fn args ; \
+		my_retrying = 0 ; \
+	} \
+	my_nospace = 0 ; \
+	op_end(&t, 0) ; \
+	pthread_rwlock_unlock(&fs_lock) ; \
+}
 
-				break ;
+TFS_LL_TIMED(TFS_OP_LOOKUP, tfs_ll_lookup, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+TFS_LL_TIMED(TFS_OP_FORGET, tfs_ll_forget, (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup), (req, ino, nlookup))
+TFS_LL_TIMED(TFS_OP_GETATTR, tfs_ll_getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TFS_LL_TIMED(TFS_OP_SETATTR, tfs_ll_setattr, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi), (req, ino, attr, to_set, fi))
+TFS_LL_TIMED(TFS_OP_MKDIR, tfs_ll_mkdir, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode), (req, parent, name, mode))
+TFS_LL_TIMED(TFS_OP_CREATE, tfs_ll_create, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi), (req, parent, name, mode, fi))
+TFS_LL_TIMED(TFS_OP_UNLINK, tfs_ll_unlink, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+TFS_LL_TIMED(TFS_OP_RMDIR, tfs_ll_rmdir, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+TFS_LL_TIMED(TFS_OP_RENAME, tfs_ll_rename, (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname), (req, parent, name, newparent, newname))
+TFS_LL_TIMED(TFS_OP_LINK, tfs_ll_link, (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname), (req, ino, newparent, newname))
+TFS_LL_TIMED(TFS_OP_SYMLINK, tfs_ll_symlink, (fuse_req_t req, const char *link, fuse_ino_t parent, const char *name), (req, link, parent, name))
+TFS_LL_TIMED(TFS_OP_READLINK, tfs_ll_readlink, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+TFS_LL_TIMED(TFS_OP_SETXATTR, tfs_ll_setxattr, (fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags), (req, ino, name, value, size, flags))
+TFS_LL_TIMED(TFS_OP_GETXATTR, tfs_ll_getxattr, (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size), (req, ino, name, size))
+TFS_LL_TIMED(TFS_OP_LISTXATTR, tfs_ll_listxattr, (fuse_req_t req, fuse_ino_t ino, size_t size), (req, ino, size))
+TFS_LL_TIMED(TFS_OP_REMOVEXATTR, tfs_ll_removexattr, (fuse_req_t req, fuse_ino_t ino, const char *name), (req, ino, name))
+TFS_LL_TIMED(TFS_OP_OPEN, tfs_ll_open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TFS_LL_TIMED(TFS_OP_READ, tfs_ll_read, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, size, offset, fi))
+TFS_LL_TIMED(TFS_OP_WRITE, tfs_ll_write, (fuse_req_t req, fuse_ino_t ino, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, buffer, size, offset, fi))
+TFS_LL_TIMED(TFS_OP_WRITE, tfs_ll_write_buf, (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi), (req, ino, buf, offset, fi))
+TFS_LL_TIMED(TFS_OP_FLUSH, tfs_ll_flush, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TFS_LL_TIMED(TFS_OP_FSYNC, tfs_ll_fsync, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi), (req, ino, datasync, fi))
+TFS_LL_TIMED(TFS_OP_RELEASE, tfs_ll_release, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TFS_LL_TIMED(TFS_OP_RELEASEDIR, tfs_ll_releasedir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TFS_LL_TIMED(TFS_OP_OPENDIR, tfs_ll_opendir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+TFS_LL_TIMED(TFS_OP_READDIR, tfs_ll_readdir, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, size, offset, fi))
+
+static struct fuse_lowlevel_ops tfs_ll_ope = {
+	.init		= tfs_ll_init,
+	.destroy	= tfs_destroy,
 
-			}
+	.lookup		= tfs_ll_lookup_timed,
+	.forget		= tfs_ll_forget_timed,
+	.getattr	= tfs_ll_getattr_timed,
+	.setattr	= tfs_ll_setattr_timed,
+	.readdir	= tfs_ll_readdir_timed,
+	.opendir	= tfs_ll_opendir_timed,
+	.releasedir	= tfs_ll_releasedir_timed,
+	.mkdir		= tfs_ll_mkdir_timed,
+	.rmdir		= tfs_ll_rmdir_timed,
+
+	.create		= tfs_ll_create_timed,
+	.open		= tfs_ll_open_timed,
+	.read		= tfs_ll_read_timed,
+	.write		= tfs_ll_write_timed,
+	.write_buf	= tfs_ll_write_buf_timed,
+	.unlink		= tfs_ll_unlink_timed,
+	.rename		= tfs_ll_rename_timed,
+	.link		= tfs_ll_link_timed,
+	.symlink	= tfs_ll_symlink_timed,
+	.readlink	= tfs_ll_readlink_timed,
+	.setxattr	= tfs_ll_setxattr_timed,
+	.getxattr	= tfs_ll_getxattr_timed,
+	.listxattr	= tfs_ll_listxattr_timed,
+	.removexattr	= tfs_ll_removexattr_timed,
+
+	.flush		= tfs_ll_flush_timed,
+	.fsync		= tfs_ll_fsync_timed,
+	.release	= tfs_ll_release_timed
+};
 
-		}
-		
-		bio_write(w, a) ;
-		b = a ;
+/*
+ * What fuse_main() does for the path based operations, for tfs_ll_ope
+ */
+static int tfs_ll_main(struct fuse_args *args) {
 
-	}
+	char * mountpoint = NULL ;
+	int multithreaded, foreground, err = -1 ;
 
-	// Step 3: Write the correct amount of data from offset to disk
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
 
-	// Step 4: Update the inode info and write it to disk
-	writei(node->ino, node) ;
+		return 1 ;
 
-	// Note: this function should return the amount of bytes you write to disk
+	}
 
-	//printf("TFS WRITE COMPLETE\n") ;
-	free(node) ;
-	return bytesWritten;
-}
+	struct fuse_chan * ch = fuse_mount(mountpoint, args) ;
+	if (ch != NULL) {
 
-static int tfs_unlink(const char *path) {
+		struct fuse_session * se = fuse_lowlevel_new(args, &tfs_ll_ope, sizeof(tfs_ll_ope), NULL) ;
+		if (se != NULL) {
 
-	//printf("UNLINK CALLED\n") ;
+			if (fuse_set_signal_handlers(se) != -1) {
 
-	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	char * directoryPath = (char *)malloc(strlen(path) + 1) ;
-	strcpy(directoryPath, path) ;
-	dirname(directoryPath) ;
-	//printf("dirPath: %s\n", directoryPath) ;
-	char * baseName = (char *)malloc(strlen(path) + 1) ;
-	strcpy(baseName, path) ;
-	//printf("Before baseName %s\n", baseName) ;
-	baseName = basename(baseName) ;
-	//printf("baseName: %s\n", baseName) ;
+				fuse_session_add_chan(se, ch) ;
+				ll_chan = ch ;
+				fuse_daemonize(foreground) ;
+				err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se) ;
+				fuse_remove_signal_handlers(se) ;
+				ll_chan = NULL ;
+				fuse_session_remove_chan(ch) ;
 
-	// Step 2: Call get_node_by_path() to get inode of target file
-	struct inode * target = (struct inode *)malloc(sizeof(struct inode)) ;
-	if (get_node_by_path(path, 0, target) != 0) {
+			}
+			fuse_session_destroy(se) ;
 
-		return -ENOENT ; // “No such file or directory.”
+		}
+		fuse_unmount(mountpoint, ch) ;
 
 	}
+	free(mountpoint) ;
 
-	// Step 3: Clear data block bitmap of target file
-	int i ;
-
-	for (i = 0 ; i < 8 ; i++) { // Large file support
-
-		if (target->indirect_ptr[i] == 0) {
-
-			break ;
+	return err ? 1 : 0 ;
+}
 
-		}
 
-		unset_bitmap(blknoBitmap, target->indirect_ptr[i] - superblock->d_start_blk) ;
-		target->indirect_ptr[i] = 0 ;
+#define TFS_OPT(t, p, v) { t, offsetof(struct tfs_options, p), v }
+
+static struct fuse_opt tfs_opt_spec[] = {
+	TFS_OPT("direct_io", direct_io, 1),
+	TFS_OPT("lowlevel", lowlevel, 1),
+	TFS_OPT("writeback_cache", writeback_cache, 1),
+	TFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+	TFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+	TFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+	TFS_OPT("stats", stats, 1),
+	TFS_OPT("trace=%s", trace, 0),
+	TFS_OPT("cache_blocks=%d", cache_blocks, 0),
+	TFS_OPT("dirty_ratio=%d", dirty_ratio, 0),
+	TFS_OPT("dirty_background_ratio=%d", dirty_background_ratio, 0),
+	TFS_OPT("dirty_expire=%lf", dirty_expire, 0),
+	TFS_OPT("snapshot=%s", snapshot, 0),
+	TFS_OPT("dedup", dedup, 1),
+	TFS_OPT("dedup_index=%d", dedup_index, 0),
+	TFS_OPT("compress", compress, 1),
+	TFS_OPT("checksum", checksum, 1),
+	TFS_OPT("defrag_rate=%d", defrag_rate, 0),
+	TFS_OPT("ram", ram, 1),
+	TFS_OPT("ram_persist", ram_persist, 1),
+	FUSE_OPT_END
+} ;
 
-		int j ;
-		int * a = (int *)malloc(BLOCK_SIZE) ;
-		bio_read(target->indirect_ptr[i], a) ;
+/*
+ * -o snapshot=<name> must name a snapshot of an existing diskfile, tfs_init() can't fail
+ */
+static int snapshot_exists(const char *name) {
 
-		for (j = 0 ; j < (BLOCK_SIZE / sizeof(int)) ; j++) {
+	char * block = (char *)malloc(BLOCK_SIZE) ;
+	struct tfs_super_ext * e = (struct tfs_super_ext *)(block + TFS_EXT_OFFSET) ;
+	int fd = open(diskfile_path, O_RDONLY) ;
+	int found = 0, k ;
 
-			if (*a == 1) {
+	if (fd >= 0 && pread(fd, block, BLOCK_SIZE, 0) == BLOCK_SIZE && e->magic == TFS_EXT_MAGIC) {
 
-				unset_bitmap(blknoBitmap, *a - superblock->d_start_blk) ;
+		for (k = 0 ; k < MAX_SNAPSHOTS ; k++) {
 
-			} else {
+			if (e->snap[k].name[0] != '\0' && strncmp(e->snap[k].name, name, SNAP_NAME_LEN) == 0) {
 
-				break ;
+				found = 1 ;
 
 			}
 
-			a++ ;
-
 		}
 
 	}
+	if (fd >= 0) {
 
-	for (i = 0 ; i < 16 ; i++) {
-
-		if (target->direct_ptr[i] ==  0) {
+		close(fd) ;
 
-			break ;
+	}
+	free(block) ;
 
-		}
+	return found ;
+}
 
-		unset_bitmap(blknoBitmap, target->direct_ptr[i] - superblock->d_start_blk) ; 
-		target->direct_ptr[i] = 0 ;
+int main(int argc, char *argv[]) {
+	int fuse_stat;
 
-	}
+	getcwd(diskfile_path, PATH_MAX);
+	strcat(diskfile_path, "/DISKFILE");
 
-	bio_write(superblock->d_bitmap_blk, blknoBitmap) ;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv) ;
+	tfs_opts.attr_timeout = 1.0 ;
+	tfs_opts.entry_timeout = 1.0 ;
+	if (fuse_opt_parse(&args, &tfs_opts, tfs_opt_spec, NULL) == -1) {
 
-	// Step 4: Clear inode bitmap and its data block
-	target->valid = 0 ;
-	unset_bitmap(inoBitmap, target->ino) ;
-	bio_write(superblock->i_bitmap_blk, inoBitmap) ;
-	writei(target->ino, target) ;
-	free(target) ;
+		return 1 ;
 
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-	struct inode * parent = (struct inode *)malloc(sizeof(struct inode)) ;
-	if (get_node_by_path(directoryPath, 0, parent) != 0) {
+	}
 
-		return -ENOENT ; // “No such file or directory.”
+	// Snapshots are served read-only, let the kernel turn writes away before they get here
+	if (tfs_opts.snapshot != NULL) {
 
-	}
+		// A plain -o ram volume starts out empty
+		if ((tfs_opts.ram && !tfs_opts.ram_persist) || !snapshot_exists(tfs_opts.snapshot)) {
 
-	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
-	dir_remove(*parent, baseName, strlen(baseName)) ;
+			fprintf(stderr, "%s: no snapshot named %s\n", diskfile_path, tfs_opts.snapshot) ;
+			return 1 ;
 
-	//printf("UNLINK FINISHED\n") ;
+		}
+		fuse_opt_add_arg(&args, "-oro") ;
 
-	return 0;
-}
+	}
 
-static int tfs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
+	if (tfs_opts.ram || tfs_opts.ram_persist) {
 
-static int tfs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
-}
+		device = &ram_device ;
 
-static int tfs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
+	}
 
-static int tfs_utimens(const char *path, const struct timespec tv[2]) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
+	// The path based API keeps its own copy of the cache timeouts, hand ours back to it
+	if (!tfs_opts.lowlevel) {
 
+		char timeouts[128] ;
+		snprintf(timeouts, sizeof(timeouts), "-oattr_timeout=%g,entry_timeout=%g,negative_timeout=%g",
+			tfs_opts.attr_timeout, tfs_opts.entry_timeout, tfs_opts.negative_timeout) ;
+		fuse_opt_add_arg(&args, timeouts) ;
 
-static struct fuse_operations tfs_ope = {
-	.init		= tfs_init,
-	.destroy	= tfs_destroy,
+	}
 
-	.getattr	= tfs_getattr,
-	.readdir	= tfs_readdir,
-	.opendir	= tfs_opendir,
-	.releasedir	= tfs_releasedir,
-	.mkdir		= tfs_mkdir,
-	.rmdir		= tfs_rmdir,
-
-	.create		= tfs_create,
-	.open		= tfs_open,
-	.read 		= tfs_read,
-	.write		= tfs_write,
-	.unlink		= tfs_unlink,
-
-	.truncate   = tfs_truncate,
-	.flush      = tfs_flush,
-	.utimens    = tfs_utimens,
-	.release	= tfs_release
-};
+	if (tfs_opts.lowlevel) {
 
+		fuse_stat = tfs_ll_main(&args) ;
 
-int main(int argc, char *argv[]) {
-	int fuse_stat;
+	} else {
 
-	getcwd(diskfile_path, PATH_MAX);
-	strcat(diskfile_path, "/DISKFILE");
+		fuse_stat = fuse_main(args.argc, args.argv, &tfs_ope, NULL);
 
-	fuse_stat = fuse_main(argc, argv, &tfs_ope, NULL);
+	}
+	fuse_opt_free_args(&args) ;
 
 	return fuse_stat;
 }
-
+#endif
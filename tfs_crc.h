@@ -0,0 +1,218 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_crc.h
+ *
+ *	CRC32C (Castagnoli) of blocks for -o checksum, see tfs_ext.h. Computed with the SSE4.2 crc32
+ *	instruction where the CPU has it and with tables otherwise, both give the same result.
+ *	Shared by tfs.c, tfs_fsck.c and the benchmarks.
+ *
+ */
+
+#ifndef _TFS_CRC_H
+#define _TFS_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // reflected
+#define CRC32C_LANE 1360 // bytes per stream when three run side by side, a third of a block rounded down to 8
+
+static uint32_t crc32c_table[8][256] ;
+static uint32_t crc32c_lane[4][256] ; // crc32c_lane[k][v]: CRC state v << 8k after CRC32C_LANE more zero bytes
+static int crc32c_mode = -1 ; // -1 not decided yet, 0 tables, 1 SSE4.2
+
+/*
+ * Slicing by 8: table k advances a byte that is followed by k more
+ */
+static void crc32c_init_tables() {
+
+	uint32_t i, j, c ;
+	for (i = 0 ; i < 256 ; i++) {
+
+		c = i ;
+		for (j = 0 ; j < 8 ; j++) {
+
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1 ;
+
+		}
+		crc32c_table[0][i] = c ;
+
+	}
+
+	for (i = 0 ; i < 256 ; i++) {
+
+		for (j = 1 ; j < 8 ; j++) {
+
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xFF] ;
+
+		}
+
+	}
+
+	// Running zeroes through the CRC is linear in its state, a byte of the state at a time is enough
+	for (j = 0 ; j < 4 ; j++) {
+
+		for (i = 0 ; i < 256 ; i++) {
+
+			uint32_t k ;
+			c = i << (8 * j) ;
+			for (k = 0 ; k < CRC32C_LANE ; k++) {
+
+				c = (c >> 8) ^ crc32c_table[0][c & 0xFF] ;
+
+			}
+			crc32c_lane[j][i] = c ;
+
+		}
+
+	}
+
+}
+
+/*
+ * State c after CRC32C_LANE zero bytes
+ */
+static uint32_t crc32c_shift(uint32_t c) {
+
+	return crc32c_lane[0][c & 0xFF] ^ crc32c_lane[1][(c >> 8) & 0xFF]
+		^ crc32c_lane[2][(c >> 16) & 0xFF] ^ crc32c_lane[3][c >> 24] ;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF] ;
+		len-- ;
+
+	}
+
+	while (len >= 8) {
+
+		uint64_t v ;
+		memcpy(&v, p, 8) ;
+		v ^= crc ;
+		crc = crc32c_table[7][v & 0xFF] ^ crc32c_table[6][(v >> 8) & 0xFF]
+			^ crc32c_table[5][(v >> 16) & 0xFF] ^ crc32c_table[4][(v >> 24) & 0xFF]
+			^ crc32c_table[3][(v >> 32) & 0xFF] ^ crc32c_table[2][(v >> 40) & 0xFF]
+			^ crc32c_table[1][(v >> 48) & 0xFF] ^ crc32c_table[0][v >> 56] ;
+		p += 8 ;
+		len -= 8 ;
+
+	}
+
+	while (len > 0) {
+
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF] ;
+		len-- ;
+
+	}
+
+	return crc ;
+}
+
+#if defined(__x86_64__)
+/*
+ * Eight bytes per instruction, built for SSE4.2 whatever the rest of the file is compiled for and
+ * only called once the CPU said it has it. The instruction takes three cycles but a new one can
+ * start every cycle, so three lanes of a block are run at once and joined with crc32c_shift():
+ * the CRC of a followed by b is that of a shifted past b's length, xored with b's own.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+
+	uint64_t c = crc ;
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+
+		c = _mm_crc32_u8((uint32_t)c, *p++) ;
+		len-- ;
+
+	}
+
+	while (len >= 3 * CRC32C_LANE) {
+
+		uint64_t c1 = 0, c2 = 0, v0, v1, v2 ;
+		size_t k ;
+		for (k = 0 ; k < CRC32C_LANE ; k += 8) {
+
+			memcpy(&v0, p + k, 8) ;
+			memcpy(&v1, p + CRC32C_LANE + k, 8) ;
+			memcpy(&v2, p + 2 * CRC32C_LANE + k, 8) ;
+			c = _mm_crc32_u64(c, v0) ;
+			c1 = _mm_crc32_u64(c1, v1) ;
+			c2 = _mm_crc32_u64(c2, v2) ;
+
+		}
+		c = crc32c_shift(crc32c_shift((uint32_t)c) ^ (uint32_t)c1) ^ (uint32_t)c2 ;
+		p += 3 * CRC32C_LANE ;
+		len -= 3 * CRC32C_LANE ;
+
+	}
+
+	while (len >= 8) {
+
+		uint64_t v ;
+		memcpy(&v, p, 8) ;
+		c = _mm_crc32_u64(c, v) ;
+		p += 8 ;
+		len -= 8 ;
+
+	}
+
+	while (len > 0) {
+
+		c = _mm_crc32_u8((uint32_t)c, *p++) ;
+		len-- ;
+
+	}
+
+	return (uint32_t)c ;
+}
+#endif
+
+/*
+ * Pick the implementation once, before the first CRC. Not thread safe, call it before starting any.
+ */
+static void crc32c_setup() {
+
+	if (crc32c_mode >= 0) {
+
+		return ;
+
+	}
+
+	crc32c_init_tables() ;
+	crc32c_mode = 0 ;
+#if defined(__x86_64__)
+	__builtin_cpu_init() ;
+	if (__builtin_cpu_supports("sse4.2")) {
+
+		crc32c_mode = 1 ;
+
+	}
+#endif
+
+}
+
+/*
+ * CRC32C of len bytes, continuing from crc (0 to start)
+ */
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+
+	crc = ~crc ;
+#if defined(__x86_64__)
+	if (crc32c_mode == 1) {
+
+		return ~crc32c_hw(crc, (const unsigned char *)buf, len) ;
+
+	}
+#endif
+	return ~crc32c_sw(crc, (const unsigned char *)buf, len) ;
+}
+
+#endif
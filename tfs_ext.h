@@ -0,0 +1,169 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_ext.h
+ *
+ *	On-disk additions to the original format, kept in the unused rest of block 0 after the
+ *	superblock so older diskfiles mount unchanged. Shared by tfs.c and tfs_fsck.c, include it
+ *	after block.h and tfs.h.
+ *
+ */
+
+#ifndef _TFS_EXT_H
+#define _TFS_EXT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TFS_EXT_MAGIC 0x58534654 // "TFSX", anything else there means none of it is in use yet
+#define TFS_EXT_OFFSET 512 // into block 0, well past struct superblock
+
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(struct inode))
+#define ITABLE_BLOCKS (MAX_INUM / INODES_PER_BLOCK)
+
+/*
+ * Shared blocks
+ * A data block may be pointed at by more than one inode table, indirect or inode block once
+ * snapshots exist. Its reference count is kept as the number of extra owners, so the table
+ * reads all zeroes for a filesystem that never shared anything. Counts are only pushed down
+ * one level at a time: copying a shared block adds one to everything it points at.
+ */
+#define REFS_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+#define REF_BLOCKS (MAX_DNUM / REFS_PER_BLOCK)
+#define REF_MAX 0xFFFF
+
+/*
+ * Compressed clusters, -o compress
+ * A file's logical blocks are grouped into clusters of CLUSTER_BLOCKS. A compressed cluster keeps
+ * its LZ4 stream in the blocks its first pointers name and the length of the stream, negated, in
+ * its last pointer, which never names a block then. Any other cluster is plain blocks.
+ */
+#define CLUSTER_BLOCKS 8
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define CLUSTER_MAX ((CLUSTER_BLOCKS - 1) * BLOCK_SIZE) // longest stream worth keeping
+
+#define TFS_FEATURE_CLUSTERS 0x1 // some file had a compressed cluster, reads have to look for them
+#define TFS_FEATURE_CSUM 0x2 // every block has a checksum, writers have to keep them up to date
+
+/*
+ * Block checksums, -o checksum
+ * A CRC32C (tfs_crc.h) of every block in front of the data region and of every data block, indexed
+ * by block number and kept in CSUM_BLOCKS blocks taken from the data region when checksums are
+ * turned on. Those are covered by csum_crc, block 0 by csum_self, which is computed with itself
+ * zeroed. Nothing else is trusted without its checksum once TFS_FEATURE_CSUM is set.
+ */
+#define CSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define CSUM_BLOCKS (MAX_DNUM / CSUMS_PER_BLOCK + 1) // one more for the blocks in front of the data region
+
+/*
+ * Symbolic links, struct inode type 2 next to 0 for files and 1 for directories
+ * A target shorter than SYMLINK_INLINE is kept in the inode itself, over its block pointers, which
+ * name no blocks then. A longer one has a block of its own in direct_ptr[0].
+ */
+#define TFS_SYMLINK 2
+#define SYMLINK_INLINE (sizeof(((struct inode *)0)->direct_ptr) + sizeof(((struct inode *)0)->indirect_ptr))
+#define SYMLINK_DATA(node) ((char *)(node) + offsetof(struct inode, direct_ptr))
+#define SYMLINK_IS_INLINE(node) ((node)->type == TFS_SYMLINK && (node)->size < SYMLINK_INLINE)
+
+/*
+ * Extended attributes
+ * All of an inode's attributes are kept together in one block named by its link field, 0 for
+ * none: a header, then the entries sorted by name, each padded to XATTR_ALIGN, then zeroes.
+ * Files with the same attributes thus have the same block contents and share one block, which
+ * is counted like any other shared block.
+ */
+#define XATTR_MAGIC 0x41585446 // "FTXA"
+#define XATTR_ALIGN 4
+
+struct tfs_xattr_hdr {
+
+	uint32_t magic ;
+	uint32_t count ; // entries
+	uint32_t used ; // bytes, the header included
+	uint32_t reserved ;
+
+} ;
+
+struct tfs_xattr_entry {
+
+	uint8_t name_len ; // the name isn't NUL terminated, the value follows it straight away
+	uint8_t reserved ;
+	uint16_t value_len ;
+
+} ;
+
+#define XATTR_ENTRY_SIZE(n, v) ((sizeof(struct tfs_xattr_entry) + (n) + (v) + XATTR_ALIGN - 1) & ~(size_t)(XATTR_ALIGN - 1))
+#define XATTR_FIRST(hdr) ((struct tfs_xattr_entry *)((struct tfs_xattr_hdr *)(hdr) + 1))
+#define XATTR_NEXT(e) ((struct tfs_xattr_entry *)((char *)(e) + XATTR_ENTRY_SIZE((e)->name_len, (e)->value_len)))
+#define XATTR_NAME(e) ((char *)((e) + 1))
+#define XATTR_VALUE(e) (XATTR_NAME(e) + (e)->name_len)
+
+/*
+ * Orphans
+ * An inode that lost its last name is freed in the background. Until then it stays valid with a
+ * link count of 0 on a list that starts at tfs_super_ext.orphans, each orphan naming the next
+ * one in ORPHAN_NEXT, which regular files, directories and symbolic links have no other use for.
+ * Both hold an inode number + 1, 0 ends the list. Mounting frees whatever is still on it.
+ * A directory on the list may still have entries, what they name joins the list once it is freed.
+ */
+#define ORPHAN_NEXT(node) ((node)->vstat.st_rdev)
+
+/*
+ * Quotas
+ * Blocks (as st_blocks counts them) and inodes in use per user, per group and per directory tree,
+ * with optional limits, in one block named by quota_blk once the first quota is set. Every inode
+ * records the tree it was created in as QUOTA_TREE, the inode number + 1 of the tree's directory
+ * or 0 for none; trees nest, an inode belongs to the innermost one.
+ */
+#define QUOTA_USER 1
+#define QUOTA_GROUP 2
+#define QUOTA_DIR 3
+
+struct tfs_quota {
+
+	uint8_t kind ; // QUOTA_*, 0 for a free slot
+	uint8_t reserved[3] ;
+	uint32_t id ; // uid, gid or the tree's directory inode number
+	uint32_t blocks ; // in use
+	uint32_t inodes ;
+	uint32_t block_limit ; // 0 for none
+	uint32_t inode_limit ;
+
+} ;
+
+#define QUOTAS_PER_BLOCK (BLOCK_SIZE / sizeof(struct tfs_quota))
+#define QUOTA_TREE(node) ((node)->vstat.st_dev)
+
+/*
+ * A read-only image of the whole tree: the inode table as it was when the snapshot was taken.
+ * Inode table blocks are never counted, they are shared for as long as more than one map
+ * (the live one or a snapshot's) names the same block.
+ */
+#define MAX_SNAPSHOTS 8
+#define SNAP_NAME_LEN 32
+
+struct tfs_snapshot {
+
+	char name[SNAP_NAME_LEN] ; // empty if the slot is free
+	int64_t created ;
+	uint32_t itable[ITABLE_BLOCKS] ;
+
+} ;
+
+struct tfs_super_ext {
+
+	uint32_t magic ;
+	uint32_t features ; // TFS_FEATURE_*
+	uint32_t ref_blk[REF_BLOCKS] ; // where the reference counts are, 0 until something is first shared
+	uint32_t itable[ITABLE_BLOCKS] ; // where each inode table block is now, 0 for i_start_blk + i
+	struct tfs_snapshot snap[MAX_SNAPSHOTS] ;
+	uint32_t csum_blk[CSUM_BLOCKS] ; // where the checksums are, TFS_FEATURE_CSUM only
+	uint32_t csum_crc[CSUM_BLOCKS] ; // checksum of each of those
+	uint32_t csum_self ; // checksum of block 0
+	uint32_t orphans ; // first orphan + 1, 0 for none
+	uint32_t quota_blk ; // where the quotas are, 0 until the first one is set
+
+} ;
+
+#define TFS_CSUM_SELF (TFS_EXT_OFFSET + offsetof(struct tfs_super_ext, csum_self)) // into block 0
+
+#endif
@@ -0,0 +1,1428 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_fsck.c
+ *
+ *	Offline consistency checker for tfs diskfiles. The filesystem must not be mounted.
+ *
+ *	Build:
+ *		gcc -std=gnu99 -O2 -Wall -D_FILE_OFFSET_BITS=64 tfs_fsck.c block.c -o tfs_fsck -lpthread
+ *
+ *	Usage: tfs_fsck [-r] [-j threads] [-v] diskfile
+ *		-r	repair what is found, otherwise the diskfile is only read
+ *		-j	number of threads, one per online CPU by default
+ *		-v	print every problem and how long each pass took
+ *
+ *	Exit status follows e2fsck: 0 clean, 1 errors were repaired, 4 errors left, 8 could not check.
+ *
+ *	Pass 1 scans the inode table and claims every block an inode points at, pass 2 reads every
+ *	directory. Both split their work over the threads, which share nothing but a few arrays
+ *	indexed by inode or block number that are updated with atomics. Memory use is bounded by
+ *	the size of the filesystem (a few bytes per inode and per data block) plus one block buffer
+ *	per thread, never by how much data the files hold.
+ *
+ *	Snapshots (see tfs_ext.h) only take part in pass 1: their inode tables claim blocks like
+ *	the live one, and once anything is shared a block is expected to be claimed as often as its
+ *	reference count says instead of once. Repairs never touch a block a snapshot still has.
+ *
+ *	The last pointer of a compressed cluster holds the length of its stream (see tfs_ext.h),
+ *	which is not taken for a block pointer.
+ *
+ *	An image with block checksums has every block in use checked against its CRC32C once the
+ *	passes are through. Repairs enter new checksums for what they wrote and accept whatever the
+ *	blocks that failed hold now, so they can be read again.
+ *
+ *	Orphans (see tfs_ext.h) are in use until the next mount frees them, they need no name. A list
+ *	that goes wrong is cut off there, what was past that point is then unreachable like any other.
+ *	A directory on the list can still name a whole tree, which counts as reachable through it.
+ *
+ *	Quotas are counted again from the live inode table once repairs are done.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "tfs_ext.h"
+#include "tfs_crc.h"
+
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(struct dirent))
+#define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(int))
+#define NO_PARENT -1
+#define TABLE_OWNER MAX_INUM // owner of inode table and reference count blocks, not an inode
+
+/*
+ * Where an inode keeps a block pointer: direct_ptr[idx] if ind < 0, indirect_ptr[ind] if idx < 0,
+ * link (its attributes) if both are, entry idx of indirect block ind otherwise
+ */
+struct ptr_ref {
+
+	uint16_t ino ;
+	int16_t ind ;
+	int16_t idx ;
+	int blkno ;
+	struct ptr_ref * next ;
+
+} ;
+
+/*
+ * Directory entry pointing at an inode that isn't there
+ */
+struct dirent_ref {
+
+	uint16_t dir ;
+	int blkno ;
+	int slot ;
+	uint16_t ino ;
+	struct dirent_ref * next ;
+
+} ;
+
+struct fsck_inode {
+
+	uint8_t valid ;
+	uint8_t type ;
+	uint8_t bad ; // unusable, cleared when repairing
+	uint8_t reachable ; // 0 unknown, 1 yes, 2 no, 3 being looked at
+	uint8_t orphan ; // on the orphan list
+	uint32_t refs ; // directory entries naming it, "." and ".." aside
+	int32_t parent ; // first directory found naming it
+	int32_t dotdot ; // what its ".." says, directories only
+	uint32_t nlink ;
+
+} ;
+
+static struct superblock sb ;
+static struct tfs_super_ext ext ; // all zero for an image that never had a snapshot
+static int counted = 0 ; // blocks have reference counts, sharing them is no error
+static int quotas = 0 ; // there is a quota table of its own to check
+static int data_blocks ; // data blocks the diskfile actually has room for
+static int threads ;
+static int verbose = 0 ;
+static int repair = 0 ;
+
+static struct fsck_inode inodes[MAX_INUM] ;
+static uint16_t * owner ; // per data block: first inode + 1 to claim it, 0 if none
+static uint8_t * claims ; // per data block: how many pointers lead to it, saturating
+
+static struct ptr_ref * dups = NULL ; // every pointer to a block that was already claimed
+static struct ptr_ref * bad_ptrs = NULL ; // pointers outside the data region
+static struct dirent_ref * dangling = NULL ;
+
+static uint32_t * csums = NULL ; // the checksum table, NULL for an image without one
+static uint32_t csum_stale = 0 ; // table blocks that failed their own check, what they cover isn't checked
+static int csum_end ; // blocks the table covers
+static uint8_t * resealed ; // per block number: gets a new checksum once repairs are done
+static int csum_errors = 0 ; // checksum problems, csum_reseal() takes care of all of them
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER ;
+
+static int errors = 0 ; // problems found
+static int fixed = 0 ; // problems repaired
+
+// Work handed out to the threads of a pass, by index
+static volatile int cursor ;
+static int work_items ;
+static uint16_t * dirs ;
+
+/*
+ * An inode table block to scan in pass 1, the live tree's slot t or one only snapshots name
+ */
+struct table_ref {
+
+	int blkno ;
+	int t ;
+	int live ;
+
+} ;
+
+static struct table_ref tables[ITABLE_BLOCKS * (MAX_SNAPSHOTS + 1)] ;
+
+
+static void problem(const char *fmt, ...) __attribute__((format(printf, 1, 2))) ;
+
+static void problem(const char *fmt, ...) {
+
+	va_list ap ;
+	__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED) ;
+	if (verbose) {
+
+		va_start(ap, fmt) ;
+		pthread_mutex_lock(&list_lock) ;
+		vprintf(fmt, ap) ;
+		pthread_mutex_unlock(&list_lock) ;
+		va_end(ap) ;
+
+	}
+
+}
+
+static double now_ms() {
+
+	struct timespec ts ;
+	clock_gettime(CLOCK_MONOTONIC, &ts) ;
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6 ;
+}
+
+static int next_item() {
+
+	return __atomic_fetch_add(&cursor, 1, __ATOMIC_RELAXED) ;
+}
+
+static void run_pass(const char *name, void *(*fn)(void *), int items) {
+
+	pthread_t * t = (pthread_t *)malloc(threads * sizeof(pthread_t)) ;
+	double start = now_ms() ;
+	int i ;
+
+	cursor = 0 ;
+	work_items = items ;
+	for (i = 0 ; i < threads ; i++) {
+
+		pthread_create(&t[i], NULL, fn, NULL) ;
+
+	}
+	for (i = 0 ; i < threads ; i++) {
+
+		pthread_join(t[i], NULL) ;
+
+	}
+	free(t) ;
+
+	if (verbose) {
+
+		printf("%s: %.1f ms\n", name, now_ms() - start) ;
+
+	}
+
+}
+
+static void add_ref(struct ptr_ref **list, uint16_t ino, int ind, int idx, int blkno) {
+
+	struct ptr_ref * r = (struct ptr_ref *)malloc(sizeof(struct ptr_ref)) ;
+	r->ino = ino ;
+	r->ind = ind ;
+	r->idx = idx ;
+	r->blkno = blkno ;
+	pthread_mutex_lock(&list_lock) ;
+	r->next = *list ;
+	*list = r ;
+	pthread_mutex_unlock(&list_lock) ;
+
+}
+
+static int data_index(int blkno) {
+
+	int i = blkno - (int)sb.d_start_blk ;
+	return (i >= 0 && i < data_blocks) ? i : -1 ;
+}
+
+static int table_blk(int t) {
+
+	return ext.itable[t] != 0 ? (int)ext.itable[t] : (int)sb.i_start_blk + t ;
+}
+
+/*
+ * Whether a snapshot names the live inode table block holding ino, it can't be written then
+ */
+static int frozen_inode(uint16_t ino) {
+
+	int t = ino / INODES_PER_BLOCK ;
+	int k ;
+	for (k = 0 ; k < MAX_SNAPSHOTS ; k++) {
+
+		if (ext.snap[k].name[0] != '\0' && ext.snap[k].itable[t] == table_blk(t)) {
+
+			return 1 ;
+
+		}
+
+	}
+
+	return 0 ;
+}
+
+/*
+ * Whether a data block has another owner besides the one about to be repaired
+ */
+static int frozen_block(int blkno) {
+
+	int i = data_index(blkno) ;
+	return counted && i >= 0 && claims[i] > 1 ;
+}
+
+
+/*
+ * Pass 1: inode table
+ */
+/*
+ * Returns 1 for the first claim of a block, 0 for later ones and -1 if it is out of range
+ * Pointers of snapshots (live 0) are only counted, nothing is ever done about them.
+ */
+static int claim(uint16_t ino, int ind, int idx, int blkno, int live) {
+
+	int i = data_index(blkno) ;
+	if (i < 0) {
+
+		problem("%sinode %d: block pointer %d is outside the data region\n", live ? "" : "snapshot ", ino, blkno) ;
+		if (live) {
+
+			add_ref(&bad_ptrs, ino, ind, idx, blkno) ;
+
+		}
+		return -1 ;
+
+	}
+
+	uint16_t none = 0 ;
+	int first = __atomic_compare_exchange_n(&owner[i], &none, ino + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ;
+	if (!first && !counted) {
+
+		problem("inode %d: block %d is also used by inode %d\n", ino, blkno, owner[i] - 1) ;
+		add_ref(&dups, ino, ind, idx, blkno) ;
+
+	}
+
+	uint8_t n = __atomic_load_n(&claims[i], __ATOMIC_RELAXED) ;
+	while (n < 255 && !__atomic_compare_exchange_n(&claims[i], &n, n + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+
+	return first ;
+}
+
+/*
+ * Whether ptr, logical block index of a file, is the length a compressed cluster keeps instead of a block
+ */
+static int cluster_length(struct inode *node, int index, int ptr) {
+
+	return node->type == 0 && index % CLUSTER_BLOCKS == CLUSTER_BLOCKS - 1 && ptr < 0 && -ptr <= CLUSTER_MAX ;
+}
+
+/*
+ * Whether an attribute block's entries add up to what its header says
+ */
+static int xattr_ok(int blkno) {
+
+	struct tfs_xattr_hdr * hdr = (struct tfs_xattr_hdr *)malloc(BLOCK_SIZE) ;
+	struct tfs_xattr_entry * e = XATTR_FIRST(hdr) ;
+	uint32_t i ;
+	bio_read(blkno, hdr) ;
+	char * end = (char *)hdr + hdr->used ;
+	int ok = hdr->magic == XATTR_MAGIC && hdr->count > 0 && hdr->used <= BLOCK_SIZE ;
+	for (i = 0 ; ok && i < hdr->count ; i++) {
+
+		ok = (char *)e + sizeof(struct tfs_xattr_entry) <= end && e->name_len > 0 ;
+		e = XATTR_NEXT(e) ;
+
+	}
+	ok = ok && (char *)e == end ;
+	free(hdr) ;
+
+	return ok ;
+}
+
+static void check_inode(struct inode *node, uint16_t ino, int *ptrs, int live) {
+
+	int i, j ;
+	struct fsck_inode * fi = &inodes[ino] ;
+
+	if (live) {
+
+		fi->valid = 1 ;
+		fi->type = node->type ;
+		fi->nlink = node->vstat.st_nlink ;
+
+	}
+	if (node->ino != ino || (node->type != 0 && node->type != 1 && node->type != TFS_SYMLINK)
+		|| (node->type == TFS_SYMLINK && node->size >= BLOCK_SIZE)) {
+
+		problem("%sinode %d: bad header (ino %d, type %d)\n", live ? "" : "snapshot ", ino, node->ino, node->type) ;
+		fi->bad |= live ;
+		return ;
+
+	}
+
+	// Attributes, a shared block is looked at by whoever claims it first
+	if (node->link != 0 && claim(ino, -1, -1, node->link, live) == 1 && !xattr_ok(node->link)) {
+
+		problem("%sinode %d: attribute block %d is damaged\n", live ? "" : "snapshot ", ino, node->link) ;
+		if (live) {
+
+			add_ref(&bad_ptrs, ino, -1, -1, node->link) ;
+
+		}
+
+	}
+
+	if (SYMLINK_IS_INLINE(node)) {
+
+		return ; // no pointers, the target is in their place
+
+	}
+
+	// Directories end at their first empty direct pointer, files may have holes
+	for (i = 0 ; i < 16 ; i++) {
+
+		if (node->direct_ptr[i] == 0) {
+
+			if (node->type == 1) {
+
+				break ;
+
+			}
+			continue ;
+
+		}
+		if (!cluster_length(node, i, node->direct_ptr[i])) {
+
+			claim(ino, -1, i, node->direct_ptr[i], live) ;
+
+		}
+
+	}
+
+	// A shared indirect block counts once for what it points at, whoever claims it first reads it
+	for (i = 0 ; i < 8 ; i++) {
+
+		if (node->indirect_ptr[i] == 0) {
+
+			continue ;
+
+		}
+
+		int first = claim(ino, i, -1, node->indirect_ptr[i], live) ;
+		if (first < 0 || (counted && !first)) {
+
+			continue ;
+
+		}
+
+		bio_read(node->indirect_ptr[i], ptrs) ;
+		for (j = 0 ; j < PTRS_PER_BLOCK ; j++) {
+
+			if (ptrs[j] != 0 && !cluster_length(node, 16 + i * PTRS_PER_BLOCK + j, ptrs[j])) {
+
+				claim(ino, i, j, ptrs[j], live) ;
+
+			}
+
+		}
+
+	}
+
+}
+
+static void *pass1(void *arg) {
+
+	struct inode * table = (struct inode *)malloc(BLOCK_SIZE) ;
+	int * ptrs = (int *)malloc(BLOCK_SIZE) ;
+	int item ;
+
+	while ((item = next_item()) < work_items) {
+
+		struct table_ref * r = &tables[item] ;
+		int i ;
+		bio_read(r->blkno, table) ;
+		for (i = 0 ; i < INODES_PER_BLOCK ; i++) {
+
+			if (table[i].valid) {
+
+				check_inode(&table[i], r->t * INODES_PER_BLOCK + i, ptrs, r->live) ;
+
+			}
+
+		}
+
+	}
+
+	free(table) ;
+	free(ptrs) ;
+	return NULL ;
+}
+
+
+/*
+ * Pass 2: directories
+ */
+static void check_dirent(uint16_t dir, int blkno, int slot, struct dirent *d) {
+
+	// Checked against the parent found in step 5, an orphan's parent may be gone already
+	if (strcmp(d->name, "..") == 0) {
+
+		inodes[dir].dotdot = d->ino ;
+		return ;
+
+	}
+
+	if (d->ino >= MAX_INUM || !inodes[d->ino].valid || inodes[d->ino].bad) {
+
+		problem("directory %d: entry \"%.*s\" points at missing inode %d\n", dir,
+			(int)sizeof(d->name), d->name, d->ino) ;
+		struct dirent_ref * r = (struct dirent_ref *)malloc(sizeof(struct dirent_ref)) ;
+		r->dir = dir ;
+		r->blkno = blkno ;
+		r->slot = slot ;
+		r->ino = d->ino ;
+		pthread_mutex_lock(&list_lock) ;
+		r->next = dangling ;
+		dangling = r ;
+		pthread_mutex_unlock(&list_lock) ;
+		return ;
+
+	}
+
+	if (strcmp(d->name, ".") == 0) {
+
+		if (d->ino != dir) {
+
+			problem("directory %d: \".\" points at %d\n", dir, d->ino) ;
+
+		}
+		return ;
+
+	}
+
+	__atomic_add_fetch(&inodes[d->ino].refs, 1, __ATOMIC_RELAXED) ;
+	int32_t none = NO_PARENT ;
+	__atomic_compare_exchange_n(&inodes[d->ino].parent, &none, dir, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ;
+
+}
+
+static void *pass2(void *arg) {
+
+	struct inode * table = (struct inode *)malloc(BLOCK_SIZE) ;
+	struct dirent * entries = (struct dirent *)malloc(BLOCK_SIZE) ;
+	int item ;
+
+	while ((item = next_item()) < work_items) {
+
+		uint16_t dir = dirs[item] ;
+		int i, j ;
+		bio_read(table_blk(dir / INODES_PER_BLOCK), table) ;
+		struct inode * node = &table[dir % INODES_PER_BLOCK] ;
+
+		for (i = 0 ; i < 16 && node->direct_ptr[i] != 0 ; i++) {
+
+			if (data_index(node->direct_ptr[i]) < 0) {
+
+				continue ;
+
+			}
+
+			bio_read(node->direct_ptr[i], entries) ;
+			for (j = 0 ; j < DIRENTS_PER_BLOCK ; j++) {
+
+				if (entries[j].valid) {
+
+					entries[j].name[sizeof(entries[j].name) - 1] = '\0' ;
+					check_dirent(dir, node->direct_ptr[i], j, &entries[j]) ;
+
+				}
+
+			}
+
+		}
+
+	}
+
+	free(table) ;
+	free(entries) ;
+	return NULL ;
+}
+
+/*
+ * Follow first parents up to the root or an orphan, a loop or a dead end makes the whole chain
+ * unreachable
+ */
+static int reachable(uint16_t ino) {
+
+	struct fsck_inode * fi = &inodes[ino] ;
+	if (fi->reachable == 0) {
+
+		fi->reachable = 3 ;
+		if (ino == 0 || fi->orphan) {
+
+			fi->reachable = 1 ;
+
+		} else if (fi->parent == NO_PARENT || inodes[fi->parent].type != 1) {
+
+			fi->reachable = 2 ;
+
+		} else {
+
+			fi->reachable = reachable(fi->parent) == 1 ? 1 : 2 ;
+
+		}
+
+	}
+
+	return fi->reachable == 1 ;
+}
+
+
+/*
+ * Repairs, done by one thread once both passes are through
+ */
+static void read_inode(uint16_t ino, struct inode *node) {
+
+	struct inode * table = (struct inode *)malloc(BLOCK_SIZE) ;
+	bio_read(table_blk(ino / INODES_PER_BLOCK), table) ;
+	*node = table[ino % INODES_PER_BLOCK] ;
+	free(table) ;
+
+}
+
+/*
+ * Every block repairs change goes through here, so its checksum can be brought up to date
+ */
+static void write_block(int blkno, void *buf) {
+
+	bio_write(blkno, buf) ;
+	if (csums != NULL && blkno > 0 && blkno < csum_end) {
+
+		resealed[blkno] = 1 ;
+
+	}
+
+}
+
+static void write_inode(uint16_t ino, struct inode *node) {
+
+	struct inode * table = (struct inode *)malloc(BLOCK_SIZE) ;
+	bio_read(table_blk(ino / INODES_PER_BLOCK), table) ;
+	table[ino % INODES_PER_BLOCK] = *node ;
+	write_block(table_blk(ino / INODES_PER_BLOCK), table) ;
+	free(table) ;
+
+}
+
+/*
+ * Follow the orphan list, every inode on it has to be valid, unnamed and on it only once. Where
+ * that isn't so the list ends, or just goes past an orphan that still has names. Runs after pass 2.
+ */
+static void check_orphans() {
+
+	struct inode node ;
+	int prev = -1, n = 0 ;
+	uint32_t next = ext.orphans ;
+
+	while (next != 0) {
+
+		int ino = next - 1 ;
+		const char * why = NULL ;
+		if (ino <= 0 || ino >= MAX_INUM || !inodes[ino].valid || inodes[ino].bad) {
+
+			why = "is no inode in use" ;
+
+		} else if (inodes[ino].orphan || n++ >= MAX_INUM) {
+
+			why = "is on the list twice" ;
+
+		} else if (inodes[ino].nlink != 0 && inodes[ino].refs == 0) {
+
+			why = "has a link count" ;
+
+		}
+
+		if (why == NULL) {
+
+			read_inode(ino, &node) ;
+			next = ORPHAN_NEXT(&node) ;
+			if (inodes[ino].refs == 0) {
+
+				inodes[ino].orphan = 1 ;
+				prev = ino ;
+				continue ;
+
+			}
+
+			// Still named, it stays and leaves the list
+			problem("orphan list: inode %d has %d names\n", ino, inodes[ino].refs) ;
+
+		} else {
+
+			problem("orphan list: entry %d %s\n", ino, why) ;
+			next = 0 ;
+
+		}
+
+		if (repair) {
+
+			if (prev < 0) {
+
+				char * block = (char *)malloc(BLOCK_SIZE) ;
+				ext.orphans = next ;
+				bio_read(0, block) ;
+				memcpy(block + TFS_EXT_OFFSET, &ext, sizeof(ext)) ;
+				bio_write(0, block) ; // csum_reseal() does block 0 again with checksums
+				free(block) ;
+
+			} else {
+
+				read_inode(prev, &node) ;
+				ORPHAN_NEXT(&node) = next ;
+				write_inode(prev, &node) ;
+
+			}
+			fixed++ ;
+
+		}
+
+	}
+
+}
+
+static void unclaim(int blkno) {
+
+	int i = data_index(blkno) ;
+	if (i >= 0 && claims[i] > 0 && claims[i] < 255) {
+
+		claims[i]-- ;
+
+	}
+
+}
+
+/*
+ * Drop an unreachable or broken inode and give back the blocks it claimed
+ */
+static void free_inode(uint16_t ino) {
+
+	struct inode node ;
+	int * ptrs = (int *)malloc(BLOCK_SIZE) ;
+	int i, j ;
+
+	read_inode(ino, &node) ;
+	if (SYMLINK_IS_INLINE(&node)) {
+
+		memset(SYMLINK_DATA(&node), 0, SYMLINK_INLINE) ; // the target, nothing claimed
+
+	}
+	unclaim(node.link) ;
+	for (i = 0 ; i < 16 ; i++) {
+
+		unclaim(node.direct_ptr[i]) ;
+
+	}
+	for (i = 0 ; i < 8 ; i++) {
+
+		if (data_index(node.indirect_ptr[i]) >= 0 && !frozen_block(node.indirect_ptr[i])) {
+
+			bio_read(node.indirect_ptr[i], ptrs) ;
+			for (j = 0 ; j < PTRS_PER_BLOCK ; j++) {
+
+				unclaim(ptrs[j]) ;
+
+			}
+
+		}
+		unclaim(node.indirect_ptr[i]) ;
+
+	}
+	free(ptrs) ;
+
+	memset(&node, 0, sizeof(node)) ;
+	write_inode(ino, &node) ;
+	inodes[ino].valid = 0 ;
+
+}
+
+/*
+ * Rewrite one block pointer of an inode
+ */
+static void set_ptr(struct ptr_ref *r, int blkno) {
+
+	struct inode node ;
+	read_inode(r->ino, &node) ;
+	if (r->ind < 0 && r->idx < 0) {
+
+		node.link = blkno ;
+		write_inode(r->ino, &node) ;
+
+	} else if (r->ind < 0) {
+
+		node.direct_ptr[r->idx] = blkno ;
+		write_inode(r->ino, &node) ;
+
+	} else if (r->idx < 0) {
+
+		node.indirect_ptr[r->ind] = blkno ;
+		write_inode(r->ino, &node) ;
+
+	} else {
+
+		int * ptrs = (int *)malloc(BLOCK_SIZE) ;
+		bio_read(node.indirect_ptr[r->ind], ptrs) ;
+		ptrs[r->idx] = blkno ;
+		write_block(node.indirect_ptr[r->ind], ptrs) ;
+		free(ptrs) ;
+
+	}
+
+}
+
+static int free_data_block() {
+
+	static int next = 0 ;
+	for ( ; next < data_blocks ; next++) {
+
+		if (claims[next] == 0) {
+
+			claims[next] = 1 ;
+			return sb.d_start_blk + next++ ;
+
+		}
+
+	}
+
+	return -1 ;
+}
+
+static void do_repairs() {
+
+	struct ptr_ref * r ;
+	struct dirent_ref * d ;
+	int i ;
+
+	// Step 1: Inodes nobody can reach, or that are beyond saving
+	// Whatever a snapshot still has is left alone here and below, it goes once the snapshot does
+	for (i = 1 ; i < MAX_INUM ; i++) {
+
+		if (inodes[i].valid && (inodes[i].bad || !reachable(i)) && !inodes[i].orphan && !frozen_inode(i)) {
+
+			free_inode(i) ;
+			fixed++ ;
+
+		}
+
+	}
+
+	// Step 2: Entries for inodes that don't exist (any longer)
+	struct dirent * entries = (struct dirent *)malloc(BLOCK_SIZE) ;
+	for (d = dangling ; d != NULL ; d = d->next) {
+
+		if (!inodes[d->dir].valid || frozen_block(d->blkno)) {
+
+			continue ; // went away with its directory
+
+		}
+
+		bio_read(d->blkno, entries) ;
+		entries[d->slot].valid = 0 ;
+		write_block(d->blkno, entries) ;
+		fixed++ ;
+
+	}
+	free(entries) ;
+
+	// Step 3: Pointers that lead nowhere
+	for (r = bad_ptrs ; r != NULL ; r = r->next) {
+
+		if (inodes[r->ino].valid && !frozen_inode(r->ino)) {
+
+			set_ptr(r, 0) ;
+			unclaim(r->blkno) ; // a damaged attribute block, nothing outside the data region
+			fixed++ ;
+
+		}
+
+	}
+
+	// Step 4: Blocks shared between inodes, every later claimer gets a copy of its own
+	char * copy = (char *)malloc(BLOCK_SIZE) ;
+	for (r = dups ; r != NULL ; r = r->next) {
+
+		int idx = data_index(r->blkno) ;
+		if (!inodes[r->ino].valid || claims[idx] <= 1) {
+
+			continue ; // the other claimer was freed above
+
+		}
+
+		int blkno = free_data_block() ;
+		if (blkno < 0) {
+
+			fprintf(stderr, "no free block left to copy block %d for inode %d\n", r->blkno, r->ino) ;
+			continue ;
+
+		}
+
+		bio_read(r->blkno, copy) ;
+		write_block(blkno, copy) ;
+		set_ptr(r, blkno) ;
+		unclaim(r->blkno) ;
+		fixed++ ;
+
+	}
+	free(copy) ;
+
+	// Step 5: Link counts of regular files and symbolic links
+	for (i = 1 ; i < MAX_INUM ; i++) {
+
+		if (inodes[i].valid && inodes[i].type != 1 && inodes[i].nlink != inodes[i].refs && !frozen_inode(i)) {
+
+			struct inode node ;
+			read_inode(i, &node) ;
+			node.vstat.st_nlink = inodes[i].refs ;
+			write_inode(i, &node) ;
+			fixed++ ;
+
+		}
+
+	}
+
+}
+
+
+/*
+ * Compare a bitmap with what it should be, and write the expected one back if repairing
+ */
+static void check_bitmap(const char *what, int blkno, int bits, int (*in_use)(int)) {
+
+	bitmap_t map = (bitmap_t)malloc(BLOCK_SIZE) ;
+	int i, wrong = 0 ;
+
+	bio_read(blkno, map) ;
+	for (i = 0 ; i < bits ; i++) {
+
+		int expect = in_use(i) ;
+		if (get_bitmap(map, i) != expect) {
+
+			problem("%s bitmap: bit %d is %d, should be %d\n", what, i, !expect, expect) ;
+			wrong++ ;
+			if (expect) {
+
+				set_bitmap(map, i) ;
+
+			} else {
+
+				unset_bitmap(map, i) ;
+
+			}
+
+		}
+
+	}
+
+	if (repair && wrong > 0) {
+
+		write_block(blkno, map) ;
+		fixed += wrong ;
+
+	}
+	free(map) ;
+
+}
+
+/*
+ * Every shared block should have one owner more than its count says it has extra
+ */
+static void check_refs() {
+
+	uint16_t * shares = (uint16_t *)malloc(BLOCK_SIZE) ;
+	int b, i ;
+
+	for (b = 0 ; b < REF_BLOCKS ; b++) {
+
+		int wrong = 0 ;
+		bio_read(ext.ref_blk[b], shares) ;
+		for (i = 0 ; i < REFS_PER_BLOCK && b * REFS_PER_BLOCK + i < data_blocks ; i++) {
+
+			int n = claims[b * REFS_PER_BLOCK + i] ;
+			int expect = n > 0 ? n - 1 : 0 ;
+			if (n < 255 && shares[i] != expect) {
+
+				problem("block %d: %d owners, but the reference count says %d\n",
+					(int)(sb.d_start_blk + b * REFS_PER_BLOCK + i), n, shares[i] + 1) ;
+				shares[i] = expect ;
+				wrong++ ;
+
+			}
+
+		}
+
+		if (repair && wrong > 0) {
+
+			write_block(ext.ref_blk[b], shares) ;
+			fixed += wrong ;
+
+		}
+
+	}
+	free(shares) ;
+
+}
+
+/*
+ * What each quota counts should be what the live inode table has of its user, group or tree
+ */
+static void check_quotas() {
+
+	struct tfs_quota * q = (struct tfs_quota *)malloc(BLOCK_SIZE) ;
+	struct inode * table = (struct inode *)malloc(BLOCK_SIZE) ;
+	uint32_t blocks[QUOTAS_PER_BLOCK], count[QUOTAS_PER_BLOCK] ;
+	int t, i, k, wrong = 0 ;
+
+	bio_read(ext.quota_blk, q) ;
+	memset(blocks, 0, sizeof(blocks)) ;
+	memset(count, 0, sizeof(count)) ;
+	for (t = 0 ; t < ITABLE_BLOCKS ; t++) {
+
+		bio_read(table_blk(t), table) ;
+		for (i = 0 ; i < INODES_PER_BLOCK ; i++) {
+
+			struct inode * node = &table[i] ;
+			if (!node->valid) {
+
+				continue ;
+
+			}
+
+			for (k = 0 ; k < QUOTAS_PER_BLOCK ; k++) {
+
+				if ((q[k].kind == QUOTA_USER && q[k].id == node->vstat.st_uid)
+					|| (q[k].kind == QUOTA_GROUP && q[k].id == node->vstat.st_gid)
+					|| (q[k].kind == QUOTA_DIR && q[k].id + 1 == QUOTA_TREE(node))) {
+
+					blocks[k] += node->vstat.st_blocks ;
+					count[k]++ ;
+
+				}
+
+			}
+
+		}
+
+	}
+
+	for (k = 0 ; k < QUOTAS_PER_BLOCK ; k++) {
+
+		if (q[k].kind != 0 && (q[k].blocks != blocks[k] || q[k].inodes != count[k])) {
+
+			problem("quota %d (kind %d, id %u): counts %u blocks and %u inodes, %u and %u are in use\n", k,
+				q[k].kind, q[k].id, q[k].blocks, q[k].inodes, blocks[k], count[k]) ;
+			q[k].blocks = blocks[k] ;
+			q[k].inodes = count[k] ;
+			wrong++ ;
+
+		}
+
+	}
+
+	if (repair && wrong > 0) {
+
+		write_block(ext.quota_blk, q) ;
+		fixed += wrong ;
+
+	}
+	free(table) ;
+	free(q) ;
+
+}
+
+/*
+ * Checksums: every block in front of the data region and every data block in use
+ */
+static int csum_block(int blkno) {
+
+	int i ;
+	for (i = 0 ; i < CSUM_BLOCKS ; i++) {
+
+		if ((int)ext.csum_blk[i] == blkno) {
+
+			return 1 ;
+
+		}
+
+	}
+
+	return 0 ;
+}
+
+static int csum_checked(int blkno) {
+
+	if (blkno <= 0 || blkno >= csum_end || (csum_stale & (1U << (blkno / CSUMS_PER_BLOCK))) || csum_block(blkno)) {
+
+		return 0 ;
+
+	}
+
+	int i = data_index(blkno) ;
+	return blkno < (int)sb.d_start_blk || (i >= 0 && claims[i] > 0) ;
+}
+
+static void *pass_csum(void *arg) {
+
+	char * buf = (char *)malloc(BLOCK_SIZE) ;
+	int blkno ;
+
+	while ((blkno = next_item()) < work_items) {
+
+		if (!csum_checked(blkno)) {
+
+			continue ;
+
+		}
+
+		bio_read(blkno, buf) ;
+		uint32_t crc = crc32c(0, buf, BLOCK_SIZE) ;
+		if (crc != csums[blkno]) {
+
+			problem("block %d: checksum %08x, expected %08x\n", blkno, crc, csums[blkno]) ;
+			__atomic_add_fetch(&csum_errors, 1, __ATOMIC_RELAXED) ;
+			resealed[blkno] = 1 ;
+
+		}
+
+	}
+
+	free(buf) ;
+	return NULL ;
+}
+
+/*
+ * Checksum of block 0 as if its csum_self were zero
+ */
+static uint32_t super_crc(char *block) {
+
+	uint32_t saved ;
+	memcpy(&saved, block + TFS_CSUM_SELF, sizeof(saved)) ;
+	memset(block + TFS_CSUM_SELF, 0, sizeof(saved)) ;
+	uint32_t crc = crc32c(0, block, BLOCK_SIZE) ;
+	memcpy(block + TFS_CSUM_SELF, &saved, sizeof(saved)) ;
+	return crc ;
+}
+
+/*
+ * After repairs: new checksums for the blocks they wrote and the ones that failed, whole table
+ * blocks for those that were damaged, then the table and block 0
+ */
+static void csum_reseal() {
+
+	char * buf = (char *)malloc(BLOCK_SIZE) ;
+	int blkno, b ;
+	uint32_t dirty = csum_stale ;
+
+	for (blkno = 1 ; blkno < csum_end ; blkno++) {
+
+		int stale = csum_stale & (1U << (blkno / CSUMS_PER_BLOCK)) ;
+		if ((resealed[blkno] || stale) && !csum_block(blkno)
+			&& (blkno < (int)sb.d_start_blk || data_index(blkno) >= 0)) {
+
+			bio_read(blkno, buf) ;
+			csums[blkno] = crc32c(0, buf, BLOCK_SIZE) ;
+			dirty |= 1U << (blkno / CSUMS_PER_BLOCK) ;
+
+		}
+
+	}
+
+	for (b = 0 ; b < CSUM_BLOCKS ; b++) {
+
+		if ((dirty & (1U << b)) && data_index(ext.csum_blk[b]) >= 0) {
+
+			ext.csum_crc[b] = crc32c(0, csums + b * CSUMS_PER_BLOCK, BLOCK_SIZE) ;
+			bio_write(ext.csum_blk[b], csums + b * CSUMS_PER_BLOCK) ;
+
+		}
+
+	}
+
+	bio_read(0, buf) ;
+	memcpy(buf + TFS_EXT_OFFSET, &ext, sizeof(ext)) ;
+	ext.csum_self = super_crc(buf) ;
+	memcpy(buf + TFS_CSUM_SELF, &ext.csum_self, sizeof(ext.csum_self)) ;
+	bio_write(0, buf) ;
+	free(buf) ;
+	fixed += csum_errors ;
+
+}
+
+static int inode_in_use(int i) {
+
+	return inodes[i].valid && (repair ? 1 : !inodes[i].bad) ;
+}
+
+static int block_in_use(int i) {
+
+	return i < data_blocks && claims[i] > 0 ;
+}
+
+int main(int argc, char *argv[]) {
+
+	struct stat st ;
+	int c, i ;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN) ;
+	while ((c = getopt(argc, argv, "rj:v")) != -1) {
+
+		switch (c) {
+		case 'r': repair = 1 ; break ;
+		case 'j': threads = atoi(optarg) ; break ;
+		case 'v': verbose = 1 ; break ;
+		default:
+			fprintf(stderr, "usage: %s [-r] [-j threads] [-v] diskfile\n", argv[0]) ;
+			return 8 ;
+		}
+
+	}
+
+	if (optind >= argc) {
+
+		fprintf(stderr, "usage: %s [-r] [-j threads] [-v] diskfile\n", argv[0]) ;
+		return 8 ;
+
+	}
+	if (threads < 1) {
+
+		threads = 1 ;
+
+	}
+	crc32c_setup() ;
+
+	// Step 1: Superblock, everything else is found through it
+	if (stat(argv[optind], &st) != 0 || dev_open(argv[optind]) != 0) {
+
+		perror(argv[optind]) ;
+		return 8 ;
+
+	}
+
+	char * block = (char *)malloc(BLOCK_SIZE) ;
+	bio_read(0, block) ;
+	memcpy(&sb, block, sizeof(sb)) ;
+	memcpy(&ext, block + TFS_EXT_OFFSET, sizeof(ext)) ;
+	free(block) ;
+	if (ext.magic != TFS_EXT_MAGIC) {
+
+		memset(&ext, 0, sizeof(ext)) ;
+
+	}
+
+	int blocks = st.st_size / BLOCK_SIZE ;
+	int itable_blocks = (MAX_INUM * sizeof(struct inode) + BLOCK_SIZE - 1) / BLOCK_SIZE ;
+	if (sb.magic_num != MAGIC_NUM || sb.max_inum != MAX_INUM || sb.max_dnum != (uint16_t)MAX_DNUM
+		|| sb.i_start_blk + itable_blocks > sb.d_start_blk || sb.d_start_blk >= blocks
+		|| sb.i_bitmap_blk == 0 || sb.i_bitmap_blk >= sb.i_start_blk
+		|| sb.d_bitmap_blk == 0 || sb.d_bitmap_blk >= sb.i_start_blk) {
+
+		fprintf(stderr, "%s: bad superblock (magic 0x%x), not a tfs diskfile\n", argv[optind], sb.magic_num) ;
+		dev_close() ;
+		return 8 ;
+
+	}
+
+	data_blocks = blocks - sb.d_start_blk ;
+	if (data_blocks > MAX_DNUM) {
+
+		data_blocks = MAX_DNUM ;
+
+	}
+	owner = (uint16_t *)calloc(data_blocks, sizeof(uint16_t)) ;
+	claims = (uint8_t *)calloc(data_blocks, 1) ;
+	for (i = 0 ; i < MAX_INUM ; i++) {
+
+		inodes[i].parent = NO_PARENT ;
+		inodes[i].dotdot = NO_PARENT ;
+
+	}
+
+	// Step 2: The live inode table and the snapshots' own blocks of theirs, which like the
+	// reference counts take up data blocks of their own
+	int ntables = 0, t, k ;
+	for (t = 0 ; t < ITABLE_BLOCKS ; t++) {
+
+		tables[ntables++] = (struct table_ref){ table_blk(t), t, 1 } ;
+
+	}
+	for (k = 0 ; k < MAX_SNAPSHOTS ; k++) {
+
+		for (t = 0 ; t < ITABLE_BLOCKS && ext.snap[k].name[0] != '\0' ; t++) {
+
+			for (i = 0 ; i < ntables && tables[i].blkno != ext.snap[k].itable[t] ; i++) ;
+			if (i == ntables) {
+
+				tables[ntables++] = (struct table_ref){ ext.snap[k].itable[t], t, 0 } ;
+
+			}
+
+		}
+
+	}
+	for (i = 0 ; i < ntables ; i++) {
+
+		if (tables[i].blkno >= sb.d_start_blk && claim(TABLE_OWNER, -1, -1, tables[i].blkno, 0) < 0) {
+
+			tables[i--] = tables[--ntables] ; // reported by claim(), nothing to read
+
+		} else if (tables[i].blkno < sb.i_start_blk) {
+
+			problem("inode table block %d is outside the inode table\n", tables[i].blkno) ;
+			tables[i--] = tables[--ntables] ;
+
+		}
+
+	}
+	if (ext.features & TFS_FEATURE_CSUM) {
+
+		char * block = (char *)malloc(BLOCK_SIZE) ;
+		bio_read(0, block) ;
+		if (super_crc(block) != ext.csum_self) {
+
+			problem("superblock: checksum mismatch\n") ;
+			csum_errors++ ;
+
+		}
+		free(block) ;
+
+		csum_end = sb.d_start_blk + MAX_DNUM ;
+		csums = (uint32_t *)calloc(CSUM_BLOCKS * CSUMS_PER_BLOCK, sizeof(uint32_t)) ;
+		resealed = (uint8_t *)calloc(csum_end, 1) ;
+		for (i = 0 ; i < CSUM_BLOCKS ; i++) {
+
+			if (claim(TABLE_OWNER, -1, -1, ext.csum_blk[i], 0) < 0) {
+
+				csum_stale |= 1U << i ;
+				continue ;
+
+			}
+
+			bio_read(ext.csum_blk[i], csums + i * CSUMS_PER_BLOCK) ;
+			if (crc32c(0, csums + i * CSUMS_PER_BLOCK, BLOCK_SIZE) != ext.csum_crc[i]) {
+
+				problem("checksums of blocks %d to %d: table block %d is damaged\n", (int)(i * CSUMS_PER_BLOCK),
+					(int)((i + 1) * CSUMS_PER_BLOCK - 1), ext.csum_blk[i]) ;
+				csum_errors++ ;
+				csum_stale |= 1U << i ;
+
+			}
+
+		}
+
+	}
+	counted = ext.ref_blk[0] != 0 ;
+	for (i = 0 ; i < REF_BLOCKS && counted ; i++) {
+
+		if (claim(TABLE_OWNER, -1, -1, ext.ref_blk[i], 0) < 0) {
+
+			counted = 0 ; // the counts can't be trusted, shared blocks are reported as such
+
+		}
+
+	}
+
+	quotas = ext.quota_blk != 0 && claim(TABLE_OWNER, -1, -1, ext.quota_blk, 0) > 0 ;
+
+	// Step 3: Pass 1, every valid inode and the blocks it points at
+	run_pass("pass 1 (inodes and blocks)", pass1, ntables) ;
+	if (!inodes[0].valid || inodes[0].type != 1 || inodes[0].bad) {
+
+		fprintf(stderr, "%s: root directory is missing, giving up\n", argv[optind]) ;
+		dev_close() ;
+		return 4 ;
+
+	}
+
+	// Step 4: Pass 2, every directory's entries
+	int ndirs = 0, ninodes = 0 ;
+	dirs = (uint16_t *)malloc(MAX_INUM * sizeof(uint16_t)) ;
+	for (i = 0 ; i < MAX_INUM ; i++) {
+
+		ninodes += inodes[i].valid ;
+		if (inodes[i].valid && !inodes[i].bad && inodes[i].type == 1) {
+
+			dirs[ndirs++] = i ;
+
+		}
+
+	}
+	run_pass("pass 2 (directories)", pass2, ndirs) ;
+	free(dirs) ;
+	check_orphans() ;
+
+	// Step 5: The tree, from the root down
+	for (i = 1 ; i < MAX_INUM ; i++) {
+
+		if (!inodes[i].valid || inodes[i].bad || inodes[i].orphan) {
+
+			continue ;
+
+		}
+
+		if (!reachable(i)) {
+
+			problem("inode %d: not reachable from the root\n", i) ;
+
+		} else if (inodes[i].type == 1) {
+
+			if (inodes[i].refs > 1) {
+
+				problem("directory %d: named by %d entries\n", i, inodes[i].refs) ;
+
+			}
+			if (inodes[i].dotdot != inodes[i].parent) {
+
+				problem("directory %d: \"..\" points at %d instead of %d\n", i, inodes[i].dotdot, inodes[i].parent) ;
+
+			}
+
+		} else if (inodes[i].nlink != inodes[i].refs) {
+
+			problem("inode %d: link count %d, but %d entries name it\n", i, inodes[i].nlink, inodes[i].refs) ;
+
+		}
+
+	}
+
+	// Step 6: Checksums, before repairs change anything
+	if (csums != NULL) {
+
+		run_pass("checksums", pass_csum, csum_end) ;
+
+	}
+
+	if (repair) {
+
+		do_repairs() ;
+
+	}
+
+	// Step 7: Reference counts, quotas and bitmaps, rebuilt from what is actually in use
+	if (counted) {
+
+		check_refs() ;
+
+	}
+	if (quotas) {
+
+		check_quotas() ;
+
+	}
+	check_bitmap("inode", sb.i_bitmap_blk, MAX_INUM, inode_in_use) ;
+	check_bitmap("data", sb.d_bitmap_blk, data_blocks, block_in_use) ;
+
+	// Step 8: Checksums of whatever was written or found wrong
+	if (csums != NULL && repair) {
+
+		csum_reseal() ;
+
+	}
+
+	dev_close() ;
+
+	printf("%s: %d inodes in use, %d directories, %d problems found, %d repaired\n", argv[optind],
+		ninodes, ndirs, errors, fixed) ;
+
+	if (errors == 0) {
+
+		return 0 ;
+
+	}
+
+	return (repair && fixed > 0) ? 1 : 4 ;
+}
@@ -0,0 +1,77 @@
+/*
+ *	Tiny File System
+ *	File:	tfs_trace.h
+ *
+ *	Block I/O trace format, written by tfs -o trace=<file> and read by benchmark/tfs_replay.c
+ *
+ */
+
+#ifndef _TFS_TRACE_H
+#define _TFS_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * FUSE operations block I/O is charged to, for -o stats and traces
+ */
+enum tfs_op {
+
+	TFS_OP_LOOKUP, TFS_OP_FORGET, TFS_OP_GETATTR, TFS_OP_SETATTR, TFS_OP_TRUNCATE, TFS_OP_UTIMENS,
+	TFS_OP_OPENDIR, TFS_OP_READDIR, TFS_OP_RELEASEDIR, TFS_OP_MKDIR, TFS_OP_RMDIR,
+	TFS_OP_CREATE, TFS_OP_OPEN, TFS_OP_READ, TFS_OP_WRITE, TFS_OP_FLUSH, TFS_OP_RELEASE, TFS_OP_UNLINK,
+	TFS_OP_FSYNC, TFS_OP_RENAME, TFS_OP_LINK, TFS_OP_SYMLINK, TFS_OP_READLINK,
+	TFS_OP_SETXATTR, TFS_OP_GETXATTR, TFS_OP_LISTXATTR, TFS_OP_REMOVEXATTR,
+	TFS_OP_NONE, // block I/O outside of any operation, e.g. from tfs_init()
+	TFS_OP_COUNT
+
+} ;
+
+static const char * tfs_op_names[TFS_OP_COUNT] = {
+
+	"lookup", "forget", "getattr", "setattr", "truncate", "utimens",
+	"opendir", "readdir", "releasedir", "mkdir", "rmdir",
+	"create", "open", "read", "write", "flush", "release", "unlink",
+	"fsync", "rename", "link", "symlink", "readlink",
+	"setxattr", "getxattr", "listxattr", "removexattr",
+	"(none)"
+
+} ;
+
+#define TFS_TRACE_MAGIC "TFSTRACE"
+#define TFS_TRACE_VERSION 3 // 2: op numbers moved for rename, link, symlink and readlink, 3: for the xattr calls
+
+#define TFS_TRACE_READ 0
+#define TFS_TRACE_WRITE 1
+
+#define TFS_TRACE_NO_INO 0xFFFF // I/O not tied to an inode
+
+/*
+ * Start of the file, followed by struct tfs_trace_rec until the end
+ */
+struct tfs_trace_hdr {
+
+	char magic[8] ;
+	uint32_t version ;
+	uint32_t block_size ;
+	uint64_t start_ns ; // CLOCK_MONOTONIC when tracing started, records are relative to it
+
+} ;
+
+/*
+ * One access to count consecutive blocks starting at blkno. Each thread writes its records in
+ * order, records of different threads are interleaved in the file so sort by ns when it matters.
+ */
+struct tfs_trace_rec {
+
+	uint64_t ns ;
+	uint32_t blkno ;
+	uint32_t thread ; // small number per traced thread, not the system tid
+	uint16_t ino ; // inode being worked on, TFS_TRACE_NO_INO if none
+	uint16_t count ;
+	uint8_t kind ; // TFS_TRACE_READ or TFS_TRACE_WRITE
+	uint8_t op ; // enum tfs_op
+	uint16_t reserved ;
+
+} ;
+
+#endif